@@ -28,6 +28,7 @@
 #include "util/neo_err.h"
 #include "util/neo_hdf.h"
 #include "util/neo_str.h"
+#include "util/ulocks.h"
 #include "cgi.h"
 #include "cgiwrap.h"
 #include "html.h"
@@ -273,16 +274,46 @@ NEOERR *cgi_css_url_validate (const char *buf, char **esc)
   return nerr_pass(neos_css_url_validate(buf, esc));
 }
 
+/* Hand buf to the data set if it can own it, in which case values can
+ * point into it.  Otherwise, or on error, the caller still owns buf. */
+static NEOERR *_own_buf (CGI *cgi, char *buf, int *borrow)
+{
+  NEOERR *err;
+
+  *borrow = 0;
+  err = hdf_own_buf (cgi->hdf, buf);
+  if (err == STATUS_OK)
+    *borrow = 1;
+  else if (!nerr_handle(&err, NERR_ASSERT))
+    return nerr_pass(err);
+  return STATUS_OK;
+}
+
+/* Parses query, which we take ownership of.  If the data set can own it,
+ * the values point into it instead of being copied. */
 static NEOERR *_parse_query (CGI *cgi, char *query)
 {
   NEOERR *err = STATUS_OK;
+  NEOERR* (*set)(HDF *hdf, const char *name, const char *value);
   char *t, *k, *v, *l;
-  char buf[256];
   char unnamed[10];
   int unnamed_count = 0;
-  HDF *obj, *child;
+  int borrow;
+  HDF *obj, *top;
 
-  if (query && *query)
+  if (query == NULL) return STATUS_OK;
+
+  err = _own_buf (cgi, query, &borrow);
+  if (err != STATUS_OK)
+  {
+    free(query);
+    return nerr_pass(err);
+  }
+  set = borrow ? hdf_set_borrowed : hdf_set_value;
+  /* Set relative to Query, but don't create it unless we set something */
+  top = hdf_get_obj (cgi->hdf, "Query");
+
+  if (*query)
   {
     k = strtok_r(query, "&", &l);
     while (k && *k)
@@ -308,47 +339,42 @@ static NEOERR *_parse_query (CGI *cgi, char *query)
         /* an hdf element can't start with a period */
         *k = '_';
       }
-      snprintf(buf, sizeof(buf), "Query.%s", cgi_url_unescape(k));
+      cgi_url_unescape(k);
 
       if (!(cgi->ignore_empty_form_vars && (*v == '\0')))
       {
 
 
 	cgi_url_unescape(v);
-	obj = hdf_get_obj (cgi->hdf, buf);
+	if (top == NULL)
+	{
+	  err = hdf_get_node (cgi->hdf, "Query", &top);
+	  if (err != STATUS_OK) break;
+	}
+	obj = hdf_get_obj (top, k);
 	if (obj != NULL)
 	{
-	  int i = 0;
+	  int i;
 	  char buf2[10];
-	  child = hdf_obj_child (obj);
-	  if (child == NULL)
+	  i = hdf_obj_child_count (obj);
+	  if (i == 0)
 	  {
 	    t = hdf_obj_value (obj);
-	    err = hdf_set_value (obj, "0", t);
+	    err = set (obj, "0", t);
 	    if (err != STATUS_OK) break;
 	    i = 1;
 	  }
-	  else
-	  {
-	    while (child != NULL)
-	    {
-	      i++;
-	      child = hdf_obj_next (child);
-	      if (err != STATUS_OK) break;
-	    }
-	    if (err != STATUS_OK) break;
-	  }
 	  snprintf (buf2, sizeof(buf2), "%d", i);
-	  err = hdf_set_value (obj, buf2, v);
+	  err = set (obj, buf2, v);
 	  if (err != STATUS_OK) break;
 	}
-	err = hdf_set_value (cgi->hdf, buf, v);
+	err = set (top, k, v);
 	if (nerr_match(err, NERR_ASSERT)) {
 	  STRING str;
 
 	  string_init(&str);
 	  nerr_error_string(err, &str);
-	  ne_warn("Unable to set Query value: %s = %s: %s", buf, v, str.buf);
+	  ne_warn("Unable to set Query value: Query.%s = %s: %s", k, v, str.buf);
 	  string_clear(&str);
 	  nerr_ignore(&err);
 	}
@@ -357,13 +383,13 @@ static NEOERR *_parse_query (CGI *cgi, char *query)
       k = strtok_r(NULL, "&", &l);
     }
   }
+  if (!borrow) free(query);
   return nerr_pass(err);
 }
 
 /* Is it an error if its a short read? */
 static NEOERR *_parse_post_form (CGI *cgi)
 {
-  NEOERR *err = STATUS_OK;
   char *l, *query;
   int len, r, o;
 
@@ -400,16 +426,16 @@ static NEOERR *_parse_post_form (CGI *cgi)
 	o, len);
   }
   query[len] = '\0';
-  err = _parse_query (cgi, query);
-  free(query);
-  return nerr_pass(err);
+  return nerr_pass(_parse_query (cgi, query));
 }
 
 static NEOERR *_parse_cookie (CGI *cgi)
 {
   NEOERR *err;
+  NEOERR* (*set)(HDF *hdf, const char *name, const char *value);
   char *cookie;
   char *k, *v, *l;
+  int borrow;
   HDF *obj;
 
   err = hdf_get_copy (cgi->hdf, "HTTP.Cookie", &cookie, NULL);
@@ -417,11 +443,14 @@ static NEOERR *_parse_cookie (CGI *cgi)
   if (cookie == NULL) return STATUS_OK;
 
   err = hdf_set_value (cgi->hdf, "Cookie", cookie);
+  if (err == STATUS_OK)
+    err = _own_buf (cgi, cookie, &borrow);
   if (err != STATUS_OK)
   {
     free(cookie);
     return nerr_pass(err);
   }
+  set = borrow ? hdf_set_borrowed : hdf_set_value;
   obj = hdf_get_obj (cgi->hdf, "Cookie");
 
   k = l = cookie;
@@ -444,7 +473,7 @@ static NEOERR *_parse_cookie (CGI *cgi)
     v = neos_strip (v);
     if (k[0] && v[0])
     {
-      err = hdf_set_value (obj, k, v);
+      err = set (obj, k, v);
       if (nerr_match(err, NERR_ASSERT)) {
 	STRING str;
 
@@ -460,7 +489,7 @@ static NEOERR *_parse_cookie (CGI *cgi)
     while (*l && *l != '=' && *l != ';') l++;
   }
 
-  free (cookie);
+  if (!borrow) free (cookie);
 
   return nerr_pass(err);
 }
@@ -697,12 +726,8 @@ static NEOERR *cgi_pre_parse (CGI *cgi)
 
   err = hdf_get_copy (cgi->hdf, "CGI.QueryString", &query, NULL);
   if (err != STATUS_OK) return nerr_pass (err);
-  if (query != NULL)
-  {
-    err = _parse_query(cgi, query);
-    free(query);
-    if (err != STATUS_OK) return nerr_pass (err);
-  }
+  err = _parse_query(cgi, query);
+  if (err != STATUS_OK) return nerr_pass (err);
 
   {
     char *d = hdf_get_value(cgi->hdf, "Query.debug_pause", NULL);
@@ -914,7 +939,9 @@ NEOERR *cgi_init (CGI **cgi, HDF *hdf)
   {
     if (hdf == NULL)
     {
-      err = hdf_init (&(mycgi->hdf));
+      /* The dataset only lives as long as the request, so it comes from
+       * an arena which cgi_destroy releases in one go */
+      err = hdf_init_arena (&(mycgi->hdf), 0);
       if (err != STATUS_OK) break;
     }
     else
@@ -1031,37 +1058,205 @@ static NEOERR *cgi_headers (CGI *cgi)
 #define DEF_MEM_LEVEL 8
 #define OS_CODE 0x03
 
-static NEOERR *cgi_compress (STRING *str, char *obuf, int *olen)
+/* Setting up a deflate stream allocates a few hundred k, so instead of
+ * doing that for every response, the last one used is kept for the next
+ * (see cgi_deflate_get) and just reset. */
+typedef struct _cgi_deflate
 {
-  z_stream stream;
-  int err;
+  z_stream zs;
+  int level;
+  int gzip;
+  int started;
+  unsigned int crc;
+  unsigned int total;
+} CGI_DEFLATE;
+
+typedef NEOERR *(*CGI_DEFLATE_WRITE)(void *ctx, const char *buf, int len);
+
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t DeflateLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static CGI_DEFLATE *DeflateFree = NULL;
 
-  stream.next_in = (Bytef*)str->buf;
-  stream.avail_in = (uInt)str->len;
-  stream.next_out = (Bytef*)obuf;
-  stream.avail_out = (uInt)*olen;
-  if ((uLong)stream.avail_out != *olen)
-    return nerr_raise(NERR_NOMEM, "Destination too big: %d", *olen);
+static void _deflate_destroy (CGI_DEFLATE *zd)
+{
+  deflateEnd(&(zd->zs));
+  free(zd);
+}
 
-  stream.zalloc = (alloc_func)0;
-  stream.zfree = (free_func)0;
-  stream.opaque = (voidpf)0;
+/* Take the kept stream, if there is one and no one else has it */
+static CGI_DEFLATE *_deflate_take (void)
+{
+  CGI_DEFLATE *zd;
+#ifdef HAVE_PTHREADS
+  NEOERR *err;
 
-  /* err = deflateInit(&stream, Z_DEFAULT_COMPRESSION); */
-  err = deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY);
-  if (err != Z_OK)
-    return nerr_raise(NERR_SYSTEM, "deflateInit2 returned %d", err);
+  err = mLock(&DeflateLock);
+  if (err != STATUS_OK)
+  {
+    nerr_ignore(&err);
+    return NULL;
+  }
+#endif
+  zd = DeflateFree;
+  DeflateFree = NULL;
+#ifdef HAVE_PTHREADS
+  err = mUnlock(&DeflateLock);
+  nerr_ignore(&err);
+#endif
+  return zd;
+}
 
-  err = deflate(&stream, Z_FINISH);
-  if (err != Z_STREAM_END) {
-    deflateEnd(&stream);
-    return nerr_raise(NERR_SYSTEM, "deflate returned %d", err);
+/* Get a deflate stream at Config.CompressionLevel, writing the gzip format
+ * if gzip is set, or raw deflate otherwise */
+static NEOERR *cgi_deflate_get (CGI *cgi, int gzip, CGI_DEFLATE **zd)
+{
+  CGI_DEFLATE *my_zd;
+  int level;
+  int r;
+
+  *zd = NULL;
+  level = hdf_get_int_value (cgi->hdf, "Config.CompressionLevel",
+                             Z_DEFAULT_COMPRESSION);
+  if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION)
+    level = Z_DEFAULT_COMPRESSION;
+
+  my_zd = _deflate_take();
+  if (my_zd != NULL && my_zd->level != level)
+  {
+    _deflate_destroy (my_zd);
+    my_zd = NULL;
+  }
+  if (my_zd != NULL)
+  {
+    r = deflateReset(&(my_zd->zs));
+    if (r != Z_OK)
+    {
+      _deflate_destroy (my_zd);
+      return nerr_raise(NERR_SYSTEM, "deflateReset returned %d", r);
+    }
   }
-  *olen = stream.total_out;
+  else
+  {
+    my_zd = (CGI_DEFLATE *) calloc (1, sizeof(CGI_DEFLATE));
+    if (my_zd == NULL)
+      return nerr_raise(NERR_NOMEM, "Unable to allocate deflate stream");
+    r = deflateInit2(&(my_zd->zs), level, Z_DEFLATED, -MAX_WBITS,
+                     DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    if (r != Z_OK)
+    {
+      free(my_zd);
+      return nerr_raise(NERR_SYSTEM, "deflateInit2 returned %d", r);
+    }
+    my_zd->level = level;
+  }
+  my_zd->gzip = gzip;
+  my_zd->started = 0;
+  my_zd->crc = crc32(0L, Z_NULL, 0);
+  my_zd->total = 0;
+  *zd = my_zd;
+  return STATUS_OK;
+}
 
-  err = deflateEnd(&stream);
+/* Done with the stream, keep it for the next response */
+static void cgi_deflate_release (CGI_DEFLATE **zd)
+{
+  CGI_DEFLATE *my_zd = *zd;
+#ifdef HAVE_PTHREADS
+  NEOERR *err;
+#endif
+
+  if (my_zd == NULL) return;
+  *zd = NULL;
+#ifdef HAVE_PTHREADS
+  err = mLock(&DeflateLock);
+  if (err != STATUS_OK)
+  {
+    nerr_ignore(&err);
+    _deflate_destroy (my_zd);
+    return;
+  }
+#endif
+  if (DeflateFree == NULL)
+  {
+    DeflateFree = my_zd;
+    my_zd = NULL;
+  }
+#ifdef HAVE_PTHREADS
+  err = mUnlock(&DeflateLock);
+  nerr_ignore(&err);
+#endif
+  if (my_zd != NULL)
+    _deflate_destroy (my_zd);
+}
+
+/* Compress the next len bytes of output, and pass everything deflate has
+ * for us to write.  Unless finish is set, this does a sync flush so the
+ * client can show everything so far.  The gzip header and trailer are
+ * written as part of the first and finishing calls. */
+static NEOERR *cgi_deflate (CGI_DEFLATE *zd, const char *buf, int len,
+                            int finish, CGI_DEFLATE_WRITE write, void *ctx)
+{
+  NEOERR *err;
+  unsigned char gz_buf[10];
+  char out[8192];
+  int r, n;
+
+  if (zd->gzip && !zd->started)
+  {
+    gz_buf[0] = 0x1f;  /* gzip magic header */
+    gz_buf[1] = 0x8b;
+    gz_buf[2] = Z_DEFLATED;
+    memset(gz_buf + 3, 0, 6);  /* flags, time, xflags */
+    gz_buf[9] = OS_CODE;
+    err = write(ctx, (char *)gz_buf, 10);
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+  zd->started = 1;
+
+  if (zd->gzip && len)
+  {
+    zd->crc = crc32(zd->crc, (const Bytef *)buf, len);
+    zd->total += len;
+  }
+  zd->zs.next_in = (Bytef *)buf;
+  zd->zs.avail_in = (uInt)len;
+  do
+  {
+    zd->zs.next_out = (Bytef *)out;
+    zd->zs.avail_out = sizeof(out);
+    r = deflate(&(zd->zs), finish ? Z_FINISH : Z_SYNC_FLUSH);
+    if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR)
+      return nerr_raise(NERR_SYSTEM, "deflate returned %d", r);
+    n = sizeof(out) - zd->zs.avail_out;
+    if (n)
+    {
+      err = write(ctx, out, n);
+      if (err != STATUS_OK) return nerr_pass(err);
+    }
+  } while (zd->zs.avail_out == 0);
+
+  if (finish && zd->gzip)
+  {
+    /* write crc and len in network order */
+    gz_buf[0] = 0xff & (zd->crc >> 0);
+    gz_buf[1] = 0xff & (zd->crc >> 8);
+    gz_buf[2] = 0xff & (zd->crc >> 16);
+    gz_buf[3] = 0xff & (zd->crc >> 24);
+    gz_buf[4] = 0xff & (zd->total >> 0);
+    gz_buf[5] = 0xff & (zd->total >> 8);
+    gz_buf[6] = 0xff & (zd->total >> 16);
+    gz_buf[7] = 0xff & (zd->total >> 24);
+    err = write(ctx, (char *)gz_buf, 8);
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
   return STATUS_OK;
 }
+
+static NEOERR *_output_write (void *ctx, const char *buf, int len)
+{
+  return nerr_pass(cgiwrap_write(buf, len));
+}
 #endif
 
 /* This ws strip function is Dave's version, designed to make debug
@@ -1204,43 +1399,203 @@ void cgi_html_ws_strip(STRING *str, int level)
   str->buf[str->len] = '\0';
 }
 
-/*
- * We use this function when there's no better option than to just log
- * and free the error chain.
- */
-static void _log_clear_error (NEOERR **err)
+/* The same stripping as cgi_html_ws_strip, but as a state machine which can
+ * stop at the end of any piece of output and pick up again with the next.
+ * Tags are copied as they come, but the start of the tag name is held back
+ * until we can tell whether it's a <pre> or <textarea>, and white space
+ * after the last non-white space is held back since a newline removes it.
+ * The white space held back is never more than a few characters, as the
+ * ws/seen_nonws state only lets one through between resets. */
+#define WS_TEXT      0
+#define WS_TAG_NAME  1
+#define WS_TAG       2
+#define WS_PRE       3
+#define WS_TEXTAREA  4
+
+void cgi_ws_strip_init (CGI_WS_STRIP *strip, int level)
 {
-  nerr_warn_error(*err);
-  nerr_ignore(err);
+  memset(strip, 0, sizeof(CGI_WS_STRIP));
+  strip->level = level;
+  strip->seen_nonws = level > 1;
 }
 
-NEOERR *cgi_output (CGI *cgi, STRING *str)
+static NEOERR *_ws_strip_run (CGI_WS_STRIP *strip, const char *buf, int len,
+                              STRING *out);
+
+/* Output non-white space, after any white space being held back */
+static NEOERR *_ws_strip_emit (CGI_WS_STRIP *strip, const char *buf, int len,
+                               STRING *out)
+{
+  NEOERR *err;
+
+  if (strip->pending_len)
+  {
+    err = string_appendn (out, strip->pending, strip->pending_len);
+    if (err != STATUS_OK) return nerr_pass(err);
+    strip->pending_len = 0;
+  }
+  return nerr_pass(string_appendn (out, buf, len));
+}
+
+static void _ws_strip_hold (CGI_WS_STRIP *strip, char c)
+{
+  if (strip->pending_len < (int)sizeof(strip->pending))
+    strip->pending[strip->pending_len++] = c;
+}
+
+/* We have enough of the tag name (or all there will be) to know what kind
+ * of tag this is, so run the name back through as part of that tag */
+static NEOERR *_ws_strip_tag (CGI_WS_STRIP *strip, STRING *out)
+{
+  char name[sizeof(strip->name)];
+  int len = strip->name_len;
+
+  memcpy (name, strip->name, len);
+  strip->name_len = 0;
+  strip->match = 0;
+  if (len == 8 && !strncasecmp(name, "textarea", 8))
+    strip->state = WS_TEXTAREA;
+  else if (len >= 3 && !strncasecmp(name, "pre", 3))
+    strip->state = WS_PRE;
+  else
+    strip->state = WS_TAG;
+  return nerr_pass(_ws_strip_run (strip, name, len, out));
+}
+
+static NEOERR *_ws_strip_run (CGI_WS_STRIP *strip, const char *buf, int len,
+                              STRING *out)
 {
   NEOERR *err = STATUS_OK;
-  double dis;
-  int is_html = 0;
-  int use_deflate = 0;
-  int use_gzip = 0;
-  int do_debug = 0;
-  int do_timefooter = 0;
-  int ws_strip_level = 0;
-  char *s, *e;
+  const char *close;
+  const char *ch;
+  int i = 0, n;
+  char c;
 
-  s = hdf_get_value (cgi->hdf, "Query.debug", NULL);
-  e = hdf_get_value (cgi->hdf, "Config.DebugPassword", NULL);
-  if (hdf_get_int_value(cgi->hdf, "Config.DebugEnabled", 0) && 
-      s && e && !strcmp(s, e)) do_debug = 1;
-  do_timefooter = hdf_get_int_value (cgi->hdf, "Config.TimeFooter", 1);
-  ws_strip_level = hdf_get_int_value (cgi->hdf, "Config.WhiteSpaceStrip", 1);
+  while (i < len)
+  {
+    switch (strip->state)
+    {
+      case WS_TAG_NAME:
+	while (i < len && strip->name_len < (int)sizeof(strip->name))
+	  strip->name[strip->name_len++] = buf[i++];
+	if (strip->name_len == sizeof(strip->name))
+	  err = _ws_strip_tag (strip, out);
+	break;
+      case WS_TAG:
+	ch = memchr (buf + i, '>', len - i);
+	n = ch ? ch - buf - i + 1 : len - i;
+	err = string_appendn (out, buf + i, n);
+	i += n;
+	if (ch) strip->state = WS_TEXT;
+	break;
+      case WS_PRE:
+      case WS_TEXTAREA:
+	/* The < only appears at the start of the closing tag, so a
+	 * mismatch only has to check whether it starts a new match */
+	close = (strip->state == WS_PRE) ? "</pre>" : "</textarea>";
+	n = i;
+	while (i < len && close[strip->match])
+	{
+	  c = tolower((unsigned char)buf[i++]);
+	  if (c == close[strip->match])
+	    strip->match++;
+	  else
+	    strip->match = (c == '<');
+	}
+	err = string_appendn (out, buf + n, i - n);
+	if (!close[strip->match])
+	{
+	  strip->state = WS_TEXT;
+	  strip->match = 0;
+	}
+	break;
+      default:
+	c = buf[i];
+	if (c == '<')
+	{
+	  err = _ws_strip_emit (strip, buf + i++, 1, out);
+	  strip->state = WS_TAG_NAME;
+	  strip->seen_nonws = 1;
+	  strip->ws = 0;
+	}
+	else if (c == '\n')
+	{
+	  /* Drop the white space at the eol, including blank lines */
+	  strip->pending_len = 0;
+	  _ws_strip_hold (strip, buf[i++]);
+	  strip->ws = strip->level > 1;
+	  strip->seen_nonws = strip->level > 1;
+	}
+	else if (strip->seen_nonws && isspace(c))
+	{
+	  if (!strip->ws) _ws_strip_hold (strip, c);
+	  strip->ws = 1;
+	  i++;
+	}
+	else if (isspace(c))
+	{
+	  _ws_strip_hold (strip, buf[i++]);
+	  strip->seen_nonws = 1;
+	  strip->ws = 0;
+	}
+	else
+	{
+	  n = i;
+	  while (i < len && buf[i] != '<' && !isspace(buf[i])) i++;
+	  err = _ws_strip_emit (strip, buf + n, i - n, out);
+	  strip->seen_nonws = 1;
+	  strip->ws = 0;
+	}
+	break;
+    }
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+  return STATUS_OK;
+}
 
-  dis = ne_timef();
-  s = hdf_get_value (cgi->hdf, "cgiout.ContentType", "text/html");
-  if (!strcasecmp(s, "text/html"))
-    is_html = 1;
+NEOERR *cgi_ws_strip_feed (CGI_WS_STRIP *strip, const char *buf, int len,
+                           STRING *out)
+{
+  if (len <= 0) return STATUS_OK;
+  if (!strip->level) return nerr_pass(string_appendn (out, buf, len));
+  if (!strip->started)
+  {
+    strip->ws = isspace(buf[0]);
+    strip->started = 1;
+  }
+  return nerr_pass(_ws_strip_run (strip, buf, len, out));
+}
+
+NEOERR *cgi_ws_strip_finish (CGI_WS_STRIP *strip, STRING *out)
+{
+  NEOERR *err;
 
+  /* Running the name back through can start another, shorter, one */
+  while (strip->state == WS_TAG_NAME)
+  {
+    err = _ws_strip_tag (strip, out);
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+  if (strip->pending_len)
+  {
+    err = string_appendn (out, strip->pending, strip->pending_len);
+    if (err != STATUS_OK) return nerr_pass(err);
+    strip->pending_len = 0;
+  }
+  return STATUS_OK;
+}
+
+/* Determine whether or not we can compress the (html) output, and add
+ * the Content-Encoding header if we can */
+static NEOERR *cgi_encoding (CGI *cgi, int *use_deflate, int *use_gzip)
+{
+  NEOERR *err = STATUS_OK;
+  char *s, *e;
+
+  *use_deflate = 0;
+  *use_gzip = 0;
 #if defined(HTML_COMPRESSION)
-  /* Determine whether or not we can compress the output */
-  if (is_html && hdf_get_int_value (cgi->hdf, "Config.CompressionEnabled", 0))
+  if (hdf_get_int_value (cgi->hdf, "Config.CompressionEnabled", 0))
   {
     err = hdf_get_copy (cgi->hdf, "HTTP.AcceptEncoding", &s, NULL);
     if (err != STATUS_OK) return nerr_pass (err);
@@ -1249,15 +1604,15 @@ NEOERR *cgi_output (CGI *cgi, STRING *str)
       char *next = NULL;
 
       e = strtok_r (s, ",", &next);
-      while (e && !use_deflate)
+      while (e && !*use_deflate)
       {
 	if (strstr(e, "deflate") != NULL)
 	{
-	  use_deflate = 1;
-	  use_gzip = 0;
+	  *use_deflate = 1;
+	  *use_gzip = 0;
 	}
 	else if (strstr(e, "gzip") != NULL)
-	  use_gzip = 1;
+	  *use_gzip = 1;
 	e = strtok_r (NULL, ",", &next);
       }
       free (s);
@@ -1270,30 +1625,30 @@ NEOERR *cgi_output (CGI *cgi, STRING *str)
 	e = hdf_get_value (cgi->hdf, "HTTP.Accept", NULL);
 	if (e && !strcmp(e, "*/*"))
 	{
-	  use_deflate = 0;
-	  use_gzip = 0;
+	  *use_deflate = 0;
+	  *use_gzip = 0;
 	}
       }
       else
       {
 	if (strncasecmp(s, "mozilla/5.", 10))
 	{
-	  use_deflate = 0;
-	  use_gzip = 0;
+	  *use_deflate = 0;
+	  *use_gzip = 0;
 	}
       }
     }
     else
     {
-      use_deflate = 0;
-      use_gzip = 0;
+      *use_deflate = 0;
+      *use_gzip = 0;
     }
-    if (use_deflate)
+    if (*use_deflate)
     {
       err = hdf_set_value (cgi->hdf, "cgiout.other.encoding",
 	  "Content-Encoding: deflate");
     }
-    else if (use_gzip)
+    else if (*use_gzip)
     {
       err = hdf_set_value (cgi->hdf, "cgiout.other.encoding",
 	  "Content-Encoding: gzip");
@@ -1302,13 +1657,81 @@ NEOERR *cgi_output (CGI *cgi, STRING *str)
   }
 #endif
 
+  return STATUS_OK;
+}
+
+/* The Config.DebugEnabled output, the environment and the data set */
+static NEOERR *cgi_debug_footer (CGI *cgi, STRING *str)
+{
+  NEOERR *err;
+  int x;
+
+  err = string_append (str, "<hr>");
+  if (err != STATUS_OK) return nerr_pass(err);
+  x = 0;
+  while (1)
+  {
+    char *k, *v;
+    err = cgiwrap_iterenv (x, &k, &v);
+    if (err != STATUS_OK) return nerr_pass(err);
+    if (k == NULL) break;
+    err =string_appendf (str, "%s = %s<br>", k, v);
+    if (err != STATUS_OK) return nerr_pass(err);
+    free(k);
+    free(v);
+    x++;
+  }
+  err = string_append (str, "<pre>");
+  if (err != STATUS_OK) return nerr_pass(err);
+  return nerr_pass(hdf_dump_str (cgi->hdf, NULL, 0, str));
+}
+
+/*
+ * We use this function when there's no better option than to just log
+ * and free the error chain.
+ */
+static void _log_clear_error (NEOERR **err)
+{
+  nerr_warn_error(*err);
+  nerr_ignore(err);
+}
+
+NEOERR *cgi_output (CGI *cgi, STRING *str)
+{
+  NEOERR *err = STATUS_OK;
+  double dis;
+  int is_html = 0;
+  int use_deflate = 0;
+  int use_gzip = 0;
+  int do_debug = 0;
+  int do_timefooter = 0;
+  int ws_strip_level = 0;
+  char *s, *e;
+
+  s = hdf_get_value (cgi->hdf, "Query.debug", NULL);
+  e = hdf_get_value (cgi->hdf, "Config.DebugPassword", NULL);
+  if (hdf_get_int_value(cgi->hdf, "Config.DebugEnabled", 0) && 
+      s && e && !strcmp(s, e)) do_debug = 1;
+  do_timefooter = hdf_get_int_value (cgi->hdf, "Config.TimeFooter", 1);
+  ws_strip_level = hdf_get_int_value (cgi->hdf, "Config.WhiteSpaceStrip", 1);
+
+  dis = ne_timef();
+  s = hdf_get_value (cgi->hdf, "cgiout.ContentType", "text/html");
+  if (!strcasecmp(s, "text/html"))
+    is_html = 1;
+
+  if (is_html)
+  {
+    err = cgi_encoding (cgi, &use_deflate, &use_gzip);
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+
   err = cgi_headers(cgi);
   if (err != STATUS_OK) return nerr_pass(err);
 
   if (is_html)
   {
     char buf[50];
-    int x;
 
     if (do_timefooter)
     {
@@ -1325,24 +1748,7 @@ NEOERR *cgi_output (CGI *cgi, STRING *str)
 
     if (do_debug)
     {
-      err = string_append (str, "<hr>");
-      if (err != STATUS_OK) return nerr_pass(err);
-      x = 0;
-      while (1)
-      {
-	char *k, *v;
-	err = cgiwrap_iterenv (x, &k, &v);
-	if (err != STATUS_OK) return nerr_pass(err);
-	if (k == NULL) break;
-	err =string_appendf (str, "%s = %s<br>", k, v);
-	if (err != STATUS_OK) return nerr_pass(err);
-	free(k);
-	free(v);
-	x++;
-      }
-      err = string_append (str, "<pre>");
-      if (err != STATUS_OK) return nerr_pass(err);
-      err = hdf_dump_str (cgi->hdf, NULL, 0, str);
+      err = cgi_debug_footer (cgi, str);
       if (err != STATUS_OK) return nerr_pass(err);
     }
   }
@@ -1350,67 +1756,17 @@ NEOERR *cgi_output (CGI *cgi, STRING *str)
 #if defined(HTML_COMPRESSION)
     if (is_html && (use_deflate || use_gzip))
     {
-      char *dest;
-      static int gz_magic[2] = {0x1f, 0x8b}; /* gzip magic header */
-      char gz_buf[20]; /* gzip header/footer buffer, len of header is 10 bytes */
-      unsigned int crc = 0;
-      int len2;
+      CGI_DEFLATE *zd;
 
-      if (use_gzip)
+      err = cgi_deflate_get (cgi, use_gzip, &zd);
+      if (err == STATUS_OK)
       {
-	crc = crc32(0L, Z_NULL, 0);
-	crc = crc32(crc, (const Bytef *)(str->buf), str->len);
-      }
-      len2 = str->len * 2;
-      dest = (char *) malloc (sizeof(char) * len2);
-      if (dest != NULL)
-      {
-	do {
-	  err = cgi_compress (str, dest, &len2);
-	  if (err == STATUS_OK)
-	  {
-	    if (use_gzip)
-	    {
-	      /* I'm using snprintf instead of cgiwrap_writef since
-	       * the wrapper writef might not handle values with
-	       * embedded NULLs... though I should fix the python one
-	       * now as well */
-	      snprintf(gz_buf, sizeof(gz_buf), "%c%c%c%c%c%c%c%c%c%c",
-                  gz_magic[0], gz_magic[1],
-		  Z_DEFLATED, 0 /*flags*/, 0,0,0,0 /*time*/, 0 /*xflags*/,
-		  OS_CODE);
-	      err = cgiwrap_write(gz_buf, 10);
-	    }
-	    if (err != STATUS_OK) break;
-	    err = cgiwrap_write(dest, len2);
-	    if (err != STATUS_OK) break;
-
-	    if (use_gzip)
-	    {
-	      /* write crc and len in network order */
-	      snprintf(gz_buf, sizeof(gz_buf), "%c%c%c%c%c%c%c%c",
-		  (0xff & (crc >> 0)),
-		  (0xff & (crc >> 8)),
-		  (0xff & (crc >> 16)),
-		  (0xff & (crc >> 24)),
-		  (0xff & (str->len >> 0)),
-		  (0xff & (str->len >> 8)),
-		  (0xff & (str->len >> 16)),
-		  (0xff & (str->len >> 24)));
-	      err = cgiwrap_write(gz_buf, 8);
-	      if (err != STATUS_OK) break;
-	    }
-	  }
-	  else
-	  {
-	    _log_clear_error (&err);
-	    err = cgiwrap_write(str->buf, str->len);
-	  }
-	} while (0);
-	free (dest);
+	err = cgi_deflate (zd, str->buf, str->len, 1, _output_write, NULL);
+	cgi_deflate_release (&zd);
       }
       else
       {
+	_log_clear_error (&err);
 	err = cgiwrap_write(str->buf, str->len);
       }
     }
@@ -1423,6 +1779,228 @@ NEOERR *cgi_output (CGI *cgi, STRING *str)
   return nerr_pass(err);
 }
 
+/* Streaming output for cgi_display, see Config.StreamOutput.  Rendered
+ * output is collected until flush_size bytes are pending, and then sent on
+ * (white space stripped, and compressed with a sync flush if the client
+ * supports it) instead of waiting for the whole page.  The headers are only
+ * sent with the first flush, so errors early in the render can still be
+ * reported normally. */
+typedef struct _cgi_stream
+{
+  CGI *cgi;
+  STRING buf;
+  int flush_size;
+  int chunked;
+  int started;
+  int is_html;
+  int use_deflate;
+  int use_gzip;
+  int ws_strip;
+  CGI_WS_STRIP strip;
+#if defined(HTML_COMPRESSION)
+  CGI_DEFLATE *zd;
+#endif
+} CGI_STREAM;
+
+#define STREAM_FLUSH_SIZE (16 * 1024)
+
+/* Any Content-Length the application set itself in cgiout.other */
+static int _has_content_length (CGI *cgi)
+{
+  HDF *obj;
+  char *s;
+
+  obj = hdf_get_child (cgi->hdf, "cgiout.other");
+  while (obj != NULL)
+  {
+    s = hdf_obj_value (obj);
+    if (s && !strncasecmp(s, "Content-Length:", 15)) return 1;
+    obj = hdf_obj_next (obj);
+  }
+  return 0;
+}
+
+static void cgi_stream_init (CGI_STREAM *st, CGI *cgi)
+{
+  memset(st, 0, sizeof(CGI_STREAM));
+  st->cgi = cgi;
+  string_init(&(st->buf));
+  st->flush_size = hdf_get_int_value (cgi->hdf, "Config.StreamFlushSize",
+                                      STREAM_FLUSH_SIZE);
+}
+
+static void cgi_stream_clear (CGI_STREAM *st)
+{
+#if defined(HTML_COMPRESSION)
+  cgi_deflate_release (&(st->zd));
+#endif
+  string_clear(&(st->buf));
+}
+
+/* Write a block of (already encoded) output, as a chunk if we're using
+ * the chunked transfer encoding */
+static NEOERR *_stream_write (void *ctx, const char *buf, int len)
+{
+  CGI_STREAM *st = (CGI_STREAM *)ctx;
+  NEOERR *err;
+
+  if (len == 0) return STATUS_OK;
+  if (st->chunked)
+  {
+    err = cgiwrap_writef ("%x\r\n", len);
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+  err = cgiwrap_write (buf, len);
+  if (err != STATUS_OK) return nerr_pass(err);
+  if (st->chunked)
+    return nerr_pass(cgiwrap_write ("\r\n", 2));
+  return STATUS_OK;
+}
+
+static NEOERR *_stream_start (CGI_STREAM *st)
+{
+  NEOERR *err;
+  CGI *cgi = st->cgi;
+  char *s;
+
+  st->started = 1;
+  s = hdf_get_value (cgi->hdf, "cgiout.ContentType", "text/html");
+  if (!strcasecmp(s, "text/html"))
+    st->is_html = 1;
+
+  if (st->is_html)
+  {
+    int level;
+
+    err = cgi_encoding (cgi, &(st->use_deflate), &(st->use_gzip));
+    if (err != STATUS_OK) return nerr_pass(err);
+
+    /* Strip what has been rendered so far, and the rest as it comes */
+    level = hdf_get_int_value (cgi->hdf, "Config.WhiteSpaceStrip", 1);
+    if (level)
+    {
+      STRING raw = st->buf;
+
+      cgi_ws_strip_init (&(st->strip), level);
+      st->ws_strip = 1;
+      string_init (&(st->buf));
+      err = cgi_ws_strip_feed (&(st->strip), raw.buf, raw.len, &(st->buf));
+      string_clear (&raw);
+      if (err != STATUS_OK) return nerr_pass(err);
+    }
+  }
+  if (hdf_get_int_value (cgi->hdf, "Config.StreamChunked", 0) &&
+      !_has_content_length (cgi))
+  {
+    st->chunked = 1;
+    err = hdf_set_value (cgi->hdf, "cgiout.other.chunked",
+	"Transfer-Encoding: chunked");
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+  err = cgi_headers(cgi);
+  if (err != STATUS_OK) return nerr_pass(err);
+
+#if defined(HTML_COMPRESSION)
+  if (st->use_deflate || st->use_gzip)
+  {
+    err = cgi_deflate_get (cgi, st->use_gzip, &(st->zd));
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+#endif
+  return STATUS_OK;
+}
+
+/* Send everything pending.  If finish is set, this is the end of the
+ * output, so also finish off the compressed stream and the chunking */
+static NEOERR *_stream_flush (CGI_STREAM *st, int finish)
+{
+  NEOERR *err;
+
+  if (!st->started)
+  {
+    err = _stream_start (st);
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+
+#if defined(HTML_COMPRESSION)
+  if (st->zd != NULL)
+  {
+    err = cgi_deflate (st->zd, st->buf.buf, st->buf.len, finish,
+                       _stream_write, st);
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+  else
+#endif
+  {
+    err = _stream_write(st, st->buf.buf, st->buf.len);
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+  st->buf.len = 0;
+  if (st->buf.buf) st->buf.buf[0] = '\0';
+
+  if (finish && st->chunked)
+    return nerr_pass(cgiwrap_write ("0\r\n\r\n", 5));
+  return STATUS_OK;
+}
+
+static NEOERR *stream_cb (void *ctx, char *buf)
+{
+  CGI_STREAM *st = (CGI_STREAM *)ctx;
+  NEOERR *err;
+
+  if (st->ws_strip)
+    err = cgi_ws_strip_feed (&(st->strip), buf, strlen(buf), &(st->buf));
+  else
+    err = string_append (&(st->buf), buf);
+  if (err != STATUS_OK) return nerr_pass(err);
+  if (st->buf.len >= st->flush_size)
+    return nerr_pass(_stream_flush (st, 0));
+  return STATUS_OK;
+}
+
+/* The end of the render, add the footers cgi_output would and send the
+ * rest */
+static NEOERR *cgi_stream_finish (CGI_STREAM *st)
+{
+  NEOERR *err;
+  CGI *cgi = st->cgi;
+  double dis;
+  char *s, *e;
+
+  dis = ne_timef();
+  if (!st->started)
+  {
+    err = _stream_start (st);
+    if (err != STATUS_OK) return nerr_pass(err);
+  }
+  if (st->is_html)
+  {
+    if (hdf_get_int_value (cgi->hdf, "Config.TimeFooter", 1))
+    {
+      char buf[50];
+
+      snprintf (buf, sizeof(buf), "\n<!-- %5.3f:%d -->\n",
+	  dis - cgi->time_start, st->use_deflate || st->use_gzip);
+      err = stream_cb (st, buf);
+      if (err != STATUS_OK) return nerr_pass(err);
+    }
+    if (st->ws_strip)
+    {
+      err = cgi_ws_strip_finish (&(st->strip), &(st->buf));
+      if (err != STATUS_OK) return nerr_pass(err);
+    }
+    s = hdf_get_value (cgi->hdf, "Query.debug", NULL);
+    e = hdf_get_value (cgi->hdf, "Config.DebugPassword", NULL);
+    if (hdf_get_int_value(cgi->hdf, "Config.DebugEnabled", 0) &&
+	s && e && !strcmp(s, e))
+    {
+      err = cgi_debug_footer (cgi, &(st->buf));
+      if (err != STATUS_OK) return nerr_pass(err);
+    }
+  }
+  return nerr_pass(_stream_flush (st, 1));
+}
+
 NEOERR *cgi_html_escape_strfunc(const char *str, char **ret)
 {
   return nerr_pass(html_escape_alloc(str, strlen(str), ret));
@@ -1490,30 +2068,59 @@ NEOERR *cgi_cs_init(CGI *cgi, CSPARSE **cs)
   return nerr_pass(err);
 }
 
+static NEOERR *_cache_init_cb (void *ctx, CSPARSE *cs)
+{
+  return nerr_pass(cgi_register_strfuncs(cs));
+}
+
 NEOERR *cgi_display (CGI *cgi, const char *cs_file)
 {
   NEOERR *err = STATUS_OK;
   char *debug;
-  CSPARSE *cs = NULL;
+  CSPARSE *cs = NULL, *render = NULL;
   STRING str;
+  CGI_STREAM st;
+  void *ctx = &str;
+  CSOUTFUNC cb = render_cb;
   int do_dump = 0;
+  int do_stream = 0;
+  int use_cache;
   char *t;
 
   string_init(&str);
+  cgi_stream_init(&st, cgi);
 
   debug = hdf_get_value (cgi->hdf, "Query.debug", NULL);
   t = hdf_get_value (cgi->hdf, "Config.DumpPassword", NULL);
   if (hdf_get_int_value(cgi->hdf, "Config.DebugEnabled", 0) &&
       debug && t && !strcmp (debug, t)) do_dump = 1;
+  use_cache = hdf_get_int_value (cgi->hdf, "Config.TemplateCache", 1);
+  if (hdf_get_value (cgi->hdf, "Config.SearchPathCacheTTL", NULL) != NULL)
+    hdf_search_path_cache (hdf_get_int_value (cgi->hdf,
+                                              "Config.SearchPathCacheTTL", 0));
+  if (hdf_get_int_value (cgi->hdf, "Config.StreamOutput", 0))
+  {
+    do_stream = 1;
+    ctx = &st;
+    cb = stream_cb;
+  }
 
   do
   {
-    err = cs_init (&cs, cgi->hdf);
-    if (err != STATUS_OK) break;
-    err = cgi_register_strfuncs(cs);
-    if (err != STATUS_OK) break;
-    err = cs_parse_file (cs, cs_file);
-    if (err != STATUS_OK) break;
+    if (use_cache)
+    {
+      err = cs_cache_get (cgi->hdf, cs_file, NULL, _cache_init_cb, &cs);
+      if (err != STATUS_OK) break;
+    }
+    else
+    {
+      err = cs_init (&cs, cgi->hdf);
+      if (err != STATUS_OK) break;
+      err = cgi_register_strfuncs(cs);
+      if (err != STATUS_OK) break;
+      err = cs_parse_file (cs, cs_file);
+      if (err != STATUS_OK) break;
+    }
     if (do_dump)
     {
       err = cgiwrap_writef("Content-Type: text/plain\n\n");
@@ -1525,16 +2132,36 @@ NEOERR *cgi_display (CGI *cgi, const char *cs_file)
       err = cgiwrap_writef("%s", str.buf);
       break;
     }
-    else
+    if (use_cache)
     {
-      err = cs_render (cs, &str, render_cb);
+      /* As cs_render_cached does, with a render context of our own */
+      err = cs_render_init (&render, cs, cgi->hdf);
       if (err != STATUS_OK) break;
     }
-    err = cgi_output(cgi, &str);
+    else
+    {
+      render = cs;
+    }
+    /* Streamed output has to reach stream_cb as often as it is sent */
+    if (do_stream)
+      err = cs_render_chunked (render, ctx, cb, st.flush_size);
+    else
+      err = cs_render (render, ctx, cb);
+    if (render != cs)
+      cs_destroy (&render);
+    if (err != STATUS_OK) break;
+    if (do_stream)
+      err = cgi_stream_finish(&st);
+    else
+      err = cgi_output(cgi, &str);
     if (err != STATUS_OK) break;
   } while (0);
 
-  cs_destroy(&cs);
+  if (use_cache)
+    cs_cache_release(&cs);
+  else
+    cs_destroy(&cs);
+  cgi_stream_clear (&st);
   string_clear (&str);
   return nerr_pass(err);
 }
@@ -84,6 +84,22 @@ struct _cgi
   double time_end;
 };
 
+/* State for stripping white space from html output a piece at a time, see
+ * cgi_ws_strip_init.  Treat this as opaque. */
+typedef struct _cgi_ws_strip
+{
+  int level;
+  int state;
+  int started;
+  int ws;
+  int seen_nonws;
+  int match;         /* how much of the closing </pre> or </textarea> */
+  char name[8];      /* the start of a tag name, until we know the tag */
+  int name_len;
+  char pending[8];   /* trailing white space a newline would remove */
+  int pending_len;
+} CGI_WS_STRIP;
+
 
 /*
  * Function: cgi_init - Initialize ClearSilver CGI environment
@@ -98,6 +114,9 @@ struct _cgi
  *              specified in the hdf_file pointed to by hdf_file.  The
  *              default settings do not allow debugger launching for
  *              security reasons.
+ *              If hdf is NULL, the data set is created with
+ *              hdf_init_arena, as it is expected to only live as long
+ *              as the request.
  * Input: cgi - a pointer to a CGI pointer
  *        hdf_file - the path to an HDF data set file that will also be
  *                   loaded into the dataset.  This will likely have to
@@ -221,7 +240,23 @@ NEOERR *cgi_cs_init(CGI *cgi, CSPARSE **cs);
  * Description: cgi_display will render the CS template pointed to by 
  *              cs_file using the CGI's HDF data set, and send the
  *              output to the user.  Note that the output is actually
- *              rendered into memory first.
+ *              rendered into memory first.  Unless Config.TemplateCache
+ *              is set to 0, the parsed template is kept in the template
+ *              cache (see cs_cache_get) and reused by later calls.
+ *              If Config.SearchPathCacheTTL is set, where templates and
+ *              their includes were found in hdf.loadpaths is cached for
+ *              that many seconds (see hdf_search_path_cache).
+ *              If Config.StreamOutput is set the output is instead sent
+ *              as it is rendered, whenever Config.StreamFlushSize bytes
+ *              (default 16k) are pending, with white space stripped
+ *              (see cgi_ws_strip_init) and each block compressed with a
+ *              sync flush when those are in use.  The headers are sent with the
+ *              first block, so an error after that can't be reported
+ *              with a new page.  If Config.StreamChunked is also set and
+ *              there is no Content-Length in cgiout.other, the output
+ *              uses the chunked transfer encoding; only set this if the
+ *              cgiwrap output goes directly to the client, not through a
+ *              web server which does its own framing.
  * Input: cgi - a pointer a CGI struct allocated with cgi_init
  *        cs_file - a ClearSilver template file
  * Output: None
@@ -234,7 +269,11 @@ NEOERR *cgi_display (CGI *cgi, const char *cs_file);
  * Function: cgi_output - display the CGI output to the user
  * Description: Normally, this is called by cgi_display, but some
  *              people wanted it external so they could call it
- *              directly.
+ *              directly.  If Config.CompressionEnabled is set and the
+ *              client accepts it, html output is compressed at the zlib
+ *              level in Config.CompressionLevel (0-9, default -1 for
+ *              zlib's default).  The deflate stream is kept and reset
+ *              for the next response instead of being set up each time.
  * Input: cgi - a pointer a CGI struct allocated with cgi_init
  *        output - the data to send to output from the CGI
  * Output: None
@@ -512,6 +551,51 @@ NEOERR *cgi_html_escape_strfunc(const char *str, char **ret);
 NEOERR *cgi_js_escape (const char *buf, char **esc);
 void cgi_html_ws_strip(STRING *str, int level);
 
+/*
+ * Function: cgi_ws_strip_init - start stripping white space a piece at a time
+ * Description: cgi_ws_strip_init sets up a CGI_WS_STRIP to remove white
+ *              space from html output which arrives in pieces, such as
+ *              from a CSOUTFUNC.  Feeding the output to cgi_ws_strip_feed
+ *              in any number of pieces, followed by cgi_ws_strip_finish,
+ *              gives the same result as cgi_html_ws_strip on the whole
+ *              output.  A CGI_WS_STRIP has no allocated memory, so there
+ *              is nothing to clean up.
+ * Input: strip - the CGI_WS_STRIP to set up
+ *        level - the Config.WhiteSpaceStrip level: 0 passes the output
+ *                through, 1 removes trailing white space, blank lines
+ *                and repeated white space after the start of the line,
+ *                2 also removes leading white space
+ * Output: strip - ready for cgi_ws_strip_feed
+ * Return: None
+ */
+void cgi_ws_strip_init (CGI_WS_STRIP *strip, int level);
+
+/*
+ * Function: cgi_ws_strip_feed - strip the next piece of output
+ * Description: cgi_ws_strip_feed strips the next len bytes of output and
+ *              appends the result to out.  A little of it (a tag name
+ *              which may be <pre> or <textarea>, or white space that a
+ *              later newline would remove) may be held back until the
+ *              next call.
+ * Input: strip - a CGI_WS_STRIP set up with cgi_ws_strip_init
+ *        buf - the next piece of output
+ *        len - the length of buf
+ * Output: out - the stripped output is appended
+ * Return: NERR_NOMEM
+ */
+NEOERR *cgi_ws_strip_feed (CGI_WS_STRIP *strip, const char *buf, int len,
+                           STRING *out);
+
+/*
+ * Function: cgi_ws_strip_finish - finish stripping output
+ * Description: cgi_ws_strip_finish appends anything held back by
+ *              cgi_ws_strip_feed, at the end of the output.
+ * Input: strip - a CGI_WS_STRIP set up with cgi_ws_strip_init
+ * Output: out - the rest of the stripped output is appended
+ * Return: NERR_NOMEM
+ */
+NEOERR *cgi_ws_strip_finish (CGI_WS_STRIP *strip, STRING *out);
+
 /* internal use only */
 NEOERR * parse_rfc2388 (CGI *cgi);
 NEOERR * open_upload(CGI *cgi, int unlink_files, FILE **fpw);
@@ -15,6 +15,9 @@
 #include "ClearSilver.h"
 
 #include <string.h>
+#if defined(HTML_COMPRESSION)
+#include <zlib.h>
+#endif
 
 
 /* Used by test_http_headers, this is the old hard-coded list of environment
@@ -218,6 +221,409 @@ NEOERR *test_content_type_parsing() {
   return STATUS_OK;
 }
 
+/* Repeated parameters become a numbered list, and mixing in named children
+ * counts them as part of it.  Done with the default arena data set, whose
+ * values point into the query string, and with one passed in, where
+ * they're copied. */
+NEOERR *test_repeated_query() {
+  NEOERR *err;
+  CGI *cgi;
+  HDF *hdf, *obj;
+  STRING query;
+  char **argv;
+  char **envp;
+  char *v;
+  char name[32];
+  int x, pass;
+
+  argv = (char **) malloc (2 * sizeof(char *));
+  argv[0] = strdup("cgi_test");
+  argv[1] = NULL;
+
+  string_init(&query);
+  err = string_append(&query, "QUERY_STRING=sel.k=x&sel=a");
+  for (x = 0; x < 1000 && err == STATUS_OK; x++)
+    err = string_appendf(&query, "&id=%d", x);
+  if (err == STATUS_OK) err = string_append(&query, "&sel=b");
+  if (err) return nerr_pass(err);
+  envp = (char **) malloc (3 * sizeof(char *));
+  envp[0] = query.buf;
+  envp[1] = strdup("HTTP_COOKIE=a=1; b = 2 ;c");
+  envp[2] = NULL;
+  putenv(envp[0]);
+  putenv(envp[1]);
+
+  cgiwrap_init_std(1, argv, envp);
+
+  for (pass = 0; pass < 2; pass++) {
+    hdf = NULL;
+    if (pass) {
+      err = hdf_init(&hdf);
+      if (err) return nerr_pass(err);
+    }
+    err = cgi_init(&cgi, hdf);
+    if (err) return nerr_pass(err);
+
+    obj = hdf_get_obj(cgi->hdf, "Query.id");
+    if (hdf_obj_child_count(obj) != 1000) {
+      return nerr_raise(NERR_ASSERT,
+                        "Query.id has %d children, expected 1000",
+                        hdf_obj_child_count(obj));
+    }
+    for (x = 0, obj = hdf_obj_child(obj); x < 1000;
+         x++, obj = hdf_obj_next(obj)) {
+      snprintf(name, sizeof(name), "%d", x);
+      if (obj == NULL || strcmp(hdf_obj_name(obj), name) ||
+          strcmp(hdf_obj_value(obj), name)) {
+        return nerr_raise(NERR_ASSERT, "Query.id.%d is wrong", x);
+      }
+    }
+    v = hdf_get_value(cgi->hdf, "Query.id", "");
+    if (strcmp(v, "999")) {
+      return nerr_raise(NERR_ASSERT, "Query.id is %s, expected 999", v);
+    }
+
+    obj = hdf_get_obj(cgi->hdf, "Query.sel");
+    if (hdf_obj_child_count(obj) != 3 ||
+        strcmp(hdf_get_value(obj, "k", ""), "x") ||
+        strcmp(hdf_get_value(obj, "1", ""), "a") ||
+        strcmp(hdf_get_value(obj, "2", ""), "b") ||
+        strcmp(hdf_obj_value(obj), "b")) {
+      hdf_dump(obj, "-E- ");
+      return nerr_raise(NERR_ASSERT, "Query.sel is wrong");
+    }
+
+    err = hdf_remove_tree(cgi->hdf, "Query.id.500");
+    if (err) return nerr_pass(err);
+    if (hdf_obj_child_count(hdf_get_obj(cgi->hdf, "Query.id")) != 999) {
+      return nerr_raise(NERR_ASSERT, "Query.id count wrong after remove");
+    }
+
+    if (strcmp(hdf_get_value(cgi->hdf, "Cookie", ""), "a=1; b = 2 ;c") ||
+        strcmp(hdf_get_value(cgi->hdf, "Cookie.a", ""), "1") ||
+        strcmp(hdf_get_value(cgi->hdf, "Cookie.b", ""), "2") ||
+        hdf_get_obj(cgi->hdf, "Cookie.c") != NULL) {
+      hdf_dump(cgi->hdf, "-E- ");
+      return nerr_raise(NERR_ASSERT, "Cookie is wrong");
+    }
+
+    cgi_destroy(&cgi);
+  }
+  envp[0] = strdup("QUERY_STRING=");
+  putenv(envp[0]);
+  envp[1] = strdup("HTTP_COOKIE=");
+  putenv(envp[1]);
+  return STATUS_OK;
+}
+
+/* Strip each of these in pieces of every size, and make sure the result
+ * matches stripping it all at once */
+static char *WSStripTests[] = {
+  "  <html>  \n\n  <body>\t\tsome   text  \n \n  more\ttext \t\n",
+  "<PRE>\n  keep   this \n\n</pre  >  <pre>\n  and   </PRE>  \n",
+  "<textarea name=x>\n  a   b \n</TextArea> x  \n\n<textareas>  y \n",
+  "<b><i>x</i></b>   \n<p\n  class=a  >\n   \n< pre>  \n<pre",
+  "\n\n   leading\n\t\ttabs   \n",
+  "<pre>  never  \n  closed <</pr",
+  "<textarea>\n  never closed  ",
+  "text <a href=\"x\"  \n  title=y",
+  "end with space  ",
+  "end with a tag <b",
+  "",
+  NULL
+};
+
+NEOERR *test_ws_strip() {
+  NEOERR *err;
+  CGI_WS_STRIP strip;
+  STRING whole, pieces;
+  int i, level, size, len, x;
+
+  for (i = 0; WSStripTests[i] != NULL; i++) {
+    len = strlen(WSStripTests[i]);
+    for (level = 1; level <= 2; level++) {
+      string_init(&whole);
+      err = string_append(&whole, WSStripTests[i]);
+      if (err) return nerr_pass(err);
+      cgi_html_ws_strip(&whole, level);
+
+      for (size = 1; size <= len + 1; size++) {
+        string_init(&pieces);
+        cgi_ws_strip_init(&strip, level);
+        for (x = 0; x < len; x += size) {
+          err = cgi_ws_strip_feed(&strip, WSStripTests[i] + x,
+                                  (len - x < size) ? len - x : size, &pieces);
+          if (err) return nerr_pass(err);
+        }
+        err = cgi_ws_strip_finish(&strip, &pieces);
+        if (err) return nerr_pass(err);
+        if ((whole.len || pieces.len) &&
+            (whole.len != pieces.len || strcmp(whole.buf, pieces.buf))) {
+          return nerr_raise(NERR_ASSERT,
+                            "Level %d strip in pieces of %d differs:\n"
+                            "%s\n---\n%s", level, size,
+                            whole.buf, pieces.buf);
+        }
+        string_clear(&pieces);
+      }
+      string_clear(&whole);
+    }
+  }
+
+  return STATUS_OK;
+}
+
+static int capture_writef (void *data, const char *fmt, va_list ap) {
+  if (string_appendvf((STRING *)data, fmt, ap)) return -1;
+  return 0;
+}
+
+static int capture_write (void *data, const char *buf, int len) {
+  if (string_appendn((STRING *)data, buf, len)) return -1;
+  return len;
+}
+
+/* Render test_cgi_funcs.cs with cgi_display, with the given extra config,
+ * and return everything it wrote, headers and all */
+static NEOERR *display_with(const char *config, STRING *out) {
+  NEOERR *err;
+  CGI *cgi;
+
+  string_init(out);
+  cgiwrap_init_emu(out, NULL, capture_writef, capture_write, NULL, NULL, NULL);
+
+  err = cgi_init(&cgi, NULL);
+  if (err) return nerr_pass(err);
+  err = hdf_read_file(cgi->hdf, "../cs/test.hdf");
+  if (err) return nerr_pass(err);
+  err = hdf_read_string(cgi->hdf, "Config.WhiteSpaceStrip = 0\n"
+                                  "Config.TimeFooter = 0\n");
+  if (err) return nerr_pass(err);
+  err = hdf_read_string(cgi->hdf, config);
+  if (err) return nerr_pass(err);
+  err = cgi_display(cgi, "test_cgi_funcs.cs");
+  cgi_destroy(&cgi);
+  return nerr_pass(err);
+}
+
+static char *body_of(STRING *out) {
+  char *s = strstr(out->buf, "\r\n\r\n");
+  return s ? s + 4 : out->buf;
+}
+
+/* Put the chunks of a chunked body of out back together into body, and
+ * count them */
+static NEOERR *unchunk(STRING *out, STRING *body, int *chunks) {
+  NEOERR *err;
+  char *s, *e;
+  int len;
+
+  string_init(body);
+  *chunks = 0;
+  s = body_of(out);
+  while (1) {
+    len = strtol(s, &e, 16);
+    if (e == s || strncmp(e, "\r\n", 2)) {
+      return nerr_raise(NERR_ASSERT, "Bad chunk header at: %s", s);
+    }
+    s = e + 2;
+    if (len == 0) break;
+    err = string_appendn(body, s, len);
+    if (err) return nerr_pass(err);
+    s += len + 2;
+    *chunks += 1;
+  }
+  if (strcmp(s, "\r\n")) {
+    return nerr_raise(NERR_ASSERT, "Trailing garbage after chunks: %s", s);
+  }
+  return STATUS_OK;
+}
+
+#if defined(HTML_COMPRESSION)
+/* Uncompress the body in s into buf, with the given inflateInit2 window
+ * bits: 16 + MAX_WBITS for gzip, -MAX_WBITS for raw deflate */
+static NEOERR *inflate_body(char *s, int slen, int wbits, char *buf,
+                            int len) {
+  z_stream zs;
+  int r;
+
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, wbits) != Z_OK) {
+    return nerr_raise(NERR_ASSERT, "inflateInit2 failed");
+  }
+  zs.next_in = (Bytef *)s;
+  zs.avail_in = slen;
+  zs.next_out = (Bytef *)buf;
+  zs.avail_out = len - 1;
+  r = inflate(&zs, Z_FINISH);
+  inflateEnd(&zs);
+  if (r != Z_STREAM_END) {
+    return nerr_raise(NERR_ASSERT, "inflate returned %d", r);
+  }
+  buf[zs.total_out] = '\0';
+  return STATUS_OK;
+}
+#endif
+
+/* The streamed tests flush every 64 bytes, so unless the output comes in
+ * more than one chunk it isn't streamed at all */
+NEOERR *test_stream_output() {
+  NEOERR *err;
+  STRING buffered, streamed;
+  STRING body;
+  int chunks;
+
+  err = display_with("", &buffered);
+  if (err) return nerr_pass(err);
+
+  err = display_with("Config.StreamOutput = 1\n"
+                     "Config.StreamFlushSize = 64\n", &streamed);
+  if (err) return nerr_pass(err);
+  if (strcmp(buffered.buf, streamed.buf)) {
+    return nerr_raise(NERR_ASSERT,
+                      "Streamed output differs:\n%s\n---\n%s",
+                      buffered.buf, streamed.buf);
+  }
+  string_clear(&streamed);
+
+  err = display_with("Config.StreamOutput = 1\n"
+                     "Config.StreamFlushSize = 64\n"
+                     "Config.StreamChunked = 1\n", &streamed);
+  if (err) return nerr_pass(err);
+  if (strstr(streamed.buf, "Transfer-Encoding: chunked\r\n") == NULL) {
+    return nerr_raise(NERR_ASSERT, "No chunked header:\n%s", streamed.buf);
+  }
+  err = unchunk(&streamed, &body, &chunks);
+  if (err) return nerr_pass(err);
+  if (strcmp(body.buf, body_of(&buffered))) {
+    return nerr_raise(NERR_ASSERT, "Chunked output differs:\n%s\n---\n%s",
+                      body_of(&buffered), body.buf);
+  }
+  if (chunks < 2) {
+    return nerr_raise(NERR_ASSERT, "Output wasn't streamed, %d chunk(s)",
+                      chunks);
+  }
+  string_clear(&body);
+  string_clear(&streamed);
+
+#if defined(HTML_COMPRESSION)
+  {
+    char out[8192];
+
+    err = display_with("Config.StreamOutput = 1\n"
+                       "Config.StreamFlushSize = 64\n"
+                       "Config.StreamChunked = 1\n"
+                       "Config.CompressionEnabled = 1\n"
+                       "HTTP.AcceptEncoding = gzip\n"
+                       "HTTP.UserAgent = Mozilla/5.0\n", &streamed);
+    if (err) return nerr_pass(err);
+    if (strstr(streamed.buf, "Content-Encoding: gzip\r\n") == NULL) {
+      return nerr_raise(NERR_ASSERT, "No gzip header:\n%s", streamed.buf);
+    }
+    err = unchunk(&streamed, &body, &chunks);
+    if (err) return nerr_pass(err);
+    err = inflate_body(body.buf, body.len, 16 + MAX_WBITS, out, sizeof(out));
+    if (err) return nerr_pass(err);
+    if (strcmp(out, body_of(&buffered))) {
+      return nerr_raise(NERR_ASSERT, "Compressed output differs:\n%s\n---\n%s",
+                        body_of(&buffered), out);
+    }
+    /* Each flush is compressed with a sync flush and sent on its own */
+    if (chunks < 2) {
+      return nerr_raise(NERR_ASSERT,
+                        "Compressed output wasn't streamed, %d chunk(s)",
+                        chunks);
+    }
+    string_clear(&body);
+    string_clear(&streamed);
+  }
+#endif
+
+  /* With white space stripping, a piece at a time */
+  string_clear(&buffered);
+  err = display_with("Config.WhiteSpaceStrip = 2\n", &buffered);
+  if (err) return nerr_pass(err);
+  err = display_with("Config.WhiteSpaceStrip = 2\n"
+                     "Config.StreamOutput = 1\n"
+                     "Config.StreamFlushSize = 64\n", &streamed);
+  if (err) return nerr_pass(err);
+  if (strcmp(buffered.buf, streamed.buf)) {
+    return nerr_raise(NERR_ASSERT,
+                      "Stripped streamed output differs:\n%s\n---\n%s",
+                      buffered.buf, streamed.buf);
+  }
+  string_clear(&streamed);
+  err = display_with("Config.WhiteSpaceStrip = 2\n"
+                     "Config.StreamOutput = 1\n"
+                     "Config.StreamFlushSize = 64\n"
+                     "Config.StreamChunked = 1\n", &streamed);
+  if (err) return nerr_pass(err);
+  err = unchunk(&streamed, &body, &chunks);
+  if (err) return nerr_pass(err);
+  if (strcmp(body.buf, body_of(&buffered))) {
+    return nerr_raise(NERR_ASSERT,
+                      "Stripped chunked output differs:\n%s\n---\n%s",
+                      body_of(&buffered), body.buf);
+  }
+  if (chunks < 2) {
+    return nerr_raise(NERR_ASSERT,
+                      "Stripped output wasn't streamed, %d chunk(s)", chunks);
+  }
+  string_clear(&body);
+  string_clear(&streamed);
+
+  string_clear(&buffered);
+
+  return STATUS_OK;
+}
+
+/* cgi_output compression, at different levels and reusing the deflate
+ * stream from one response to the next */
+NEOERR *test_compressed_output() {
+#if defined(HTML_COMPRESSION)
+  NEOERR *err;
+  STRING plain, compressed;
+  char out[8192];
+  char config[256];
+  static char *Encodings[] = {"gzip", "deflate"};
+  static int Levels[] = {-1, 1, 1, 9, 0, -1};
+  char *s;
+  int e, l;
+
+  err = display_with("", &plain);
+  if (err) return nerr_pass(err);
+
+  for (e = 0; e < 2; e++) {
+    for (l = 0; l < sizeof(Levels) / sizeof(int); l++) {
+      snprintf(config, sizeof(config),
+               "Config.CompressionEnabled = 1\n"
+               "Config.CompressionLevel = %d\n"
+               "HTTP.AcceptEncoding = %s\n"
+               "HTTP.UserAgent = Mozilla/5.0\n", Levels[l], Encodings[e]);
+      err = display_with(config, &compressed);
+      if (err) return nerr_pass(err);
+      if (strstr(compressed.buf, "Content-Encoding: ") == NULL) {
+        return nerr_raise(NERR_ASSERT, "No %s header:\n%s", Encodings[e],
+                          compressed.buf);
+      }
+      s = body_of(&compressed);
+      err = inflate_body(s, compressed.len - (s - compressed.buf),
+                         e ? -MAX_WBITS : 16 + MAX_WBITS, out, sizeof(out));
+      if (err) return nerr_pass(err);
+      if (strcmp(out, body_of(&plain))) {
+        return nerr_raise(NERR_ASSERT,
+                          "Level %d %s output differs:\n%s\n---\n%s",
+                          Levels[l], Encodings[e], body_of(&plain), out);
+      }
+      string_clear(&compressed);
+    }
+  }
+  string_clear(&plain);
+#endif
+
+  return STATUS_OK;
+}
+
 int main(int argc, char **argv, char **envp) {
   NEOERR *err;
 
@@ -231,6 +637,26 @@ int main(int argc, char **argv, char **envp) {
     nerr_log_error(err);
     return -1;
   }
+  err = test_repeated_query();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+  err = test_ws_strip();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+  err = test_stream_output();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+  err = test_compressed_output();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
 
   return 0;
 }
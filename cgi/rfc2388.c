@@ -358,7 +358,7 @@ static NEOERR * _read_part (CGI *cgi, char *boundary, int *done)
 {
   NEOERR *err = STATUS_OK;
   STRING str;
-  HDF *child, *obj = NULL;
+  HDF *obj = NULL;
   FILE *fp = NULL;
   char buf[256];
   char *p;
@@ -509,27 +509,17 @@ static NEOERR * _read_part (CGI *cgi, char *boundary, int *done)
 	  obj = hdf_get_obj (cgi->hdf, buf);
 	  if (obj != NULL)
 	  {
-	    int i = 0;
+	    int i;
 	    char buf2[10];
 	    char *t;
-	    child = hdf_obj_child (obj);
-	    if (child == NULL)
+	    i = hdf_obj_child_count (obj);
+	    if (i == 0)
 	    {
 	      t = hdf_obj_value (obj);
 	      err = hdf_set_value (obj, "0", t);
 	      if (err != STATUS_OK) break;
 	      i = 1;
 	    }
-	    else
-	    {
-	      while (child != NULL)
-	      {
-		i++;
-		child = hdf_obj_next (child);
-		if (err != STATUS_OK) break;
-	      }
-	      if (err != STATUS_OK) break;
-	    }
 	    snprintf (buf2, sizeof(buf2), "%d", i);
 	    err = hdf_set_value (obj, buf2, str.buf);
 	    if (err != STATUS_OK) break;
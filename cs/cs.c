@@ -23,6 +23,48 @@ static NEOERR *output (void *ctx, char *s)
   return STATUS_OK;
 }
 
+static NEOERR *output_file (void *ctx, char *s)
+{
+  if (fputs (s, (FILE *) ctx) == EOF)
+    return nerr_raise_errno (NERR_IO, "Unable to write precompiled templates");
+  return STATUS_OK;
+}
+
+/* Stands in for a string function the program registers, the templates
+ * are only parsed, never rendered */
+static NEOERR *declared_strfunc (const char *str, char **ret)
+{
+  return nerr_raise (NERR_ASSERT, "Declared function called");
+}
+
+static NEOERR *precompile_file (HDF *hdf, ULIST *funcs, const char *cs_file,
+                                int num, FILE *fp)
+{
+  NEOERR *err;
+  CSPARSE *parse;
+  char ident[64];
+  char *name;
+  int x;
+
+  err = cs_init (&parse, hdf);
+  if (err) return nerr_pass(err);
+  for (x = 0; x < uListLength(funcs) && err == STATUS_OK; x++)
+  {
+    err = uListGet (funcs, x, (void *)&name);
+    if (err == STATUS_OK)
+      err = cs_register_strfunc (parse, name, declared_strfunc);
+  }
+  if (err == STATUS_OK)
+    err = cs_parse_file (parse, cs_file);
+  if (err == STATUS_OK)
+  {
+    snprintf (ident, sizeof(ident), "cs_template_%d", num);
+    err = cs_dump_c (parse, cs_file, ident, fp, output_file);
+  }
+  cs_destroy (&parse);
+  return nerr_pass(err);
+}
+
 int main (int argc, char *argv[])
 {
   NEOERR *err;
@@ -30,6 +72,11 @@ int main (int argc, char *argv[])
   HDF *hdf;
   int verbose = 0;
   char *hdf_file, *cs_file;
+  char *register_name = "cs_register_templates";
+  FILE *c_fp = NULL;
+  ULIST *funcs = NULL;
+  int num_templates = 0;
+  int x;
   char c;
 
   extern char *optarg;
@@ -47,7 +94,13 @@ int main (int argc, char *argv[])
     return -1;
   }
 
-  while ((c = getopt(argc, argv, "Hvh:c:")) != EOF )
+  err = uListInit (&funcs, 10, 0);
+  if (err != STATUS_OK) {
+    nerr_warn_error(err);
+    return -1;
+  }
+
+  while ((c = getopt(argc, argv, "Hvh:c:o:C:n:F:")) != EOF )
 
     switch (c) {
     case 'h':
@@ -63,25 +116,81 @@ int main (int argc, char *argv[])
       if ( verbose )
 	printf ("Parsing %s\n", cs_file);
 
-      err = cs_parse_file (parse, cs_file);
+      if (c_fp != NULL)
+	err = precompile_file (hdf, funcs, cs_file, num_templates++, c_fp);
+      else
+	err = cs_parse_file (parse, cs_file);
       if (err != STATUS_OK) {
 	err = nerr_pass(err);
 	nerr_warn_error(err);
 	return -1;
       }
       break;
+    case 'o':
+      err = hdf_write_image(hdf, optarg);
+      if (err != STATUS_OK) {
+	nerr_warn_error(err);
+	return -1;
+      }
+      break;
+    case 'C':
+      c_fp = fopen (optarg, "w");
+      if (c_fp == NULL) {
+	perror (optarg);
+	return -1;
+      }
+      fprintf (c_fp, "/* Generated by cs -C, do not edit */\n"
+	  "#include \"ClearSilver.h\"\n\n");
+      break;
+    case 'n':
+      register_name = optarg;
+      break;
+    case 'F':
+      err = uListAppend (funcs, optarg);
+      if (err != STATUS_OK) {
+	nerr_warn_error(err);
+	return -1;
+      }
+      break;
     case 'v':
       verbose=1;
       break;
     case 'H':
-      fprintf(stderr, "Usage: %s [-v] [-h <file.hdf>] [-c <file.cs>]\n", argv[0]);
+      fprintf(stderr, "Usage: %s [-v] [-h <file.hdf>] [-o <file.img>] [-C <file.c> [-n <name>] [-F <func>]] [-c <file.cs>]\n", argv[0]);
       fprintf(stderr, "     -h <file.hdf> load hdf file file.hdf (multiple allowed)\n");
+      fprintf(stderr, "     -o <file.img> compile the hdf loaded so far to an image\n");
+      fprintf(stderr, "                   for hdf_init_image\n");
+      fprintf(stderr, "     -C <file.c>   write the cs files after this to file.c as C\n");
+      fprintf(stderr, "                   instead of rendering them, see\n");
+      fprintf(stderr, "                   cs_register_precompiled\n");
+      fprintf(stderr, "     -n <name>     name of the function in file.c which\n");
+      fprintf(stderr, "                   registers them (cs_register_templates)\n");
+      fprintf(stderr, "     -F <func>     a string function the program registers\n");
+      fprintf(stderr, "                   (multiple allowed)\n");
       fprintf(stderr, "     -c <file.cs>  load cs file file.cs (multiple allowed)\n");
       fprintf(stderr, "     -v            verbose output\n");
       return -1;
       break;
     }
 
+  if (c_fp != NULL)
+  {
+    fprintf (c_fp, "static const CS_PRECOMPILED *Templates[] = {\n");
+    for (x = 0; x < num_templates; x++)
+      fprintf (c_fp, "  &cs_template_%d,\n", x);
+    fprintf (c_fp, "  NULL\n};\n\n"
+	"NEOERR *%s (void)\n{\n"
+	"  return nerr_pass (cs_register_precompiled (Templates));\n}\n",
+	register_name);
+    if (fclose (c_fp) == EOF) {
+      perror ("fclose");
+      return -1;
+    }
+    uListDestroy (&funcs, 0);
+    cs_destroy (&parse);
+    hdf_destroy (&hdf);
+    return 0;
+  }
 
   err = cs_render(parse, NULL, output);
   if (err != STATUS_OK) {
@@ -96,6 +205,7 @@ int main (int argc, char *argv[])
   }
 
   cs_destroy (&parse);
+  uListDestroy (&funcs, 0);
 
   if (verbose) {
     printf ("\n-----------------------\nHDF DUMP\n");
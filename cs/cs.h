@@ -107,8 +107,14 @@ typedef struct _funct CS_FUNCTION;
 typedef struct _escape_context CS_ECONTEXT;
 typedef struct _position CS_POSITION;
 typedef struct _error CS_ERROR;
+typedef struct _cache_entry CS_CACHE_ENTRY;
 
 typedef struct _autoescape CS_AUTOESCAPE;
+typedef struct _auto_trans CS_AUTO_TRANS;
+typedef struct _auto_trace CS_AUTO_TRACE;
+typedef struct _code CS_CODE;
+typedef struct _lookup_cache CS_LOOKUP_CACHE;
+typedef struct _scratch CS_SCRATCH;
 
 typedef enum
 {
@@ -127,6 +133,12 @@ typedef struct _arg
   CSESCAPE_STATUS escape_status;
   struct _funct *function;
   struct _macro *macro;
+  HDF_PATH *path;   /* CS_TYPE_VAR names, split once at parse time */
+  /* CS_TYPE_VAR names bound by an enclosing each, loop, with or def
+   * argument: 1 + how many local variables are pushed after it, and its
+   * name, worked out at parse time.  0 if nothing encloses it. */
+  int local_slot;
+  char *local_name;
   struct _arg *expr1;
   struct _arg *expr2;
   struct _arg *next;
@@ -151,6 +163,14 @@ typedef struct _tree
   int linenum;
   int colnum;
 
+  /* literals only, the auto escape parser state each known entry state
+   * leads to, worked out at parse time */
+  CS_AUTO_TRANS *auto_trans;
+
+  /* If this node starts a list compiled by cs_compile, 1 + the index of
+   * its entry point */
+  int code;
+
   struct _tree *case_0;
   struct _tree *case_1;
   struct _tree *next;
@@ -166,6 +186,8 @@ typedef struct _local_map
   char *s;
   long int n;
   HDF *h;
+  /* Where s points for the string value of a CS_TYPE_NUM n */
+  char numbuf[24];
   /* Store escaping status for local variables,
    * used when a string or number is stored in the map.
    * hdf objects keep track of their own escape status.
@@ -190,6 +212,73 @@ typedef struct _macro
   struct _macro *next;
 } CS_MACRO;
 
+/* A parse tree flattened into tables, see cs_precompile() and cs_dump_c().
+ * The tables refer to each other by index, with -1 for none, and strings
+ * are offsets into one pool of NUL terminated strings, -1 for NULL.  The
+ * first node is the start of the tree, and every child comes after the
+ * entry that refers to it. */
+#define CS_PRECOMPILED_VERSION 1
+
+typedef struct _precompiled_arg
+{
+  int op_type;
+  int s;
+  int argexpr;
+  long int n;
+  int escape_status;
+  int function;     /* name of the function */
+  int macro;
+  int path;         /* 1 if s is a compiled HDF path */
+  int expr1;
+  int expr2;
+  int next;
+} CS_PRECOMPILED_ARG;
+
+typedef struct _precompiled_node
+{
+  int cmd;          /* index into the command names */
+  int flags;
+  int escape;
+  int do_autoescape;
+  int arg1;
+  int arg2;
+  int vargs;
+  int case_0;
+  int case_1;
+  int next;
+} CS_PRECOMPILED_NODE;
+
+typedef struct _precompiled_macro
+{
+  int name;
+  int n_args;
+  int args;
+  int tree;         /* the def node */
+} CS_PRECOMPILED_MACRO;
+
+typedef struct _precompiled
+{
+  int version;      /* CS_PRECOMPILED_VERSION */
+  const char *name; /* what cs_parse_file and cs_cache_get are asked for */
+
+  /* The parse settings the tree was built with, it is only used by a
+   * parse with the same ones */
+  int auto_escape;
+  int escape;
+  const char *tag;
+
+  const char *strings;
+  int strings_len;
+  const int *cmds;
+  int num_cmds;
+  const CS_PRECOMPILED_NODE *nodes;
+  int num_nodes;
+  const CS_PRECOMPILED_ARG *args;
+  int num_args;
+  const CS_PRECOMPILED_MACRO *macros;
+  int num_macros;
+} CS_PRECOMPILED;
+
 
 /* CSOUTFUNC is a callback function for where cs_render will render the
  * template to.
@@ -222,6 +311,12 @@ typedef NEOERR* (*CSSTRFUNC)(const char *str, char **ret);
 typedef NEOERR* (*CSFILELOAD)(void *ctx, HDF *hdf, const char *filename,
                               char **contents);
 
+/* CSCACHEINIT is a callback function used by cs_cache_get to prepare a
+ * newly created CSPARSE before a template is parsed into the cache.  This is
+ * where you register the functions the template uses (ie,
+ * cgi_register_strfuncs) or set the global_hdf. */
+typedef NEOERR* (*CSCACHEINIT)(void *ctx, CSPARSE *parse);
+
 struct _funct
 {
   char *name;
@@ -324,14 +419,21 @@ struct _parse
   struct _parse *parent;  /* set on internally created parse instances to point
                              at the parent.  This can be used for hierarchical
                              scope in the future. */
+  struct _parse *program; /* set on render contexts (see cs_render_init) to
+                             the parse whose tree, macros and functions
+                             they share.  The shared parts are read-only
+                             during render. */
+  CS_CODE *code;          /* set by cs_compile, shared by render contexts */
 
   CS_LOCAL_MAP *locals;
   CS_MACRO *macros;
   CS_FUNCTION *functions;
 
   /* Output */
-  void *output_ctx;
-  CSOUTFUNC output_cb;
+  STRING *output;         /* where rendering appends to */
+  void *output_ctx;       /* when rendering for a CSOUTFUNC, output */
+  CSOUTFUNC output_cb;    /* is passed on to it every so often */
+  int output_chunk;       /* once this many bytes are pending */
 
   void *fileload_ctx;
   CSFILELOAD fileload;
@@ -341,6 +443,26 @@ struct _parse
   HDF *global_hdf;
 
   CS_AUTOESCAPE auto_ctx;
+  /* Where working out the literal auto_trans left off, see auto_trace_tree */
+  CS_AUTO_TRACE *auto_trace;
+
+  /* Set on parse trees owned by the template cache, see cs_cache_get() */
+  CS_CACHE_ENTRY *cache_entry;
+
+  /* Parse trees of files lincluded while rendering, keyed by escape mode
+   * and path, so each file is only parsed once */
+  NE_HASH *lincludes;
+
+  /* The HDF nodes this parse's variables led to during the current
+   * render, and the number of cs_render calls (only counted on the top
+   * parse) which says which render that is */
+  CS_LOOKUP_CACHE *lookup_cache;
+  int renders;
+
+  /* Strings made while evaluating expressions (concatenations, computed
+   * variable names), which only live until the node that made them is
+   * done rendering, see scratch_alloc */
+  CS_SCRATCH *scratch;
 };
 
 /*
@@ -357,10 +479,34 @@ struct _parse
  * Return: NERR_NOMEM
  * MT-Level: cs routines perform no locking, and neither do hdf
  *           routines.  They should be safe in an MT environment as long
- *           as they are confined to a single thread.
+ *           as they are confined to a single thread.  To render one
+ *           parsed template from several threads, give each render its
+ *           own context with cs_render_init().
  */
 NEOERR *cs_init (CSPARSE **parse, HDF *hdf);
 
+/*
+ * Function: cs_render_init - create a render context for a parsed template
+ * Description: cs_render_init creates a lightweight CSPARSE which shares
+ *              the parse tree, macros and registered functions of parse,
+ *              but has its own render state: the HDF dataset, local
+ *              variables, output callback, escaping and auto escaping
+ *              state and recursion depth.  Rendering only reads the
+ *              shared parts, so once parse is fully parsed, any number of
+ *              render contexts can cs_render() it at the same time from
+ *              different threads, each against its own HDF dataset.
+ *              parse must not be parsed into, modified or destroyed
+ *              while render contexts for it exist.  A render context
+ *              can't be parsed into.  Free it with cs_destroy(), which
+ *              leaves the shared parts alone.
+ * Input: parse - a CSPARSE that a template has been parsed into
+ *        hdf - the HDF dataset to render against
+ * Output: render - the allocated render context
+ * Return: NERR_ASSERT - if parse is NULL
+ *         NERR_NOMEM
+ */
+NEOERR *cs_render_init (CSPARSE **render, CSPARSE *parse, HDF *hdf);
+
 /*
  * Function: cs_parse_file - parse a CS template file
  * Description: cs_parse_file will parse the CS template located at
@@ -411,6 +557,11 @@ NEOERR *cs_parse_string (CSPARSE *parse, char *buf, size_t blen);
  *              side-effects, it updates the HDF data used by the
  *              render.  Typically, you will call one of the cs_parse
  *              functions before calling this function.
+ *              During a render, the node each variable name leads to
+ *              is remembered until something is added to, removed from
+ *              or relinked in the HDF (see hdf_change_count), so
+ *              functions and output callbacks which change the HDF
+ *              have to do it with the hdf_ functions.
  * Input: parse - the CSPARSE structure containing the CS parse tree
  *                that will be evaluated
  *        ctx - user data that will be passed as the first variable to
@@ -418,6 +569,11 @@ NEOERR *cs_parse_string (CSPARSE *parse, char *buf, size_t blen);
  *        cb - a CSOUTFUNC called to render the output.  A CSOUTFUNC is
  *             defined as:
  *                 typedef NEOERR* (*CSOUTFUNC)(void *, char *);
+ *             The output is collected and passed to cb in pieces of
+ *             several kilobytes, not a piece for every literal and
+ *             variable; use cs_render_chunked to choose the size.  If
+ *             the render fails, whatever was rendered before the error
+ *             is still passed to cb.
  * Output: None
  * Return: NERR_NOMEM - Unable to allocate memory for CALL or SET
  *                      functions
@@ -425,6 +581,97 @@ NEOERR *cs_parse_string (CSPARSE *parse, char *buf, size_t blen);
  */
 NEOERR *cs_render (CSPARSE *parse, void *ctx, CSOUTFUNC cb);
 
+/*
+ * Function: cs_render_chunked - render a CS parse tree in pieces of a size
+ * Description: cs_render_chunked renders the same as cs_render, but
+ *              passes the output to cb as soon as chunk_size bytes are
+ *              pending, for callers which send the output on as it is
+ *              rendered and care how soon it goes.  A piece can be
+ *              larger than chunk_size, since variables and literals
+ *              aren't split.
+ * Input: parse - the CSPARSE structure containing the CS parse tree
+ *                that will be evaluated
+ *        ctx - user data that will be passed as the first variable to
+ *              the CSOUTFUNC.
+ *        cb - a CSOUTFUNC called to render the output
+ *        chunk_size - the number of bytes to collect before calling cb,
+ *                     1 (or less) calls it for every piece of output
+ * Output: None
+ * Return: see cs_render
+ */
+NEOERR *cs_render_chunked (CSPARSE *parse, void *ctx, CSOUTFUNC cb,
+                           int chunk_size);
+
+/*
+ * Function: cs_render_string - render a CS parse tree into a STRING
+ * Description: cs_render_string renders the same as cs_render, but
+ *              appends the output to str as it goes, without any
+ *              callbacks.  Escaped variables are escaped directly onto
+ *              the end of str, so this is the cheapest way to render
+ *              when the whole output is wanted in memory.
+ * Input: parse - the CSPARSE structure containing the CS parse tree
+ *                that will be evaluated
+ *        str - an initialized STRING (see string_init), which may
+ *              already hold something
+ * Output: str - the output is appended to it.  After an error, it
+ *               holds what was rendered up to the error.
+ * Return: see cs_render
+ */
+NEOERR *cs_render_string (CSPARSE *parse, STRING *str);
+
+/*
+ * Function: cs_compile - compile a parsed template for rendering
+ * Description: cs_compile lowers the parse tree (and the bodies of
+ *              macros) into a flat list of instructions, which cs_render
+ *              runs instead of walking the tree.  Runs of literal text are
+ *              joined and copied into one buffer, and if/elif/else become
+ *              conditional jumps.  The output is the same either way, this
+ *              just makes rendering a template many times cheaper.  The
+ *              template cache compiles the templates it holds.  Parsing
+ *              more into parse throws the compiled version away, call
+ *              cs_compile again after.  Render contexts created with
+ *              cs_render_init() after cs_compile use the compiled version.
+ * Input: parse - a CSPARSE that a template has been parsed into
+ * Output: None
+ * Return: NERR_ASSERT - if parse is a render context
+ *         NERR_NOMEM
+ */
+NEOERR *cs_compile (CSPARSE *parse);
+
+/*
+ * Function: cs_optimize - simplify a parsed template before rendering
+ * Description: cs_optimize works out the expressions in the parse tree
+ *              that don't depend on the data, like 2 * 60 or "a" + "b",
+ *              drops if/elif/else and alt branches which can never be
+ *              rendered, like <?cs if:0 ?> blocks, and joins up runs of
+ *              literal text, so each render has less to do.  Branches
+ *              holding a def are kept.  Without frozen the output is the
+ *              same either way; the template cache optimizes the
+ *              templates it holds this way.
+ *              With frozen, variables under any of prefixes (like
+ *              "Config" for Config and Config.Site.Url) are also read
+ *              from frozen now and built into the template as constants.
+ *              That is only right if rendering would find the same
+ *              values: the template mustn't set anything under them or
+ *              use them as local variable names, and the HDF it is
+ *              rendered with has to agree with frozen there, for
+ *              instance by having it as its base (see hdf_set_base).
+ *              Values are copied, frozen can be destroyed afterwards.
+ *              Frozen is ignored when auto escaping is enabled, since
+ *              values from the HDF carry their own escape status.
+ *              Like cs_compile, call it once everything is parsed into
+ *              parse and before creating render contexts.
+ * Input: parse - a CSPARSE that a template has been parsed into
+ *        frozen - NULL, or a data set frozen with hdf_freeze
+ *        prefixes - a NULL terminated list of the names in frozen that
+ *                   won't change, NULL for none
+ * Output: None
+ * Return: NERR_ASSERT - if parse is a render context, or frozen isn't
+ *                       frozen
+ *         NERR_NOMEM
+ */
+NEOERR *cs_optimize (CSPARSE *parse, HDF *frozen, const char **prefixes);
+
 /*
  * Function: cs_dump - dump the cs parse tree
  * Description: cs_dump will dump the CS parse tree in the parse struct.
@@ -521,6 +768,152 @@ NEOERR *cs_register_strfunc(CSPARSE *parse, char *funcname, CSSTRFUNC str_func);
 NEOERR *cs_register_esc_strfunc(CSPARSE *parse, char *funcname,
                                 CSSTRFUNC str_func);
 
+/*
+ * Function: cs_cache_get - get a parsed CS template from the template cache
+ * Description: cs_cache_get returns the parse tree for the CS template
+ *              file at path from a process wide cache, parsing it on the
+ *              first request.  The cache is keyed by the path after it is
+ *              resolved with hdf_search_path(), the HDF settings which
+ *              change how a template is parsed (Config.AutoEscape,
+ *              Config.LogAutoEscape, Config.PropagateEscapeStatus,
+ *              Config.EnableAuditMode, Config.TagStart and
+ *              Config.VarEscapeMode), and init and ctx, so a ctx which
+ *              changes on every call defeats the cache.  An entry is
+ *              re-parsed when the modification time or size of the file,
+ *              or of any file it includes, changes; the files are checked
+ *              at most once every Config.TemplateCacheCheckInterval
+ *              seconds (default 1, 0 checks them on every call).
+ *              Templates whose parse depends on the HDF dataset (evar,
+ *              or include of a variable) or that are loaded with a
+ *              CSFILELOAD function are not cached, and are parsed again
+ *              on every call.
+ *              The returned parse tree should be rendered with
+ *              cs_render_cached() and must be returned with
+ *              cs_cache_release(), never cs_destroy().
+ * Input: hdf - the HDF dataset used to find the file, and to configure
+ *              the parse if it isn't in the cache yet
+ *        path - the path to the template file
+ *        ctx - user data passed to init
+ *        init - an optional CSCACHEINIT called on a new CSPARSE before
+ *               the template is parsed
+ * Output: parse - the parsed template
+ * Return: NERR_ASSERT - if path == NULL
+ *         NERR_NOT_FOUND - if path isn't found
+ *         NERR_NOMEM - unable to allocate memory
+ *         NERR_PARSE - error in CS template
+ *         anything your init function returns
+ * MT-Level: Safe, when built with pthreads.  The returned parse tree
+ *           can be rendered by several threads at once with
+ *           cs_render_cached().
+ */
+NEOERR *cs_cache_get (HDF *hdf, const char *path, void *ctx, CSCACHEINIT init,
+                      CSPARSE **parse);
+
+/*
+ * Function: cs_render_cached - render a cached CS parse tree
+ * Description: cs_render_cached renders a parse tree returned by
+ *              cs_cache_get against the given HDF dataset.  Each render
+ *              uses its own render context (see cs_render_init), so the
+ *              cached parse tree is never modified.
+ * Input: parse - a CSPARSE returned by cs_cache_get
+ *        hdf - the HDF dataset to render with
+ *        ctx - user data that will be passed as the first variable to
+ *              the CSOUTFUNC.
+ *        cb - a CSOUTFUNC called to render the output.
+ * Output: None
+ * Return: see cs_render
+ */
+NEOERR *cs_render_cached (CSPARSE *parse, HDF *hdf, void *ctx, CSOUTFUNC cb);
+
+/*
+ * Function: cs_cache_release - release a parse tree returned by cs_cache_get
+ * Description: cs_cache_release gives a parse tree back to the template
+ *              cache.  Parse trees which weren't cached are destroyed.
+ * Input: parse - a pointer to a CSPARSE returned by cs_cache_get
+ * Output: parse - will be NULL
+ * Return: None
+ */
+void cs_cache_release (CSPARSE **parse);
+
+/*
+ * Function: cs_cache_clear - empty the template cache
+ * Description: cs_cache_clear drops all of the entries in the template
+ *              cache.  Entries which are still in use are destroyed when
+ *              they are released.
+ * Input: None
+ * Output: None
+ * Return: None
+ */
+void cs_cache_clear (void);
+
+/*
+ * Function: cs_precompile - flatten a parse tree into tables
+ * Description: cs_precompile builds the CS_PRECOMPILED form of the
+ *              templates parsed into parse, which cs_dump_c() writes
+ *              out as C.  Whatever the parse read at parse time is part
+ *              of the result: included files, and the values of evar
+ *              and of variables used as include paths.
+ * Input: parse - a CSPARSE with templates parsed into it
+ *        name - the name the result is registered under
+ * Output: pre - the tables, free with cs_precompiled_destroy()
+ * Return: NERR_ASSERT - parse is a render context
+ *         NERR_NOMEM
+ */
+NEOERR *cs_precompile (CSPARSE *parse, const char *name,
+                       CS_PRECOMPILED **pre);
+
+/*
+ * Function: cs_precompiled_destroy - free the result of cs_precompile
+ * Input: pre - a pointer to a CS_PRECOMPILED made by cs_precompile()
+ * Output: pre - will be NULL
+ * Return: None
+ */
+void cs_precompiled_destroy (CS_PRECOMPILED **pre);
+
+/*
+ * Function: cs_dump_c - write a parse tree out as C
+ * Description: cs_dump_c writes the templates parsed into parse as a
+ *              static const CS_PRECOMPILED named ident, with its tables,
+ *              to be compiled into a program and registered with
+ *              cs_register_precompiled().  The caller writes the
+ *              #include of cs.h, and whatever refers to ident.  The cs
+ *              tool's -C option uses this for a set of templates.
+ * Input: parse - a CSPARSE with templates parsed into it
+ *        name - the name the template is registered under
+ *        ident - the C identifier for the result
+ *        ctx - user data passed to the CSOUTFUNC
+ *        cb - a CSOUTFUNC called with the C source
+ * Output: None
+ * Return: see cs_precompile(), and anything your CSOUTFUNC returns
+ */
+NEOERR *cs_dump_c (CSPARSE *parse, const char *name, const char *ident,
+                   void *ctx, CSOUTFUNC cb);
+
+/*
+ * Function: cs_register_precompiled - register precompiled templates
+ * Description: cs_register_precompiled makes a list of precompiled
+ *              templates available by name to the whole process.  When
+ *              cs_parse_file(), include, linclude or cs_cache_get() are
+ *              asked for a registered name, the tree is built from the
+ *              tables instead of finding, reading and parsing a file, as
+ *              long as the parse has the same Config.AutoEscape,
+ *              Config.VarEscapeMode and Config.TagStart it was built with
+ *              and isn't in audit mode; otherwise the file is used.
+ *              The templates are not copied, and the parse trees built
+ *              from them point into their strings, so they must outlive
+ *              both, which the static data cs_dump_c() writes does.
+ * Input: templates - a NULL terminated list, or NULL to unregister all
+ *                    of them
+ * Output: None
+ * Return: NERR_ASSERT - a template was built by a different version
+ *         NERR_DUPLICATE - a different template is registered with the
+ *                          same name
+ *         NERR_NOMEM
+ * MT-Level: Unsafe, register the templates before any thread uses
+ *           them.
+ */
+NEOERR *cs_register_precompiled (const CS_PRECOMPILED **templates);
+
 /* Testing functions for future function api.  This api may change in the
  * future. */
 NEOERR *cs_arg_parse(CSPARSE *parse, CSARG *args, const char *fmt, ...);
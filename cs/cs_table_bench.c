@@ -0,0 +1,194 @@
+#include "cs_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+#include "util/neo_str.h"
+#include "cs.h"
+
+/* Times rendering a table of 2000 rows of 10 columns, where every cell
+ * looks up a column of the each variable and the same few configuration
+ * names, so most of the time goes to variable lookups.  Each template is
+ * rendered through a CSOUTFUNC (cs_render) and into a STRING
+ * (cs_render_string).  Not run as part of the tests; build it with "make
+ * bench" and run it by hand. */
+
+#define NUM_ROWS 2000
+#define NUM_COLS 10
+
+static char *Table =
+  "<table><?cs each:row = Rows ?><tr class=\"<?cs var:Config.Style ?>\">"
+  "<td><a href=\"<?cs var:Config.Site.Url ?><?cs var:row.Id ?>\">"
+  "<?cs var:row.C0 ?></a></td>"
+  "<td><a href=\"<?cs var:Config.Site.Url ?><?cs var:row.Id ?>\">"
+  "<?cs var:row.C1 ?></a></td>"
+  "<td><a href=\"<?cs var:Config.Site.Url ?><?cs var:row.Id ?>\">"
+  "<?cs var:row.C2 ?></a></td>"
+  "<td><a href=\"<?cs var:Config.Site.Url ?><?cs var:row.Id ?>\">"
+  "<?cs var:row.C3 ?></a></td>"
+  "<td><a href=\"<?cs var:Config.Site.Url ?><?cs var:row.Id ?>\">"
+  "<?cs var:row.C4 ?></a></td>"
+  "<td><a href=\"<?cs var:Config.Site.Url ?><?cs var:row.Id ?>\">"
+  "<?cs var:row.C5 ?></a></td>"
+  "<td><a href=\"<?cs var:Config.Site.Url ?><?cs var:row.Id ?>\">"
+  "<?cs var:row.C6 ?></a></td>"
+  "<td><a href=\"<?cs var:Config.Site.Url ?><?cs var:row.Id ?>\">"
+  "<?cs var:row.C7 ?></a></td>"
+  "<td><a href=\"<?cs var:Config.Site.Url ?><?cs var:row.Id ?>\">"
+  "<?cs var:row.C8 ?></a></td>"
+  "<td><a href=\"<?cs var:Config.Site.Url ?><?cs var:row.Id ?>\">"
+  "<?cs var:row.C9 ?></a></td>"
+  "</tr><?cs /each ?></table>";
+
+/* Mostly lookups and comparisons, hardly any output */
+static char *Lookup =
+  "<?cs each:row = Rows ?><?cs loop:col = 0, 9 ?>"
+  "<?cs if:row.Id == Config.Site.Current ?>current<?cs /if ?>"
+  "<?cs if:row.C0 == Config.Site.Url ?>match<?cs /if ?>"
+  "<?cs if:row.C9 == Config.Site.Url ?>match<?cs /if ?>"
+  "<?cs /loop ?><?cs /each ?>";
+
+/* Concatenations and computed names */
+static char *Expr =
+  "<?cs each:row = Rows ?><?cs loop:col = 0, 9 ?>"
+  "<?cs var:Config.Site.Url + row.Id + \"/\" + row.C0 ?>"
+  "<?cs if:Rows[name(row)].Id == col ?>match<?cs /if ?>"
+  "<?cs /loop ?><?cs /each ?>";
+
+/* The table again, with every variable html escaped */
+static char *Escape =
+  "<?cs escape:\"html\" ?><table><?cs each:row = Rows ?><tr>"
+  "<?cs loop:col = 0, 9 ?><td><a href=\"<?cs var:Config.Site.Url ?>"
+  "<?cs var:row.Id ?>\"><?cs var:Rows[name(row)][\"C\" + col] ?>"
+  " &lt;<?cs var:Config.Site.Name ?>&gt;</a></td><?cs /loop ?>"
+  "</tr><?cs /each ?></table><?cs /escape ?>";
+
+static char *Macro =
+  "<?cs def:cell(value, url) ?><td><a href=\"<?cs var:url ?>\">"
+  "<?cs var:value ?></a></td><?cs /def ?>"
+  "<table><?cs each:row = Rows ?><tr>"
+  "<?cs call:cell(row.C0, Config.Site.Url) ?>"
+  "<?cs call:cell(row.C1, Config.Site.Url) ?>"
+  "<?cs call:cell(row.C2, Config.Site.Url) ?>"
+  "<?cs call:cell(row.C3, Config.Site.Url) ?>"
+  "<?cs call:cell(row.C4, Config.Site.Url) ?>"
+  "<?cs call:cell(row.C5, Config.Site.Url) ?>"
+  "<?cs call:cell(row.C6, Config.Site.Url) ?>"
+  "<?cs call:cell(row.C7, Config.Site.Url) ?>"
+  "<?cs call:cell(row.C8, Config.Site.Url) ?>"
+  "<?cs call:cell(row.C9, Config.Site.Url) ?>"
+  "</tr><?cs /each ?></table>";
+
+static NEOERR *output (void *ctx, char *s)
+{
+  return nerr_pass(string_append((STRING *)ctx, s));
+}
+
+static NEOERR *fill(HDF *hdf)
+{
+  NEOERR *err;
+  char name[128];
+  int x, y;
+
+  err = hdf_read_string(hdf,
+      "Config.Site {\n"
+      "  Name = Example\n"
+      "  Title = Example Items\n"
+      "  Logo = /images/logo.png\n"
+      "  Style = /css/site.css\n"
+      "  Script = /js/site.js\n"
+      "  Current = -1\n"
+      "  Url = http://example.com/item/\n"
+      "}\n"
+      "Config.Style = row\n");
+  if (err) return nerr_pass(err);
+  for (x = 0; x < NUM_ROWS; x++)
+  {
+    snprintf(name, sizeof(name), "Rows.%d.Id", x);
+    err = hdf_set_int_value(hdf, name, x);
+    if (err) return nerr_pass(err);
+    for (y = 0; y < NUM_COLS; y++)
+    {
+      snprintf(name, sizeof(name), "Rows.%d.C%d", x, y);
+      err = hdf_set_valuef(hdf, "%s=cell %d of row %d", name, y, x);
+      if (err) return nerr_pass(err);
+    }
+  }
+  return STATUS_OK;
+}
+
+static NEOERR *bench_render(const char *what, HDF *hdf, const char *tmpl,
+                            int rounds)
+{
+  NEOERR *err;
+  CSPARSE *parse;
+  STRING out;
+  char *buf;
+  double start, t, best = 0, best_str = 0;
+  int r;
+
+  buf = strdup(tmpl);
+  if (buf == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to copy template");
+  err = cs_init(&parse, hdf);
+  if (err) return nerr_pass(err);
+  err = cs_parse_string(parse, buf, strlen(buf));
+  if (err) return nerr_pass(err);
+
+  string_init(&out);
+  for (r = 0; r < rounds; r++)
+  {
+    string_clear(&out);
+    start = ne_timef();
+    err = cs_render(parse, &out, output);
+    t = ne_timef() - start;
+    if (r == 0 || t < best) best = t;
+    if (err) return nerr_pass(err);
+  }
+  for (r = 0; r < rounds; r++)
+  {
+    out.len = 0;
+    start = ne_timef();
+    err = cs_render_string(parse, &out);
+    t = ne_timef() - start;
+    if (r == 0 || t < best_str) best_str = t;
+    if (err) return nerr_pass(err);
+  }
+
+  printf("render %-6s %8.1fKB  best of %d %8.2fms  string %8.2fms\n", what,
+      out.len / 1024.0, rounds, best * 1000, best_str * 1000);
+  string_clear(&out);
+  cs_destroy(&parse);
+  return STATUS_OK;
+}
+
+int main(int argc, char *argv[])
+{
+  NEOERR *err;
+  HDF *hdf;
+
+  err = hdf_init(&hdf);
+  if (err == STATUS_OK)
+    err = fill(hdf);
+  if (err == STATUS_OK)
+    err = bench_render("table", hdf, Table, 20);
+  if (err == STATUS_OK)
+    err = bench_render("macro", hdf, Macro, 20);
+  if (err == STATUS_OK)
+    err = bench_render("lookup", hdf, Lookup, 20);
+  if (err == STATUS_OK)
+    err = bench_render("expr", hdf, Expr, 20);
+  if (err == STATUS_OK)
+    err = bench_render("escape", hdf, Escape, 20);
+  if (err)
+  {
+    nerr_log_error(err);
+    return -1;
+  }
+
+  hdf_destroy(&hdf);
+  return 0;
+}
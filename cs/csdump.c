@@ -15,19 +15,18 @@
 #include "util/neo_misc.h"
 #include "util/neo_hdf.h"
 
-/*
 static NEOERR *output (void *ctx, char *s)
 {
-  printf ("%s", s);
+  fputs (s, (FILE *) ctx);
   return STATUS_OK;
 }
-*/
 
 int main (int argc, char *argv[])
 {
   NEOERR *err;
   CSPARSE *parse;
   HDF *hdf;
+  FILE *fp;
 
   if (argc < 3)
   {
@@ -58,7 +57,20 @@ int main (int argc, char *argv[])
     return -1;
   }
 
-  err = cs_dump_c(parse, argv[2]);
+  fp = fopen (argv[2], "w");
+  if (fp == NULL)
+  {
+    ne_warn ("Unable to open %s for writing", argv[2]);
+    return -1;
+  }
+  fprintf (fp, "#include \"ClearSilver.h\"\n\n");
+  err = cs_dump_c(parse, argv[1], "cs_template", fp, output);
+  fclose (fp);
+  if (err != STATUS_OK)
+  {
+    nerr_warn_error(err);
+    return -1;
+  }
 
   cs_destroy (&parse);
 
@@ -41,6 +41,8 @@
 #include "util/neo_files.h"
 #include "util/neo_str.h"
 #include "util/ulist.h"
+#include "util/neo_hash.h"
+#include "util/ulocks.h"
 #include "cs.h"
 
 /* turn on some debug output for expressions */
@@ -74,6 +76,30 @@ typedef struct _stack_entry
   int location;
 } STACK_ENTRY;
 
+/* A file read while parsing a cached template, used to notice when the
+ * cached parse tree is out of date */
+typedef struct _cache_file
+{
+  char *path;
+  time_t mtime;
+  off_t size;
+  struct _cache_file *next;
+} CS_CACHE_FILE;
+
+struct _cache_entry
+{
+  char *key;            /* see cache_key and linclude_eval */
+  CSPARSE *parse;
+  CS_CACHE_FILE *files;
+  int uncacheable;      /* the parse depends on more than the files */
+  int refs;
+  int stale;            /* no longer in the cache, free on last release */
+  CS_ECONTEXT escaping; /* lincludes: escaping state right after the parse */
+  int checked;          /* lincludes: the render the files were checked in */
+  time_t checked_at;    /* templates: when the files were last checked */
+  struct _cache_entry *next;
+};
+
 static NEOERR *literal_parse (CSPARSE *parse, int cmd, char *arg);
 static NEOERR *literal_eval (CSPARSE *parse, CSTREE *node, CSTREE **next);
 static NEOERR *name_parse (CSPARSE *parse, int cmd, char *arg);
@@ -114,10 +140,26 @@ static NEOERR *render_node (CSPARSE *parse, CSTREE *node);
 static NEOERR *increase_stack_depth (CSPARSE *parse);
 static NEOERR *decrease_stack_depth (CSPARSE *parse);
 static NEOERR *cs_init_internal (CSPARSE **parse, HDF *hdf, CSPARSE *parent);
-static NEOERR *cs_render_internal (CSPARSE *parse, void *ctx, CSOUTFUNC cb);
+static NEOERR *cs_render_internal (CSPARSE *parse, STRING *out,
+                                   void *ctx, CSOUTFUNC cb, int chunk);
 static NEOERR *cs_parse_string_internal (CSPARSE *parse, char *ibuf,
                                          size_t ibuf_len);
 static int rearrange_for_call(CSARG **args);
+static NEOERR *cache_add_file (CS_CACHE_ENTRY *entry, const char *path);
+static NEOERR *cache_entry_new (const char *key, CS_CACHE_ENTRY **entry);
+static int cache_entry_is_fresh (CS_CACHE_ENTRY *entry);
+static void cache_entry_destroy (CS_CACHE_ENTRY **entry);
+static void cache_entry_retire (CS_CACHE_ENTRY *entry);
+static void cache_hash_retire_all (NE_HASH **hash);
+static NEOERR *auto_trace_tree (CSPARSE *parse);
+static void local_slot_tree (CSPARSE *parse);
+static void auto_trace_clear (CS_AUTO_TRACE *trace);
+static void dealloc_auto_trans (CS_AUTO_TRANS **trans);
+static NEOERR *run_code (CSPARSE *parse, CS_CODE *code, int pc);
+static void dealloc_code (CS_CODE **code);
+static const CS_PRECOMPILED *precompiled_find (const char *path);
+static int precompiled_fits (CSPARSE *parse, const CS_PRECOMPILED *pre);
+static NEOERR *precompiled_load (CSPARSE *parse, const CS_PRECOMPILED *pre);
 
 #define ATTR_PROPAGATE_STATUS "escape_status"
 #define ATTR_TRUSTED "trusted"
@@ -305,6 +347,7 @@ static void dealloc_arg (CSARG **arg)
   if (p->next) dealloc_arg (&(p->next));
 
   if (p->argexpr) free(p->argexpr);
+  if (p->path) hdf_path_destroy(&(p->path));
 
   free(p);
   *arg = NULL;
@@ -329,6 +372,9 @@ static void dealloc_node (CSTREE **node)
 
   if (my_node->arg1.argexpr) free(my_node->arg1.argexpr);
   if (my_node->arg2.argexpr) free(my_node->arg2.argexpr);
+  if (my_node->arg1.path) hdf_path_destroy(&(my_node->arg1.path));
+  if (my_node->arg2.path) hdf_path_destroy(&(my_node->arg2.path));
+  if (my_node->auto_trans) dealloc_auto_trans(&(my_node->auto_trans));
   if (my_node->fname) free(my_node->fname);
 
   free(my_node);
@@ -423,25 +469,39 @@ static NEOERR *cs_parse_file_internal (CSPARSE *parse, const char *path)
   char fpath[PATH_BUF_SIZE];
   CS_POSITION pos = { };
   int tmp_idx = -1;
+  const CS_PRECOMPILED *pre;
 
   if (path == NULL)
     return nerr_raise (NERR_ASSERT, "path is NULL");
 
+  /* Built into the program, see cs_register_precompiled */
+  pre = precompiled_find (path);
+  if (pre != NULL && precompiled_fits (parse, pre))
+    return nerr_pass (precompiled_load (parse, pre));
+
   if (parse->fileload)
   {
+    /* We have no way to tell when this changes */
+    if (parse->cache_entry) parse->cache_entry->uncacheable = 1;
     err = parse->fileload(parse->fileload_ctx, parse->hdf, path, &ibuf);
   }
   else
   {
     if (path[0] != '/')
     {
-      err = hdf_search_path (parse->hdf, path, fpath, PATH_BUF_SIZE);
+      err = hdf_search_path_probe (parse->hdf, path, fpath, PATH_BUF_SIZE);
       if (parse->global_hdf && nerr_handle(&err, NERR_NOT_FOUND))
-        err = hdf_search_path(parse->global_hdf, path, fpath, PATH_BUF_SIZE);
+        err = hdf_search_path_probe (parse->global_hdf, path, fpath,
+                                     PATH_BUF_SIZE);
       if (err != STATUS_OK) return nerr_pass(err);
       path = fpath;
     }
 
+    if (parse->cache_entry)
+    {
+      err = cache_add_file (parse->cache_entry, path);
+      if (err) return nerr_pass (err);
+    }
     err = ne_load_file (path, &ibuf);
   }
   if (err) return nerr_pass (err);
@@ -543,10 +603,21 @@ NEOERR *cs_parse_file (CSPARSE *parse, const char *path)
 {
   NEOERR *err;
 
+  if (parse->program)
+    return nerr_raise (NERR_ASSERT, "Can't parse into a render context");
+
   err = read_auto_status(parse);
   if (err) return nerr_pass(err);
 
-  return nerr_pass(cs_parse_file_internal(parse, path));
+  /* The compiled version doesn't know about what's added */
+  dealloc_code(&(parse->code));
+
+  err = cs_parse_file_internal(parse, path);
+  if (nerr_match(err, NERR_NOT_FOUND))
+    return nerr_pass_ctx(err, "Unable to find %s", path);
+  if (err) return nerr_pass(err);
+  local_slot_tree(parse);
+  return nerr_pass(auto_trace_tree(parse));
 }
 
 static char *find_context (CSPARSE *parse, int offset, char *buf, size_t blen)
@@ -814,10 +885,19 @@ NEOERR *cs_parse_string (CSPARSE *parse, char *ibuf, size_t ibuf_len)
 {
   NEOERR *err;
 
+  if (parse->program)
+    return nerr_raise (NERR_ASSERT, "Can't parse into a render context");
+
   err = read_auto_status(parse);
   if (err) return nerr_pass(err);
 
-  return nerr_pass(cs_parse_string_internal(parse, ibuf, ibuf_len));
+  /* The compiled version doesn't know about what's added */
+  dealloc_code(&(parse->code));
+
+  err = cs_parse_string_internal(parse, ibuf, ibuf_len);
+  if (err) return nerr_pass(err);
+  local_slot_tree(parse);
+  return nerr_pass(auto_trace_tree(parse));
 }
 
 /* Like strcmp but stops when either string contains a '.'. Used to compare HDF
@@ -872,25 +952,294 @@ static CS_LOCAL_MAP * lookup_map (CSPARSE *parse, char *name, char **rest)
   return scoped_lookup_map (parse->locals, name, rest);
 }
 
+/* Same as lookup_map for a parsed variable.  If the parser found which
+   enclosing each, loop, with or def argument binds it (see
+   local_slot_tree), it is always that many locals in, so go straight
+   there instead of comparing names on the way.  The name is checked by
+   pointer in case the locals aren't what the parser expected. */
+static CS_LOCAL_MAP * arg_lookup_map (CSPARSE *parse, CSARG *arg, char **rest)
+{
+  CS_LOCAL_MAP *map = parse->locals;
+  int x;
+
+  if (arg->local_slot > 0)
+  {
+    for (x = 1; x < arg->local_slot && map != NULL; x++)
+      map = map->next;
+    if (map != NULL && map->name == arg->local_name)
+    {
+      *rest = strchr (arg->s, '.');
+      return map;
+    }
+  }
+  return lookup_map (parse, arg->s, rest);
+}
+
+/* Look up name under hdf.  If the parser compiled the name into path, walk
+   that instead, skipping the first skip elements of it (which name has
+   already had removed, ie the local variable part). */
+static HDF *path_lookup_obj (HDF *hdf, char *name, HDF_PATH *path, int skip)
+{
+  HDF_PATH sub;
+
+  if (path == NULL) return hdf_get_obj (hdf, name);
+  sub.num = path->num - skip;
+  sub.elems = path->elems + skip;
+  return hdf_get_obj_path (hdf, &sub);
+}
+
+/* Remembers which node each compiled variable name led to in the HDF
+   (or global HDF), so an each over a big table only walks the HDF for
+   the names which don't change from row to row once per render.
+   Entries are keyed by the HDF_PATH, which belongs to this parse's own
+   tree, and all of them are forgotten when a new render starts, the
+   HDF is swapped, or anything is added to, removed from or relinked in
+   either data set (see hdf_change_count), which is what set or a
+   registered function can do to change where a name leads. */
+#define LOOKUP_CACHE_SIZE 256
+
+typedef struct _lookup_entry
+{
+  HDF_PATH *path;
+  int global;
+  HDF *obj;
+} CS_LOOKUP_ENTRY;
+
+struct _lookup_cache
+{
+  HDF *hdf;
+  HDF *global_hdf;
+  unsigned int changes;
+  int renders;
+  CS_LOOKUP_ENTRY entries[LOOKUP_CACHE_SIZE];
+};
+
+/* path_lookup_obj from the top of parse->hdf, or of parse->global_hdf if
+   global is set, through the lookup cache */
+static HDF *cached_lookup_obj (CSPARSE *parse, char *name, HDF_PATH *path,
+                               int global)
+{
+  CS_LOOKUP_CACHE *cache = parse->lookup_cache;
+  CS_LOOKUP_ENTRY *entry;
+  CSPARSE *top;
+  HDF *hdf = global ? parse->global_hdf : parse->hdf;
+  unsigned int changes;
+
+  if (path == NULL || hdf == NULL)
+    return path_lookup_obj (hdf, name, path, 0);
+  if (cache == NULL)
+  {
+    /* Without the memory for it, just don't cache */
+    cache = (CS_LOOKUP_CACHE *) calloc (1, sizeof (CS_LOOKUP_CACHE));
+    if (cache == NULL)
+      return path_lookup_obj (hdf, name, path, 0);
+    parse->lookup_cache = cache;
+  }
+
+  /* lvar and linclude parses render as part of their top parse's render */
+  for (top = parse; top->parent != NULL; top = top->parent);
+  changes = hdf_change_count (parse->hdf) +
+            hdf_change_count (parse->global_hdf);
+  if (cache->hdf != parse->hdf || cache->global_hdf != parse->global_hdf ||
+      cache->changes != changes || cache->renders != top->renders)
+  {
+    memset (cache->entries, 0, sizeof (cache->entries));
+    cache->hdf = parse->hdf;
+    cache->global_hdf = parse->global_hdf;
+    cache->changes = changes;
+    cache->renders = top->renders;
+  }
+
+  entry = &(cache->entries[(((size_t) path >> 4) ^ global) &
+                           (LOOKUP_CACHE_SIZE - 1)]);
+  if (entry->path != path || entry->global != global)
+  {
+    entry->path = path;
+    entry->global = global;
+    entry->obj = path_lookup_obj (hdf, name, path, 0);
+  }
+  return entry->obj;
+}
+
+/* Strings that expressions make along the way, like a + b or the name
+ * of a[x].b, are carved out of blocks owned by the parse instead of
+ * being malloc'd.  render_node and run_code take a scratch_mark before
+ * each node and scratch_release it once the node is done, so a string
+ * lives as long as the node whose expression made it, and after the
+ * first render the blocks are just reused.  Strings from here are
+ * handed out with alloc = 0; anything kept past the node (set, lvar)
+ * already copies it. */
+#define SCRATCH_BLOCK_SIZE 4096
+
+typedef struct _scratch_block
+{
+  struct _scratch_block *next;
+  size_t size;
+  size_t used;
+  size_t last;  /* where the newest string starts, see scratch_concat */
+  char data[1];
+} CS_SCRATCH_BLOCK;
+
+struct _scratch
+{
+  CS_SCRATCH_BLOCK *first;
+  CS_SCRATCH_BLOCK *cur;    /* blocks after this one are free */
+};
+
+typedef struct _scratch_mark
+{
+  CS_SCRATCH_BLOCK *block;
+  size_t used;
+} CS_SCRATCH_MARK;
+
+static void scratch_mark (CSPARSE *parse, CS_SCRATCH_MARK *mark)
+{
+  CS_SCRATCH_BLOCK *block;
+
+  mark->block = NULL;
+  mark->used = 0;
+  if (parse->scratch == NULL || parse->scratch->cur == NULL)
+    return;
+  block = parse->scratch->cur;
+  mark->block = block;
+  mark->used = block->used;
+  /* The strings before the mark may be held by locals, don't let a
+   * concatenation grow them in place */
+  block->last = block->used;
+}
+
+static void scratch_release (CSPARSE *parse, CS_SCRATCH_MARK *mark)
+{
+  CS_SCRATCH_BLOCK *block = mark->block;
+
+  if (parse->scratch == NULL)
+    return;
+  parse->scratch->cur = block;
+  if (block != NULL)
+  {
+    block->used = mark->used;
+    block->last = mark->used;
+  }
+}
+
+static char *scratch_alloc (CSPARSE *parse, size_t len)
+{
+  CS_SCRATCH *scratch = parse->scratch;
+  CS_SCRATCH_BLOCK *block, *next;
+  size_t size;
+
+  if (scratch == NULL)
+  {
+    scratch = (CS_SCRATCH *) calloc (1, sizeof (CS_SCRATCH));
+    if (scratch == NULL)
+      return NULL;
+    parse->scratch = scratch;
+  }
+
+  block = scratch->cur;
+  if (block == NULL || block->size - block->used < len)
+  {
+    next = block ? block->next : scratch->first;
+    if (next == NULL || next->size < len)
+    {
+      size = (len > SCRATCH_BLOCK_SIZE) ? len : SCRATCH_BLOCK_SIZE;
+      next = (CS_SCRATCH_BLOCK *) malloc (sizeof (CS_SCRATCH_BLOCK) + size);
+      if (next == NULL)
+        return NULL;
+      next->size = size;
+      if (block != NULL)
+      {
+        next->next = block->next;
+        block->next = next;
+      }
+      else
+      {
+        next->next = scratch->first;
+        scratch->first = next;
+      }
+    }
+    next->used = 0;
+    scratch->cur = block = next;
+  }
+  block->last = block->used;
+  block->used += len;
+  return block->data + block->last;
+}
+
+/* s1 + sep + s2 in scratch.  If s1 is the newest scratch string it is
+ * just grown, so a + b + c builds one string */
+static char *scratch_concat (CSPARSE *parse, char *s1, const char *sep,
+                             const char *s2)
+{
+  CS_SCRATCH_BLOCK *block;
+  size_t l1, lsep, l2;
+  char *s;
+
+  if (s1 == NULL) s1 = "";
+  l1 = strlen(s1);
+  lsep = strlen(sep);
+  l2 = strlen(s2);
+  block = parse->scratch ? parse->scratch->cur : NULL;
+  if (block != NULL && s1 == block->data + block->last && s2 != s1 &&
+      block->last + l1 + 1 == block->used &&
+      block->size - block->used >= lsep + l2)
+  {
+    s = s1;
+    block->used += lsep + l2;
+  }
+  else
+  {
+    s = scratch_alloc (parse, l1 + lsep + l2 + 1);
+    if (s == NULL)
+      return NULL;
+    memcpy (s, s1, l1);
+  }
+  memcpy (s + l1, sep, lsep);
+  memcpy (s + l1 + lsep, s2, l2 + 1);
+  return s;
+}
+
+static void scratch_destroy (CS_SCRATCH **scratch)
+{
+  CS_SCRATCH_BLOCK *block, *next;
+
+  if (*scratch == NULL)
+    return;
+  for (block = (*scratch)->first; block != NULL; block = next)
+  {
+    next = block->next;
+    free (block);
+  }
+  free (*scratch);
+  *scratch = NULL;
+}
+
 /* Note: Check that the map argument passed to this function is either
    parse->locals or (CS_LOCAL_MAP*)->next_scope.  If not one of those two then
    there is probably a bug.
 
+   If arg is set, name is the parsed variable arg, and map is parse->locals.
+
    We return NEOERR* to properly handle creation function return values.
    If create == FALSE, the return value will always be STATUS_OK.  If you modify
    the code to behave differently, you should check all the callers as some make
    this assumption.
 */
 static NEOERR *scoped_var_lookup_or_create_obj (CSPARSE *parse, char *name,
-                                                BOOL create, CS_LOCAL_MAP *map,
+                                                CSARG *arg, BOOL create,
+                                                CS_LOCAL_MAP *map,
                                                 HDF **ret_hdf)
 {
   NEOERR *err;
+  HDF_PATH *path = (arg != NULL) ? arg->path : NULL;
   char *rest;
 
   if (ret_hdf != NULL) *ret_hdf = NULL;
   if (name == NULL || name[0] == '\0') return STATUS_OK;
-  map = scoped_lookup_map(map, name, &rest);
+  if (arg != NULL)
+    map = arg_lookup_map(parse, arg, &rest);
+  else
+    map = scoped_lookup_map(map, name, &rest);
   if (map != NULL)
   {
     /* We found a local variable that matches the name */
@@ -900,7 +1249,7 @@ static NEOERR *scoped_var_lookup_or_create_obj (CSPARSE *parse, char *name,
       if (map->h == NULL)
       {
         /* We don't have a pointer to the HDF node yet. Look it up. */
-        err = scoped_var_lookup_or_create_obj(parse, map->s, create,
+        err = scoped_var_lookup_or_create_obj(parse, map->s, NULL, create,
                                               map->next_scope, &(map->h));
         /* Check if there was an err. */
         if (err != STATUS_OK) {
@@ -928,37 +1277,37 @@ static NEOERR *scoped_var_lookup_or_create_obj (CSPARSE *parse, char *name,
         }
         else
         {
-          *ret_hdf = hdf_get_obj(map->h, rest+1);
+          *ret_hdf = path_lookup_obj(map->h, rest+1, path, 1);
           return STATUS_OK;
         }
       }
     }
   }
-  /* Look in local HDF */
-  *ret_hdf = hdf_get_obj (parse->hdf, name);
-  /* If not in local HDF, and we are not creating/setting a node,
-     check global HDF */
-  if (*ret_hdf == NULL && !create && parse->global_hdf != NULL)
-  {
-    *ret_hdf = hdf_get_obj (parse->global_hdf, name);
-  }
-  if (*ret_hdf == NULL && create)
+  if (create)
   {
-    return nerr_pass(hdf_get_node(parse->hdf, name, ret_hdf));
+    /* Look in local HDF */
+    *ret_hdf = path_lookup_obj (parse->hdf, name, path, 0);
+    if (*ret_hdf == NULL)
+      return nerr_pass(hdf_get_node(parse->hdf, name, ret_hdf));
+    return STATUS_OK;
   }
-  else
+  /* Look in local HDF, and if not there, check global HDF */
+  *ret_hdf = cached_lookup_obj (parse, name, path, 0);
+  if (*ret_hdf == NULL && parse->global_hdf != NULL)
   {
-    return STATUS_OK;
+    *ret_hdf = cached_lookup_obj (parse, name, path, 1);
   }
+  return STATUS_OK;
 }
 
-static HDF *var_lookup_obj (CSPARSE *parse, char *name)
+static HDF *var_lookup_obj (CSPARSE *parse, CSARG *arg)
 {
   HDF *ret_hdf;
         /* NOTE: We ignore the return value as it can only be STATUS_OK. That
            is what we always return from scoped_var_lookup_or_create_obj when
            create == FALSE */
-  scoped_var_lookup_or_create_obj (parse, name, FALSE, parse->locals, &ret_hdf);
+  scoped_var_lookup_or_create_obj (parse, arg->s, arg, FALSE, parse->locals,
+                                   &ret_hdf);
   return ret_hdf;
 }
 
@@ -984,7 +1333,8 @@ static NEOERR *var_set_value (CSPARSE *parse, char *name,
        a local or global HDF variable), or the local variable references
        an HDF variable. Either way, we lookup or create an HDF node to
        set the value of. */
-    err = scoped_var_lookup_or_create_obj(parse, name, TRUE, map, &set_hdf);
+    err = scoped_var_lookup_or_create_obj(parse, name, NULL, TRUE, map,
+                                          &set_hdf);
     if (err != STATUS_OK)
     {
       return nerr_pass(err);
@@ -1094,15 +1444,17 @@ int get_escape_status(CSPARSE *parse, HDF_ATTR* h)
 }
 
 /* Returns the current escaping status in escape_status */
-static char *var_lookup (CSPARSE *parse, char *name, int *escape_status)
+static char *var_lookup (CSPARSE *parse, CSARG *arg, int *escape_status)
 {
   CS_LOCAL_MAP *map;
+  char *name = arg->s;
+  HDF_PATH *path = arg->path;
   char *c;
   char* retval;
   HDF *obj;
 
   *escape_status = CS_ES_UNTRUSTED;
-  map = lookup_map (parse, name, &c);
+  map = arg_lookup_map (parse, arg, &c);
   if (map)
   {
     if (map->type == CS_TYPE_VAR)
@@ -1116,8 +1468,8 @@ static char *var_lookup (CSPARSE *parse, char *name, int *escape_status)
         /* NOTE: We ignore the return value as it can only be STATUS_OK. That
            is what we always return from scoped_var_lookup_or_create_obj when
            create == FALSE */
-        scoped_var_lookup_or_create_obj (parse, map->s, FALSE, map->next_scope,
-                                         &(map->h));
+        scoped_var_lookup_or_create_obj (parse, map->s, NULL, FALSE,
+                                         map->next_scope, &(map->h));
       }
       if (c == NULL)
       {
@@ -1128,7 +1480,7 @@ static char *var_lookup (CSPARSE *parse, char *name, int *escape_status)
       else
       {
         HDF_ATTR *h;
-        obj = hdf_get_obj(map->h, c+1);
+        obj = path_lookup_obj(map->h, c+1, path, 1);
         if (!obj)
           return NULL;
         h = hdf_obj_attr(obj);
@@ -1149,18 +1501,16 @@ static char *var_lookup (CSPARSE *parse, char *name, int *escape_status)
     }
     else if (map->type == CS_TYPE_NUM)
     {
-      char buf[40];
       *escape_status = CS_ES_TRUSTED;
       if (map->s) return map->s;
-      snprintf (buf, sizeof(buf), "%ld", map->n);
-      map->s = strdup(buf);
-      map->map_alloc = 1;
+      snprintf (map->numbuf, sizeof(map->numbuf), "%ld", map->n);
+      map->s = map->numbuf;
       return map->s;
     }
   }
   /* smarti:  Added support for global hdf under local hdf */
   /* return hdf_get_value (parse->hdf, name, NULL); */
-  obj = hdf_get_obj(parse->hdf, name);
+  obj = cached_lookup_obj(parse, name, path, 0);
   if (obj)
   {
     HDF_ATTR *h;
@@ -1177,16 +1527,16 @@ static char *var_lookup (CSPARSE *parse, char *name, int *escape_status)
      for now, treat all values there as untrusted */
   if (retval == NULL && parse->global_hdf != NULL)
   {
-    retval = hdf_get_value (parse->global_hdf, name, NULL);
+    retval = hdf_obj_value (cached_lookup_obj (parse, name, path, 1));
   }
   return retval;
 }
 
-long int var_int_lookup (CSPARSE *parse, char *name)
+static long int var_int_lookup_arg (CSPARSE *parse, CSARG *arg)
 {
   char *vs;
   int ignore;
-  vs = var_lookup (parse, name, &ignore);
+  vs = var_lookup (parse, arg, &ignore);
 
   if (vs == NULL)
     return 0;
@@ -1194,6 +1544,15 @@ long int var_int_lookup (CSPARSE *parse, char *name)
     return atoi(vs);
 }
 
+long int var_int_lookup (CSPARSE *parse, char *name)
+{
+  CSARG arg;
+
+  memset(&arg, 0, sizeof(arg));
+  arg.s = name;
+  return var_int_lookup_arg (parse, &arg);
+}
+
 typedef struct _token
 {
   CSTOKEN_TYPE type;
@@ -1743,6 +2102,36 @@ static NEOERR *parse_expr2 (CSPARSE *parse, CSTOKEN *tokens, int ntokens, int lv
       token_list(tokens, ntokens, tmp2, sizeof(tmp2)));
 }
 
+/* Split the names of all the variables in an expression once, here, instead
+ * of every time the expression is evaluated.  A variable on the right hand
+ * side of a dot is only ever appended as a string, so it is skipped. */
+static NEOERR *compile_arg_paths (CSARG *arg)
+{
+  NEOERR *err;
+
+  while (arg != NULL)
+  {
+    if ((arg->op_type & CS_TYPES_VAR) && arg->s != NULL && arg->path == NULL)
+    {
+      err = hdf_path_compile (arg->s, &(arg->path));
+      if (err) return nerr_pass(err);
+    }
+    if (arg->expr1)
+    {
+      err = compile_arg_paths (arg->expr1);
+      if (err) return nerr_pass(err);
+    }
+    if (arg->expr2 && !(arg->op_type == CS_OP_DOT &&
+                        (arg->expr2->op_type & CS_TYPES_VAR)))
+    {
+      err = compile_arg_paths (arg->expr2);
+      if (err) return nerr_pass(err);
+    }
+    arg = arg->next;
+  }
+  return STATUS_OK;
+}
+
 static NEOERR *parse_expr (CSPARSE *parse, char *arg, int lvalue, CSARG *expr)
 {
   NEOERR *err;
@@ -1761,6 +2150,8 @@ static NEOERR *parse_expr (CSPARSE *parse, char *arg, int lvalue, CSARG *expr)
 
   err = parse_expr2 (parse, tokens, ntokens, lvalue, expr);
   if (err) return nerr_pass(err);
+  err = compile_arg_paths (expr);
+  if (err) return nerr_pass(err);
   return STATUS_OK;
 }
 
@@ -1784,16 +2175,47 @@ static NEOERR* lookup_node_filename(CSPARSE *parse, CSTREE *node, char **pfname)
   return STATUS_OK;
 }
 
-static NEOERR *output_variable(CSPARSE *parse, CSTREE *node,
-                               char *var_name, char *var)
+/* Rendering appends to parse->output (see cs_render_string).  When
+ * rendering for a CSOUTFUNC, cs_render gives it a buffer of its own, and
+ * what builds up there is handed on once parse->output_chunk bytes are
+ * pending (CS_OUTPUT_CHUNK unless the caller used cs_render_chunked) and
+ * at the end, instead of a call for every literal and variable. */
+#define CS_OUTPUT_CHUNK 8192
+
+static NEOERR *output_flush (CSPARSE *parse)
+{
+  STRING *out = parse->output;
+  NEOERR *err;
+
+  if (parse->output_cb == NULL || out->len == 0 ||
+      out->len < parse->output_chunk)
+    return STATUS_OK;
+  err = parse->output_cb (parse->output_ctx, out->buf);
+  out->len = 0;
+  out->buf[0] = '\0';
+  return nerr_pass(err);
+}
+
+static NEOERR *output_text (CSPARSE *parse, const char *s, int len)
 {
   NEOERR *err;
-  err = parse->output_cb (parse->output_ctx, var);
 
+  err = string_appendn (parse->output, s, len);
   if (err != STATUS_OK) return nerr_pass(err);
+  return nerr_pass(output_flush (parse));
+}
+
+/* Finish off a variable which has just been appended to the output at
+ * start: the auto escape parser may need to see it */
+static NEOERR *output_variable_end (CSPARSE *parse, CSTREE *node,
+                                    char *var_name, int start)
+{
+  NEOERR *err;
+  STRING *out = parse->output;
 
   if (parse->auto_ctx.global_enabled == 1) {
-    err = neos_auto_parse_var (parse->auto_ctx.parser_ctx, var, strlen(var));
+    err = neos_auto_parse_var (parse->auto_ctx.parser_ctx, out->buf + start,
+                               out->len - start);
     if (err != STATUS_OK)
     {
       char *prefix = NULL;
@@ -1811,7 +2233,18 @@ static NEOERR *output_variable(CSPARSE *parse, CSTREE *node,
 
   }
 
-  return nerr_pass(err);
+  return nerr_pass(output_flush (parse));
+}
+
+static NEOERR *output_variable(CSPARSE *parse, CSTREE *node,
+                               char *var_name, char *var)
+{
+  NEOERR *err;
+  int start = parse->output->len;
+
+  err = string_append (parse->output, var);
+  if (err != STATUS_OK) return nerr_pass(err);
+  return nerr_pass(output_variable_end (parse, node, var_name, start));
 }
 
 static NEOERR *escape_and_output_variable(CSPARSE *parse, CSTREE *node,
@@ -1822,10 +2255,11 @@ static NEOERR *escape_and_output_variable(CSPARSE *parse, CSTREE *node,
 
   if (value && parse->escaping.current == NEOS_ESCAPE_UNDEF)
   {
-    /* no explicit escape */
-    char *escaped = NULL;
+    /* no explicit escape, escape it straight onto the output */
+    STRING *out = parse->output;
+    int start = out->len;
     NEOS_ESCAPE context;
-    int do_free = 0;
+    int changed = 0;
 
     /* Use default escape if escape is UNDEF */
     if (node->escape == NEOS_ESCAPE_UNDEF)
@@ -1846,26 +2280,23 @@ static NEOERR *escape_and_output_variable(CSPARSE *parse, CSTREE *node,
     if ((escape_status != CS_ES_TRUSTED) && (context == NEOS_ESCAPE_UNDEF)
         && (node->do_autoescape == 1))
     {
-      err = neos_auto_escape(parse->auto_ctx.parser_ctx,
-                             value, &escaped, &do_free);
-      if (do_free && parse->auto_ctx.log_changes)
+      err = neos_auto_escape_append(parse->auto_ctx.parser_ctx,
+                                    value, out, &changed);
+      if (err == STATUS_OK && changed && parse->auto_ctx.log_changes)
       {
         char *fname = NULL;
         err = lookup_node_filename(parse, node, &fname);
 
-        if (err != STATUS_OK)
+        if (err == STATUS_OK)
         {
-          free(escaped);
-          return nerr_pass(err);
-        }
-
-        ne_warn("[%s]: Auto-escape changed variable [%s] from [%s] to [%s]\n",
-                (fname ? fname : "string"), name, value, escaped);
+          ne_warn("[%s]: Auto-escape changed variable [%s] from [%s] to [%s]\n",
+                  (fname ? fname : "string"), name, value, out->buf + start);
 
-        if (escape_status == CS_ES_MIXED)
-        {
-          ne_warn("[%s]: %s has a mix of trusted and untrusted content\n",
-                  (fname ? fname : "string"), name);
+          if (escape_status == CS_ES_MIXED)
+          {
+            ne_warn("[%s]: %s has a mix of trusted and untrusted content\n",
+                    (fname ? fname : "string"), name);
+          }
         }
       }
     }
@@ -1875,22 +2306,17 @@ static NEOERR *escape_and_output_variable(CSPARSE *parse, CSTREE *node,
       {
         context = NEOS_ESCAPE_NONE;
       }
-      err = neos_var_escape(context, value, &escaped);
-      do_free = 1;
+      err = neos_var_escape_append(context, value, out);
     }
 
     if (err != STATUS_OK) {
-      if (do_free) free(escaped);
-      return nerr_pass(err);
-    }
-
-    if (escaped)
-    {
-      err = output_variable (parse, node, name, escaped);
-      if (do_free) free(escaped);
+      /* Drop whatever part of it made it */
+      out->len = start;
+      out->buf[start] = '\0';
       return nerr_pass(err);
     }
 
+    return nerr_pass(output_variable_end (parse, node, name, start));
   }
   else if (value)
   { /* already explicitly escaped */
@@ -1902,70 +2328,514 @@ static NEOERR *escape_and_output_variable(CSPARSE *parse, CSTREE *node,
   return STATUS_OK;
 }
 
-static NEOERR *literal_parse (CSPARSE *parse, int cmd, char *arg)
+/* **** Auto escape literal transitions **************************** */
+
+/* Parsing literals is the only thing rendering does to the auto escape
+ * parser which depends on nothing but the template, so it can be done
+ * ahead of time.  At parse time, auto_trace_tree follows the template from
+ * the start of a render with a copy of the parser for each state it could
+ * be in (as far as it can tell, and up to AUTO_TRACE_MAX of them), and
+ * saves the state each literal leaves each of those in.  When rendering, if
+ * the parser is known to be in one of the saved entry states of a literal
+ * (see neos_auto_state), it can skip to the saved exit state.  Anything
+ * else leaves the state unknown, and literals are parsed as usual. */
+#define AUTO_TRACE_MAX 4
+#define AUTO_TRANS_MAX 8
+/* Copying a saved parser costs about as much as parsing this much, so the
+ * exit states of shorter literals are only used as a known state */
+#define AUTO_KEEP_MIN 64
+
+struct _auto_trans
 {
-  NEOERR *err;
-  CSTREE *node;
+  NEOS_AUTO_STATE *entry;  /* owned by another literal, or the reset state */
+  NEOS_AUTO_STATE *exit;
+  struct _auto_trans *next;
+};
 
-  /* ne_warn ("literal: %s", arg); */
-  err = alloc_node (&node, parse);
-  if (err) return nerr_pass(err);
-  node->cmd = cmd;
-  node->arg1.op_type = CS_TYPE_STRING;
-  node->arg1.s = arg;
-  node->do_autoescape = parse->auto_ctx.global_enabled;
-  *(parse->next) = node;
-  parse->next = &(node->next);
-  parse->current = node;
+struct _auto_trace
+{
+  int num;
+  NEOS_AUTO_CTX *ctx[AUTO_TRACE_MAX];
+  CSTREE *last;  /* the last top level node traced */
+};
+
+static void dealloc_auto_trans (CS_AUTO_TRANS **trans)
+{
+  CS_AUTO_TRANS *next;
+
+  while (*trans != NULL)
+  {
+    next = (*trans)->next;
+    neos_auto_state_destroy(&((*trans)->exit));
+    free(*trans);
+    *trans = next;
+  }
+}
+
+static void auto_trace_clear (CS_AUTO_TRACE *trace)
+{
+  int x;
 
+  for (x = 0; x < trace->num; x++)
+    neos_auto_destroy(&(trace->ctx[x]));
+  trace->num = 0;
+}
+
+static NEOERR *auto_trace_copy (CS_AUTO_TRACE *dest, CS_AUTO_TRACE *src)
+{
+  NEOERR *err;
+  int x;
+
+  dest->num = 0;
+  for (x = 0; x < src->num; x++)
+  {
+    err = neos_auto_copy(&(dest->ctx[x]), src->ctx[x]);
+    if (err)
+    {
+      auto_trace_clear(dest);
+      return nerr_pass(err);
+    }
+    dest->num++;
+  }
   return STATUS_OK;
 }
 
-static NEOERR *literal_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
+/* Move the parsers in src into trace, dropping ones in a state trace
+ * already has, or that don't fit */
+static void auto_trace_merge (CS_AUTO_TRACE *trace, CS_AUTO_TRACE *src)
 {
-  NEOERR *err = STATUS_OK;
+  int x, y;
 
-  if (node->arg1.s != NULL)
+  for (x = 0; x < src->num; x++)
   {
-    if (node->do_autoescape == 1) {
-      err = neos_auto_parse(parse->auto_ctx.parser_ctx,
-			    node->arg1.s, strlen(node->arg1.s));
+    for (y = 0; y < trace->num; y++)
+    {
+      if (neos_auto_state(trace->ctx[y]) == neos_auto_state(src->ctx[x]))
+        break;
+    }
+    if (y == trace->num && trace->num < AUTO_TRACE_MAX)
+    {
+      trace->ctx[trace->num++] = src->ctx[x];
+      src->ctx[x] = NULL;
+    }
+    else
+    {
+      neos_auto_destroy(&(src->ctx[x]));
+    }
+  }
+  src->num = 0;
+}
 
-      if (err != STATUS_OK)
+/* Parse the literal from each state in trace, saving the states it leads
+ * to.  A state we can't follow (because the literal is a parse error from
+ * there, or already has too many entry states) is dropped. */
+static NEOERR *auto_trace_literal (CSTREE *node, CS_AUTO_TRACE *trace)
+{
+  NEOERR *err;
+  NEOS_AUTO_CTX *ctx;
+  NEOS_AUTO_STATE *entry;
+  CS_AUTO_TRANS *trans;
+  int x, num = 0;
+  int count;
+  int len = strlen(node->arg1.s);
+
+  for (x = 0; x < trace->num; x++)
+  {
+    ctx = trace->ctx[x];
+    trace->ctx[x] = NULL;
+    entry = neos_auto_state(ctx);
+    count = 0;
+    for (trans = node->auto_trans; trans != NULL; trans = trans->next)
+    {
+      if (trans->entry == entry) break;
+      count++;
+    }
+    /* Parsing can fail, but that will be reported by the render */
+    err = STATUS_OK;
+    if (trans != NULL && neos_auto_state_kept(trans->exit))
+    {
+      err = neos_auto_restore(ctx, trans->exit);
+    }
+    else if (trans != NULL)
+    {
+      err = neos_auto_parse(ctx, node->arg1.s, len);
+      if (err == STATUS_OK) neos_auto_set_state(ctx, trans->exit);
+    }
+    else if (count < AUTO_TRANS_MAX)
+    {
+      err = neos_auto_parse(ctx, node->arg1.s, len);
+      if (err == STATUS_OK)
       {
-        char *prefix = NULL;
-        if (parse->auto_ctx.log_changes)
+        trans = (CS_AUTO_TRANS *) calloc (1, sizeof (CS_AUTO_TRANS));
+        if (trans == NULL)
         {
-          NEOERR *err2 = lookup_node_filename(parse, node, &prefix);
-          if (err2 != STATUS_OK)  return nerr_pass(err2);
+          neos_auto_destroy(&ctx);
+          continue;
         }
-        return nerr_pass_ctx(err,
-                             "[%s] Auto Escaping encountered the following"\
-                             " error while parsing a literal",
-                             (prefix ? prefix : "error"));
+        err = neos_auto_save(ctx, len >= AUTO_KEEP_MIN, &(trans->exit));
+        if (err)
+        {
+          free(trans);
+          neos_auto_destroy(&ctx);
+          return nerr_pass(err);
+        }
+        trans->entry = entry;
+        trans->next = node->auto_trans;
+        node->auto_trans = trans;
       }
     }
-    err = parse->output_cb (parse->output_ctx, node->arg1.s);
+    else
+    {
+      neos_auto_destroy(&ctx);
+      continue;
+    }
+    if (err)
+    {
+      nerr_ignore(&err);
+      neos_auto_destroy(&ctx);
+      continue;
+    }
+    trace->ctx[num++] = ctx;
   }
-  *next = node->next;
-  return nerr_pass(err);
+  trace->num = num;
+  return STATUS_OK;
 }
 
-static NEOERR *name_parse (CSPARSE *parse, int cmd, char *arg)
+/* Outputting a variable inside a tag parses it */
+static void auto_trace_var (CS_AUTO_TRACE *trace)
 {
-  NEOERR *err;
-  CSTREE *node;
-  char *a, *s;
-  char tmp[256];
-  STACK_ENTRY *entry;
+  int x, num = 0;
 
-  err = uListGet (parse->stack, -1, (void *)&entry);
-  if (err != STATUS_OK) return nerr_pass(err);
+  for (x = 0; x < trace->num; x++)
+  {
+    if (neos_auto_in_tag(trace->ctx[x]))
+      neos_auto_destroy(&(trace->ctx[x]));
+    else
+      trace->ctx[num++] = trace->ctx[x];
+  }
+  trace->num = num;
+}
 
-  /* ne_warn ("name: %s", arg); */
-  err = alloc_node (&node, parse);
-  if (err) return nerr_pass(err);
-  node->cmd = cmd;
+static NEOERR *auto_trace_nodes (CSTREE *node, CS_AUTO_TRACE *trace);
+
+/* Follow nodes which may or may not be rendered (maybe after outputting a
+ * variable): the states before and after are both possible */
+static NEOERR *auto_trace_maybe (CSTREE *node, int var, CS_AUTO_TRACE *trace)
+{
+  NEOERR *err;
+  CS_AUTO_TRACE taken;
+
+  err = auto_trace_copy(&taken, trace);
+  if (err) return nerr_pass(err);
+  if (var) auto_trace_var(&taken);
+  err = auto_trace_nodes(node, &taken);
+  if (err == STATUS_OK) auto_trace_merge(trace, &taken);
+  auto_trace_clear(&taken);
+  return nerr_pass(err);
+}
+
+static NEOERR *auto_trace_nodes (CSTREE *node, CS_AUTO_TRACE *trace)
+{
+  NEOERR *err = STATUS_OK;
+  NEOERR* (*eval)(CSPARSE *parse, CSTREE *node, CSTREE **next);
+  CS_AUTO_TRACE taken;
+  int pass;
+
+  for (; node != NULL && trace->num && err == STATUS_OK; node = node->next)
+  {
+    eval = Commands[node->cmd].eval_handler;
+    if (eval == literal_eval)
+    {
+      if (node->arg1.s != NULL && node->do_autoescape == 1)
+        err = auto_trace_literal(node, trace);
+    }
+    else if (eval == var_eval || eval == name_eval)
+    {
+      auto_trace_var(trace);
+    }
+    else if (eval == skip_eval || eval == set_eval)
+    {
+      /* Nothing is output */
+    }
+    else if (eval == escape_eval)
+    {
+      err = auto_trace_nodes(node->case_0, trace);
+    }
+    else if (eval == with_eval)
+    {
+      err = auto_trace_maybe(node->case_0, 0, trace);
+    }
+    else if (eval == alt_eval)
+    {
+      /* Either the variable, or the body */
+      err = auto_trace_copy(&taken, trace);
+      if (err) break;
+      auto_trace_var(&taken);
+      err = auto_trace_nodes(node->case_0, trace);
+      if (err == STATUS_OK) auto_trace_merge(trace, &taken);
+      auto_trace_clear(&taken);
+    }
+    else if (eval == if_eval)
+    {
+      err = auto_trace_copy(&taken, trace);
+      if (err) break;
+      err = auto_trace_nodes(node->case_0, &taken);
+      if (err == STATUS_OK) err = auto_trace_nodes(node->case_1, trace);
+      if (err == STATUS_OK) auto_trace_merge(trace, &taken);
+      auto_trace_clear(&taken);
+    }
+    else if (eval == each_eval || eval == loop_eval)
+    {
+      /* Follow the first two times through.  After that, states are only
+       * known if they happen to be ones we've already seen. */
+      for (pass = 0; pass < 2 && err == STATUS_OK && trace->num; pass++)
+        err = auto_trace_maybe(node->case_0, 0, trace);
+    }
+    else
+    {
+      /* Macro calls, lvar, linclude and content-type: the state is
+       * unknown */
+      auto_trace_clear(trace);
+    }
+  }
+  return nerr_pass(err);
+}
+
+/* Work out the literal transitions for anything added to the top level
+ * of parse since we were last called */
+static NEOERR *auto_trace_tree (CSPARSE *parse)
+{
+  NEOERR *err;
+  CS_AUTO_TRACE *trace = parse->auto_trace;
+  CSTREE *node;
+
+  /* Sub-parses (lvar and linclude) start wherever their parent is */
+  if (parse->auto_ctx.global_enabled != 1 || parse->parent != NULL)
+    return STATUS_OK;
+
+  if (trace == NULL)
+  {
+    trace = (CS_AUTO_TRACE *) calloc (1, sizeof (CS_AUTO_TRACE));
+    if (trace == NULL)
+      return nerr_raise (NERR_NOMEM,
+          "Unable to allocate memory for auto escape trace");
+    parse->auto_trace = trace;
+    /* The state of the parser at the start of cs_render */
+    trace->num = 1;
+    err = neos_auto_init(&(trace->ctx[0]));
+    if (err) return nerr_pass(err);
+    node = parse->tree;
+  }
+  else
+  {
+    node = trace->last ? trace->last->next : parse->tree;
+  }
+  if (node == NULL)
+    return STATUS_OK;
+
+  err = auto_trace_nodes(node, trace);
+  if (err) return nerr_pass(err);
+  while (node->next != NULL) node = node->next;
+  trace->last = node;
+  return STATUS_OK;
+}
+
+/* The local variables in scope at a point in the parse tree, innermost
+ * first, in the same order they'll be in parse->locals when it's
+ * rendered */
+typedef struct _local_scope
+{
+  char *name;
+  struct _local_scope *next;
+} CS_LOCAL_SCOPE;
+
+static void local_slot_args (CSARG *arg, CS_LOCAL_SCOPE *scope)
+{
+  CS_LOCAL_SCOPE *binder;
+  int slot;
+
+  for (; arg != NULL; arg = arg->next)
+  {
+    arg->local_slot = 0;
+    arg->local_name = NULL;
+    if ((arg->op_type & CS_TYPES_VAR) && arg->s != NULL)
+    {
+      for (binder = scope, slot = 1; binder != NULL;
+           binder = binder->next, slot++)
+      {
+        if (name_match (binder->name, arg->s))
+        {
+          arg->local_slot = slot;
+          arg->local_name = binder->name;
+          break;
+        }
+      }
+    }
+    if (arg->expr1) local_slot_args (arg->expr1, scope);
+    if (arg->expr2) local_slot_args (arg->expr2, scope);
+  }
+}
+
+static void local_slot_nodes (CSPARSE *parse, CSTREE *node,
+                              CS_LOCAL_SCOPE *scope);
+
+/* A macro body starts with nothing in scope but its arguments, the first
+ * one innermost (see call_eval).  The scope is built up one argument per
+ * call, so it lives on the stack. */
+static void local_slot_def (CSPARSE *parse, CSTREE *body, CSARG *darg,
+                            CS_LOCAL_SCOPE *first, CS_LOCAL_SCOPE *last)
+{
+  CS_LOCAL_SCOPE scope;
+
+  if (darg == NULL)
+  {
+    local_slot_nodes (parse, body, first);
+    return;
+  }
+  scope.name = darg->s;
+  scope.next = NULL;
+  if (last != NULL) last->next = &scope;
+  local_slot_def (parse, body, darg->next, first ? first : &scope, &scope);
+}
+
+static void local_slot_nodes (CSPARSE *parse, CSTREE *node,
+                              CS_LOCAL_SCOPE *scope)
+{
+  NEOERR* (*eval)(CSPARSE *parse, CSTREE *node, CSTREE **next);
+  CS_LOCAL_SCOPE inner;
+  CS_MACRO *macro;
+
+  for (; node != NULL; node = node->next)
+  {
+    eval = Commands[node->cmd].eval_handler;
+    local_slot_args (&(node->arg1), scope);
+    local_slot_args (&(node->arg2), scope);
+    local_slot_args (node->vargs, scope);
+    if (eval == each_eval || eval == loop_eval || eval == with_eval)
+    {
+      inner.name = node->arg1.s;
+      inner.next = scope;
+      local_slot_nodes (parse, node->case_0, &inner);
+    }
+    else if (Commands[node->cmd].parse_handler == def_parse)
+    {
+      /* Macros run in whatever scope they're called from */
+      for (macro = parse->macros; macro != NULL; macro = macro->next)
+      {
+        if (macro->tree == node)
+        {
+          local_slot_def (parse, node->case_0, macro->args, NULL, NULL);
+          break;
+        }
+      }
+    }
+    else
+    {
+      local_slot_nodes (parse, node->case_0, scope);
+      local_slot_nodes (parse, node->case_1, scope);
+    }
+  }
+}
+
+/* Work out which local variable each variable in the parse tree refers
+ * to, where an enclosing each, loop, with or def argument says so, see
+ * arg_lookup_map.  Names nothing encloses may still be locals, of a
+ * macro's caller or of the template an lvar or linclude is rendered from,
+ * so those are still looked up by name. */
+static void local_slot_tree (CSPARSE *parse)
+{
+  local_slot_nodes (parse, parse->tree, NULL);
+}
+
+/* Parse a literal with the auto escape parser, or skip to the result if
+ * auto_trace_tree already worked it out from the parser's current state */
+static NEOERR *auto_parse_literal (CSPARSE *parse, CSTREE *node)
+{
+  NEOERR *err;
+  NEOS_AUTO_CTX *ctx = parse->auto_ctx.parser_ctx;
+  NEOS_AUTO_STATE *state;
+  CS_AUTO_TRANS *trans = NULL;
+
+  state = neos_auto_state(ctx);
+  if (state != NULL)
+  {
+    for (trans = node->auto_trans; trans != NULL; trans = trans->next)
+    {
+      if (trans->entry == state) break;
+    }
+  }
+  if (trans != NULL && neos_auto_state_kept(trans->exit))
+    return nerr_pass(neos_auto_restore(ctx, trans->exit));
+
+  err = neos_auto_parse(ctx, node->arg1.s, strlen(node->arg1.s));
+  if (err == STATUS_OK && trans != NULL)
+    neos_auto_set_state(ctx, trans->exit);
+  return nerr_pass(err);
+}
+
+static NEOERR *literal_parse (CSPARSE *parse, int cmd, char *arg)
+{
+  NEOERR *err;
+  CSTREE *node;
+
+  /* ne_warn ("literal: %s", arg); */
+  err = alloc_node (&node, parse);
+  if (err) return nerr_pass(err);
+  node->cmd = cmd;
+  node->arg1.op_type = CS_TYPE_STRING;
+  node->arg1.s = arg;
+  node->do_autoescape = parse->auto_ctx.global_enabled;
+  *(parse->next) = node;
+  parse->next = &(node->next);
+  parse->current = node;
+
+  return STATUS_OK;
+}
+
+static NEOERR *literal_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
+{
+  NEOERR *err = STATUS_OK;
+
+  if (node->arg1.s != NULL)
+  {
+    if (node->do_autoescape == 1) {
+      err = auto_parse_literal(parse, node);
+
+      if (err != STATUS_OK)
+      {
+        char *prefix = NULL;
+        if (parse->auto_ctx.log_changes)
+        {
+          NEOERR *err2 = lookup_node_filename(parse, node, &prefix);
+          if (err2 != STATUS_OK)  return nerr_pass(err2);
+        }
+        return nerr_pass_ctx(err,
+                             "[%s] Auto Escaping encountered the following"\
+                             " error while parsing a literal",
+                             (prefix ? prefix : "error"));
+      }
+    }
+    err = output_text (parse, node->arg1.s, strlen(node->arg1.s));
+  }
+  *next = node->next;
+  return nerr_pass(err);
+}
+
+static NEOERR *name_parse (CSPARSE *parse, int cmd, char *arg)
+{
+  NEOERR *err;
+  CSTREE *node;
+  char *a, *s;
+  char tmp[256];
+  STACK_ENTRY *entry;
+
+  err = uListGet (parse->stack, -1, (void *)&entry);
+  if (err != STATUS_OK) return nerr_pass(err);
+
+  /* ne_warn ("name: %s", arg); */
+  err = alloc_node (&node, parse);
+  if (err) return nerr_pass(err);
+  node->cmd = cmd;
   if (arg[0] == '!')
     node->flags |= CSF_REQUIRED;
   arg++;
@@ -1982,6 +2852,12 @@ static NEOERR *name_parse (CSPARSE *parse, int cmd, char *arg)
 
   node->arg1.op_type = CS_TYPE_VAR;
   node->arg1.s = a;
+  err = hdf_path_compile (a, &(node->arg1.path));
+  if (err)
+  {
+    dealloc_node(&node);
+    return nerr_pass(err);
+  }
   node->escape = entry->escape;
   node->do_autoescape = parse->auto_ctx.enabled;
 
@@ -2099,7 +2975,7 @@ static NEOERR *name_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
 
   if (node->arg1.op_type == CS_TYPE_VAR && node->arg1.s != NULL)
   {
-    obj = var_lookup_obj (parse, node->arg1.s);
+    obj = var_lookup_obj (parse, &(node->arg1));
     if (obj != NULL)
     {
       v = hdf_obj_name(obj);
@@ -2281,6 +3157,8 @@ static NEOERR *evar_parse (CSPARSE *parse, int cmd, char *arg)
 	a, s[0]);
   }
 
+  /* The parse tree now depends on the HDF data */
+  if (parse->cache_entry) parse->cache_entry->uncacheable = 1;
   err = hdf_get_copy (parse->hdf, a, &s, NULL);
   if (err)
   {
@@ -2355,7 +3233,7 @@ static char *arg_eval_with_escape_status (CSPARSE *parse, CSARG *arg,
       *escape_status = arg->escape_status;
       return arg->s;
     case CS_TYPE_VAR:
-      return var_lookup (parse, arg->s, escape_status);
+      return var_lookup (parse, arg, escape_status);
     case CS_TYPE_NUM:
     case CS_TYPE_VAR_NUM:
     default:
@@ -2388,7 +3266,7 @@ long int arg_eval_num (CSPARSE *parse, CSARG *arg)
 
     case CS_TYPE_VAR:
     case CS_TYPE_VAR_NUM:
-      v = var_int_lookup (parse, arg->s);
+      v = var_int_lookup_arg (parse, arg);
       break;
     default:
       ne_warn ("Unsupported type %s in arg_eval_num", expand_token_type(arg->op_type, 1));
@@ -2413,7 +3291,7 @@ long int arg_eval_bool (CSPARSE *parse, CSARG *arg)
     case CS_TYPE_STRING:
     case CS_TYPE_VAR:
       if (arg->op_type == CS_TYPE_VAR)
-        s = var_lookup(parse, arg->s, &ignore);
+        s = var_lookup (parse, arg, &ignore);
       else
 	s = arg->s;
       if (!s || *s == '\0') return 0; /* non existance or empty is false(0) */
@@ -2426,7 +3304,7 @@ long int arg_eval_bool (CSPARSE *parse, CSARG *arg)
     case CS_TYPE_NUM:
       return arg->n;
     case CS_TYPE_VAR_NUM: /* this implies forced numeric evaluation */
-      return var_int_lookup (parse, arg->s);
+      return var_int_lookup_arg (parse, arg);
       break;
     default:
       ne_warn ("Unsupported type %s in arg_eval_bool", expand_token_type(arg->op_type, 1));
@@ -2449,7 +3327,7 @@ char *arg_eval_str_alloc (CSPARSE *parse, CSARG *arg)
       s = arg->s;
       break;
     case CS_TYPE_VAR:
-      s = var_lookup (parse, arg->s, &ignore);
+      s = var_lookup (parse, arg, &ignore);
       break;
     case CS_TYPE_NUM:
     case CS_TYPE_VAR_NUM:
@@ -2489,7 +3367,7 @@ static void expand_arg (CSPARSE *parse, int depth, char *where, CSARG *arg)
   else if (arg->op_type & CS_TYPE_STRING)
     fprintf(stderr, "'%s'\n", arg->s);
   else if (arg->op_type & CS_TYPE_VAR)
-    fprintf(stderr, "%s = %s\n", arg->s, var_lookup(parse, arg->s, &ignore));
+    fprintf(stderr, "%s = %s\n", arg->s, var_lookup (parse, arg, &ignore));
   else if (arg->op_type & CS_TYPE_VAR_NUM)
     fprintf(stderr, "%s = %ld\n", arg->s, var_int_lookup(parse, arg->s));
   else
@@ -2587,7 +3465,6 @@ static NEOERR *eval_expr_string(CSPARSE *parse, CSARG *arg1, CSARG *arg2, CSTOKE
 	break;
       case CS_OP_ADD:
 	result->op_type = CS_TYPE_STRING;
-	result->alloc = 1;
         if (escape_status1 == CS_ES_TRUSTED && escape_status2 == CS_ES_TRUSTED)
         {
           result->escape_status = CS_ES_TRUSTED;
@@ -2605,11 +3482,9 @@ static NEOERR *eval_expr_string(CSPARSE *parse, CSARG *arg1, CSARG *arg2, CSTOKE
         {
           result->escape_status = CS_ES_UNTRUSTED;
         }
-	result->s = (char *) calloc ((strlen(s1) + strlen(s2) + 1), sizeof(char));
+	result->s = scratch_concat (parse, s1, "", s2);
 	if (result->s == NULL)
 	  return nerr_raise (NERR_NOMEM, "Unable to allocate memory to concatenate strings in expression: %s + %s", s1, s2);
-	strcpy(result->s, s1);
-	strcat(result->s, s2);
 	break;
       default:
 	ne_warn ("Unsupported op %s in eval_expr_string", expand_token_type(op, 1));
@@ -2853,11 +3728,12 @@ static NEOERR *eval_expr (CSPARSE *parse, CSARG *expr, CSARG *result)
         /* This is an HDF lookup, so we will know the escaping status when
            the caller does the actual lookup and fetches the HDF object. */
         result->op_type = CS_TYPE_VAR;
-        result->alloc = 1;
         if (arg2.op_type & (CS_TYPE_VAR_NUM | CS_TYPE_NUM))
         {
+          char buf[40];
           long int n2 = arg_eval_num (parse, &arg2);
-          result->s = sprintf_alloc("%s.%ld", arg1.s, n2);
+          snprintf (buf, sizeof(buf), "%ld", n2);
+          result->s = scratch_concat (parse, arg1.s, ".", buf);
           if (result->s == NULL)
             return nerr_raise (NERR_NOMEM, "Unable to allocate memory to concatenate varnames in expression: %s + %ld", arg1.s, n2);
         }
@@ -2866,7 +3742,7 @@ static NEOERR *eval_expr (CSPARSE *parse, CSARG *expr, CSARG *result)
           char *s2 = arg_eval (parse, &arg2);
           if (s2 && s2[0])
           {
-            result->s = sprintf_alloc("%s.%s", arg1.s, s2);
+            result->s = scratch_concat (parse, arg1.s, ".", s2);
             if (result->s == NULL)
               return nerr_raise (NERR_NOMEM, "Unable to allocate memory to concatenate varnames in expression: %s + %s", arg1.s, s2);
           }
@@ -2874,7 +3750,6 @@ static NEOERR *eval_expr (CSPARSE *parse, CSARG *expr, CSARG *result)
           {
             /* if s2 doesn't match anything, then the whole thing is empty */
             result->s = "";
-            result->alloc = 0;
           }
         }
       }
@@ -2885,10 +3760,9 @@ static NEOERR *eval_expr (CSPARSE *parse, CSARG *expr, CSARG *result)
         /* This is an HDF lookup, so we will know the escaping status when
            the caller does the actual lookup and fetches the HDF object. */
         result->op_type = CS_TYPE_VAR;
-        result->alloc = 1;
         if (arg2.op_type & CS_TYPES_VAR)
         {
-          result->s = sprintf_alloc("%s.%s", arg1.s, arg2.s);
+          result->s = scratch_concat (parse, arg1.s, ".", arg2.s);
           if (result->s == NULL)
             return nerr_raise (NERR_NOMEM, "Unable to allocate memory to concatenate varnames in expression: %s + %s", arg1.s, arg2.s);
         }
@@ -2896,8 +3770,10 @@ static NEOERR *eval_expr (CSPARSE *parse, CSARG *expr, CSARG *result)
         {
           if (arg2.op_type & CS_TYPE_NUM)
           {
+            char buf[40];
             long int n2 = arg_eval_num (parse, &arg2);
-            result->s = sprintf_alloc("%s.%ld", arg1.s, n2);
+            snprintf (buf, sizeof(buf), "%ld", n2);
+            result->s = scratch_concat (parse, arg1.s, ".", buf);
             if (result->s == NULL)
               return nerr_raise (NERR_NOMEM, "Unable to allocate memory to concatenate varnames in expression: %s + %ld", arg1.s, n2);
           }
@@ -2906,7 +3782,7 @@ static NEOERR *eval_expr (CSPARSE *parse, CSARG *expr, CSARG *result)
             char *s2 = arg_eval (parse, &arg2);
             if (s2 && s2[0])
             {
-              result->s = sprintf_alloc("%s.%s", arg1.s, s2);
+              result->s = scratch_concat (parse, arg1.s, ".", s2);
               if (result->s == NULL)
                 return nerr_raise (NERR_NOMEM, "Unable to allocate memory to concatenate varnames in expression: %s + %s", arg1.s, s2);
             }
@@ -2914,7 +3790,6 @@ static NEOERR *eval_expr (CSPARSE *parse, CSARG *expr, CSARG *result)
             {
               /* if s2 doesn't match anything, then the whole thing is empty */
               result->s = "";
-              result->alloc = 0;
             }
           }
         }
@@ -3051,13 +3926,15 @@ static NEOERR *lvar_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
         }
         err = cs_parse_string_internal(cs, s, strlen(s));
 	if (err) break;
+        local_slot_tree(cs);
 
         if (cs->auto_ctx.log_changes)
         {
           cs->cur_file_idx = tmp_idx;
         }
 
-        err = cs_render_internal(cs, parse->output_ctx, parse->output_cb);
+        err = cs_render_internal(cs, parse->output, parse->output_ctx,
+                                 parse->output_cb, parse->output_chunk);
 	if (err) break;
       } while (0);      
       cs_destroy(&cs);
@@ -3069,6 +3946,112 @@ static NEOERR *lvar_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
   return nerr_pass(err);
 }
 
+/* The render count of the top parse, which lvar and linclude parses
+ * render as part of */
+static int top_renders (CSPARSE *parse)
+{
+  while (parse->parent != NULL)
+    parse = parse->parent;
+  return parse->renders;
+}
+
+/* Find the parse tree of a file we've already lincluded with the same
+ * escaping, making sure the file hasn't changed since.  That is only
+ * checked once per render, so a file lincluded in a loop isn't stat'ed
+ * each time round. */
+static CS_CACHE_ENTRY *linclude_lookup (CSPARSE *parse, const char *key)
+{
+  CS_CACHE_ENTRY *entry;
+  int renders;
+
+  if (parse->lincludes == NULL)
+    return NULL;
+
+  entry = (CS_CACHE_ENTRY *) ne_hash_lookup (parse->lincludes, (void *)key);
+  if (entry == NULL)
+    return NULL;
+  renders = top_renders(parse);
+  if (entry->checked == renders)
+    return entry;
+  if (!cache_entry_is_fresh(entry))
+  {
+    ne_hash_remove (parse->lincludes, entry->key);
+    cache_entry_retire (entry);
+    return NULL;
+  }
+  entry->checked = renders;
+  return entry;
+}
+
+/* Parse a lincluded file into a new child parse, and remember it if the
+ * parse tree only depends on the files it read. */
+static NEOERR *linclude_load (CSPARSE *parse, CSTREE *node, const char *path,
+                              const char *key, CSPARSE **cs,
+                              CS_CACHE_ENTRY **cached)
+{
+  NEOERR *err;
+  CSPARSE *my_cs = NULL;
+  CS_CACHE_ENTRY *entry = NULL;
+
+  *cs = NULL;
+  *cached = NULL;
+
+  err = cache_entry_new (key, &entry);
+  if (err) return nerr_pass(err);
+
+  do
+  {
+    err = cs_init_internal(&my_cs, parse->hdf, parse);
+    if (err) break;
+    my_cs->cache_entry = entry;
+    if (node->escape != NEOS_ESCAPE_UNDEF)
+    {
+      STACK_ENTRY *stack_entry;
+
+      /* Pass on the currently active escape mode to the
+         linclude tree about to be parsed */
+      err = uListGet (my_cs->stack, -1, (void *)&stack_entry);
+      if (err) break;
+      stack_entry->escape = node->escape;
+      my_cs->escaping.next_stack = node->escape;
+    }
+
+    err = cs_parse_file_internal(my_cs, path);
+    if (err) break;
+    local_slot_tree(my_cs);
+
+    if (parse->lincludes == NULL)
+    {
+      err = ne_hash_init (&(parse->lincludes), ne_hash_str_hash,
+                          ne_hash_str_comp);
+      if (err) break;
+    }
+    if (!entry->uncacheable)
+    {
+      err = ne_hash_insert (parse->lincludes, entry->key, entry);
+      if (err) break;
+      entry->parse = my_cs;
+      entry->escaping = my_cs->escaping;
+      entry->checked = top_renders(parse);
+      *cached = entry;
+      entry = NULL;
+    }
+  } while (0);
+
+  if (entry != NULL)
+  {
+    if (my_cs) my_cs->cache_entry = NULL;
+    cache_entry_destroy (&entry);
+  }
+  if (err)
+  {
+    cs_destroy (&my_cs);
+    return nerr_pass(err);
+  }
+  *cs = my_cs;
+  return STATUS_OK;
+}
+
 static NEOERR *linclude_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
 {
   NEOERR *err = STATUS_OK;
@@ -3093,6 +4076,10 @@ static NEOERR *linclude_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
     if (s)
     {
       CSPARSE *cs = NULL;
+      CS_CACHE_ENTRY *cached = NULL;
+      char key[PATH_BUF_SIZE + 16];
+
+      snprintf (key, sizeof(key), "%d:%s", node->escape, s);
       do {
   err = increase_stack_depth (parse);
   if (err)
@@ -3104,36 +4091,40 @@ static NEOERR *linclude_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
         s);
     break;
   }
-  err = cs_init_internal(&cs, parse->hdf, parse);
-  if (err) break;
-  if (node->escape != NEOS_ESCAPE_UNDEF)
-  {
-    STACK_ENTRY *entry;
-
-    /* Pass on the currently active escape mode to the
-       linclude tree about to be parsed */
-    err = uListGet (cs->stack, -1, (void *)&entry);
-    if (err) break;
-    entry->escape = node->escape;
-    cs->escaping.next_stack = node->escape;
-  }
-
-  err = cs_parse_file_internal(cs, s);
-  if (!(node->flags & CSF_REQUIRED))
+  cached = linclude_lookup (parse, key);
+  if (cached != NULL)
   {
-    nerr_handle(&err, NERR_NOT_FOUND);
+    /* Reset the render state left over from the last time */
+    cs = cached->parse;
+    cs->locals = parse->locals;
+    cs->stack_depth = parse->stack_depth;
+    cs->escaping = cached->escaping;
   }
-  if (err)
+  else
   {
-    err = nerr_pass_ctx(
-        err,
-        "%s failed to include '%s' while parsing.",
-        find_context(parse, -1, tmp, sizeof(tmp)),
-        s);
-    break;
+    err = linclude_load (parse, node, s, key, &cs, &cached);
+    if (!(node->flags & CSF_REQUIRED))
+    {
+      if (nerr_handle(&err, NERR_NOT_FOUND))
+      {
+        err = decrease_stack_depth (parse);
+        break;
+      }
+    }
+    if (err)
+    {
+      err = nerr_pass_ctx(
+          err,
+          "%s failed to include '%s' while parsing.",
+          find_context(parse, -1, tmp, sizeof(tmp)),
+          s);
+      break;
+    }
   }
-  if (err) break;
-  err = cs_render_internal(cs, parse->output_ctx, parse->output_cb);
+  if (cached) cached->refs++;
+  err = cs_render_internal(cs, parse->output, parse->output_ctx,
+                           parse->output_cb, parse->output_chunk);
+  if (cached) cached->refs--;
   if (err)
   {
     err = nerr_pass_ctx(
@@ -3146,7 +4137,10 @@ static NEOERR *linclude_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
   err = decrease_stack_depth (parse);
   if (err) break;
       } while (0);
-      cs_destroy(&cs);
+      if (cached == NULL)
+        cs_destroy(&cs);
+      else if (cached->stale && cached->refs <= 0)
+        cache_entry_destroy(&cached);
     }
   }
   if (val.alloc) free(val.s);
@@ -3364,7 +4358,7 @@ static NEOERR *each_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
 
   if (val.op_type == CS_TYPE_VAR)
   {
-    var = var_lookup_obj (parse, val.s);
+    var = var_lookup_obj (parse, &val);
 
     if (var != NULL)
     {
@@ -3426,7 +4420,7 @@ static NEOERR *with_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
 
   if (val.op_type == CS_TYPE_VAR)
   {
-    var = var_lookup_obj (parse, val.s);
+    var = var_lookup_obj (parse, &val);
 
     if (var != NULL)
     {
@@ -3488,6 +4482,10 @@ static NEOERR *include_parse (CSPARSE *parse, int cmd, char *arg)
   if (err) return nerr_pass(err);
   /* ne_warn ("include: %s", a); */
 
+  /* Including a variable makes the parse tree depend on the HDF data */
+  if (parse->cache_entry && arg1.op_type != CS_TYPE_STRING)
+    parse->cache_entry->uncacheable = 1;
+
   err = eval_expr(parse, &arg1, &val);
   if (err) return nerr_pass(err);
 
@@ -3499,6 +4497,7 @@ static NEOERR *include_parse (CSPARSE *parse, int cmd, char *arg)
       free(arg1.argexpr);
       arg1.argexpr = NULL;
     }
+    hdf_path_destroy(&(arg1.path));
     return STATUS_OK;
   }
   do {
@@ -3514,6 +4513,10 @@ static NEOERR *include_parse (CSPARSE *parse, int cmd, char *arg)
     }
 
     err = cs_parse_file_internal(parse, s);
+    /* Handle a missing optional include here, before adding context we'd
+     * only throw away */
+    if (!(flags & CSF_REQUIRED) && nerr_handle(&err, NERR_NOT_FOUND))
+      break;
     if (err)
     {
       err = nerr_pass_ctx(
@@ -3538,6 +4541,7 @@ static NEOERR *include_parse (CSPARSE *parse, int cmd, char *arg)
     free(arg1.argexpr);
     arg1.argexpr = NULL;
   }
+  hdf_path_destroy(&(arg1.path));
 
   return nerr_pass (err);
 }
@@ -3898,7 +4902,7 @@ static NEOERR *call_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
     {
       CS_LOCAL_MAP *lmap;
       char *c;
-      lmap = lookup_map (parse, val.s, &c);
+      lmap = arg_lookup_map (parse, &val, &c);
       if (lmap != NULL && (lmap->type != CS_TYPE_VAR && lmap->type != CS_TYPE_VAR_NUM))
       {
 	/* if we're referencing a local var which maps to a string or
@@ -3918,7 +4922,7 @@ static NEOERR *call_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
       }
       else
       {
-	var = var_lookup_obj (parse, val.s);
+	var = var_lookup_obj (parse, &val);
 	map->h = var;
         map->type = CS_TYPE_VAR;
         /* Setting a dummy value. The real escape status is part of map->h
@@ -4251,10 +5255,9 @@ static NEOERR *loop_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
          convention, set escape_status TRUSTED */
       each_map.escape_status = CS_ES_TRUSTED;
       err = render_node (parse, node->case_0);
-      if (each_map.map_alloc) {
-        free(each_map.s);
-        each_map.s = NULL;
-      }
+      if (each_map.map_alloc) free(each_map.s);
+      /* drop the string value of the last n, see var_lookup */
+      each_map.s = NULL;
       if (each_map.first) each_map.first = 0;
       if (err != STATUS_OK) break;
     }
@@ -4273,834 +5276,2863 @@ static NEOERR *skip_eval (CSPARSE *parse, CSTREE *node, CSTREE **next)
   return STATUS_OK;
 }
 
-static NEOERR *render_node (CSPARSE *parse, CSTREE *node)
-{
-  NEOERR *err = STATUS_OK;
-
-  while (node != NULL)
-  {
-    /* ne_warn ("%s %08x", Commands[node->cmd].cmd, node); */
-    err = (*(Commands[node->cmd].eval_handler))(parse, node, &node);
-    if (err) break;
-  }
-  return nerr_pass(err);
-}
+/* **** Optimizing ************************************************* */
 
-static NEOERR *increase_stack_depth (CSPARSE *parse)
+/* How the value of an expression is used, which decides what a variable
+ * on its own can be replaced with */
+typedef enum
 {
-  if (parse == NULL)
-    return nerr_raise (NERR_ASSERT,
-  "NULL parse object in increase_stack_depth");
+  FOLD_NODE,    /* it may name an HDF node (each, call), leave variables */
+  FOLD_STRING,  /* only its string or true/false value is used */
+  FOLD_NUM      /* only its numeric value is used */
+} CS_FOLD_USE;
 
-  if(parse->stack_depth >= MAX_STACK_DEPTH)
-    return nerr_raise (NERR_MAX_RECURSION, "Stack depth too large.");
-  parse->stack_depth++;
+typedef struct _fold
+{
+  CSPARSE *parse;
+  HDF *frozen;
+  const char **prefixes;
+} CS_FOLD;
 
-  return STATUS_OK;
-}
+static NEOERR *fold_nodes (CS_FOLD *fold, CSTREE **link);
 
-static NEOERR *decrease_stack_depth (CSPARSE *parse)
+/* A variable not bound by the template itself under one of the frozen
+ * prefixes */
+static int fold_frozen_var (CS_FOLD *fold, CSARG *arg)
 {
-  if (parse == NULL)
-    return nerr_raise (NERR_ASSERT,
-  "NULL parse object in decrease_stack_depth");
-
-  if(parse->stack_depth <= 0)
-      return nerr_raise (NERR_ASSERT, "Negative stack depth!!");
-  parse->stack_depth--;
+  const char **p;
+  size_t len;
 
-  return STATUS_OK;
+  if (fold->frozen == NULL || fold->prefixes == NULL || arg->s == NULL ||
+      arg->local_slot > 0)
+    return 0;
+  for (p = fold->prefixes; *p != NULL; p++)
+  {
+    len = strlen(*p);
+    if (!strncmp(arg->s, *p, len) &&
+        (arg->s[len] == '\0' || arg->s[len] == '.'))
+      return 1;
+  }
+  return 0;
 }
 
-
-NEOERR *cs_render_internal (CSPARSE *parse, void *ctx, CSOUTFUNC cb)
+/* Whether arg can be worked out before rendering: literals, frozen
+ * variables and the operators on them.  Functions can do anything, and
+ * a.b or a[b] name a node, so those never can */
+static int fold_constant (CS_FOLD *fold, CSARG *arg)
 {
-  CSTREE *node;
-
-  if (parse->tree == NULL)
-    return nerr_raise (NERR_ASSERT, "No parse tree exists");
-
-  parse->output_ctx = ctx;
-  parse->output_cb = cb;
-
-  node = parse->tree;
-  return nerr_pass (render_node(parse, node));
+  if (arg->op_type & CS_TYPES_CONST)
+    return 1;
+  if (arg->op_type & CS_TYPES_VAR)
+    return fold_frozen_var (fold, arg);
+  if (arg->op_type & (CS_TYPE_FUNCTION | CS_TYPE_MACRO | CS_OP_DOT |
+                      CS_OP_LBRACKET | CS_OP_COMMA))
+    return 0;
+  if (arg->expr1 == NULL || !fold_constant (fold, arg->expr1))
+    return 0;
+  if (arg->expr2 != NULL && !fold_constant (fold, arg->expr2))
+    return 0;
+  return 1;
 }
 
-NEOERR *cs_render (CSPARSE *parse, void *ctx, CSOUTFUNC cb)
+/* Evaluates arg, looking variables up in the frozen HDF, and turns it
+ * into the CS_TYPE_NUM or CS_TYPE_STRING it comes to, if that means the
+ * same to whatever uses it */
+static NEOERR *fold_value (CS_FOLD *fold, CSARG *arg, CS_FOLD_USE use)
 {
-  NEOERR *err = STATUS_OK;
+  NEOERR *err;
+  CSPARSE *parse = fold->parse;
+  CS_SCRATCH_MARK mark;
+  HDF *hdf = parse->hdf;
+  HDF *global_hdf = parse->global_hdf;
+  CSARG val;
+  CSTOKEN_TYPE type = 0;
+  char *s = NULL;
+  long int n = 0;
 
-  /* Reset the auto escape parser. This will erase any
-     existing context due to any previous call to cs_render.
-  */
-  if (parse->auto_ctx.global_enabled == 1)
+  parse->hdf = fold->frozen;
+  parse->global_hdf = NULL;
+  scratch_mark (parse, &mark);
+  err = eval_expr (parse, arg, &val);
+  if (err == STATUS_OK)
   {
-    if (parse->auto_ctx.parser_ctx)
-      err = neos_auto_reset(parse->auto_ctx.parser_ctx);
-    else
-      err = neos_auto_init(&(parse->auto_ctx.parser_ctx));
-
-    if (err)
-      return nerr_pass(err);
+    if (val.op_type == CS_TYPE_NUM)
+    {
+      type = CS_TYPE_NUM;
+      n = val.n;
+    }
+    else if (val.op_type == CS_TYPE_STRING)
+    {
+      type = CS_TYPE_STRING;
+      s = val.s;
+    }
+    else if (use == FOLD_NUM && (val.op_type & CS_TYPES_VAR))
+    {
+      type = CS_TYPE_NUM;
+      n = arg_eval_num (parse, &val);
+    }
+    else if (use == FOLD_STRING && val.op_type == CS_TYPE_VAR_NUM)
+    {
+      type = CS_TYPE_NUM;
+      n = arg_eval_num (parse, &val);
+    }
+    else if (use == FOLD_STRING && val.op_type == CS_TYPE_VAR)
+    {
+      type = CS_TYPE_STRING;
+      s = arg_eval (parse, &val);
+    }
+    /* A missing value isn't the same as any string */
+    if (type == CS_TYPE_STRING)
+    {
+      if (s == NULL)
+        type = 0;
+      else
+      {
+        s = strdup (s);
+        if (s == NULL)
+          err = nerr_raise (NERR_NOMEM,
+                            "Unable to allocate memory for constant %s",
+                            arg->argexpr ? arg->argexpr : "");
+        else
+        {
+          err = uListAppend (parse->alloc, s);
+          if (err) free (s);
+        }
+      }
+    }
+    if (val.alloc) free (val.s);
   }
+  scratch_release (parse, &mark);
+  parse->hdf = hdf;
+  parse->global_hdf = global_hdf;
+  if (err) return nerr_pass (err);
+  if (type == 0)
+    return STATUS_OK;
 
-  return nerr_pass(cs_render_internal(parse, ctx, cb));
+  /* arg keeps its argexpr, and its place in any list */
+  if (arg->expr1) dealloc_arg (&(arg->expr1));
+  if (arg->expr2) dealloc_arg (&(arg->expr2));
+  if (arg->path) hdf_path_destroy (&(arg->path));
+  arg->op_type = type;
+  arg->s = s;
+  arg->n = n;
+  arg->alloc = 0;
+  arg->function = NULL;
+  arg->macro = NULL;
+  arg->local_slot = 0;
+  arg->local_name = NULL;
+  return STATUS_OK;
 }
 
-/* **** Functions ******************************************** */
-
-NEOERR *cs_register_function(CSPARSE *parse, const char *funcname,
-                                  int n_args, CSFUNCTION function)
+static NEOERR *fold_expr (CS_FOLD *fold, CSARG *arg, CS_FOLD_USE use)
 {
-  CS_FUNCTION *csf;
+  NEOERR *err;
+  CSARG *sub;
 
-  /* Should we validate the parseability of the name? */
+  if (arg->op_type & CS_TYPES_CONST)
+    return STATUS_OK;
+  if (fold_constant (fold, arg))
+    return nerr_pass (fold_value (fold, arg, use));
 
-  csf = parse->functions;
-  while (csf != NULL)
+  /* Fold what can be inside it.  Operands, function arguments and the
+   * rest of a comma list are chained through next */
+  for (sub = arg->expr1; sub != NULL; sub = sub->next)
   {
-    if (!strcmp(csf->name, funcname) && csf->function != function)
-    {
-      return nerr_raise(NERR_DUPLICATE,
-	  "Attempt to register duplicate function %s", funcname);
-    }
-    csf = csf->next;
+    err = fold_expr (fold, sub, FOLD_NODE);
+    if (err) return nerr_pass (err);
   }
-  csf = (CS_FUNCTION *) calloc (1, sizeof(CS_FUNCTION));
-  if (csf == NULL)
-    return nerr_raise(NERR_NOMEM,
-	"Unable to allocate memory to register function %s", funcname);
-  csf->name = strdup(funcname);
-  if (csf->name == NULL)
+  for (sub = arg->expr2; sub != NULL; sub = sub->next)
   {
-    free(csf);
-    return nerr_raise(NERR_NOMEM,
-	"Unable to allocate memory to register function %s", funcname);
+    err = fold_expr (fold, sub, FOLD_NODE);
+    if (err) return nerr_pass (err);
   }
-  csf->function = function;
-  csf->n_args = n_args;
-  csf->escape = NEOS_ESCAPE_UNDEF;
-  csf->next = parse->functions;
-  parse->functions = csf;
-
   return STATUS_OK;
 }
 
-NEOERR *cs_register_esc_function(CSPARSE *parse, const char *funcname,
-                                 int n_args, CSFUNCTION function)
+/* Each expression in a list used the same way, like the arguments of a
+ * call or loop */
+static NEOERR *fold_list (CS_FOLD *fold, CSARG *arg, CS_FOLD_USE use)
 {
   NEOERR *err;
 
-  err = cs_register_function(parse, funcname, n_args, function);
-  if (err) return nerr_pass(err);
-  parse->functions->escape = NEOS_ESCAPE_FUNCTION;
-
+  for (; arg != NULL; arg = arg->next)
+  {
+    err = fold_expr (fold, arg, use);
+    if (err) return nerr_pass (err);
+  }
   return STATUS_OK;
 }
 
-/* This is similar to python's PyArg_ParseTuple, :
- *   s - string (allocated)
- *   i - int
- *   A - arg ptr (maybe later)
- */
-NEOERR * cs_arg_parsev(CSPARSE *parse, CSARG *args, const char *fmt,
-                       va_list ap)
+/* Macros are found by their def node at parse time, so those have to
+ * stay even in a branch that's never rendered */
+static int fold_has_def (CSTREE *node)
 {
-  NEOERR *err = STATUS_OK;
-  char **s;
-  long int *i;
-  CSARG val;
-
-  while (*fmt)
+  for (; node != NULL; node = node->next)
   {
-    memset(&val, 0, sizeof(val));
-    err = eval_expr(parse, args, &val);
-    if (err) return nerr_pass(err);
-
-    switch (*fmt)
-    {
-      case 's':
-	s = va_arg(ap, char **);
-	if (s == NULL)
-	{
-	  err = nerr_raise(NERR_ASSERT,
-	      "Invalid number of arguments in call to cs_arg_parse");
-	  break;
-	}
-	*s = arg_eval_str_alloc(parse, &val);
-	break;
-      case 'i':
-	i = va_arg(ap, long int *);
-	if (i == NULL)
-	{
-	  err = nerr_raise(NERR_ASSERT,
-	      "Invalid number of arguments in call to cs_arg_parse");
-	  break;
-	}
-	*i = arg_eval_num(parse, &val);
-	break;
-      default:
-	break;
-    }
-    if (err) return nerr_pass(err);
-    fmt++;
-    args = args->next;
-    if (val.alloc) free(val.s);
+    if (Commands[node->cmd].parse_handler == def_parse)
+      return 1;
+    if (fold_has_def (node->case_0) || fold_has_def (node->case_1))
+      return 1;
   }
-  if (err) return nerr_pass(err);
-  return STATUS_OK;
+  return 0;
 }
 
-NEOERR * cs_arg_parse(CSPARSE *parse, CSARG *args, const char *fmt, ...)
+/* Puts the list keep, already taken off the node, in place of the node
+ * at *link and frees the node with whatever else hangs off it */
+static void fold_splice (CSTREE **link, CSTREE *keep)
 {
-  NEOERR *err;
-  va_list ap;
+  CSTREE *node = *link;
+  CSTREE **tail = &keep;
+
+  while (*tail != NULL)
+    tail = &((*tail)->next);
+  *tail = node->next;
+  *link = keep;
+  node->next = NULL;
+  dealloc_node (&node);
+}
 
-  va_start(ap, fmt);
-  err = cs_arg_parsev(parse, args, fmt, ap);
-  va_end(ap);
-  return nerr_pass(err);
+/* Literal text that can be joined up.  Auto escaping keeps the parser
+ * state each literal leads to, so those have to stay as they are */
+static int fold_literal (CSTREE *node)
+{
+  return node != NULL && Commands[node->cmd].eval_handler == literal_eval &&
+         node->arg1.s != NULL && node->do_autoescape != 1;
 }
 
-static NEOERR * _builtin_subcount(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+/* Joins the run of literals starting at *link into one, or drops it if
+ * it's all empty */
+static NEOERR *fold_literals (CS_FOLD *fold, CSTREE **link)
 {
   NEOERR *err;
-  HDF *obj;
-  int count = 0;
-  CSARG val;
+  CSTREE *node = *link;
+  CSTREE *last = node;
+  CSTREE *rest;
+  size_t len = strlen(node->arg1.s);
+  char *s, *p;
 
-  memset(&val, 0, sizeof(val));
-  err = eval_expr(parse, args, &val);
-  if (err) return nerr_pass(err);
+  while (fold_literal (last->next))
+  {
+    last = last->next;
+    len += strlen(last->arg1.s);
+  }
+  if (last == node && len > 0)
+    return STATUS_OK;
 
-  /* default for non-vars is 0 children */
-  result->op_type = CS_TYPE_NUM;
-  result->n = 0;
+  if (len == 0)
+  {
+    *link = last->next;
+    last->next = NULL;
+    dealloc_node (&node);
+    return STATUS_OK;
+  }
 
-  if (val.op_type & CS_TYPE_VAR)
+  s = (char *) malloc (len + 1);
+  if (s == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory to join literals");
+  err = uListAppend (fold->parse->alloc, s);
+  if (err)
   {
-    obj = var_lookup_obj (parse, val.s);
-    if (obj != NULL)
+    free (s);
+    return nerr_pass (err);
+  }
+  for (p = s, rest = node; rest != last->next; rest = rest->next)
+  {
+    len = strlen(rest->arg1.s);
+    memcpy (p, rest->arg1.s, len);
+    p += len;
+  }
+  *p = '\0';
+
+  node->arg1.s = s;
+  rest = node->next;
+  node->next = last->next;
+  last->next = NULL;
+  dealloc_node (&rest);
+  return STATUS_OK;
+}
+
+static NEOERR *fold_nodes (CS_FOLD *fold, CSTREE **link)
+{
+  NEOERR *err = STATUS_OK;
+  NEOERR* (*eval)(CSPARSE *, CSTREE *, CSTREE **);
+  CSTREE **prev = NULL;
+  CSTREE *node, *keep;
+  int eval_true;
+
+  while (*link != NULL)
+  {
+    node = *link;
+    eval = Commands[node->cmd].eval_handler;
+    if (eval == var_eval || eval == lvar_eval || eval == alt_eval ||
+        eval == if_eval || eval == linclude_eval)
+      err = fold_list (fold, &(node->arg1), FOLD_STRING);
+    else if (eval == set_eval)
+      err = fold_list (fold, &(node->arg2), FOLD_STRING);
+    else if (eval == each_eval || eval == with_eval)
+      err = fold_list (fold, &(node->arg2), FOLD_NODE);
+    else if (eval == loop_eval)
+      err = fold_list (fold, node->vargs, FOLD_NUM);
+    else if (eval == call_eval)
+      err = fold_list (fold, node->vargs, FOLD_NODE);
+    if (err) return nerr_pass (err);
+
+    err = fold_nodes (fold, &(node->case_0));
+    if (err) return nerr_pass (err);
+    err = fold_nodes (fold, &(node->case_1));
+    if (err) return nerr_pass (err);
+
+    /* Decided if/elif/alt, render only the branch that would be.  Its
+     * nodes are already done, but they may join up with their new
+     * neighbours, so go through them again, from the literal before
+     * them if there is one */
+    if ((eval == if_eval || eval == alt_eval) &&
+        (node->arg1.op_type & CS_TYPES_CONST))
     {
-      obj = hdf_obj_child(obj);
-      while (obj != NULL)
+      eval_true = arg_eval_bool (fold->parse, &(node->arg1));
+      if (eval == if_eval &&
+          !fold_has_def (eval_true ? node->case_1 : node->case_0))
       {
-	count++;
-	obj = hdf_obj_next(obj);
+        if (eval_true)
+        {
+          keep = node->case_0;
+          node->case_0 = NULL;
+        }
+        else
+        {
+          keep = node->case_1;
+          node->case_1 = NULL;
+        }
+        fold_splice (link, keep);
+        if (prev != NULL && fold_literal (*prev)) link = prev;
+        continue;
+      }
+      if (eval == alt_eval && !fold_has_def (node->case_0))
+      {
+        if (!eval_true)
+        {
+          keep = node->case_0;
+          node->case_0 = NULL;
+          fold_splice (link, keep);
+          if (prev != NULL && fold_literal (*prev)) link = prev;
+          continue;
+        }
+        dealloc_node (&(node->case_0));
       }
     }
-    result->n = count;
-  }
-  if (val.alloc) free(val.s);
 
+    if (fold_literal (node))
+    {
+      err = fold_literals (fold, link);
+      if (err) return nerr_pass (err);
+      /* An empty run is gone, look at what followed it */
+      if (*link != node) continue;
+    }
+    prev = link;
+    link = &(node->next);
+  }
   return STATUS_OK;
 }
 
-static NEOERR * _builtin_str_length(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+NEOERR *cs_optimize (CSPARSE *parse, HDF *frozen, const char **prefixes)
 {
   NEOERR *err;
-  CSARG val;
+  CS_FOLD fold;
+  CSTREE *node;
 
-  memset(&val, 0, sizeof(val));
-  err = eval_expr(parse, args, &val);
-  if (err) return nerr_pass(err);
+  if (parse->program)
+    return nerr_raise (NERR_ASSERT, "Can't optimize a render context");
+  if (frozen != NULL && !frozen->frozen)
+    return nerr_raise (NERR_ASSERT,
+                       "Only a frozen data set can be built into a template");
 
-  /* non var/string objects have 0 length */
-  result->op_type = CS_TYPE_NUM;
-  result->n = 0;
+  fold.parse = parse;
+  fold.frozen = frozen;
+  fold.prefixes = prefixes;
+  /* Auto escaping goes by the escape status of the HDF values, which a
+   * constant doesn't have */
+  if (parse->auto_ctx.global_enabled == 1)
+    fold.frozen = NULL;
 
-  if (val.op_type & (CS_TYPE_VAR | CS_TYPE_STRING))
-  {
-    char *s = arg_eval(parse, &val);
-    if (s) result->n = strlen(s);
-  }
-  if (val.alloc) free(val.s);
-  return STATUS_OK;
+  /* The compiled version may jump into nodes that are about to go */
+  dealloc_code (&(parse->code));
+
+  err = fold_nodes (&fold, &(parse->tree));
+
+  /* The first node is the empty literal from cs_init, which stays.  More
+   * can still be parsed in after what's left */
+  for (node = parse->tree; node->next != NULL; node = node->next);
+  parse->current = node;
+  parse->next = &(node->next);
+  if (parse->auto_trace != NULL && parse->auto_trace->last != NULL)
+    parse->auto_trace->last = node;
+  return nerr_pass (err);
 }
 
-static NEOERR * _builtin_str_crc(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
-                                 CSARG *result)
+/* **** Compiled templates ***************************************** */
+
+typedef enum
 {
-  NEOERR *err;
-  CSARG val;
+  CS_OP_END,        /* return from the list */
+  CS_OP_TEXT,       /* output the literal text at arg, len long */
+  CS_OP_EVAL,       /* run eval on node */
+  CS_OP_IF,         /* if node's condition is false, jump to arg */
+  CS_OP_JUMP        /* jump to arg */
+} CS_OPCODE;
+
+typedef struct _op
+{
+  CS_OPCODE op;
+  int arg;
+  int len;
+  CSTREE *node;
+  NEOERR* (*eval)(CSPARSE *parse, CSTREE *node, CSTREE **next);
+} CS_OP;
 
-  memset(&val, 0, sizeof(val));
-  err = eval_expr(parse, args, &val);
-  if (err) return nerr_pass(err);
+typedef struct _entry
+{
+  CSTREE *node;   /* the start of the list */
+  int pc;         /* and the first instruction for it */
+} CS_ENTRY;
 
-  /* non var/string objects have 0 length */
-  result->op_type = CS_TYPE_NUM;
-  result->n = 0;
+struct _code
+{
+  CS_OP *ops;
+  int num_ops;
+  int max_ops;
+
+  /* The text of literals, NUL terminated runs of them */
+  char *text;
+  int text_len;
+  int text_max;
+
+  CS_ENTRY *entries;
+  int num_entries;
+  int max_entries;
+};
 
-  if (val.op_type & (CS_TYPE_VAR | CS_TYPE_STRING))
-  {
-    char *s = arg_eval(parse, &val);
-    if (s) result->n = (INT32) ne_crc((unsigned char *)s, strlen(s));
-  }
-  if (val.alloc) free(val.s);
-  return STATUS_OK;
+static void dealloc_code (CS_CODE **code)
+{
+  CS_CODE *my_code = *code;
+
+  if (my_code == NULL) return;
+  if (my_code->ops) free(my_code->ops);
+  if (my_code->text) free(my_code->text);
+  if (my_code->entries) free(my_code->entries);
+  free(my_code);
+  *code = NULL;
 }
 
+/* Make room for need more elements of size in *buf */
+static NEOERR *code_grow (void **buf, int *max, int len, int need, int size)
+{
+  void *new_buf;
+  int new_max;
+
+  if (len + need <= *max) return STATUS_OK;
 
-static NEOERR * _builtin_str_find(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+  new_max = *max ? *max * 2 : 64;
+  while (new_max < len + need) new_max *= 2;
+  new_buf = realloc (*buf, new_max * size);
+  if (new_buf == NULL)
+    return nerr_raise (NERR_NOMEM,
+                       "Unable to allocate memory for compiled template");
+  *buf = new_buf;
+  *max = new_max;
+  return STATUS_OK;
+}
+
+static NEOERR *code_emit (CS_CODE *code, CS_OPCODE op, int arg, CSTREE *node)
 {
   NEOERR *err;
-  char *s = NULL;
-  char *substr = NULL;
-  char *pstr = NULL;
-
-  result->op_type = CS_TYPE_NUM;
-  result->n = -1;
+  CS_OP *my_op;
 
-  err = cs_arg_parse(parse, args, "ss", &s, &substr);
+  err = code_grow ((void **)&(code->ops), &(code->max_ops), code->num_ops, 1,
+                   sizeof(CS_OP));
   if (err) return nerr_pass(err);
-  /* If null arguments, return -1 index */
-  if (s == NULL || substr == NULL) {
-    if (s) free(s);
-    if (substr) free(substr);
-    return STATUS_OK;
-  }
-  pstr = strstr(s, substr);
-  if (pstr != NULL) {
-    result->n = (pstr - s) / sizeof(char);
-  }
-  free(s);
-  free(substr);
+  my_op = &(code->ops[code->num_ops++]);
+  my_op->op = op;
+  my_op->arg = arg;
+  my_op->len = 0;
+  my_op->node = node;
+  my_op->eval = node ? Commands[node->cmd].eval_handler : NULL;
   return STATUS_OK;
 }
 
-
-static NEOERR * _builtin_name(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+static NEOERR *code_add_text (CS_CODE *code, const char *s, int len)
 {
   NEOERR *err;
-  HDF *obj;
-  CSARG val;
 
-  memset(&val, 0, sizeof(val));
-  err = eval_expr(parse, args, &val);
+  err = code_grow ((void **)&(code->text), &(code->text_max), code->text_len,
+                   len, sizeof(char));
   if (err) return nerr_pass(err);
+  memcpy (code->text + code->text_len, s, len);
+  code->text_len += len;
+  return STATUS_OK;
+}
 
-  result->op_type = CS_TYPE_STRING;
-  result->s = "";
+static NEOERR *compile_list (CS_CODE *code, CSTREE *node, ULIST *bodies)
+{
+  NEOERR *err = STATUS_OK;
+  NEOERR* (*eval)(CSPARSE *parse, CSTREE *node, CSTREE **next);
+  int start, jump;
 
-  if (val.op_type & CS_TYPE_VAR)
-  {
-    obj = var_lookup_obj (parse, val.s);
-    if (obj != NULL)
-      result->s = hdf_obj_name(obj);
-  }
-  else if (val.op_type & CS_TYPE_STRING)
+  while (node != NULL)
   {
-    result->s = val.s;
-    result->alloc = val.alloc;
-    val.alloc = 0;
+    eval = Commands[node->cmd].eval_handler;
+    if (eval == skip_eval)
+    {
+      node = node->next;
+    }
+    else if (eval == literal_eval && node->do_autoescape != 1)
+    {
+      /* Join the run of literals, skipping nodes that don't output
+       * anything.  Literals the auto escape parser sees stay separate. */
+      start = code->text_len;
+      while (node != NULL)
+      {
+        eval = Commands[node->cmd].eval_handler;
+        if (eval == literal_eval && node->do_autoescape != 1)
+        {
+          if (node->arg1.s != NULL)
+          {
+            err = code_add_text (code, node->arg1.s, strlen(node->arg1.s));
+            if (err) return nerr_pass(err);
+          }
+        }
+        else if (eval != skip_eval)
+        {
+          break;
+        }
+        node = node->next;
+      }
+      if (code->text_len > start)
+      {
+        err = code_add_text (code, "", 1);
+        if (err) return nerr_pass(err);
+        err = code_emit (code, CS_OP_TEXT, start, NULL);
+        if (err) return nerr_pass(err);
+        code->ops[code->num_ops - 1].len = code->text_len - 1 - start;
+      }
+    }
+    else if (eval == if_eval)
+    {
+      /* elif and else are in case_1 */
+      start = code->num_ops;
+      err = code_emit (code, CS_OP_IF, 0, node);
+      if (err) return nerr_pass(err);
+      err = compile_list (code, node->case_0, bodies);
+      if (err) return nerr_pass(err);
+      if (node->case_1 != NULL)
+      {
+        jump = code->num_ops;
+        err = code_emit (code, CS_OP_JUMP, 0, NULL);
+        if (err) return nerr_pass(err);
+        code->ops[start].arg = code->num_ops;
+        err = compile_list (code, node->case_1, bodies);
+        if (err) return nerr_pass(err);
+        code->ops[jump].arg = code->num_ops;
+      }
+      else
+      {
+        code->ops[start].arg = code->num_ops;
+      }
+      node = node->next;
+    }
+    else
+    {
+      /* each, with, loop, alt and escape render their body with
+       * render_node, which will find its own compiled list */
+      err = code_emit (code, CS_OP_EVAL, 0, node);
+      if (err) return nerr_pass(err);
+      if (node->case_0 != NULL)
+      {
+        err = uListAppend (bodies, node->case_0);
+        if (err) return nerr_pass(err);
+      }
+      node = node->next;
+    }
   }
-  if (val.alloc) free(val.s);
   return STATUS_OK;
 }
 
-/* Check to see if a local variable is the first in an each/loop sequence */
-static NEOERR * _builtin_first(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
-                               CSARG *result)
+NEOERR *cs_compile (CSPARSE *parse)
 {
-  NEOERR *err;
-  CS_LOCAL_MAP *map;
-  char *c;
-  CSARG val;
+  NEOERR *err = STATUS_OK;
+  CS_CODE *code;
+  CS_MACRO *macro;
+  CSTREE *node;
+  ULIST *bodies = NULL;
 
-  memset(&val, 0, sizeof(val));
-  err = eval_expr(parse, args, &val);
-  if (err) return nerr_pass(err);
+  if (parse->program)
+    return nerr_raise (NERR_ASSERT, "Can't compile a render context");
 
-  /* default is "not first" */
-  result->op_type = CS_TYPE_NUM;
-  result->n = 0;
+  dealloc_code (&(parse->code));
+  code = (CS_CODE *) calloc (1, sizeof (CS_CODE));
+  if (code == NULL)
+    return nerr_raise (NERR_NOMEM,
+                       "Unable to allocate memory for compiled template");
 
-  /* Only applies to possible local vars */
-  if ((val.op_type & CS_TYPE_VAR) && !strchr(val.s, '.'))
+  do
   {
-    map = lookup_map (parse, val.s, &c);
-    if (map && map->first)
-      result->n = 1;
+    err = uListInit (&bodies, 10, 0);
+    if (err) break;
+    if (parse->tree != NULL)
+    {
+      err = uListAppend (bodies, parse->tree);
+      if (err) break;
+    }
+    for (macro = parse->macros; macro != NULL; macro = macro->next)
+    {
+      if (macro->tree->case_0 == NULL) continue;
+      err = uListAppend (bodies, macro->tree->case_0);
+      if (err) break;
+    }
+    if (err) break;
+
+    while (uListLength (bodies))
+    {
+      err = uListPop (bodies, (void *)&node);
+      if (err) break;
+      err = code_grow ((void **)&(code->entries), &(code->max_entries),
+                       code->num_entries, 1, sizeof(CS_ENTRY));
+      if (err) break;
+      code->entries[code->num_entries].node = node;
+      code->entries[code->num_entries].pc = code->num_ops;
+      node->code = ++code->num_entries;
+      err = compile_list (code, node, bodies);
+      if (err) break;
+      err = code_emit (code, CS_OP_END, 0, NULL);
+      if (err) break;
+    }
+  } while (0);
+
+  uListDestroy (&bodies, 0);
+  if (err)
+  {
+    dealloc_code (&code);
+    return nerr_pass(err);
   }
-  if (val.alloc) free(val.s);
+  parse->code = code;
   return STATUS_OK;
 }
 
-/* Check to see if a local variable is the last in an each/loop sequence */
-/* TODO: consider making this work on regular HDF vars */
-static NEOERR * _builtin_last(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
-                               CSARG *result)
+static NEOERR *run_code (CSPARSE *parse, CS_CODE *code, int pc)
 {
-  NEOERR *err;
-  CS_LOCAL_MAP *map;
-  char *c;
+  NEOERR *err = STATUS_OK;
+  CS_OP *op;
+  CSTREE *next;
   CSARG val;
+  CS_SCRATCH_MARK mark;
+  int eval_true;
 
-  memset(&val, 0, sizeof(val));
-  err = eval_expr(parse, args, &val);
-  if (err) return nerr_pass(err);
-
-  /* default is "not last" */
-  result->op_type = CS_TYPE_NUM;
-  result->n = 0;
-
-  /* Only applies to possible local vars */
-  if ((val.op_type & CS_TYPE_VAR) && !strchr(val.s, '.'))
+  while (err == STATUS_OK)
   {
-    map = lookup_map (parse, val.s, &c);
-    if (map) {
-      if (map->last) {
-        result->n = 1;
-      } else if (map->type == CS_TYPE_VAR) {
-        if (hdf_obj_next(map->h) == NULL) {
-          result->n = 1;
+    op = &(code->ops[pc++]);
+    switch (op->op)
+    {
+      case CS_OP_END:
+        return STATUS_OK;
+      case CS_OP_TEXT:
+        err = output_text (parse, code->text + op->arg, op->len);
+        break;
+      case CS_OP_EVAL:
+        scratch_mark (parse, &mark);
+        err = (*(op->eval))(parse, op->node, &next);
+        scratch_release (parse, &mark);
+        break;
+      case CS_OP_IF:
+        scratch_mark (parse, &mark);
+        err = eval_expr(parse, &(op->node->arg1), &val);
+        if (err == STATUS_OK)
+        {
+          eval_true = arg_eval_bool(parse, &val);
+          if (val.alloc) free(val.s);
+          if (!eval_true) pc = op->arg;
         }
-      }
+        scratch_release (parse, &mark);
+        break;
+      case CS_OP_JUMP:
+        pc = op->arg;
+        break;
     }
   }
-  if (val.alloc) free(val.s);
-  return STATUS_OK;
+  return nerr_pass(err);
 }
 
-/* returns the absolute value (ie, positive) of a number */
-static NEOERR * _builtin_abs (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
-                              CSARG *result)
+static NEOERR *render_node (CSPARSE *parse, CSTREE *node)
 {
-  NEOERR *err;
-  int n1 = 0;
-  CSARG val;
+  NEOERR *err = STATUS_OK;
+  CS_CODE *code = parse->code;
 
-  memset(&val, 0, sizeof(val));
-  err = eval_expr(parse, args, &val);
-  if (err) return nerr_pass(err);
+  /* Only use the compiled version if it's for this node, see cs_compile */
+  if (code != NULL && node != NULL && node->code > 0 &&
+      node->code <= code->num_entries &&
+      code->entries[node->code - 1].node == node)
+  {
+    return nerr_pass(run_code(parse, code, code->entries[node->code - 1].pc));
+  }
 
-  result->op_type = CS_TYPE_NUM;
-  n1 = arg_eval_num(parse, &val);
-  result->n = abs(n1);
+  while (node != NULL)
+  {
+    CS_SCRATCH_MARK mark;
 
-  if (val.alloc) free(val.s);
-  return STATUS_OK;
+    /* ne_warn ("%s %08x", Commands[node->cmd].cmd, node); */
+    scratch_mark (parse, &mark);
+    err = (*(Commands[node->cmd].eval_handler))(parse, node, &node);
+    scratch_release (parse, &mark);
+    if (err) break;
+  }
+  return nerr_pass(err);
 }
 
-/* returns the larger or two integers */
-static NEOERR * _builtin_max (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
-                              CSARG *result)
+static NEOERR *increase_stack_depth (CSPARSE *parse)
 {
-  NEOERR *err;
-  long int n1 = 0;
-  long int n2 = 0;
-
-  result->op_type = CS_TYPE_NUM;
-  result->n = 0;
+  if (parse == NULL)
+    return nerr_raise (NERR_ASSERT,
+  "NULL parse object in increase_stack_depth");
 
-  err = cs_arg_parse(parse, args, "ii", &n1, &n2);
-  if (err) return nerr_pass(err);
-  result->n = (n1 > n2) ? n1 : n2;
+  if(parse->stack_depth >= MAX_STACK_DEPTH)
+    return nerr_raise (NERR_MAX_RECURSION, "Stack depth too large.");
+  parse->stack_depth++;
 
   return STATUS_OK;
 }
 
-/* returns the smaller or two integers */
-static NEOERR * _builtin_min (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
-                              CSARG *result)
+static NEOERR *decrease_stack_depth (CSPARSE *parse)
 {
-  NEOERR *err;
-  long int n1 = 0;
-  long int n2 = 0;
-
-  result->op_type = CS_TYPE_NUM;
-  result->n = 0;
+  if (parse == NULL)
+    return nerr_raise (NERR_ASSERT,
+  "NULL parse object in decrease_stack_depth");
 
-  err = cs_arg_parse(parse, args, "ii", &n1, &n2);
-  if (err) return nerr_pass(err);
-  result->n = (n1 < n2) ? n1 : n2;
+  if(parse->stack_depth <= 0)
+      return nerr_raise (NERR_ASSERT, "Negative stack depth!!");
+  parse->stack_depth--;
 
   return STATUS_OK;
 }
 
-static NEOERR * _builtin_str_slice (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
-{
-  NEOERR *err;
-  char *s = NULL;
-  char *slice;
-  long int b = 0;
-  long int e = 0;
-  size_t len;
 
-  result->op_type = CS_TYPE_STRING;
-  result->s = "";
+static NEOERR *cs_render_internal (CSPARSE *parse, STRING *out,
+                                   void *ctx, CSOUTFUNC cb, int chunk)
+{
+  CSTREE *node;
 
-  err = cs_arg_parse(parse, args, "sii", &s, &b, &e);
-  if (err) return nerr_pass(err);
-  /* If null, return empty string */
-  if (s == NULL) return STATUS_OK;
-  len = strlen(s);
-  if (b < 0 && e == 0) e = len;
-  if (b < 0) b += len;
-  if (b < 0) b = 0;
-  if (b > len) b = len;
-  if (e < 0) e += len;
-  if (e < 0) e = 0;
-  if (e > len) e = len;
-  /* Its the whole string */
-  if (b == 0 && e == len)
-  {
-    result->s = s;
-    result->alloc = 1;
-    return STATUS_OK;
-  }
-  if (e < b) b = e;
-  if (b == e)
-  {
-    /* If null, return empty string */
-    free(s);
-    return STATUS_OK;
-  }
-  slice = (char *) malloc (sizeof(char) * (e-b+1));
-  if (slice == NULL)
-    return nerr_raise(NERR_NOMEM, "Unable to allocate memory for string slice");
-  strncpy(slice, s + b, e-b);
-  free(s);
-  slice[e-b] = '\0';
+  if (parse->tree == NULL)
+    return nerr_raise (NERR_ASSERT, "No parse tree exists");
 
-  result->s = slice;
-  result->alloc = 1;
+  parse->output = out;
+  parse->output_ctx = ctx;
+  parse->output_cb = cb;
+  parse->output_chunk = chunk;
 
-  return STATUS_OK;
+  node = parse->tree;
+  return nerr_pass (render_node(parse, node));
 }
 
-static NEOERR * _builtin_str_tolower (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+static NEOERR *render_start (CSPARSE *parse, STRING *out)
 {
-  NEOERR *err;
-  char *s = NULL;
+  NEOERR *err = STATUS_OK;
 
-  result->op_type = CS_TYPE_STRING;
-  result->s = "";
+  /* Forget the HDF lookups of any previous render */
+  parse->renders++;
 
-  err = cs_arg_parse(parse, args, "s", &s);
-  if (err) return nerr_pass(err);
-  /* If null, return empty string */
-  if (s == NULL) return STATUS_OK;
+  /* Reset the auto escape parser. This will erase any
+     existing context due to any previous call to cs_render.
+  */
+  if (parse->auto_ctx.global_enabled == 1)
+  {
+    if (parse->auto_ctx.parser_ctx)
+      err = neos_auto_reset(parse->auto_ctx.parser_ctx);
+    else
+      err = neos_auto_init(&(parse->auto_ctx.parser_ctx));
 
-  neos_lower(s);
-  result->s = s;
-  result->alloc = 1;
+    if (err)
+      return nerr_pass(err);
+  }
 
-  return STATUS_OK;
+  /* Rendering relies on out always having a buffer */
+  if (out->buf == NULL)
+    err = string_append (out, "");
+
+  return nerr_pass(err);
 }
 
-#ifdef ENABLE_GETTEXT
-static NEOERR * _builtin_gettext(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+NEOERR *cs_render_string (CSPARSE *parse, STRING *str)
 {
   NEOERR *err;
-  char *s;
-  CSARG val;
 
-  memset(&val, 0, sizeof(val));
-  err = eval_expr(parse, args, &val);
+  err = render_start (parse, str);
   if (err) return nerr_pass(err);
+  err = cs_render_internal(parse, str, NULL, NULL, 0);
+  parse->output = NULL;
+  return nerr_pass(err);
+}
 
-  result->op_type = CS_TYPE_STRING;
-  result->s = "";
+NEOERR *cs_render (CSPARSE *parse, void *ctx, CSOUTFUNC cb)
+{
+  return nerr_pass(cs_render_chunked (parse, ctx, cb, CS_OUTPUT_CHUNK));
+}
 
-  if (val.op_type & (CS_TYPE_VAR | CS_TYPE_STRING))
+NEOERR *cs_render_chunked (CSPARSE *parse, void *ctx, CSOUTFUNC cb,
+                           int chunk_size)
+{
+  NEOERR *err, *err2;
+  STRING out;
+
+  string_init (&out);
+  err = render_start (parse, &out);
+  if (err == STATUS_OK)
+    err = cs_render_internal(parse, &out, ctx, cb, chunk_size);
+  parse->output = NULL;
+
+  /* Whatever was rendered before any error still goes to cb, as it would
+   * have if cb had been called as it went */
+  if (out.len > 0)
   {
-    s = arg_eval(parse, &val);
-    if (s)
-    {
-      result->s = gettext(s);
-    }
+    err2 = cb (ctx, out.buf);
+    if (err == STATUS_OK)
+      err = err2;
+    else
+      nerr_ignore (&err2);
   }
-  if (val.alloc) free(val.s);
-  return STATUS_OK;
+  string_clear (&out);
+  return nerr_pass(err);
 }
-#endif
 
-static NEOERR * _str_func_wrapper (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+/* **** Functions ******************************************** */
+
+NEOERR *cs_register_function(CSPARSE *parse, const char *funcname,
+                                  int n_args, CSFUNCTION function)
 {
-  NEOERR *err;
-  char *s;
-  CSARG val;
+  CS_FUNCTION *csf;
 
-  memset(&val, 0, sizeof(val));
-  err = eval_expr(parse, args, &val);
-  if (err) return nerr_pass(err);
+  /* Should we validate the parseability of the name? */
 
-  if (val.op_type & (CS_TYPE_VAR | CS_TYPE_STRING))
+  csf = parse->functions;
+  while (csf != NULL)
   {
-    result->op_type = CS_TYPE_STRING;
-    result->n = 0;
-
-    s = arg_eval(parse, &val);
-    if (s)
+    if (!strcmp(csf->name, funcname) && csf->function != function)
     {
-      err = csf->str_func(s, &(result->s));
-      if (err) return nerr_pass(err);
-      result->alloc = 1;
+      return nerr_raise(NERR_DUPLICATE,
+	  "Attempt to register duplicate function %s", funcname);
     }
+    csf = csf->next;
   }
-  else
+  csf = (CS_FUNCTION *) calloc (1, sizeof(CS_FUNCTION));
+  if (csf == NULL)
+    return nerr_raise(NERR_NOMEM,
+	"Unable to allocate memory to register function %s", funcname);
+  csf->name = strdup(funcname);
+  if (csf->name == NULL)
   {
-    result->op_type = val.op_type;
-    result->n = val.n;
-    result->s = val.s;
-    result->alloc = val.alloc;
-    val.alloc = 0;
+    free(csf);
+    return nerr_raise(NERR_NOMEM,
+	"Unable to allocate memory to register function %s", funcname);
   }
-  if (val.alloc) free(val.s);
+  csf->function = function;
+  csf->n_args = n_args;
+  csf->escape = NEOS_ESCAPE_UNDEF;
+  csf->next = parse->functions;
+  parse->functions = csf;
+
   return STATUS_OK;
 }
 
-NEOERR *cs_register_strfunc(CSPARSE *parse, char *funcname, CSSTRFUNC str_func)
+NEOERR *cs_register_esc_function(CSPARSE *parse, const char *funcname,
+                                 int n_args, CSFUNCTION function)
 {
   NEOERR *err;
 
-  err = cs_register_function(parse, funcname, 1, _str_func_wrapper);
+  err = cs_register_function(parse, funcname, n_args, function);
   if (err) return nerr_pass(err);
-  parse->functions->str_func = str_func;
+  parse->functions->escape = NEOS_ESCAPE_FUNCTION;
 
   return STATUS_OK;
 }
 
-NEOERR *cs_register_esc_strfunc(CSPARSE *parse, char *funcname,
-                                CSSTRFUNC str_func)
+/* This is similar to python's PyArg_ParseTuple, :
+ *   s - string (allocated)
+ *   i - int
+ *   A - arg ptr (maybe later)
+ */
+NEOERR * cs_arg_parsev(CSPARSE *parse, CSARG *args, const char *fmt,
+                       va_list ap)
 {
-  NEOERR *err;
+  NEOERR *err = STATUS_OK;
+  char **s;
+  long int *i;
+  CSARG val;
 
-  err = cs_register_strfunc(parse, funcname, str_func);
-  if (err) return nerr_pass(err);
-  parse->functions->escape = NEOS_ESCAPE_FUNCTION;
+  while (*fmt)
+  {
+    memset(&val, 0, sizeof(val));
+    err = eval_expr(parse, args, &val);
+    if (err) return nerr_pass(err);
 
+    switch (*fmt)
+    {
+      case 's':
+	s = va_arg(ap, char **);
+	if (s == NULL)
+	{
+	  err = nerr_raise(NERR_ASSERT,
+	      "Invalid number of arguments in call to cs_arg_parse");
+	  break;
+	}
+	*s = arg_eval_str_alloc(parse, &val);
+	break;
+      case 'i':
+	i = va_arg(ap, long int *);
+	if (i == NULL)
+	{
+	  err = nerr_raise(NERR_ASSERT,
+	      "Invalid number of arguments in call to cs_arg_parse");
+	  break;
+	}
+	*i = arg_eval_num(parse, &val);
+	break;
+      default:
+	break;
+    }
+    if (err) return nerr_pass(err);
+    fmt++;
+    args = args->next;
+    if (val.alloc) free(val.s);
+  }
+  if (err) return nerr_pass(err);
   return STATUS_OK;
 }
 
-/* **** CS Initialize/Destroy ************************************ */
-NEOERR *cs_init (CSPARSE **parse, HDF *hdf) {
-  return nerr_pass(cs_init_internal(parse, hdf, NULL));
+NEOERR * cs_arg_parse(CSPARSE *parse, CSARG *args, const char *fmt, ...)
+{
+  NEOERR *err;
+  va_list ap;
+
+  va_start(ap, fmt);
+  err = cs_arg_parsev(parse, args, fmt, ap);
+  va_end(ap);
+  return nerr_pass(err);
 }
 
-static NEOERR *cs_init_internal (CSPARSE **parse, HDF *hdf, CSPARSE *parent)
+static NEOERR * _builtin_subcount(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
 {
-  NEOERR *err = STATUS_OK;
-  CSPARSE *my_parse;
-  STACK_ENTRY *entry;
-  char *esc_value;
-  CS_ESCAPE_MODES *esc_cursor;
+  NEOERR *err;
+  HDF *obj;
+  int count = 0;
+  CSARG val;
 
-  err = nerr_init();
-  if (err != STATUS_OK) return nerr_pass (err);
+  memset(&val, 0, sizeof(val));
+  err = eval_expr(parse, args, &val);
+  if (err) return nerr_pass(err);
 
-  my_parse = (CSPARSE *) calloc (1, sizeof (CSPARSE));
-  if (my_parse == NULL)
-    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for CSPARSE");
+  /* default for non-vars is 0 children */
+  result->op_type = CS_TYPE_NUM;
+  result->n = 0;
+
+  if (val.op_type & CS_TYPE_VAR)
+  {
+    obj = var_lookup_obj (parse, &val);
+    if (obj != NULL)
+    {
+      obj = hdf_obj_child(obj);
+      while (obj != NULL)
+      {
+	count++;
+	obj = hdf_obj_next(obj);
+      }
+    }
+    result->n = count;
+  }
+  if (val.alloc) free(val.s);
+
+  return STATUS_OK;
+}
+
+static NEOERR * _builtin_str_length(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+{
+  NEOERR *err;
+  CSARG val;
+
+  memset(&val, 0, sizeof(val));
+  err = eval_expr(parse, args, &val);
+  if (err) return nerr_pass(err);
+
+  /* non var/string objects have 0 length */
+  result->op_type = CS_TYPE_NUM;
+  result->n = 0;
+
+  if (val.op_type & (CS_TYPE_VAR | CS_TYPE_STRING))
+  {
+    char *s = arg_eval(parse, &val);
+    if (s) result->n = strlen(s);
+  }
+  if (val.alloc) free(val.s);
+  return STATUS_OK;
+}
+
+static NEOERR * _builtin_str_crc(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
+                                 CSARG *result)
+{
+  NEOERR *err;
+  CSARG val;
+
+  memset(&val, 0, sizeof(val));
+  err = eval_expr(parse, args, &val);
+  if (err) return nerr_pass(err);
+
+  /* non var/string objects have 0 length */
+  result->op_type = CS_TYPE_NUM;
+  result->n = 0;
+
+  if (val.op_type & (CS_TYPE_VAR | CS_TYPE_STRING))
+  {
+    char *s = arg_eval(parse, &val);
+    if (s) result->n = (INT32) ne_crc((unsigned char *)s, strlen(s));
+  }
+  if (val.alloc) free(val.s);
+  return STATUS_OK;
+}
+
+
+static NEOERR * _builtin_str_find(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+{
+  NEOERR *err;
+  char *s = NULL;
+  char *substr = NULL;
+  char *pstr = NULL;
+
+  result->op_type = CS_TYPE_NUM;
+  result->n = -1;
+
+  err = cs_arg_parse(parse, args, "ss", &s, &substr);
+  if (err) return nerr_pass(err);
+  /* If null arguments, return -1 index */
+  if (s == NULL || substr == NULL) {
+    if (s) free(s);
+    if (substr) free(substr);
+    return STATUS_OK;
+  }
+  pstr = strstr(s, substr);
+  if (pstr != NULL) {
+    result->n = (pstr - s) / sizeof(char);
+  }
+  free(s);
+  free(substr);
+  return STATUS_OK;
+}
+
+
+static NEOERR * _builtin_name(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+{
+  NEOERR *err;
+  HDF *obj;
+  CSARG val;
+
+  memset(&val, 0, sizeof(val));
+  err = eval_expr(parse, args, &val);
+  if (err) return nerr_pass(err);
+
+  result->op_type = CS_TYPE_STRING;
+  result->s = "";
+
+  if (val.op_type & CS_TYPE_VAR)
+  {
+    obj = var_lookup_obj (parse, &val);
+    if (obj != NULL)
+      result->s = hdf_obj_name(obj);
+  }
+  else if (val.op_type & CS_TYPE_STRING)
+  {
+    result->s = val.s;
+    result->alloc = val.alloc;
+    val.alloc = 0;
+  }
+  if (val.alloc) free(val.s);
+  return STATUS_OK;
+}
+
+/* Check to see if a local variable is the first in an each/loop sequence */
+static NEOERR * _builtin_first(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
+                               CSARG *result)
+{
+  NEOERR *err;
+  CS_LOCAL_MAP *map;
+  char *c;
+  CSARG val;
+
+  memset(&val, 0, sizeof(val));
+  err = eval_expr(parse, args, &val);
+  if (err) return nerr_pass(err);
+
+  /* default is "not first" */
+  result->op_type = CS_TYPE_NUM;
+  result->n = 0;
+
+  /* Only applies to possible local vars */
+  if ((val.op_type & CS_TYPE_VAR) && !strchr(val.s, '.'))
+  {
+    map = arg_lookup_map (parse, &val, &c);
+    if (map && map->first)
+      result->n = 1;
+  }
+  if (val.alloc) free(val.s);
+  return STATUS_OK;
+}
+
+/* Check to see if a local variable is the last in an each/loop sequence */
+/* TODO: consider making this work on regular HDF vars */
+static NEOERR * _builtin_last(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
+                               CSARG *result)
+{
+  NEOERR *err;
+  CS_LOCAL_MAP *map;
+  char *c;
+  CSARG val;
+
+  memset(&val, 0, sizeof(val));
+  err = eval_expr(parse, args, &val);
+  if (err) return nerr_pass(err);
+
+  /* default is "not last" */
+  result->op_type = CS_TYPE_NUM;
+  result->n = 0;
+
+  /* Only applies to possible local vars */
+  if ((val.op_type & CS_TYPE_VAR) && !strchr(val.s, '.'))
+  {
+    map = arg_lookup_map (parse, &val, &c);
+    if (map) {
+      if (map->last) {
+        result->n = 1;
+      } else if (map->type == CS_TYPE_VAR) {
+        if (hdf_obj_next(map->h) == NULL) {
+          result->n = 1;
+        }
+      }
+    }
+  }
+  if (val.alloc) free(val.s);
+  return STATUS_OK;
+}
+
+/* returns the absolute value (ie, positive) of a number */
+static NEOERR * _builtin_abs (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
+                              CSARG *result)
+{
+  NEOERR *err;
+  int n1 = 0;
+  CSARG val;
+
+  memset(&val, 0, sizeof(val));
+  err = eval_expr(parse, args, &val);
+  if (err) return nerr_pass(err);
+
+  result->op_type = CS_TYPE_NUM;
+  n1 = arg_eval_num(parse, &val);
+  result->n = abs(n1);
+
+  if (val.alloc) free(val.s);
+  return STATUS_OK;
+}
+
+/* returns the larger or two integers */
+static NEOERR * _builtin_max (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
+                              CSARG *result)
+{
+  NEOERR *err;
+  long int n1 = 0;
+  long int n2 = 0;
+
+  result->op_type = CS_TYPE_NUM;
+  result->n = 0;
+
+  err = cs_arg_parse(parse, args, "ii", &n1, &n2);
+  if (err) return nerr_pass(err);
+  result->n = (n1 > n2) ? n1 : n2;
+
+  return STATUS_OK;
+}
+
+/* returns the smaller or two integers */
+static NEOERR * _builtin_min (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args,
+                              CSARG *result)
+{
+  NEOERR *err;
+  long int n1 = 0;
+  long int n2 = 0;
+
+  result->op_type = CS_TYPE_NUM;
+  result->n = 0;
+
+  err = cs_arg_parse(parse, args, "ii", &n1, &n2);
+  if (err) return nerr_pass(err);
+  result->n = (n1 < n2) ? n1 : n2;
+
+  return STATUS_OK;
+}
+
+static NEOERR * _builtin_str_slice (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+{
+  NEOERR *err;
+  char *s = NULL;
+  char *slice;
+  long int b = 0;
+  long int e = 0;
+  size_t len;
+
+  result->op_type = CS_TYPE_STRING;
+  result->s = "";
+
+  err = cs_arg_parse(parse, args, "sii", &s, &b, &e);
+  if (err) return nerr_pass(err);
+  /* If null, return empty string */
+  if (s == NULL) return STATUS_OK;
+  len = strlen(s);
+  if (b < 0 && e == 0) e = len;
+  if (b < 0) b += len;
+  if (b < 0) b = 0;
+  if (b > len) b = len;
+  if (e < 0) e += len;
+  if (e < 0) e = 0;
+  if (e > len) e = len;
+  /* Its the whole string */
+  if (b == 0 && e == len)
+  {
+    result->s = s;
+    result->alloc = 1;
+    return STATUS_OK;
+  }
+  if (e < b) b = e;
+  if (b == e)
+  {
+    /* If null, return empty string */
+    free(s);
+    return STATUS_OK;
+  }
+  slice = (char *) malloc (sizeof(char) * (e-b+1));
+  if (slice == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to allocate memory for string slice");
+  strncpy(slice, s + b, e-b);
+  free(s);
+  slice[e-b] = '\0';
+
+  result->s = slice;
+  result->alloc = 1;
+
+  return STATUS_OK;
+}
+
+static NEOERR * _builtin_str_tolower (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+{
+  NEOERR *err;
+  char *s = NULL;
+
+  result->op_type = CS_TYPE_STRING;
+  result->s = "";
+
+  err = cs_arg_parse(parse, args, "s", &s);
+  if (err) return nerr_pass(err);
+  /* If null, return empty string */
+  if (s == NULL) return STATUS_OK;
+
+  neos_lower(s);
+  result->s = s;
+  result->alloc = 1;
+
+  return STATUS_OK;
+}
+
+#ifdef ENABLE_GETTEXT
+static NEOERR * _builtin_gettext(CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+{
+  NEOERR *err;
+  char *s;
+  CSARG val;
+
+  memset(&val, 0, sizeof(val));
+  err = eval_expr(parse, args, &val);
+  if (err) return nerr_pass(err);
+
+  result->op_type = CS_TYPE_STRING;
+  result->s = "";
+
+  if (val.op_type & (CS_TYPE_VAR | CS_TYPE_STRING))
+  {
+    s = arg_eval(parse, &val);
+    if (s)
+    {
+      result->s = gettext(s);
+    }
+  }
+  if (val.alloc) free(val.s);
+  return STATUS_OK;
+}
+#endif
+
+static NEOERR * _str_func_wrapper (CSPARSE *parse, CS_FUNCTION *csf, CSARG *args, CSARG *result)
+{
+  NEOERR *err;
+  char *s;
+  CSARG val;
+
+  memset(&val, 0, sizeof(val));
+  err = eval_expr(parse, args, &val);
+  if (err) return nerr_pass(err);
+
+  if (val.op_type & (CS_TYPE_VAR | CS_TYPE_STRING))
+  {
+    result->op_type = CS_TYPE_STRING;
+    result->n = 0;
+
+    s = arg_eval(parse, &val);
+    if (s)
+    {
+      err = csf->str_func(s, &(result->s));
+      if (err) return nerr_pass(err);
+      result->alloc = 1;
+    }
+  }
+  else
+  {
+    result->op_type = val.op_type;
+    result->n = val.n;
+    result->s = val.s;
+    result->alloc = val.alloc;
+    val.alloc = 0;
+  }
+  if (val.alloc) free(val.s);
+  return STATUS_OK;
+}
+
+NEOERR *cs_register_strfunc(CSPARSE *parse, char *funcname, CSSTRFUNC str_func)
+{
+  NEOERR *err;
+
+  err = cs_register_function(parse, funcname, 1, _str_func_wrapper);
+  if (err) return nerr_pass(err);
+  parse->functions->str_func = str_func;
+
+  return STATUS_OK;
+}
+
+NEOERR *cs_register_esc_strfunc(CSPARSE *parse, char *funcname,
+                                CSSTRFUNC str_func)
+{
+  NEOERR *err;
+
+  err = cs_register_strfunc(parse, funcname, str_func);
+  if (err) return nerr_pass(err);
+  parse->functions->escape = NEOS_ESCAPE_FUNCTION;
+
+  return STATUS_OK;
+}
+
+/* **** CS Initialize/Destroy ************************************ */
+NEOERR *cs_init (CSPARSE **parse, HDF *hdf) {
+  return nerr_pass(cs_init_internal(parse, hdf, NULL));
+}
+
+static NEOERR *cs_init_internal (CSPARSE **parse, HDF *hdf, CSPARSE *parent)
+{
+  NEOERR *err = STATUS_OK;
+  CSPARSE *my_parse;
+  STACK_ENTRY *entry;
+  char *esc_value;
+  CS_ESCAPE_MODES *esc_cursor;
+
+  err = nerr_init();
+  if (err != STATUS_OK) return nerr_pass (err);
+
+  my_parse = (CSPARSE *) calloc (1, sizeof (CSPARSE));
+  if (my_parse == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for CSPARSE");
+
+  err = uListInit (&(my_parse->stack), 10, 0);
+  if (err != STATUS_OK)
+  {
+    free(my_parse);
+    return nerr_pass(err);
+  }
+  err = uListInit (&(my_parse->alloc), 10, 0);
+  if (err != STATUS_OK)
+  {
+    free(my_parse);
+    return nerr_pass(err);
+  }
+  err = alloc_node (&(my_parse->tree), my_parse);
+  if (err != STATUS_OK)
+  {
+    cs_destroy (&my_parse);
+    return nerr_pass(err);
+  }
+  my_parse->current = my_parse->tree;
+  my_parse->next = &(my_parse->current->next);
+
+  entry = (STACK_ENTRY *) calloc (1, sizeof (STACK_ENTRY));
+  if (entry == NULL)
+  {
+    cs_destroy (&my_parse);
+    return nerr_raise (NERR_NOMEM,
+	"Unable to allocate memory for stack entry");
+  }
+  entry->state = ST_GLOBAL;
+  entry->tree = my_parse->current;
+  entry->location = 0;
+  entry->escape = NEOS_ESCAPE_UNDEF;
+  err = uListAppend(my_parse->stack, entry);
+  if (err != STATUS_OK) {
+    free (entry);
+    cs_destroy(&my_parse);
+    return nerr_pass(err);
+  }
+  my_parse->tag = hdf_get_value(hdf, "Config.TagStart", "cs");
+  my_parse->taglen = strlen(my_parse->tag);
+  my_parse->hdf = hdf;
+
+  /* Let's set the default escape data */
+  my_parse->escaping.current = NEOS_ESCAPE_UNDEF;
+  my_parse->escaping.next_stack = NEOS_ESCAPE_UNDEF;
+  my_parse->escaping.when_undef = NEOS_ESCAPE_UNDEF;
+  my_parse->escaping.is_modified = 1;
+
+  /* See CS_ESCAPE_MODES. 0 is "undef" */
+  esc_value = hdf_get_value(hdf, "Config.VarEscapeMode", EscapeModes[0].mode);
+  /* Let's ensure the specified escape mode is valid and proceed */
+  for (esc_cursor = &EscapeModes[0];
+       esc_cursor->mode != NULL;
+       esc_cursor++)
+    if (!strcmp(esc_value, esc_cursor->mode))
+    {
+      my_parse->escaping.next_stack = esc_cursor->context;
+      entry->escape = esc_cursor->context;
+      break;
+    }
+  /* Didn't find an acceptable value we were looking for */
+  if (esc_cursor->mode == NULL) {
+    cs_destroy (&my_parse);
+    return nerr_raise (NERR_OUTOFRANGE,
+      "Invalid HDF value for Config.VarEscapeMode (none,html,js,url): %s",
+      esc_value);
+  }
+
+  /* Read configuration value to determine whether to enable audit mode */
+  my_parse->audit_mode = hdf_get_int_value(hdf, "Config.EnableAuditMode", 0);
+
+  my_parse->err_list = NULL;
+
+  if (parent == NULL)
+  {
+    static struct _builtin_functions {
+      const char *name;
+      int nargs;
+      CSFUNCTION function;
+    } Builtins[] = {
+      { "len", 1, _builtin_subcount },
+      { "subcount", 1, _builtin_subcount },
+      { "name", 1, _builtin_name },
+      { "first", 1, _builtin_first },
+      { "last", 1, _builtin_last },
+      { "abs", 1, _builtin_abs },
+      { "max", 2, _builtin_max },
+      { "min", 2, _builtin_min },
+      { "string.find", 2, _builtin_str_find },
+      { "string.slice", 3, _builtin_str_slice },
+      { "string.length", 1, _builtin_str_length },
+      { "string.crc", 1, _builtin_str_crc},
+      { "string.tolower", 1, _builtin_str_tolower},
+#ifdef ENABLE_GETTEXT
+      { "_", 1, _builtin_gettext },
+#endif
+      { NULL, 0, NULL },
+    };
+    int x = 0;
+    while (Builtins[x].name != NULL) {
+      err = cs_register_function(my_parse, Builtins[x].name, Builtins[x].nargs,
+                               Builtins[x].function);
+      if (err)
+      {
+        cs_destroy(&my_parse);
+        return nerr_pass(err);
+      }
+      x++;
+    }
+    /* Set global_hdf to be null */
+    my_parse->global_hdf = NULL;
+    my_parse->parent = NULL;
+    my_parse->stack_depth = 0;
+
+    my_parse->file_list = NULL;
+    my_parse->cur_file_idx = -1;
+
+    /* Set these variables to -1 to indicate "undefined" */
+    my_parse->auto_ctx.global_enabled = -1;
+    my_parse->auto_ctx.enabled = -1;
+    my_parse->auto_ctx.parser_ctx = NULL;
+    my_parse->auto_ctx.log_changes = 0;
+    my_parse->auto_ctx.propagate_status = 0;
+  }
+  else
+  {
+    /* TODO: macros and functions should actually not be duplicated, they
+     * should just be modified in lookup to walk the CS struct hierarchy we're
+     * creating here */
+    /* BUG: We currently can't copy the macros because they reference the parse
+     * tree, so if this sub-parse tree adds a macro, the macro reference will
+     * persist, but the parse tree it points to will be gone when the sub-parse
+     * is gone. */
+    my_parse->functions = parent->functions;
+    my_parse->global_hdf = parent->global_hdf;
+    my_parse->fileload = parent->fileload;
+    my_parse->fileload_ctx = parent->fileload_ctx;
+    /* This should be safe since locals handling is done entirely local to the
+     * eval functions, not globally by the parse handling.  This should
+     * pass the locals down to the new parse context to make locals work with
+     * lvar */
+    my_parse->locals = parent->locals;
+    my_parse->parent = parent;
+    my_parse->stack_depth = parent->stack_depth;
 
-  err = uListInit (&(my_parse->stack), 10, 0);
-  if (err != STATUS_OK)
+    my_parse->file_list = parent->file_list;
+    my_parse->cur_file_idx = parent->cur_file_idx;
+
+    /* Copy the audit flag from parent */
+    my_parse->audit_mode = parent->audit_mode;
+
+    my_parse->auto_ctx.global_enabled = parent->auto_ctx.global_enabled;
+    my_parse->auto_ctx.enabled = parent->auto_ctx.enabled;
+    my_parse->auto_ctx.parser_ctx = parent->auto_ctx.parser_ctx;
+    my_parse->auto_ctx.log_changes = parent->auto_ctx.log_changes;
+    my_parse->auto_ctx.propagate_status = parent->auto_ctx.propagate_status;
+  }
+
+  *parse = my_parse;
+  return STATUS_OK;
+}
+
+NEOERR *cs_render_init (CSPARSE **render, CSPARSE *parse, HDF *hdf)
+{
+  NEOERR *err;
+  CSPARSE *my_render;
+  char *fname;
+  int x;
+
+  *render = NULL;
+  if (parse == NULL)
+    return nerr_raise (NERR_ASSERT, "parse is NULL");
+
+  /* All of the render contexts share the original parse */
+  if (parse->program != NULL)
+    parse = parse->program;
+
+  my_render = (CSPARSE *) calloc (1, sizeof (CSPARSE));
+  if (my_render == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for CSPARSE");
+
+  my_render->program = parse;
+  my_render->code = parse->code;
+  my_render->tree = parse->tree;
+  my_render->macros = parse->macros;
+  my_render->functions = parse->functions;
+
+  my_render->hdf = hdf;
+  my_render->global_hdf = parse->global_hdf;
+  my_render->fileload = parse->fileload;
+  my_render->fileload_ctx = parse->fileload_ctx;
+  my_render->tag = parse->tag;
+  my_render->taglen = parse->taglen;
+  my_render->audit_mode = parse->audit_mode;
+  my_render->escaping = parse->escaping;
+
+  my_render->auto_ctx = parse->auto_ctx;
+  my_render->auto_ctx.parser_ctx = NULL;
+
+  my_render->cur_file_idx = parse->cur_file_idx;
+  if (parse->auto_ctx.log_changes)
+  {
+    /* lvar and linclude append to the file list while rendering, so each
+     * render context needs its own copy */
+    err = uListInit (&(my_render->file_list), 10, 0);
+    if (err)
+    {
+      free(my_render);
+      return nerr_pass(err);
+    }
+    for (x = 0; x < uListLength(parse->file_list); x++)
+    {
+      err = uListGet (parse->file_list, x, (void *)&fname);
+      if (err) break;
+      fname = strdup(fname);
+      if (fname == NULL)
+      {
+        err = nerr_raise (NERR_NOMEM,
+            "Unable to allocate memory for render file list");
+        break;
+      }
+      err = uListAppend (my_render->file_list, fname);
+      if (err)
+      {
+        free(fname);
+        break;
+      }
+    }
+    if (err)
+    {
+      cs_destroy(&my_render);
+      return nerr_pass(err);
+    }
+  }
+  else
+  {
+    my_render->file_list = parse->file_list;
+  }
+
+  *render = my_render;
+  return STATUS_OK;
+}
+
+void cs_register_fileload(CSPARSE *parse, void *ctx, CSFILELOAD fileload) {
+  if (parse != NULL) {
+    parse->fileload_ctx = ctx;
+    parse->fileload = fileload;
+  }
+}
+
+void cs_destroy (CSPARSE **parse)
+{
+  CSPARSE *my_parse = *parse;
+
+  if (my_parse == NULL)
+    return;
+
+  uListDestroy (&(my_parse->stack), ULIST_FREE);
+  uListDestroy (&(my_parse->alloc), ULIST_FREE);
+  cache_hash_retire_all (&(my_parse->lincludes));
+  if (my_parse->lookup_cache) free(my_parse->lookup_cache);
+  scratch_destroy (&(my_parse->scratch));
+
+  /* Render contexts don't own the parse tree, macros or functions */
+  if (my_parse->program == NULL)
+  {
+    dealloc_macro(&my_parse->macros);
+    dealloc_node(&(my_parse->tree));
+    dealloc_code(&(my_parse->code));
+    if (my_parse->auto_trace)
+    {
+      auto_trace_clear(my_parse->auto_trace);
+      free(my_parse->auto_trace);
+    }
+  }
+  if (my_parse->parent == NULL) {
+    if (my_parse->program == NULL)
+      dealloc_function(&(my_parse->functions));
+
+    if (my_parse->auto_ctx.log_changes)
+      uListDestroy (&(my_parse->file_list), ULIST_FREE);
+
+    if (my_parse->auto_ctx.parser_ctx)
+      neos_auto_destroy(&(my_parse->auto_ctx.parser_ctx));
+  }
+
+  /* Free list of errors */
+  if (my_parse->err_list != NULL) {
+    CS_ERROR *ptr;
+
+    while (my_parse->err_list) {
+      ptr = my_parse->err_list->next;
+      free(my_parse->err_list->err);
+      free(my_parse->err_list);
+      my_parse->err_list = ptr;
+    }
+  }
+
+  free(my_parse);
+  *parse = NULL;
+}
+
+/* **** CS Template Cache ***************************************** */
+
+/* Process wide cache of parsed templates, see cache_key.  TemplateCache
+ * and the refs and stale flags of its entries are guarded by CacheLock. */
+static NE_HASH *TemplateCache = NULL;
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t CacheLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static NEOERR *cache_lock (void)
+{
+#ifdef HAVE_PTHREADS
+  return nerr_pass(mLock(&CacheLock));
+#else
+  return STATUS_OK;
+#endif
+}
+
+static void cache_unlock (void)
+{
+#ifdef HAVE_PTHREADS
+  NEOERR *err;
+
+  err = mUnlock(&CacheLock);
+  nerr_ignore(&err);
+#endif
+}
+
+static NEOERR *cache_add_file (CS_CACHE_ENTRY *entry, const char *path)
+{
+  CS_CACHE_FILE *file;
+  struct stat s;
+
+  if (stat(path, &s) == -1)
+  {
+    /* Let ne_load_file report the error */
+    entry->uncacheable = 1;
+    return STATUS_OK;
+  }
+
+  file = (CS_CACHE_FILE *) calloc (1, sizeof (CS_CACHE_FILE));
+  if (file == NULL)
+    return nerr_raise (NERR_NOMEM,
+        "Unable to allocate memory for template cache file %s", path);
+  file->path = strdup(path);
+  if (file->path == NULL)
+  {
+    free(file);
+    return nerr_raise (NERR_NOMEM,
+        "Unable to allocate memory for template cache file %s", path);
+  }
+  file->mtime = s.st_mtime;
+  file->size = s.st_size;
+  file->next = entry->files;
+  entry->files = file;
+  return STATUS_OK;
+}
+
+static NEOERR *cache_entry_new (const char *key, CS_CACHE_ENTRY **entry)
+{
+  CS_CACHE_ENTRY *my_entry;
+
+  *entry = NULL;
+  my_entry = (CS_CACHE_ENTRY *) calloc (1, sizeof (CS_CACHE_ENTRY));
+  if (my_entry == NULL)
+    return nerr_raise (NERR_NOMEM,
+        "Unable to allocate memory for template cache entry");
+  my_entry->key = strdup(key);
+  if (my_entry->key == NULL)
+  {
+    free(my_entry);
+    return nerr_raise (NERR_NOMEM,
+        "Unable to allocate memory for template cache entry");
+  }
+  *entry = my_entry;
+  return STATUS_OK;
+}
+
+static int cache_entry_is_fresh (CS_CACHE_ENTRY *entry)
+{
+  CS_CACHE_FILE *file;
+  struct stat s;
+
+  for (file = entry->files; file != NULL; file = file->next)
+  {
+    if (stat(file->path, &s) == -1)
+      return 0;
+    if (s.st_mtime != file->mtime || s.st_size != file->size)
+      return 0;
+  }
+  return 1;
+}
+
+static void cache_entry_destroy (CS_CACHE_ENTRY **entry)
+{
+  CS_CACHE_ENTRY *my_entry = *entry;
+  CS_CACHE_FILE *file;
+
+  if (my_entry == NULL)
+    return;
+
+  while (my_entry->files != NULL)
+  {
+    file = my_entry->files;
+    my_entry->files = file->next;
+    free(file->path);
+    free(file);
+  }
+  if (my_entry->parse)
+  {
+    my_entry->parse->cache_entry = NULL;
+    cs_destroy(&(my_entry->parse));
+  }
+  free(my_entry->key);
+  free(my_entry);
+  *entry = NULL;
+}
+
+/* Remove an entry from use, it is destroyed once the last user releases it */
+static void cache_entry_retire (CS_CACHE_ENTRY *entry)
+{
+  entry->stale = 1;
+  if (entry->refs <= 0)
+    cache_entry_destroy(&entry);
+}
+
+/* The template cache key: the resolved path and everything else the
+ * parse tree depends on, which is the HDF settings read by cs_init and the
+ * parser, and the init callback, which can register functions and set
+ * the global HDF.  Strings are prefixed with their length so that no
+ * two keys can run together. */
+static NEOERR *cache_key (HDF *hdf, const char *path, void *ctx,
+                          CSCACHEINIT init, char **key)
+{
+  const char *tag, *esc;
+
+  tag = hdf_get_value (hdf, "Config.TagStart", "cs");
+  esc = hdf_get_value (hdf, "Config.VarEscapeMode", EscapeModes[0].mode);
+  *key = sprintf_alloc ("%d:%s %d:%s %d:%s %d %d %d %d %p %p",
+      (int) strlen(path), path, (int) strlen(tag), tag,
+      (int) strlen(esc), esc,
+      hdf_get_int_value (hdf, "Config.AutoEscape", 0),
+      hdf_get_int_value (hdf, "Config.LogAutoEscape", 0),
+      hdf_get_int_value (hdf, "Config.PropagateEscapeStatus", 0),
+      hdf_get_int_value (hdf, "Config.EnableAuditMode", 0),
+      (void *) init, ctx);
+  if (*key == NULL)
+    return nerr_raise (NERR_NOMEM,
+        "Unable to allocate memory for template cache key");
+  return STATUS_OK;
+}
+
+/* Finds the entry for key and takes a reference on it.  check is set if
+ * its files are due to be checked for changes, which the caller does
+ * without the lock; the entry counts as checked from now on, so other
+ * threads don't check it as well.  Must be called with the lock held. */
+static CS_CACHE_ENTRY *cache_lookup (const char *key, int interval,
+                                     int *check)
+{
+  CS_CACHE_ENTRY *entry;
+  time_t now;
+
+  *check = 0;
+  if (TemplateCache == NULL)
+    return NULL;
+  entry = (CS_CACHE_ENTRY *) ne_hash_lookup (TemplateCache, (void *)key);
+  if (entry == NULL)
+    return NULL;
+  entry->refs++;
+  now = time(NULL);
+  if (interval <= 0 || now - entry->checked_at >= interval)
+  {
+    entry->checked_at = now;
+    *check = 1;
+  }
+  return entry;
+}
+
+/* Takes an entry out of the cache, if it is still in it, and returns
+ * whether it is no longer used, in which case the caller destroys it once
+ * the lock is released.  Must be called with the lock held. */
+static int cache_unlink (CS_CACHE_ENTRY *entry)
+{
+  /* Entries are only marked stale when they leave the cache */
+  if (!entry->stale)
+  {
+    ne_hash_remove (TemplateCache, entry->key);
+    entry->stale = 1;
+  }
+  return (entry->refs <= 0);
+}
+
+/* Adds a new entry and takes a reference on it.  Another thread may have
+ * parsed the same template in the meantime; ours replaces it, and old is
+ * set if that needs destroying once the lock is released.  Must be called
+ * with the lock held. */
+static NEOERR *cache_insert (CS_CACHE_ENTRY *entry, CS_CACHE_ENTRY **old)
+{
+  NEOERR *err;
+  CS_CACHE_ENTRY *other;
+
+  *old = NULL;
+  if (TemplateCache == NULL)
+  {
+    err = ne_hash_init (&TemplateCache, ne_hash_str_hash, ne_hash_str_comp);
+    if (err) return nerr_pass(err);
+  }
+  other = (CS_CACHE_ENTRY *) ne_hash_lookup (TemplateCache, entry->key);
+  if (other != NULL && cache_unlink (other))
+    *old = other;
+  err = ne_hash_insert (TemplateCache, entry->key, entry);
+  if (err) return nerr_pass(err);
+  entry->checked_at = time(NULL);
+  entry->refs++;
+  return STATUS_OK;
+}
+
+/* A new parse for the template cache, set up by the init callback */
+static NEOERR *cache_parse_init (HDF *hdf, void *ctx, CSCACHEINIT init,
+                                 CSPARSE **parse)
+{
+  NEOERR *err;
+
+  err = cs_init (parse, hdf);
+  if (err) return nerr_pass(err);
+  if (init)
+  {
+    err = init (ctx, *parse);
+    if (err)
+    {
+      cs_destroy (parse);
+      return nerr_pass(err);
+    }
+  }
+  return STATUS_OK;
+}
+
+NEOERR *cs_cache_get (HDF *hdf, const char *path, void *ctx, CSCACHEINIT init,
+                      CSPARSE **parse)
+{
+  NEOERR *err;
+  CS_CACHE_ENTRY *entry, *old;
+  CSPARSE *my_parse = NULL;
+  char fpath[PATH_BUF_SIZE];
+  char *key;
+  int check, last;
+
+  *parse = NULL;
+  if (path == NULL)
+    return nerr_raise (NERR_ASSERT, "path is NULL");
+
+  /* Precompiled templates are cached by name, and never go stale */
+  if (path[0] != '/' && precompiled_find (path) == NULL)
+  {
+    /* Search the same load paths as cs_parse_file, falling back on the
+     * global HDF's.  That is only known once init has set up a parse, so
+     * it takes making the parse we'd need on a miss. */
+    err = hdf_search_path_probe (hdf, path, fpath, PATH_BUF_SIZE);
+    if (nerr_handle(&err, NERR_NOT_FOUND))
+    {
+      err = cache_parse_init (hdf, ctx, init, &my_parse);
+      if (err) return nerr_pass(err);
+      if (my_parse->global_hdf)
+        err = hdf_search_path_probe (my_parse->global_hdf, path, fpath,
+                                     PATH_BUF_SIZE);
+      else
+        err = nerr_raise_static (NERR_NOT_FOUND);
+    }
+    if (err != STATUS_OK)
+    {
+      cs_destroy (&my_parse);
+      return nerr_pass_ctx(err, "Unable to find %s", path);
+    }
+    path = fpath;
+  }
+
+  err = cache_key (hdf, path, ctx, init, &key);
+  if (err)
+  {
+    cs_destroy (&my_parse);
+    return nerr_pass(err);
+  }
+
+  err = cache_lock ();
+  if (err)
+  {
+    free(key);
+    cs_destroy (&my_parse);
+    return nerr_pass(err);
+  }
+  entry = cache_lookup (key, hdf_get_int_value (hdf,
+                        "Config.TemplateCacheCheckInterval", 1), &check);
+  cache_unlock ();
+
+  /* Stat the files without holding the lock, since every thread using the
+   * cache needs it */
+  if (entry != NULL && check && !cache_entry_is_fresh (entry))
+  {
+    err = cache_lock ();
+    if (err)
+    {
+      free(key);
+      cs_destroy (&my_parse);
+      return nerr_pass(err);
+    }
+    entry->refs--;
+    last = cache_unlink (entry);
+    cache_unlock ();
+    if (last)
+      cache_entry_destroy (&entry);
+    entry = NULL;
+  }
+  if (entry != NULL)
+  {
+    free(key);
+    cs_destroy (&my_parse);
+    *parse = entry->parse;
+    return STATUS_OK;
+  }
+
+  /* Parse without holding the lock, so other templates can be fetched
+   * meanwhile */
+  err = cache_entry_new (key, &entry);
+  free(key);
+  if (err)
+  {
+    cs_destroy (&my_parse);
+    return nerr_pass(err);
+  }
+
+  do
+  {
+    if (my_parse == NULL)
+    {
+      err = cache_parse_init (hdf, ctx, init, &my_parse);
+      if (err) break;
+    }
+    my_parse->cache_entry = entry;
+    err = cs_parse_file (my_parse, path);
+    if (err) break;
+    err = cs_optimize (my_parse, NULL, NULL);
+    if (err) break;
+    err = cs_compile (my_parse);
+    if (err) break;
+  } while (0);
+
+  if (err)
   {
-    free(my_parse);
+    if (my_parse) my_parse->cache_entry = NULL;
+    cs_destroy (&my_parse);
+    cache_entry_destroy (&entry);
     return nerr_pass(err);
   }
-  err = uListInit (&(my_parse->alloc), 10, 0);
-  if (err != STATUS_OK)
+
+  /* The parse tree outlives this HDF, cs_render_cached provides one for
+   * each render.  The tag string belongs to the HDF as well, but is only
+   * used while parsing. */
+  my_parse->hdf = NULL;
+  my_parse->tag = NULL;
+
+  if (entry->uncacheable)
   {
-    free(my_parse);
-    return nerr_pass(err);
+    my_parse->cache_entry = NULL;
+    cache_entry_destroy (&entry);
+    *parse = my_parse;
+    return STATUS_OK;
   }
-  err = alloc_node (&(my_parse->tree), my_parse);
-  if (err != STATUS_OK)
+
+  entry->parse = my_parse;
+  err = cache_lock ();
+  if (err == STATUS_OK)
   {
-    cs_destroy (&my_parse);
+    err = cache_insert (entry, &old);
+    cache_unlock ();
+    cache_entry_destroy (&old);
+  }
+  if (err)
+  {
+    cache_entry_destroy (&entry);
     return nerr_pass(err);
   }
-  my_parse->current = my_parse->tree;
-  my_parse->next = &(my_parse->current->next);
+  *parse = my_parse;
+  return STATUS_OK;
+}
 
-  entry = (STACK_ENTRY *) calloc (1, sizeof (STACK_ENTRY));
+NEOERR *cs_render_cached (CSPARSE *parse, HDF *hdf, void *ctx, CSOUTFUNC cb)
+{
+  NEOERR *err;
+  CSPARSE *render = NULL;
+
+  err = cs_render_init (&render, parse, hdf);
+  if (err) return nerr_pass(err);
+  err = cs_render (render, ctx, cb);
+  cs_destroy (&render);
+
+  return nerr_pass(err);
+}
+
+void cs_cache_release (CSPARSE **parse)
+{
+  NEOERR *err;
+  CSPARSE *my_parse = *parse;
+  CS_CACHE_ENTRY *entry;
+  int last;
+
+  if (my_parse == NULL)
+    return;
+
+  entry = my_parse->cache_entry;
   if (entry == NULL)
   {
-    cs_destroy (&my_parse);
-    return nerr_raise (NERR_NOMEM,
-	"Unable to allocate memory for stack entry");
+    cs_destroy(parse);
+    return;
   }
-  entry->state = ST_GLOBAL;
-  entry->tree = my_parse->current;
-  entry->location = 0;
-  entry->escape = NEOS_ESCAPE_UNDEF;
-  err = uListAppend(my_parse->stack, entry);
-  if (err != STATUS_OK) {
-    free (entry);
-    cs_destroy(&my_parse);
-    return nerr_pass(err);
+  *parse = NULL;
+
+  err = cache_lock ();
+  if (err)
+  {
+    nerr_ignore(&err);
+    return;
   }
-  my_parse->tag = hdf_get_value(hdf, "Config.TagStart", "cs");
-  my_parse->taglen = strlen(my_parse->tag);
-  my_parse->hdf = hdf;
+  entry->refs--;
+  last = (entry->stale && entry->refs <= 0);
+  cache_unlock ();
+  if (last)
+    cache_entry_destroy(&entry);
+}
 
-  /* Let's set the default escape data */
-  my_parse->escaping.current = NEOS_ESCAPE_UNDEF;
-  my_parse->escaping.next_stack = NEOS_ESCAPE_UNDEF;
-  my_parse->escaping.when_undef = NEOS_ESCAPE_UNDEF;
-  my_parse->escaping.is_modified = 1;
+static void cache_hash_retire_all (NE_HASH **hash)
+{
+  CS_CACHE_ENTRY *entry, *retired = NULL;
+  void *key = NULL;
 
-  /* See CS_ESCAPE_MODES. 0 is "undef" */
-  esc_value = hdf_get_value(hdf, "Config.VarEscapeMode", EscapeModes[0].mode);
-  /* Let's ensure the specified escape mode is valid and proceed */
-  for (esc_cursor = &EscapeModes[0];
-       esc_cursor->mode != NULL;
-       esc_cursor++)
-    if (!strcmp(esc_value, esc_cursor->mode))
-    {
-      my_parse->escaping.next_stack = esc_cursor->context;
-      entry->escape = esc_cursor->context;
-      break;
-    }
-  /* Didn't find an acceptable value we were looking for */
-  if (esc_cursor->mode == NULL) {
-    cs_destroy (&my_parse);
-    return nerr_raise (NERR_OUTOFRANGE,
-      "Invalid HDF value for Config.VarEscapeMode (none,html,js,url): %s",
-      esc_value);
+  if (*hash == NULL)
+    return;
+
+  /* The keys belong to the entries, so empty the hash before retiring them */
+  while ((entry = (CS_CACHE_ENTRY *) ne_hash_next (*hash, &key)))
+  {
+    entry->next = retired;
+    retired = entry;
   }
+  ne_hash_destroy (hash);
 
-  /* Read configuration value to determine whether to enable audit mode */
-  my_parse->audit_mode = hdf_get_int_value(hdf, "Config.EnableAuditMode", 0);
+  while (retired != NULL)
+  {
+    entry = retired;
+    retired = entry->next;
+    cache_entry_retire (entry);
+  }
+}
 
-  my_parse->err_list = NULL;
+void cs_cache_clear (void)
+{
+  NEOERR *err;
 
-  if (parent == NULL)
+  err = cache_lock ();
+  if (err)
   {
-    static struct _builtin_functions {
-      const char *name;
-      int nargs;
-      CSFUNCTION function;
-    } Builtins[] = {
-      { "len", 1, _builtin_subcount },
-      { "subcount", 1, _builtin_subcount },
-      { "name", 1, _builtin_name },
-      { "first", 1, _builtin_first },
-      { "last", 1, _builtin_last },
-      { "abs", 1, _builtin_abs },
-      { "max", 2, _builtin_max },
-      { "min", 2, _builtin_min },
-      { "string.find", 2, _builtin_str_find },
-      { "string.slice", 3, _builtin_str_slice },
-      { "string.length", 1, _builtin_str_length },
-      { "string.crc", 1, _builtin_str_crc},
-      { "string.tolower", 1, _builtin_str_tolower},
-#ifdef ENABLE_GETTEXT
-      { "_", 1, _builtin_gettext },
-#endif
-      { NULL, 0, NULL },
-    };
-    int x = 0;
-    while (Builtins[x].name != NULL) {
-      err = cs_register_function(my_parse, Builtins[x].name, Builtins[x].nargs,
-                               Builtins[x].function);
-      if (err)
-      {
-        cs_destroy(&my_parse);
-        return nerr_pass(err);
-      }
-      x++;
-    }
-    /* Set global_hdf to be null */
-    my_parse->global_hdf = NULL;
-    my_parse->parent = NULL;
-    my_parse->stack_depth = 0;
+    nerr_ignore(&err);
+    return;
+  }
+  cache_hash_retire_all (&TemplateCache);
+  cache_unlock ();
+}
 
-    my_parse->file_list = NULL;
-    my_parse->cur_file_idx = -1;
+/* **** CS Precompiled Templates ********************************** */
 
-    /* Set these variables to -1 to indicate "undefined" */
-    my_parse->auto_ctx.global_enabled = -1;
-    my_parse->auto_ctx.enabled = -1;
-    my_parse->auto_ctx.parser_ctx = NULL;
-    my_parse->auto_ctx.log_changes = 0;
-    my_parse->auto_ctx.propagate_status = 0;
+/* Templates registered with cs_register_precompiled, keyed by name */
+static NE_HASH *Precompiled = NULL;
+
+#define NUM_COMMANDS ((int) (sizeof(Commands) / sizeof(Commands[0])) - 1)
+
+/* The tables cs_precompile is building */
+typedef struct _precompile
+{
+  CSPARSE *parse;
+  CS_PRECOMPILED *pre;
+  STRING strings;
+  NE_HASH *string_offsets;      /* string -> 1 + its offset in strings */
+  int cmds[NUM_COMMANDS];       /* Commands index -> 1 + index in cmd_names */
+  int *cmd_names;
+  int max_cmd_names;
+  CS_PRECOMPILED_NODE *nodes;
+  int max_nodes;
+  CS_PRECOMPILED_ARG *args;
+  int max_args;
+  CS_PRECOMPILED_MACRO *macros;
+  CS_MACRO **macro_list;        /* parse->macros, in table order */
+} CS_PRECOMPILE;
+
+void cs_precompiled_destroy (CS_PRECOMPILED **pre)
+{
+  CS_PRECOMPILED *my_pre = *pre;
+
+  if (my_pre == NULL) return;
+  if (my_pre->name) free ((char *) my_pre->name);
+  if (my_pre->tag) free ((char *) my_pre->tag);
+  if (my_pre->strings) free ((char *) my_pre->strings);
+  if (my_pre->cmds) free ((int *) my_pre->cmds);
+  if (my_pre->nodes) free ((CS_PRECOMPILED_NODE *) my_pre->nodes);
+  if (my_pre->args) free ((CS_PRECOMPILED_ARG *) my_pre->args);
+  if (my_pre->macros) free ((CS_PRECOMPILED_MACRO *) my_pre->macros);
+  free (my_pre);
+  *pre = NULL;
+}
+
+static NEOERR *precompile_string (CS_PRECOMPILE *pc, const char *s, int *off)
+{
+  NEOERR *err;
+  void *found;
+
+  *off = -1;
+  if (s == NULL) return STATUS_OK;
+  found = ne_hash_lookup (pc->string_offsets, (void *)s);
+  if (found != NULL)
+  {
+    *off = (int)(long) found - 1;
+    return STATUS_OK;
   }
-  else
+  *off = pc->strings.len;
+  /* Keep the NUL, the strings are stored back to back */
+  err = string_appendn (&(pc->strings), s, strlen(s) + 1);
+  if (err) return nerr_pass(err);
+  err = ne_hash_insert (pc->string_offsets, (void *)s, (void *)(long)(*off + 1));
+  if (err) return nerr_pass(err);
+  return STATUS_OK;
+}
+
+static NEOERR *precompile_cmd (CS_PRECOMPILE *pc, int cmd, int *idx)
+{
+  NEOERR *err;
+  CS_PRECOMPILED *pre = pc->pre;
+  int off;
+
+  if (cmd < 0 || cmd >= NUM_COMMANDS)
+    return nerr_raise (NERR_ASSERT, "Invalid command %d in parse tree", cmd);
+  if (pc->cmds[cmd] == 0)
   {
-    /* TODO: macros and functions should actually not be duplicated, they
-     * should just be modified in lookup to walk the CS struct hierarchy we're
-     * creating here */
-    /* BUG: We currently can't copy the macros because they reference the parse
-     * tree, so if this sub-parse tree adds a macro, the macro reference will
-     * persist, but the parse tree it points to will be gone when the sub-parse
-     * is gone. */
-    my_parse->functions = parent->functions;
-    my_parse->global_hdf = parent->global_hdf;
-    my_parse->fileload = parent->fileload;
-    my_parse->fileload_ctx = parent->fileload_ctx;
-    /* This should be safe since locals handling is done entirely local to the
-     * eval functions, not globally by the parse handling.  This should
-     * pass the locals down to the new parse context to make locals work with
-     * lvar */
-    my_parse->locals = parent->locals;
-    my_parse->parent = parent;
-    my_parse->stack_depth = parent->stack_depth;
+    err = code_grow ((void **)&(pc->cmd_names), &(pc->max_cmd_names),
+                     pre->num_cmds, 1, sizeof(int));
+    if (err) return nerr_pass(err);
+    err = precompile_string (pc, Commands[cmd].cmd, &off);
+    if (err) return nerr_pass(err);
+    pc->cmd_names[pre->num_cmds++] = off;
+    pc->cmds[cmd] = pre->num_cmds;
+  }
+  *idx = pc->cmds[cmd] - 1;
+  return STATUS_OK;
+}
 
-    my_parse->file_list = parent->file_list;
-    my_parse->cur_file_idx = parent->cur_file_idx;
+static int precompile_macro_index (CS_PRECOMPILE *pc, CS_MACRO *macro)
+{
+  int x;
+
+  for (x = 0; x < pc->pre->num_macros; x++)
+  {
+    if (pc->macro_list[x] == macro) return x;
+  }
+  return -1;
+}
+
+/* An arg and everything it points to, *idx is -1 for an unused arg */
+static NEOERR *precompile_arg (CS_PRECOMPILE *pc, CSARG *arg, int *idx)
+{
+  NEOERR *err;
+  CS_PRECOMPILED *pre = pc->pre;
+  CS_PRECOMPILED_ARG my_arg;
+  int x;
+
+  *idx = -1;
+  if (arg == NULL) return STATUS_OK;
+  if (arg->op_type == 0 && arg->s == NULL && arg->argexpr == NULL &&
+      arg->n == 0 && arg->escape_status == 0 && arg->function == NULL &&
+      arg->macro == NULL && arg->expr1 == NULL && arg->expr2 == NULL &&
+      arg->next == NULL)
+    return STATUS_OK;
+
+  /* Reserve this arg's entry first, so its children come after it */
+  err = code_grow ((void **)&(pc->args), &(pc->max_args), pre->num_args, 1,
+                   sizeof(CS_PRECOMPILED_ARG));
+  if (err) return nerr_pass(err);
+  x = pre->num_args++;
+
+  memset (&my_arg, 0, sizeof(my_arg));
+  my_arg.op_type = arg->op_type;
+  my_arg.n = arg->n;
+  my_arg.escape_status = arg->escape_status;
+  my_arg.path = arg->path != NULL;
+  err = precompile_string (pc, arg->s, &(my_arg.s));
+  if (err) return nerr_pass(err);
+  err = precompile_string (pc, arg->argexpr, &(my_arg.argexpr));
+  if (err) return nerr_pass(err);
+  err = precompile_string (pc, arg->function ? arg->function->name : NULL,
+                           &(my_arg.function));
+  if (err) return nerr_pass(err);
+  my_arg.macro = -1;
+  if (arg->macro != NULL)
+  {
+    my_arg.macro = precompile_macro_index (pc, arg->macro);
+    if (my_arg.macro == -1)
+      return nerr_raise (NERR_ASSERT, "Call of unknown macro %s",
+                         arg->macro->name);
+  }
+  err = precompile_arg (pc, arg->expr1, &(my_arg.expr1));
+  if (err) return nerr_pass(err);
+  err = precompile_arg (pc, arg->expr2, &(my_arg.expr2));
+  if (err) return nerr_pass(err);
+  err = precompile_arg (pc, arg->next, &(my_arg.next));
+  if (err) return nerr_pass(err);
+
+  pc->args[x] = my_arg;
+  *idx = x;
+  return STATUS_OK;
+}
+
+static NEOERR *precompile_list (CS_PRECOMPILE *pc, CSTREE *node, int *first);
+
+static NEOERR *precompile_node (CS_PRECOMPILE *pc, CSTREE *node, int x,
+                                int last)
+{
+  NEOERR *err;
+  CS_PRECOMPILED_NODE my_node;
+  int m;
+
+  memset (&my_node, 0, sizeof(my_node));
+  err = precompile_cmd (pc, node->cmd, &(my_node.cmd));
+  if (err) return nerr_pass(err);
+  my_node.flags = node->flags;
+  my_node.escape = node->escape;
+  my_node.do_autoescape = node->do_autoescape;
+  err = precompile_arg (pc, &(node->arg1), &(my_node.arg1));
+  if (err) return nerr_pass(err);
+  err = precompile_arg (pc, &(node->arg2), &(my_node.arg2));
+  if (err) return nerr_pass(err);
+  err = precompile_arg (pc, node->vargs, &(my_node.vargs));
+  if (err) return nerr_pass(err);
+  err = precompile_list (pc, node->case_0, &(my_node.case_0));
+  if (err) return nerr_pass(err);
+  err = precompile_list (pc, node->case_1, &(my_node.case_1));
+  if (err) return nerr_pass(err);
+  my_node.next = last ? -1 : x + 1;
+
+  for (m = 0; m < pc->pre->num_macros; m++)
+  {
+    if (pc->macro_list[m]->tree == node) pc->macros[m].tree = x;
+  }
+  pc->nodes[x] = my_node;
+  return STATUS_OK;
+}
+
+/* The nodes of a list get consecutive entries, so only the nesting in
+ * case_0 and case_1 recurses */
+static NEOERR *precompile_list (CS_PRECOMPILE *pc, CSTREE *node, int *first)
+{
+  NEOERR *err;
+  CS_PRECOMPILED *pre = pc->pre;
+  CSTREE *n;
+  int count = 0;
+  int x;
+
+  *first = -1;
+  for (n = node; n != NULL; n = n->next)
+    count++;
+  if (count == 0) return STATUS_OK;
+
+  err = code_grow ((void **)&(pc->nodes), &(pc->max_nodes), pre->num_nodes,
+                   count, sizeof(CS_PRECOMPILED_NODE));
+  if (err) return nerr_pass(err);
+  *first = pre->num_nodes;
+  pre->num_nodes += count;
+
+  for (n = node, x = *first; n != NULL; n = n->next, x++)
+  {
+    err = precompile_node (pc, n, x, n->next == NULL);
+    if (err) return nerr_pass(err);
+  }
+  return STATUS_OK;
+}
+
+static NEOERR *precompile_macros (CS_PRECOMPILE *pc)
+{
+  NEOERR *err;
+  CS_PRECOMPILED *pre = pc->pre;
+  CS_MACRO *macro;
+  int x;
 
-    /* Copy the audit flag from parent */
-    my_parse->audit_mode = parent->audit_mode;
+  for (macro = pc->parse->macros; macro != NULL; macro = macro->next)
+    pre->num_macros++;
+  if (pre->num_macros == 0) return STATUS_OK;
 
-    my_parse->auto_ctx.global_enabled = parent->auto_ctx.global_enabled;
-    my_parse->auto_ctx.enabled = parent->auto_ctx.enabled;
-    my_parse->auto_ctx.parser_ctx = parent->auto_ctx.parser_ctx;
-    my_parse->auto_ctx.log_changes = parent->auto_ctx.log_changes;
-    my_parse->auto_ctx.propagate_status = parent->auto_ctx.propagate_status;
+  pc->macros = (CS_PRECOMPILED_MACRO *) calloc (pre->num_macros,
+                                                sizeof(CS_PRECOMPILED_MACRO));
+  pc->macro_list = (CS_MACRO **) calloc (pre->num_macros, sizeof(CS_MACRO *));
+  if (pc->macros == NULL || pc->macro_list == NULL)
+    return nerr_raise (NERR_NOMEM,
+                       "Unable to allocate memory for precompiled macros");
+  for (macro = pc->parse->macros, x = 0; macro != NULL;
+       macro = macro->next, x++)
+    pc->macro_list[x] = macro;
+
+  /* The def nodes fill in tree */
+  for (x = 0; x < pre->num_macros; x++)
+  {
+    macro = pc->macro_list[x];
+    err = precompile_string (pc, macro->name, &(pc->macros[x].name));
+    if (err) return nerr_pass(err);
+    pc->macros[x].n_args = macro->n_args;
+    err = precompile_arg (pc, macro->args, &(pc->macros[x].args));
+    if (err) return nerr_pass(err);
+    pc->macros[x].tree = -1;
   }
+  return STATUS_OK;
+}
 
-  *parse = my_parse;
+NEOERR *cs_precompile (CSPARSE *parse, const char *name,
+                       CS_PRECOMPILED **pre)
+{
+  NEOERR *err;
+  CS_PRECOMPILE pc;
+  CS_PRECOMPILED *my_pre;
+  STACK_ENTRY *entry;
+  int first, x;
+
+  *pre = NULL;
+  if (parse->program)
+    return nerr_raise (NERR_ASSERT, "Can't precompile a render context");
+  if (name == NULL)
+    return nerr_raise (NERR_ASSERT, "name is NULL");
+  err = uListGet (parse->stack, 0, (void *)&entry);
+  if (err) return nerr_pass(err);
+
+  my_pre = (CS_PRECOMPILED *) calloc (1, sizeof(CS_PRECOMPILED));
+  if (my_pre == NULL)
+    return nerr_raise (NERR_NOMEM,
+                       "Unable to allocate memory for precompiled template");
+  memset (&pc, 0, sizeof(pc));
+  pc.parse = parse;
+  pc.pre = my_pre;
+  string_init (&(pc.strings));
+
+  do
+  {
+    my_pre->version = CS_PRECOMPILED_VERSION;
+    my_pre->auto_escape = parse->auto_ctx.global_enabled == 1;
+    my_pre->escape = entry->escape;
+    my_pre->name = strdup (name);
+    my_pre->tag = strdup (parse->tag ? parse->tag : "cs");
+    if (my_pre->name == NULL || my_pre->tag == NULL)
+    {
+      err = nerr_raise (NERR_NOMEM,
+                        "Unable to allocate memory for precompiled template");
+      break;
+    }
+    err = ne_hash_init (&(pc.string_offsets), ne_hash_str_hash,
+                        ne_hash_str_comp);
+    if (err) break;
+    err = precompile_macros (&pc);
+    if (err) break;
+    /* The root of the tree is an empty literal, the templates follow it */
+    err = precompile_list (&pc, parse->tree ? parse->tree->next : NULL, &first);
+    if (err) break;
+    for (x = 0; x < my_pre->num_macros; x++)
+    {
+      if (pc.macros[x].tree == -1)
+      {
+        err = nerr_raise (NERR_ASSERT, "Macro %s isn't defined in the tree",
+                          pc.macro_list[x]->name);
+        break;
+      }
+    }
+  } while (0);
+
+  ne_hash_destroy (&(pc.string_offsets));
+  if (pc.macro_list) free (pc.macro_list);
+  my_pre->strings = pc.strings.buf;
+  my_pre->strings_len = pc.strings.len;
+  my_pre->cmds = pc.cmd_names;
+  my_pre->nodes = pc.nodes;
+  my_pre->args = pc.args;
+  my_pre->macros = pc.macros;
+  if (err)
+  {
+    cs_precompiled_destroy (&my_pre);
+    return nerr_pass(err);
+  }
+  *pre = my_pre;
   return STATUS_OK;
 }
 
-void cs_register_fileload(CSPARSE *parse, void *ctx, CSFILELOAD fileload) {
-  if (parse != NULL) {
-    parse->fileload_ctx = ctx;
-    parse->fileload = fileload;
+NEOERR *cs_register_precompiled (const CS_PRECOMPILED **templates)
+{
+  NEOERR *err;
+  const CS_PRECOMPILED *found;
+  int x;
+
+  if (templates == NULL)
+  {
+    ne_hash_destroy (&Precompiled);
+    return STATUS_OK;
+  }
+  if (Precompiled == NULL)
+  {
+    err = ne_hash_init (&Precompiled, ne_hash_str_hash, ne_hash_str_comp);
+    if (err) return nerr_pass(err);
+  }
+  for (x = 0; templates[x] != NULL; x++)
+  {
+    if (templates[x]->version != CS_PRECOMPILED_VERSION)
+      return nerr_raise (NERR_ASSERT,
+          "Precompiled template %s is version %d, expected version %d",
+          templates[x]->name, templates[x]->version, CS_PRECOMPILED_VERSION);
+    found = (const CS_PRECOMPILED *) ne_hash_lookup (Precompiled,
+                                         (void *) templates[x]->name);
+    if (found == templates[x]) continue;
+    if (found != NULL)
+      return nerr_raise (NERR_DUPLICATE,
+          "A different precompiled template %s is already registered",
+          templates[x]->name);
+    err = ne_hash_insert (Precompiled, (void *) templates[x]->name,
+                          (void *) templates[x]);
+    if (err) return nerr_pass(err);
   }
+  return STATUS_OK;
 }
 
-void cs_destroy (CSPARSE **parse)
+static const CS_PRECOMPILED *precompiled_find (const char *path)
 {
-  CSPARSE *my_parse = *parse;
+  if (Precompiled == NULL) return NULL;
+  return (const CS_PRECOMPILED *) ne_hash_lookup (Precompiled, (void *)path);
+}
 
-  if (my_parse == NULL)
-    return;
+/* Whether parse would build the same tree from the template's files */
+static int precompiled_fits (CSPARSE *parse, const CS_PRECOMPILED *pre)
+{
+  NEOERR *err;
+  STACK_ENTRY *entry;
 
-  uListDestroy (&(my_parse->stack), ULIST_FREE);
-  uListDestroy (&(my_parse->alloc), ULIST_FREE);
+  /* Audit mode and logged auto escaping want file names and positions */
+  if (parse->audit_mode || parse->auto_ctx.log_changes)
+    return 0;
+  if ((parse->auto_ctx.global_enabled == 1) != pre->auto_escape ||
+      parse->auto_ctx.enabled != parse->auto_ctx.global_enabled)
+    return 0;
+  if (strcmp (parse->tag ? parse->tag : "cs", pre->tag))
+    return 0;
+  err = uListGet (parse->stack, -1, (void *)&entry);
+  if (err)
+  {
+    nerr_ignore (&err);
+    return 0;
+  }
+  return entry->escape == pre->escape;
+}
 
-  dealloc_macro(&my_parse->macros);
-  dealloc_node(&(my_parse->tree));
-  if (my_parse->parent == NULL) {
-    dealloc_function(&(my_parse->functions));
+#define PRE_STRING_OK(pre, x) ((x) >= -1 && (x) < (pre)->strings_len)
+#define PRE_INDEX_OK(x, num) ((x) >= -1 && (x) < (num))
 
-    if (my_parse->auto_ctx.log_changes)
-      uListDestroy (&(my_parse->file_list), ULIST_FREE);
+/* Count a reference to entry x, each one except the first node must be
+ * referred to exactly once, and only by an entry before it */
+static int precompiled_ref (char *refs, int x, int from)
+{
+  if (x == -1) return 1;
+  if (x <= from || refs[x]) return 0;
+  refs[x] = 1;
+  return 1;
+}
 
-    if (my_parse->auto_ctx.parser_ctx)
-      neos_auto_destroy(&(my_parse->auto_ctx.parser_ctx));
+/* The tables come from a file compiled into the program, but check them
+ * before building anything, so a bad one is an error instead of a crash */
+static NEOERR *precompiled_check (const CS_PRECOMPILED *pre, int *cmds)
+{
+  NEOERR *err = STATUS_OK;
+  const CS_PRECOMPILED_NODE *node;
+  const CS_PRECOMPILED_ARG *arg;
+  const CS_PRECOMPILED_MACRO *macro;
+  char *node_refs = NULL;
+  char *arg_refs = NULL;
+  int x, c;
+
+  if (pre->strings_len < 0 || pre->num_cmds < 0 || pre->num_nodes < 0 ||
+      pre->num_args < 0 || pre->num_macros < 0 ||
+      (pre->strings_len && pre->strings[pre->strings_len - 1] != '\0'))
+    return nerr_raise (NERR_PARSE, "Corrupt precompiled template %s",
+                       pre->name);
+
+  for (x = 0; x < pre->num_cmds; x++)
+  {
+    if (pre->cmds[x] < 0 || pre->cmds[x] >= pre->strings_len)
+      return nerr_raise (NERR_PARSE, "Corrupt precompiled template %s",
+                         pre->name);
+    for (c = 0; c < NUM_COMMANDS; c++)
+    {
+      if (!strcmp (Commands[c].cmd, pre->strings + pre->cmds[x])) break;
+    }
+    if (c == NUM_COMMANDS)
+      return nerr_raise (NERR_PARSE,
+                         "Unknown command %s in precompiled template %s",
+                         pre->strings + pre->cmds[x], pre->name);
+    cmds[x] = c;
   }
 
-  /* Free list of errors */
-  if (my_parse->err_list != NULL) {
-    CS_ERROR *ptr;
+  node_refs = (char *) calloc (pre->num_nodes + 1, sizeof(char));
+  arg_refs = (char *) calloc (pre->num_args + 1, sizeof(char));
+  if (node_refs == NULL || arg_refs == NULL)
+  {
+    if (node_refs) free (node_refs);
+    if (arg_refs) free (arg_refs);
+    return nerr_raise (NERR_NOMEM,
+                       "Unable to allocate memory for precompiled template");
+  }
+
+  for (x = 0; x < pre->num_nodes && err == STATUS_OK; x++)
+  {
+    node = &(pre->nodes[x]);
+    if (node->cmd < 0 || node->cmd >= pre->num_cmds ||
+        !PRE_INDEX_OK(node->arg1, pre->num_args) ||
+        !PRE_INDEX_OK(node->arg2, pre->num_args) ||
+        !PRE_INDEX_OK(node->vargs, pre->num_args) ||
+        !PRE_INDEX_OK(node->case_0, pre->num_nodes) ||
+        !PRE_INDEX_OK(node->case_1, pre->num_nodes) ||
+        !PRE_INDEX_OK(node->next, pre->num_nodes) ||
+        !precompiled_ref (arg_refs, node->arg1, -1) ||
+        !precompiled_ref (arg_refs, node->arg2, -1) ||
+        !precompiled_ref (arg_refs, node->vargs, -1) ||
+        !precompiled_ref (node_refs, node->case_0, x) ||
+        !precompiled_ref (node_refs, node->case_1, x) ||
+        !precompiled_ref (node_refs, node->next, x))
+      err = nerr_raise (NERR_PARSE, "Corrupt node %d in precompiled template %s",
+                        x, pre->name);
+  }
+  for (x = 0; x < pre->num_macros && err == STATUS_OK; x++)
+  {
+    macro = &(pre->macros[x]);
+    if (macro->name < 0 || macro->name >= pre->strings_len ||
+        macro->tree < 0 || macro->tree >= pre->num_nodes ||
+        !PRE_INDEX_OK(macro->args, pre->num_args) ||
+        !precompiled_ref (arg_refs, macro->args, -1))
+      err = nerr_raise (NERR_PARSE,
+                        "Corrupt macro %d in precompiled template %s",
+                        x, pre->name);
+  }
+  for (x = 0; x < pre->num_args && err == STATUS_OK; x++)
+  {
+    arg = &(pre->args[x]);
+    if (!PRE_STRING_OK(pre, arg->s) || !PRE_STRING_OK(pre, arg->argexpr) ||
+        !PRE_STRING_OK(pre, arg->function) ||
+        (arg->path && arg->s == -1) ||
+        !PRE_INDEX_OK(arg->macro, pre->num_macros) ||
+        !PRE_INDEX_OK(arg->expr1, pre->num_args) ||
+        !PRE_INDEX_OK(arg->expr2, pre->num_args) ||
+        !PRE_INDEX_OK(arg->next, pre->num_args) ||
+        !precompiled_ref (arg_refs, arg->expr1, x) ||
+        !precompiled_ref (arg_refs, arg->expr2, x) ||
+        !precompiled_ref (arg_refs, arg->next, x))
+      err = nerr_raise (NERR_PARSE, "Corrupt arg %d in precompiled template %s",
+                        x, pre->name);
+  }
+  /* Nothing is left over, which would leak */
+  for (x = 1; x < pre->num_nodes && err == STATUS_OK; x++)
+  {
+    if (!node_refs[x])
+      err = nerr_raise (NERR_PARSE, "Corrupt node %d in precompiled template %s",
+                        x, pre->name);
+  }
+  for (x = 0; x < pre->num_args && err == STATUS_OK; x++)
+  {
+    if (!arg_refs[x])
+      err = nerr_raise (NERR_PARSE, "Corrupt arg %d in precompiled template %s",
+                        x, pre->name);
+  }
+  free (node_refs);
+  free (arg_refs);
+  return nerr_pass(err);
+}
 
-    while (my_parse->err_list) {
-      ptr = my_parse->err_list->next;
-      free(my_parse->err_list->err);
-      free(my_parse->err_list);
-      my_parse->err_list = ptr;
+static NEOERR *precompiled_load (CSPARSE *parse, const CS_PRECOMPILED *pre)
+{
+  NEOERR *err = STATUS_OK;
+  const CS_PRECOMPILED_NODE *pnode;
+  const CS_PRECOMPILED_ARG *parg;
+  const CS_PRECOMPILED_MACRO *pmacro;
+  CS_FUNCTION **functions = NULL;
+  CS_FUNCTION *csf;
+  CS_MACRO **macros = NULL;
+  CS_MACRO *macro;
+  CSTREE **nodes = NULL;
+  CSTREE *node;
+  CSARG **args = NULL;
+  CSARG *arg;
+  int *cmds = NULL;
+  int x;
+
+  /* calloc(0) may return NULL, so always ask for one more */
+  cmds = (int *) calloc (pre->num_cmds + 1, sizeof(int));
+  functions = (CS_FUNCTION **) calloc (pre->num_args + 1,
+                                       sizeof(CS_FUNCTION *));
+  args = (CSARG **) calloc (pre->num_args + 1, sizeof(CSARG *));
+  nodes = (CSTREE **) calloc (pre->num_nodes + 1, sizeof(CSTREE *));
+  macros = (CS_MACRO **) calloc (pre->num_macros + 1, sizeof(CS_MACRO *));
+  if (cmds == NULL || functions == NULL || args == NULL || nodes == NULL ||
+      macros == NULL)
+  {
+    err = nerr_raise (NERR_NOMEM,
+                      "Unable to allocate memory for precompiled template");
+    goto load_done;
+  }
+
+  /* Everything which can fail other than allocation, before anything is
+   * built */
+  err = precompiled_check (pre, cmds);
+  if (err) goto load_done;
+  for (x = 0; x < pre->num_args; x++)
+  {
+    parg = &(pre->args[x]);
+    if (parg->function == -1) continue;
+    for (csf = parse->functions; csf != NULL; csf = csf->next)
+    {
+      if (!strcmp (csf->name, pre->strings + parg->function)) break;
+    }
+    if (csf == NULL)
+    {
+      err = nerr_raise (NERR_PARSE,
+                        "Unknown function %s called in precompiled template %s",
+                        pre->strings + parg->function, pre->name);
+      goto load_done;
+    }
+    functions[x] = csf;
+  }
+  for (x = 0; x < pre->num_macros; x++)
+  {
+    pmacro = &(pre->macros[x]);
+    for (macro = parse->macros; macro != NULL; macro = macro->next)
+    {
+      if (!strcmp (macro->name, pre->strings + pmacro->name))
+      {
+        err = nerr_raise (NERR_PARSE,
+                          "Duplicate macro def for %s in precompiled template %s",
+                          macro->name, pre->name);
+        goto load_done;
+      }
     }
   }
 
-  free(my_parse);
-  *parse = NULL;
+  /* Build each entry on its own, so they can be freed on their own */
+  for (x = 0; x < pre->num_args; x++)
+  {
+    parg = &(pre->args[x]);
+    arg = (CSARG *) calloc (1, sizeof(CSARG));
+    if (arg == NULL)
+    {
+      err = nerr_raise (NERR_NOMEM,
+                        "Unable to allocate memory for precompiled template");
+      goto load_done;
+    }
+    args[x] = arg;
+    arg->op_type = (CSTOKEN_TYPE) parg->op_type;
+    arg->n = parg->n;
+    arg->escape_status = (CSESCAPE_STATUS) parg->escape_status;
+    arg->function = functions[x];
+    /* Never written to, the parse tree only reads strings */
+    if (parg->s != -1) arg->s = (char *) (pre->strings + parg->s);
+    if (parg->argexpr != -1)
+    {
+      arg->argexpr = strdup (pre->strings + parg->argexpr);
+      if (arg->argexpr == NULL)
+      {
+        err = nerr_raise (NERR_NOMEM,
+                          "Unable to allocate memory for precompiled template");
+        goto load_done;
+      }
+    }
+    if (parg->path)
+    {
+      err = hdf_path_compile (arg->s, &(arg->path));
+      if (err) goto load_done;
+    }
+  }
+  for (x = 0; x < pre->num_nodes; x++)
+  {
+    pnode = &(pre->nodes[x]);
+    node = (CSTREE *) calloc (1, sizeof(CSTREE));
+    if (node == NULL)
+    {
+      err = nerr_raise (NERR_NOMEM,
+                        "Unable to allocate memory for precompiled template");
+      goto load_done;
+    }
+    nodes[x] = node;
+    node->node_num = NodeNumber++;
+    node->file_idx = -1;
+    node->cmd = cmds[pnode->cmd];
+    node->flags = pnode->flags;
+    node->escape = (NEOS_ESCAPE) pnode->escape;
+    node->do_autoescape = pnode->do_autoescape;
+  }
+  for (x = 0; x < pre->num_macros; x++)
+  {
+    macro = (CS_MACRO *) calloc (1, sizeof(CS_MACRO));
+    if (macro) macro->name = strdup (pre->strings + pre->macros[x].name);
+    if (macro == NULL || macro->name == NULL)
+    {
+      if (macro) free (macro);
+      err = nerr_raise (NERR_NOMEM,
+                        "Unable to allocate memory for precompiled template");
+      goto load_done;
+    }
+    macros[x] = macro;
+    macro->n_args = pre->macros[x].n_args;
+  }
+
+  /* Nothing fails from here on, link it all together */
+  for (x = 0; x < pre->num_args; x++)
+  {
+    parg = &(pre->args[x]);
+    arg = args[x];
+    if (parg->macro != -1) arg->macro = macros[parg->macro];
+    if (parg->expr1 != -1) arg->expr1 = args[parg->expr1];
+    if (parg->expr2 != -1) arg->expr2 = args[parg->expr2];
+    if (parg->next != -1) arg->next = args[parg->next];
+  }
+  for (x = 0; x < pre->num_macros; x++)
+  {
+    pmacro = &(pre->macros[x]);
+    if (pmacro->args != -1) macros[x]->args = args[pmacro->args];
+    macros[x]->tree = nodes[pmacro->tree];
+  }
+  for (x = 0; x < pre->num_nodes; x++)
+  {
+    pnode = &(pre->nodes[x]);
+    node = nodes[x];
+    /* arg1 and arg2 are part of the node */
+    if (pnode->arg1 != -1)
+    {
+      node->arg1 = *(args[pnode->arg1]);
+      free (args[pnode->arg1]);
+    }
+    if (pnode->arg2 != -1)
+    {
+      node->arg2 = *(args[pnode->arg2]);
+      free (args[pnode->arg2]);
+    }
+    if (pnode->vargs != -1) node->vargs = args[pnode->vargs];
+    if (pnode->case_0 != -1) node->case_0 = nodes[pnode->case_0];
+    if (pnode->case_1 != -1) node->case_1 = nodes[pnode->case_1];
+    if (pnode->next != -1) node->next = nodes[pnode->next];
+  }
+  for (x = pre->num_macros - 1; x >= 0; x--)
+  {
+    macros[x]->next = parse->macros;
+    parse->macros = macros[x];
+  }
+  if (pre->num_nodes)
+  {
+    node = nodes[0];
+    *(parse->next) = node;
+    while (node->next != NULL)
+      node = node->next;
+    parse->next = &(node->next);
+    parse->current = node;
+  }
+  free (cmds);
+  free (functions);
+  free (args);
+  free (nodes);
+  free (macros);
+  return STATUS_OK;
+
+load_done:
+  /* Nothing was linked yet, so each entry is freed on its own */
+  for (x = 0; args && x < pre->num_args; x++)
+    dealloc_arg (&(args[x]));
+  for (x = 0; nodes && x < pre->num_nodes; x++)
+    dealloc_node (&(nodes[x]));
+  for (x = 0; macros && x < pre->num_macros; x++)
+    dealloc_macro (&(macros[x]));
+  if (cmds) free (cmds);
+  if (functions) free (functions);
+  if (args) free (args);
+  if (nodes) free (nodes);
+  if (macros) free (macros);
+  return nerr_pass(err);
 }
 
 /* **** CS Debug Dumps ******************************************** */
@@ -5201,113 +8233,211 @@ NEOERR *cs_dump (CSPARSE *parse, void *ctx, CSOUTFUNC cb)
   return nerr_pass (dump_node (parse, node, 0, ctx, cb, buf, sizeof(buf)));
 }
 
-#if 0
-static char *node_name (CSTREE *node)
+/* Write s as a C string literal, split over lines, without trigraphs */
+static NEOERR *dump_c_string (STRING *out, const char *s, int len)
 {
-  static char buf[256];
+  NEOERR *err;
+  int x, line = 0;
+  unsigned char c;
 
-  if (node == NULL)
-    snprintf (buf, sizeof(buf), "NULL");
-  else
-    snprintf (buf, sizeof(buf), "%s_%08x", Commands[node->cmd].cmd,
-	node->node_num);
+  err = string_append (out, "  \"");
+  if (err) return nerr_pass(err);
+  for (x = 0; x < len; x++)
+  {
+    c = (unsigned char) s[x];
+    if (c == '"' || c == '\\' || c == '?')
+      err = string_appendf (out, "\\%c", c);
+    else if (c < ' ' || c > '~')
+      err = string_appendf (out, "\\%03o", c);
+    else
+      err = string_append_char (out, c);
+    if (err) return nerr_pass(err);
+    if (++line >= 64 && x + 1 < len)
+    {
+      err = string_append (out, "\"\n  \"");
+      if (err) return nerr_pass(err);
+      line = 0;
+    }
+  }
+  err = string_append (out, "\"");
+  return nerr_pass(err);
+}
 
-  return buf;
+static NEOERR *dump_c_flush (STRING *out, void *ctx, CSOUTFUNC cb, int force)
+{
+  NEOERR *err;
+
+  if (out->len == 0 || (!force && out->len < 4096)) return STATUS_OK;
+  err = cb (ctx, out->buf);
+  if (err) return nerr_pass(err);
+  out->len = 0;
+  out->buf[0] = '\0';
+  return STATUS_OK;
 }
 
-static NEOERR *dump_node_pre_c (CSPARSE *parse, CSTREE *node, FILE *fp)
+static NEOERR *dump_c_tables (CS_PRECOMPILED *pre, const char *ident,
+                              STRING *out, void *ctx, CSOUTFUNC cb)
 {
   NEOERR *err;
+  const CS_PRECOMPILED_NODE *n;
+  const CS_PRECOMPILED_ARG *a;
+  const CS_PRECOMPILED_MACRO *m;
+  int x, len;
 
-  while (node != NULL)
+  err = string_appendf (out, "static const char %s_strings[] =\n", ident);
+  if (err) return nerr_pass(err);
+  if (pre->strings_len == 0)
   {
-    fprintf (fp, "CSTREE %s;\n", node_name(node));
-    if (node->case_0)
+    err = string_append (out, "  \"\"\n");
+    if (err) return nerr_pass(err);
+  }
+  /* One line per string, each with its NUL */
+  for (x = 0; x < pre->strings_len; x += len)
+  {
+    len = strlen (pre->strings + x) + 1;
+    err = dump_c_string (out, pre->strings + x, len);
+    if (err) return nerr_pass(err);
+    err = string_append (out, "\n");
+    if (err) return nerr_pass(err);
+    err = dump_c_flush (out, ctx, cb, 0);
+    if (err) return nerr_pass(err);
+  }
+  err = string_append (out, "  ;\n\n");
+  if (err) return nerr_pass(err);
+
+  if (pre->num_cmds)
+  {
+    err = string_appendf (out, "static const int %s_cmds[] = {\n", ident);
+    if (err) return nerr_pass(err);
+    for (x = 0; x < pre->num_cmds; x++)
     {
-      err = dump_node_pre_c (parse, node->case_0, fp);
-      if (err != STATUS_OK) nerr_pass (err);
+      err = string_appendf (out, "  %d, /* %s */\n", pre->cmds[x],
+                            pre->strings + pre->cmds[x]);
+      if (err) return nerr_pass(err);
     }
-    if (node->case_1)
+    err = string_append (out, "};\n\n");
+    if (err) return nerr_pass(err);
+  }
+
+  if (pre->num_nodes)
+  {
+    err = string_appendf (out,
+        "static const CS_PRECOMPILED_NODE %s_nodes[] = {\n", ident);
+    if (err) return nerr_pass(err);
+    for (x = 0; x < pre->num_nodes; x++)
     {
-      err = dump_node_pre_c (parse, node->case_1, fp);
-      if (err != STATUS_OK) nerr_pass (err);
+      n = &(pre->nodes[x]);
+      err = string_appendf (out,
+          "  { %d, %d, %d, %d, %d, %d, %d, %d, %d, %d },\n",
+          n->cmd, n->flags, n->escape, n->do_autoescape, n->arg1, n->arg2,
+          n->vargs, n->case_0, n->case_1, n->next);
+      if (err) return nerr_pass(err);
+      err = dump_c_flush (out, ctx, cb, 0);
+      if (err) return nerr_pass(err);
     }
-    node = node->next;
+    err = string_append (out, "};\n\n");
+    if (err) return nerr_pass(err);
   }
-  return STATUS_OK;
-}
-
-static NEOERR *dump_node_c (CSPARSE *parse, CSTREE *node, FILE *fp)
-{
-  NEOERR *err;
-  char *s;
 
-  while (node != NULL)
+  if (pre->num_args)
   {
-    fprintf (fp, "CSTREE %s =\n\t{%d, %d, %d, ", node_name(node), node->node_num,
-	node->cmd, node->flags);
-    s = repr_string_alloc (node->arg1.s);
-    if (s == NULL)
-      return nerr_raise(NERR_NOMEM, "Unable to allocate space for repr");
-    fprintf (fp, "\n\t  { %d, %s, %ld }, ", node->arg1.op_type, s, node->arg1.n);
-    free(s);
-    s = repr_string_alloc (node->arg2.s);
-    if (s == NULL)
-      return nerr_raise(NERR_NOMEM, "Unable to allocate space for repr");
-    fprintf (fp, "\n\t  { %d, %s, %ld }, ", node->arg2.op_type, s, node->arg2.n);
-    free(s);
-    if (node->case_0)
-      fprintf (fp, "\n\t%d, &%s, ", node->op, node_name(node->case_0));
-    else
-      fprintf (fp, "\n\t%d, NULL, ", node->op);
-    if (node->case_1)
-      fprintf (fp, "&%s, ", node_name(node->case_1));
-    else
-      fprintf (fp, "NULL, ");
-    if (node->next)
-      fprintf (fp, "&%s};\n\n", node_name(node->next));
-    else
-      fprintf (fp, "NULL};\n\n");
-    if (node->case_0)
+    err = string_appendf (out,
+        "static const CS_PRECOMPILED_ARG %s_args[] = {\n", ident);
+    if (err) return nerr_pass(err);
+    for (x = 0; x < pre->num_args; x++)
     {
-      err = dump_node_c (parse, node->case_0, fp);
-      if (err != STATUS_OK) nerr_pass (err);
+      a = &(pre->args[x]);
+      /* op_type can be 1<<31, which isn't an int literal */
+      err = string_appendf (out,
+          "  { (int) %uU, %d, %d, %ldL, %d, %d, %d, %d, %d, %d, %d },\n",
+          (unsigned int) a->op_type, a->s, a->argexpr, a->n,
+          a->escape_status, a->function, a->macro, a->path, a->expr1,
+          a->expr2, a->next);
+      if (err) return nerr_pass(err);
+      err = dump_c_flush (out, ctx, cb, 0);
+      if (err) return nerr_pass(err);
     }
-    if (node->case_1)
+    err = string_append (out, "};\n\n");
+    if (err) return nerr_pass(err);
+  }
+
+  if (pre->num_macros)
+  {
+    err = string_appendf (out,
+        "static const CS_PRECOMPILED_MACRO %s_macros[] = {\n", ident);
+    if (err) return nerr_pass(err);
+    for (x = 0; x < pre->num_macros; x++)
     {
-      err = dump_node_c (parse, node->case_1, fp);
-      if (err != STATUS_OK) nerr_pass (err);
+      m = &(pre->macros[x]);
+      err = string_appendf (out, "  { %d, %d, %d, %d }, /* %s */\n",
+          m->name, m->n_args, m->args, m->tree, pre->strings + m->name);
+      if (err) return nerr_pass(err);
     }
-    node = node->next;
+    err = string_append (out, "};\n\n");
+    if (err) return nerr_pass(err);
   }
   return STATUS_OK;
 }
 
-NEOERR *cs_dump_c (CSPARSE *parse, char *path)
+NEOERR *cs_dump_c (CSPARSE *parse, const char *name, const char *ident,
+                   void *ctx, CSOUTFUNC cb)
 {
-  CSTREE *node;
-  FILE *fp;
   NEOERR *err;
+  CS_PRECOMPILED *pre = NULL;
+  STRING out;
 
-  if (parse->tree == NULL)
-    return nerr_raise (NERR_ASSERT, "No parse tree exists");
+  string_init (&out);
+  err = cs_precompile (parse, name, &pre);
+  if (err) return nerr_pass(err);
 
-  fp = fopen(path, "w");
-  if (fp == NULL)
+  do
   {
-    return nerr_raise (NERR_SYSTEM,
-	"Unable to open file %s for writing: [%d] %s", path, errno,
-	strerror(errno));
-  }
+    err = string_appendf (&out, "/* %s, precompiled by cs_dump_c */\n",
+                          name);
+    if (err) break;
+    err = dump_c_tables (pre, ident, &out, ctx, cb);
+    if (err) break;
+    err = string_appendf (&out,
+        "static const CS_PRECOMPILED %s = {\n"
+        "  %d,\n", ident, pre->version);
+    if (err) break;
+    err = dump_c_string (&out, pre->name, strlen (pre->name));
+    if (err) break;
+    err = string_appendf (&out, ",\n  %d, %d,\n", pre->auto_escape,
+                          pre->escape);
+    if (err) break;
+    err = dump_c_string (&out, pre->tag, strlen (pre->tag));
+    if (err) break;
+    err = string_appendf (&out, ",\n  %s_strings, %d,\n", ident,
+                          pre->strings_len);
+    if (err) break;
+    if (pre->num_cmds)
+      err = string_appendf (&out, "  %s_cmds, %d,\n", ident, pre->num_cmds);
+    else
+      err = string_append (&out, "  NULL, 0,\n");
+    if (err) break;
+    if (pre->num_nodes)
+      err = string_appendf (&out, "  %s_nodes, %d,\n", ident, pre->num_nodes);
+    else
+      err = string_append (&out, "  NULL, 0,\n");
+    if (err) break;
+    if (pre->num_args)
+      err = string_appendf (&out, "  %s_args, %d,\n", ident, pre->num_args);
+    else
+      err = string_append (&out, "  NULL, 0,\n");
+    if (err) break;
+    if (pre->num_macros)
+      err = string_appendf (&out, "  %s_macros, %d,\n", ident,
+                            pre->num_macros);
+    else
+      err = string_append (&out, "  NULL, 0,\n");
+    if (err) break;
+    err = string_append (&out, "};\n\n");
+    if (err) break;
+    err = dump_c_flush (&out, ctx, cb, 1);
+  } while (0);
 
-  fprintf(fp, "/* Auto-generated file: DO NOT EDIT */\n");
-  fprintf(fp, "#include <stdlib.h>\n\n");
-  fprintf(fp, "#include \"cs.h\"\n");
-  node = parse->tree;
-  err = dump_node_pre_c (parse, node, fp);
-  fprintf(fp, "\n");
-  err = dump_node_c (parse, node, fp);
-  fclose(fp);
-  return nerr_pass (err);
+  string_clear (&out);
+  cs_precompiled_destroy (&pre);
+  return nerr_pass(err);
 }
-#endif
@@ -40,9 +40,16 @@ NEOERR *test_strfunc(const char *str, char **ret)
   return STATUS_OK;
 }
 
+static NEOERR *cache_init (void *ctx, CSPARSE *parse)
+{
+  parse->global_hdf = (HDF *)ctx;
+  return nerr_pass(cs_register_strfunc(parse, "test_strfunc", test_strfunc));
+}
+
 void usage(char *argv0)
 {
-  ne_warn("Usage: %s [-v] [-parse_must_fail] [-global_hdf <file.hdf>] "
+  ne_warn("Usage: %s [-v] [-parse_must_fail] [-cache] [-precompiled] "
+          "[-global_hdf <file.hdf>] [-frozen <prefix>]... "
           "<file.hdf> <file.cs>", argv0);
 }
 
@@ -148,13 +155,18 @@ int main (int argc, char *argv[])
 {
   NEOERR *err;
   CSPARSE *parse;
+  STRING out;
   HDF *global_hdf = NULL;
   HDF *hdf;
   int verbose = 0;
   int parse_must_fail = 0;
+  int use_cache = 0;
+  int use_precompiled = 0;
   char *global_hdf_file = NULL;
   char *hdf_file, *cs_file;
   int arg_position = 1;
+  const char *frozen_prefixes[10];
+  int num_frozen = 0;
 
   while(arg_position < argc) {
     if (!strcmp(argv[arg_position], "-v"))
@@ -165,6 +177,14 @@ int main (int argc, char *argv[])
     {
       parse_must_fail = 1;
     }
+    else if (!strcmp(argv[arg_position], "-cache"))
+    {
+      use_cache = 1;
+    }
+    else if (!strcmp(argv[arg_position], "-precompiled"))
+    {
+      use_precompiled = 1;
+    }
     else if (!strcmp(argv[arg_position], "-global_hdf"))
     {
       if (++arg_position >= argc) {
@@ -173,6 +193,16 @@ int main (int argc, char *argv[])
       }
       global_hdf_file = argv[arg_position];
     }
+    else if (!strcmp(argv[arg_position], "-frozen"))
+    {
+      /* Optimize with the names under prefix read from a frozen copy of
+       * the data, see cs_optimize */
+      if (++arg_position >= argc || num_frozen == 9) {
+        usage(argv[0]);
+        return -1;
+      }
+      frozen_prefixes[num_frozen++] = argv[arg_position];
+    }
     else
     {
       break;
@@ -202,6 +232,92 @@ int main (int argc, char *argv[])
   }
 
   printf ("Parsing %s\n", cs_file);
+  if (use_precompiled)
+  {
+    CS_PRECOMPILED *pre = NULL;
+    const CS_PRECOMPILED *templates[2];
+    char name[PATH_BUF_SIZE];
+
+    /* Registered under a name no file has, so reading the file instead
+     * fails */
+    snprintf (name, sizeof(name), "%s.precompiled", cs_file);
+    err = cs_init (&parse, hdf);
+    if (err == STATUS_OK)
+      err = cache_init (global_hdf, parse);
+    if (err == STATUS_OK)
+      err = cs_parse_file (parse, cs_file);
+    if (err == STATUS_OK)
+      err = cs_precompile (parse, name, &pre);
+    cs_destroy (&parse);
+    if (err == STATUS_OK)
+    {
+      templates[0] = pre;
+      templates[1] = NULL;
+      err = cs_register_precompiled (templates);
+    }
+    if (err == STATUS_OK)
+      err = cs_cache_get (hdf, name, global_hdf, cache_init, &parse);
+    if (err == STATUS_OK)
+    {
+      cs_cache_release (&parse);
+      err = cs_cache_get (hdf, name, global_hdf, cache_init, &parse);
+    }
+    if (err == STATUS_OK)
+    {
+      err = cs_render_cached (parse, hdf, NULL, output);
+      cs_cache_release (&parse);
+    }
+    if (err != STATUS_OK)
+    {
+      nerr_warn_error(err);
+      return -1;
+    }
+    cs_cache_clear ();
+    cs_register_precompiled (NULL);
+    cs_precompiled_destroy (&pre);
+    hdf_destroy(&hdf);
+    hdf_destroy(&global_hdf);
+    return 0;
+  }
+  if (use_cache)
+  {
+    /* A parse tree made with other settings must not be reused, so cache
+     * one with another tag start first, which would output the template
+     * as it is */
+    err = hdf_set_value (hdf, "Config.TagStart", "cstest");
+    if (err == STATUS_OK)
+      err = cs_cache_get (hdf, cs_file, global_hdf, cache_init, &parse);
+    if (err == STATUS_OK)
+    {
+      cs_cache_release (&parse);
+      err = hdf_remove_tree (hdf, "Config.TagStart");
+    }
+    /* Fetch it twice, so the render uses the cached parse tree */
+    if (err == STATUS_OK)
+      err = cs_cache_get (hdf, cs_file, global_hdf, cache_init, &parse);
+    if (err == STATUS_OK)
+    {
+      cs_cache_release (&parse);
+      err = cs_cache_get (hdf, cs_file, global_hdf, cache_init, &parse);
+    }
+    if (err != STATUS_OK)
+    {
+      nerr_warn_error(err);
+      return -1;
+    }
+    err = cs_render_cached (parse, hdf, NULL, output);
+    if (err != STATUS_OK)
+    {
+      nerr_warn_error(err);
+      return -1;
+    }
+    cs_cache_release (&parse);
+    cs_cache_clear ();
+    hdf_destroy(&hdf);
+    hdf_destroy(&global_hdf);
+    return 0;
+  }
+
   err = cs_init (&parse, hdf);
   if (err != STATUS_OK)
   {
@@ -233,7 +349,32 @@ int main (int argc, char *argv[])
     }
   }
 
-  err = cs_render(parse, NULL, output);
+  if (num_frozen)
+  {
+    HDF *frozen = NULL;
+
+    frozen_prefixes[num_frozen] = NULL;
+    err = hdf_init (&frozen);
+    if (err == STATUS_OK)
+      err = hdf_copy (frozen, "", hdf);
+    if (err == STATUS_OK)
+      err = hdf_freeze (frozen);
+    if (err == STATUS_OK)
+      err = cs_optimize (parse, frozen, frozen_prefixes);
+    /* The values were copied, so the render mustn't need it */
+    hdf_destroy (&frozen);
+    if (err != STATUS_OK)
+    {
+      nerr_warn_error(err);
+      return -1;
+    }
+  }
+
+  /* The plain render goes to a STRING, the others use a CSOUTFUNC */
+  string_init (&out);
+  err = cs_render_string(parse, &out);
+  if (out.len > 0) output (NULL, out.buf);
+  string_clear (&out);
   if (err != STATUS_OK)
   {
     if ( !parse_must_fail)
@@ -0,0 +1,19 @@
+Chained concatenation:
+<?cs var:"a" + Foo + "b" + "c" + Foo ?>
+<?cs var:("x" + Foo) + ("y" + Foo) ?>
+<?cs if:"a" + "b" + "c" == "abc" ?>equal<?cs /if ?> <?cs if:"a" + "b" < "a" + "c" ?>less<?cs /if ?>
+Computed names:
+<?cs loop:n = 0, 3 ?><?cs var:Foo["Bar"]["Baz"][n] ?>/<?cs var:Foo.Bar.Baz[n].num ?>/<?cs var:Foo.Bar["Baz"][n]["num"] ?> <?cs /loop ?>
+<?cs each:item = Foo.Bar.Baz ?><?cs var:Foo.Bar.Baz[name(item)] + "-" + item.num ?> <?cs /each ?>
+Loop numbers as strings:
+<?cs loop:n = 0, 12, 3 ?><?cs if:n == "6" ?>six<?cs else ?><?cs var:n ?><?cs /if ?>,<?cs var:Numbers[n] ?> <?cs /loop ?>
+Concatenated macro arguments:
+<?cs def:twice(p, q) ?>[<?cs var:p + p ?>|<?cs var:p + q + p ?>|<?cs each:item = Numbers ?><?cs var:p + item ?><?cs /each ?>|<?cs var:p ?>]<?cs /def ?>
+<?cs call:twice("<" + Foo + ">", "+" + "-") ?>
+<?cs each:item = Foo.Bar.Baz ?><?cs call:twice(name(item) + ":", item + "") ?> <?cs /each ?>
+<?cs def:bang(p) ?><?cs set:p = p + "!" ?><?cs var:p ?><?cs var:p + "?" ?><?cs /def ?>
+<?cs call:bang("a" + "b") ?> <?cs call:bang(Foo + "") ?>
+Long strings:
+<?cs loop:n = 1, 60 ?><?cs set:Scratch.Long = Scratch.Long + "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ" ?><?cs /loop ?>
+<?cs var:string.length(Scratch.Long) ?> <?cs var:string.length(Scratch.Long + Scratch.Long + "x" + Scratch.Long) ?>
+<?cs var:string.slice(Scratch.Long + "end" + Scratch.Long, 3718, 3726) ?>
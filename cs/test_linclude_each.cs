@@ -0,0 +1,7 @@
+Each with linclude:
+<?cs each:item = Foo.Bar.Baz ?><?cs linclude:"test_lincluded_row.cs" ?><?cs /each ?>
+Each with linclude inside escape:
+<?cs escape:"html" ?><?cs each:item = Foo.Bar.Baz ?><?cs linclude:"test_lincluded_row.cs" ?><?cs /each ?><?cs /escape ?>
+Missing optional linclude:
+<?cs each:item = Foo.Bar.Baz ?><?cs linclude:"test_missing_row.cs" ?><?cs /each ?>
+Done
@@ -0,0 +1 @@
+Row <?cs name:item ?>: <?cs var:item ?><?cs if:first(item) ?> (first)<?cs /if ?><?cs if:last(item) ?> (last)<?cs /if ?> <?cs var:Title ?>
@@ -0,0 +1,27 @@
+Shadowed each variables:
+<?cs each:x = Outside ?><?cs each:x = x.Inside ?><?cs var:x ?>,<?cs /each ?>;<?cs /each ?>
+Outer each from the inner one:
+<?cs each:o = Outside ?><?cs each:i = o.Inside ?><?cs name:o ?>.<?cs name:i ?>=<?cs var:i ?> <?cs /each ?><?cs /each ?>
+Loop and with:
+<?cs loop:n = 0, 3 ?><?cs with:b = Foo.Bar.Baz ?><?cs var:n ?>=<?cs var:b[n] ?>/<?cs var:b[n].num ?> <?cs /with ?><?cs /loop ?>
+Macro arguments, and an each shadowing one:
+<?cs def:show(a, b, c) ?>[<?cs var:a ?>|<?cs var:b ?>|<?cs var:c ?>]<?cs each:a = Numbers ?>(<?cs var:a ?> <?cs var:c ?>)<?cs /each ?><?cs var:a ?><?cs /def ?>
+<?cs call:show("one", Blah, 3) ?>
+<?cs each:item = Foo.Bar.Baz ?><?cs call:show(item, item.num, name(item)) ?> <?cs /each ?>
+A macro seeing its caller's locals:
+<?cs def:caller_item(prefix) ?><?cs var:prefix ?><?cs var:item ?><?cs /def ?>
+<?cs each:item = Foo.Bar.Baz ?><?cs call:caller_item("-") ?><?cs /each ?>
+<?cs loop:item = 5, 7 ?><?cs call:caller_item("+") ?><?cs /loop ?>
+A macro defined inside an each:
+<?cs each:item = Numbers ?><?cs def:nested(x) ?><?cs var:x ?>:<?cs var:item ?> <?cs /def ?><?cs /each ?>
+<?cs each:item = Foo.Bar.Baz ?><?cs call:nested(name(item)) ?><?cs /each ?>
+Recursion:
+<?cs def:count(n) ?><?cs var:n ?><?cs if:n > 0 ?><?cs call:count(n - 1) ?><?cs var:n ?><?cs /if ?><?cs /def ?>
+<?cs call:count(3) ?>
+Setting below a local:
+<?cs each:item = Foo.Bar.Baz ?><?cs set:item.copy = item ?><?cs /each ?><?cs each:item = Foo.Bar.Baz ?><?cs var:item.copy ?> <?cs /each ?>
+Lookups after set:
+<?cs each:item = Foo.Bar.Baz ?><?cs var:Lookup.Seen ?>/<?cs set:Lookup.Seen = Lookup.Seen + item ?><?cs /each ?>
+<?cs each:item = Foo.Bar.Baz ?><?cs alt:Lookup.Made[name(item)] ?>-<?cs /alt ?><?cs set:Lookup.Made[name(item)] = item ?><?cs alt:Lookup.Made[name(item)] ?>-<?cs /alt ?> <?cs /each ?>
+<?cs each:item = Foo.Bar.Baz ?><?cs if:?Lookup.Flag ?>set<?cs else ?>unset<?cs set:Lookup.Flag = 1 ?><?cs /if ?> <?cs /each ?>
+<?cs each:m = Lookup.Made ?><?cs name:m ?>=<?cs var:m ?> <?cs /each ?><?cs var:subcount(Lookup.Made) ?>
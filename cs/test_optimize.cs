@@ -0,0 +1,20 @@
+Constant expressions:
+<?cs var:2 * 60 ?> <?cs var:"a" + "b" + "c" ?> <?cs var:"a" + 1 ?> <?cs var:7 / 0 ?> <?cs var:7 % 0 ?> <?cs var:!0 ?> <?cs var:?"x" ?> <?cs var:"12" - 1 ?> <?cs var:("5" == 5) + ("10" < "9") ?>
+<?cs var:(1 + 2) * Wow.Foo ?> <?cs var:string.length("ab" + "cd") ?> <?cs var:Foo.Bar.Baz[1 + 1] ?> <?cs var:Foo.Bar.Baz[0] + ("-" + "-") ?>
+Dead branches:
+<?cs if:0 ?>never<?cs /if ?>[<?cs if:1 ?>always<?cs else ?>never<?cs /if ?>]
+<?cs if:0 ?>a<?cs elif:Wow.Foo == 3 ?>b<?cs elif:1 ?>c<?cs else ?>d<?cs /if ?>
+<?cs if:Wow.Foo == 2 ?>a<?cs elif:0 ?>b<?cs elif:"" ?>c<?cs elif:"0" ?>d<?cs elif:"x" ?>e<?cs else ?>f<?cs /if ?>
+<?cs if:0 ?>a<?cs elif:0 ?>b<?cs /if ?><?cs if:1 ?><?cs if:0 ?>no<?cs else ?>nested<?cs /if ?><?cs /if ?>
+<?cs alt:"" ?>empty alt<?cs /alt ?> <?cs alt:"value" ?>not shown<?cs /alt ?> <?cs alt:0 ?>zero alt<?cs /alt ?> <?cs alt:Foo.Missing ?>missing<?cs /alt ?>
+A macro defined in a dead branch:
+<?cs if:0 ?><?cs def:hidden(x) ?>hidden <?cs var:x ?><?cs /def ?><?cs /if ?><?cs call:hidden("still there") ?>
+Loops and calls:
+<?cs loop:i = 1 + 1, 2 * 5, 4 - 1 ?><?cs var:i ?><?cs if:0 ?>never<?cs /if ?>,<?cs /loop ?> <?cs loop:i = 1, Wow.Foo ?><?cs var:i ?><?cs /loop ?>
+<?cs def:show(a, b) ?>[<?cs var:a ?>|<?cs var:b ?>|<?cs var:b.num ?>]<?cs /def ?><?cs call:show(2 + 2, Foo.Bar.Baz.2) ?>
+<?cs each:x = Foo.Bar.Baz ?><?cs if:1 ?><?cs name:x ?><?cs /if ?><?cs if:0 ?>-<?cs /if ?><?cs /each ?>
+Frozen looking names:
+<?cs var:Foo ?>/<?cs var:Foo + " " + Foo.Bar.Baz.1 ?>/<?cs var:#Wow.Foo + 1 ?>/<?cs var:?Foo.Missing ?><?cs var:?Wow.Foo ?>/<?cs var:Foo.Missing ?>
+<?cs if:Wow.Foo > 2 && Foo.Bar.Baz.2.num == "#2" ?>yes<?cs else ?>no<?cs /if ?> <?cs if:Foo.Bar.Baz.2.num == Foo.Bar.Baz.0.num ?>same<?cs else ?>different<?cs /if ?>
+<?cs each:Foo = Numbers ?><?cs var:Foo ?>,<?cs /each ?> <?cs def:shadow(Wow) ?><?cs var:Wow ?><?cs /def ?><?cs call:shadow("local") ?> <?cs with:Wow = Foo.Bar ?><?cs var:Wow.Baz.3 ?><?cs /with ?>
+<?cs set:Optimize.Copy = Foo + "!" ?><?cs var:Optimize.Copy ?> <?cs var:name(Foo.Bar) ?> <?cs var:subcount(Foo.Bar.Baz) ?>
@@ -128,13 +128,6 @@ JNIEXPORT void JNICALL Java_org_clearsilver_jni_JniCs__1parseStr
 
 }
 
-static NEOERR *render_cb (void *ctx, char *buf)
-{
-  STRING *str= (STRING *)ctx;
-
-  return nerr_pass(string_append(str, buf));
-}
-
 
 JNIEXPORT jstring JNICALL Java_org_clearsilver_jni_JniCs__1render
 (JNIEnv *env, jobject objCS, jlong cs_obj_ptr, jboolean use_cb) {
@@ -164,7 +157,7 @@ JNIEXPORT jstring JNICALL Java_org_clearsilver_jni_JniCs__1render
   }
 
   string_init(&str);
-  err = cs_render(cs, &str, render_cb);
+  err = cs_render_string(cs, &str);
 
   if (use_cb == JNI_TRUE) cs_register_fileload(cs, NULL, NULL);
 
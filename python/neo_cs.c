@@ -135,13 +135,6 @@ static PyObject * p_cs_parse_str (PyObject *self, PyObject *args)
   return Py_None;
 }
 
-static NEOERR *render_cb (void *ctx, char *buf)
-{
-  STRING *str= (STRING *)ctx;
-
-  return nerr_pass(string_append(str, buf));
-}
-
 static PyObject * p_cs_render (PyObject *self, PyObject *args)
 {
   CSObject *co = (CSObject *)self;
@@ -158,7 +151,7 @@ static PyObject * p_cs_render (PyObject *self, PyObject *args)
                                      "ClearSilver.WhiteSpaceStrip", 0);
 
   string_init(&str);
-  err = cs_render (co->data, &str, render_cb);
+  err = cs_render_string (co->data, &str);
   if (err) return p_neo_error(err);
 
   if (ws_strip_level) {
@@ -86,13 +86,6 @@ static VALUE c_parse_str (VALUE self, VALUE oString)
   return self;
 }
 
-static NEOERR *render_cb (void *ctx, char *buf)
-{
-  STRING *str= (STRING *)ctx;
-
-  return nerr_pass(string_append(str, buf));
-}
-
 static VALUE c_render (VALUE self)
 {
   CSPARSE *cs = NULL;
@@ -103,7 +96,7 @@ static VALUE c_render (VALUE self)
   Data_Get_Struct(self, CSPARSE, cs);
 
   string_init(&str);
-  err = cs_render (cs, &str, render_cb);
+  err = cs_render_string (cs, &str);
   if (err) Srb_raise(r_neo_error(err));
 
   rv = rb_str_new2(str.buf);
@@ -17,8 +17,18 @@
 
 struct _neos_auto_ctx {
   htmlparser_ctx *hctx;
+  NEOS_AUTO_STATE *state;  /* the saved state hctx is known to be in */
 };
 
+/* A saved parser state.  hctx is only kept if the state is going to be
+ * restored, otherwise the state is just used for its identity. */
+struct _neos_auto_state {
+  htmlparser_ctx *hctx;
+};
+
+/* The state of a freshly reset parser */
+static NEOS_AUTO_STATE ResetState = {NULL};
+
 /* This structure is used to map an HTTP content type to the htmlparser mode
  * that should be used for parsing it.
  */
@@ -94,79 +104,52 @@ static char *CSS_SAFE_CHARS = "_.,!#%-";
 /* neo_str.c already has all these escaping routines.
  * But since with auto escaping, the escaping routines will be called for every
  * variable, these new functions do an initial pass to determine if escaping is
- * needed. If not, the input string itself is returned, and no extraneous
- * memory allocation or copying is done.
+ * needed. If not, the input string itself is appended to the output in one
+ * go.  Otherwise, the part of it before the first character which needs
+ * escaping is, and the rest is escaped onto the end of that.
  */
 
 /* TODO(mugdha): Consolidate these functions with the ones in neo_str.c. */
 
 /* Function: neos_auto_html_escape - HTML escapes input if necessary.
  * Description: This function scans through in, looking for HTML metacharacters.
- *              If any metacharacters are found, the input is HTML escaped and
- *              the resulting output returned in *esc.
+ *              If any metacharacters are found, the input is HTML escaped.
+ *              The result is appended to out.
  * Input: in -> input string
  *        quoted -> should be 0 if the input string appears on an HTML attribute
  *                  and is not quoted.
- * Output: esc -> pointer to output string. Could point back to input string
- *                if the input does not need modification.
- *         do_free -> will be 1 if *esc should be freed. If it is 0, *esc
- *                    points to in.
+ * Output: out -> the escaped input is appended to it
+ *         changed -> will be 1 if what was appended differs from in.
  */
-static NEOERR *neos_auto_html_escape (const char *in, char **esc,
-                                      int quoted, int *do_free)
+static NEOERR *neos_auto_html_escape (const char *in, STRING *out,
+                                      int quoted, int *changed)
 {
-  unsigned int newlen = 0;
-  int modify = 0;
+  NEOERR *err;
   unsigned int l = 0;
-  char *tmp = NULL;
   char *metachars = HTML_CHARS_LIST;
 
-  *do_free = 0;
+  *changed = 0;
 
   if (!quoted)
     metachars = HTML_UNQUOTED_LIST;
 
   /*
      Check if there are any characters that need escaping. In the majority of
-     cases, this will be false and we can just quit the function immediately
+     cases, this will be false and we can just append the input as it is.
   */
   while (in[l])
   {
-    if (!quoted && (IS_CTRL_CHAR(in[l]) || IS_SPACE(in[l])))
-    {
-      modify = 1;
-    }
-    else
-    {
-      if (IN_LIST(metachars, in[l]))
-      {
-        newlen += strlen(HTML_CHAR_MAP[(int)in[l]]);
-        modify = 1;
-      }
-      else
-        newlen += 1;
-    }
-
+    if ((!quoted && (IS_CTRL_CHAR(in[l]) || IS_SPACE(in[l]))) ||
+        IN_LIST(metachars, in[l]))
+      break;
     l++;
   }
 
-  if (!modify) {
-    *esc = (char *)in;
-    return STATUS_OK;
-  }
+  err = string_appendn(out, in, l);
+  if (err != STATUS_OK || !in[l]) return nerr_pass(err);
 
-  /*
-     There are some HTML metacharacters. Allocate a new string and do escaping
-     in that string.
-  */
-  (*esc) = (char *) malloc(newlen + 1);
-  if (*esc == NULL)
-    return nerr_raise (NERR_NOMEM, "Unable to allocate memory to escape %s",
-                       in);
-  *do_free = 1;
-
-  tmp = *esc;
-  l = 0;
+  /* There are some HTML metacharacters, escape from the first one on */
+  *changed = 1;
   while (in[l])
   {
     if (!quoted && (IS_CTRL_CHAR(in[l]) || IS_SPACE(in[l])))
@@ -176,19 +159,13 @@ static NEOERR *neos_auto_html_escape (const char *in, char **esc,
     else
     {
       if (IN_LIST(metachars, in[l]))
-      {
-        strncpy(tmp, HTML_CHAR_MAP[(int)in[l]],
-                strlen(HTML_CHAR_MAP[(int)in[l]]));
-        tmp += strlen(HTML_CHAR_MAP[(int)in[l]]);
-      }
+        err = string_append(out, HTML_CHAR_MAP[(int)in[l]]);
       else
-      {
-        *tmp++ = in[l];
-      }
+        err = string_append_char(out, in[l]);
+      if (err != STATUS_OK) return nerr_pass(err);
     }
     l++;
   }
-  (*esc)[newlen] = '\0';
 
   return STATUS_OK;
 }
@@ -206,13 +183,11 @@ static char *AUTO_URL_PROTOCOLS[] = {"http://", "https://", "ftp://", "mailto:"}
  *        quoted -> should be 0 if the input string appears on an HTML attribute
  *                  and is not quoted. Will be passed through to the html
  *                  escaping function.
- * Output: esc -> pointer to output string. Could point back to input string
- *                if the input does not need modification.
- *         do_free -> will be 1 if *esc should be freed. If it is 0, *esc
- *                    points to in.
+ * Output: out -> the validated input, or '#', is appended to it
+ *         changed -> will be 1 if what was appended differs from in.
  */
-static NEOERR *neos_auto_url_validate (const char *in, char **esc,
-                                       int quoted, int *do_free)
+static NEOERR *neos_auto_url_validate (const char *in, STRING *out,
+                                       int quoted, int *changed)
 {
   int valid = 0;
   size_t i;
@@ -220,9 +195,8 @@ static NEOERR *neos_auto_url_validate (const char *in, char **esc,
   int num_protocols = sizeof(AUTO_URL_PROTOCOLS) / sizeof(char*);
   char* slashpos;
   void* colonpos;
-  char *s;
 
-  *do_free = 0;
+  *changed = 0;
   inlen = strlen(in);
 
   /*
@@ -261,49 +235,37 @@ static NEOERR *neos_auto_url_validate (const char *in, char **esc,
   }
 
   if (valid)
-    return nerr_pass(neos_auto_html_escape(in, esc, quoted, do_free));
+    return nerr_pass(neos_auto_html_escape(in, out, quoted, changed));
 
   /* 'in' contains an unsupported scheme, replace with '#' */
-  s = (char *) malloc(2);
-  if (s == NULL)
-    return nerr_raise (NERR_NOMEM,
-                       "Unable to allocate memory to escape %s", in);
-
-  s[0] = '#';
-  s[1] = '\0';
-  *esc = s;
-  *do_free = 1;
-  return STATUS_OK;
-
+  *changed = 1;
+  return nerr_pass(string_appendn(out, "#", 1));
 }
 
 /* Function: neos_auto_check_number - Verify that in points to a number.
  * Description: This function scans through in and validates that it contains
  *              a number. Digits, decimal points and spaces are ok. If the
- *              input is not a valid number, output is set to "null". A pointer
- *              to the output is returned in *esc.
+ *              input is not a valid number, output is set to "null".
  * Input: in -> input string
  *
- * Output: esc -> pointer to output string. Will point back to input string
- *                if the input is a valid number. Otherwise, points to '_'.
- *         do_free -> will be 1 if *esc should be freed. If it is 0, *esc
- *                    points to in.
+ * Output: out -> in, if it is a valid number, or "null" is appended to it
+ *         changed -> will be 1 if what was appended differs from in.
  */
-static NEOERR *neos_auto_check_number (const char *in, char **esc, int *do_free)
+static NEOERR *neos_auto_check_number (const char *in, STRING *out,
+                                       int *changed)
 {
   size_t i;
   int inlen;
   int valid;
 
-  *do_free = 0;
+  *changed = 0;
 
   inlen = strlen(in);
   valid = 1;
 
   /* Permit boolean literals */
   if ((strcmp(in, "true") == 0) || (strcmp(in, "false") == 0)) {
-    *esc = (char *)in;
-    return STATUS_OK;
+    return nerr_pass(string_appendn(out, in, inlen));
   }
 
   if (in[0] == '0' && inlen > 2 && (in[1] == 'x' || in[1] == 'X')) {
@@ -333,20 +295,11 @@ static NEOERR *neos_auto_check_number (const char *in, char **esc, int *do_free)
   }
 
   if (!valid) {
-    char *tmp_esc;
-    tmp_esc = (char *) malloc(5);
-    if (tmp_esc == NULL)
-      return nerr_raise (NERR_NOMEM,
-                         "Unable to allocate memory to escape %s", in);
-
-    strcpy(tmp_esc, "null");
-    *esc = tmp_esc;
-    *do_free = 1;
+    *changed = 1;
+    return nerr_pass(string_appendn(out, "null", 4));
   }
-  else
-    *esc = (char *)in;
 
-  return STATUS_OK;
+  return nerr_pass(string_appendn(out, in, inlen));
 }
 
 /* Function: neos_auto_css_validate - Verify that in points to safe css subset.
@@ -354,54 +307,40 @@ static NEOERR *neos_auto_check_number (const char *in, char **esc, int *do_free)
  *              characters that are ok to use as the value of a style property.
  *              Alphanumeric characters, space (0x20), non-ascii characters and
  *              _.,!#%- are allowed.
- *              All other characters are stripped out. A pointer to the
- *              output is returned in *esc.
+ *              All other characters are stripped out.
  * Input: in -> input string
  *
- * Output: esc -> pointer to output string. Will point back to input string
- *                if the input is not modified.
- *         do_free -> will be 1 if *esc should be freed. If it is 0, *esc
- *                    points to in.
+ * Output: out -> the allowed characters of in are appended to it
+ *         changed -> will be 1 if what was appended differs from in.
  */
-static NEOERR *neos_auto_css_validate (const unsigned char *in, char **esc,
-                                       int quoted, int *do_free)
+static NEOERR *neos_auto_css_validate (const unsigned char *in, STRING *out,
+                                       int quoted, int *changed)
 {
+  NEOERR *err;
   int l = 0;
 
-  *do_free = 0;
+  *changed = 0;
   while (in[l] &&
          (isalnum(in[l]) || (in[l] == ' ' && quoted) || 
           IN_LIST(CSS_SAFE_CHARS, in[l]) || in[l] >= 0x80)) {
     l++;
   }
 
-  if (!in[l]) {
-    /* while() looped successfully through all characters in 'in'.
-       'in' is safe to use as is */
-    *esc = (char *)in;
-  }
-  else {
-    /* Create a new string, stripping out all dangerous characters from 'in' */
-    int i = 0;
-    char *s;
-    s = (char *) malloc(strlen(in) + 1);
-    if (s == NULL)
-      return nerr_raise (NERR_NOMEM,
-                         "Unable to allocate memory to escape %s", in);
-
-    l = 0;
-    while (in[l]) {
-      /* Strip out all except a whitelist of characters */
-      if (isalnum(in[l]) || (in[l] == ' ' && quoted) ||
-          IN_LIST(CSS_SAFE_CHARS, in[l]) || in[l] >= 0x80) {
-        s[i++] = in[l];
-      }
-
-      l++;
+  /* Everything up to l is safe to use as is */
+  err = string_appendn(out, (const char *)in, l);
+  if (err != STATUS_OK || !in[l]) return nerr_pass(err);
+
+  /* Strip out all dangerous characters from the rest */
+  *changed = 1;
+  while (in[l]) {
+    /* Strip out all except a whitelist of characters */
+    if (isalnum(in[l]) || (in[l] == ' ' && quoted) ||
+        IN_LIST(CSS_SAFE_CHARS, in[l]) || in[l] >= 0x80) {
+      err = string_append_char(out, in[l]);
+      if (err != STATUS_OK) return nerr_pass(err);
     }
-    s[i] = '\0';
-    *esc = s;
-    *do_free = 1;
+
+    l++;
   }
 
   return STATUS_OK;
@@ -409,25 +348,23 @@ static NEOERR *neos_auto_css_validate (const unsigned char *in, char **esc,
 
 /* Function: neos_auto_js_escape - Javascript escapes input if necessary.
  * Description: This function scans through in, looking for javascript
- *              metacharacters. If any are found, the input is js escaped and
- *              the resulting output returned in *esc.
+ *              metacharacters. If any are found, the input is js escaped.
+ *              The result is appended to out.
  * Input: in -> input string
  *        attr_quoted -> should be 0 if the input string appears on an JS
  *                       attribute and the entire attribute is not quoted.
- * Output: esc -> pointer to output string. Could point back to input string
- *                if the input does not need modification.
- *         do_free -> will be 1 if *esc should be freed. If it is 0, *esc
- *                    points to in.
+ * Output: out -> the escaped input is appended to it
+ *         changed -> will be 1 if what was appended differs from in.
  */
-static NEOERR *neos_auto_js_escape (const char *in, char **esc,
-                                    int attr_quoted, int *do_free)
+static NEOERR *neos_auto_js_escape (const char *in, STRING *out,
+                                    int attr_quoted, int *changed)
 {
-  int nl = 0;
+  NEOERR *err;
   int l = 0;
-  char *s;
+  char hex[4];
   char *metachars = JS_CHARS_LIST;
 
-  *do_free = 0;
+  *changed = 0;
   /*
     attr_quoted can be false if
     - a variable inside a javascript attribute is being escaped
@@ -443,44 +380,34 @@ static NEOERR *neos_auto_js_escape (const char *in, char **esc,
     if (IN_LIST(metachars, in[l]) || (in[l] > 0 && in[l] < 32) ||
         (in[l] == 0x7f))
     {
-      nl += 3;
+      break;
     }
     l++;
   }
 
-  if (nl == 0) {
-    *esc = (char *)in;
-    return STATUS_OK;
-  }
+  err = string_appendn(out, in, l);
+  if (err != STATUS_OK || !in[l]) return nerr_pass(err);
 
-  nl += l;
-  s = (char *) malloc(nl + 1);
-  if (s == NULL)
-    return nerr_raise (NERR_NOMEM, "Unable to allocate memory to escape %s",
-                       in);
-
-  l = 0;
-  nl = 0;
+  *changed = 1;
+  hex[0] = '\\';
+  hex[1] = 'x';
   while (in[l])
   {
     if (IN_LIST(metachars, in[l]) || (in[l] > 0 && in[l] < 32) ||
         (in[l] == 0x7f))
     {
-      s[nl++] = '\\';
-      s[nl++] = 'x';
-      s[nl++] = "0123456789ABCDEF"[(in[l] >> 4) & 0xF];
-      s[nl++] = "0123456789ABCDEF"[in[l] & 0xF];
-      l++;
+      hex[2] = "0123456789ABCDEF"[(in[l] >> 4) & 0xF];
+      hex[3] = "0123456789ABCDEF"[in[l] & 0xF];
+      err = string_appendn(out, hex, 4);
     }
     else
     {
-      s[nl++] = in[l++];
+      err = string_append_char(out, in[l]);
     }
+    if (err != STATUS_OK) return nerr_pass(err);
+    l++;
   }
-  s[nl] = '\0';
 
-  *esc = (char *)s;
-  *do_free = 1;
   return STATUS_OK;
 }
 
@@ -491,48 +418,35 @@ static NEOERR *neos_auto_js_escape (const char *in, char **esc,
  *              characters are stripped out.
  * Input: in -> input string
  *
- * Output: esc -> pointer to output string. Could point back to input string
- *                if the input does not need modification.
- *         do_free -> will be 1 if *esc should be freed. If it is 0, *esc
- *                    points to in.
+ * Output: out -> the allowed characters of in are appended to it
+ *         changed -> will be 1 if what was appended differs from in.
  */
-static NEOERR *neos_auto_tag_validate (const char *in, char **esc, int *do_free)
+static NEOERR *neos_auto_tag_validate (const char *in, STRING *out,
+                                       int *changed)
 {
+  NEOERR *err;
   int l = 0;
 
-  *do_free = 0;
+  *changed = 0;
   while (in[l] &&
          (isalnum(in[l]) || in[l] == ':' || in[l] == '_' || in[l] == '-')) {
     l++;
   }
 
-  if (!in[l]) {
-    /* while() looped successfully through all characters in 'in'.
-       'in' is safe to use as is */
-    *esc = (char *)in;
-  }
-  else {
-    /* Create a new string, stripping out all dangerous characters from 'in' */
-    int i = 0;
-    char *s;
-    s = (char *) malloc(strlen(in) + 1);
-    if (s == NULL)
-      return nerr_raise (NERR_NOMEM,
-                         "Unable to allocate memory to escape %s", in);
-
-    l = 0;
-    while (in[l]) {
-      /* Strip out all except a whitelist of characters */
-      if (isalnum(in[l]) || in[l] == ':' || in[l] == '_' || in[l] == '-') {
-        s[i++] = in[l];
-      }
-
-      l++;
+  /* Everything up to l is safe to use as is */
+  err = string_appendn(out, in, l);
+  if (err != STATUS_OK || !in[l]) return nerr_pass(err);
+
+  /* Strip out all dangerous characters from the rest */
+  *changed = 1;
+  while (in[l]) {
+    /* Strip out all except a whitelist of characters */
+    if (isalnum(in[l]) || in[l] == ':' || in[l] == '_' || in[l] == '-') {
+      err = string_append_char(out, in[l]);
+      if (err != STATUS_OK) return nerr_pass(err);
     }
 
-    s[i] = '\0';
-    *esc = s;
-    *do_free = 1;
+    l++;
   }
 
   return STATUS_OK;
@@ -540,6 +454,32 @@ static NEOERR *neos_auto_tag_validate (const char *in, char **esc, int *do_free)
 
 NEOERR *neos_auto_escape(NEOS_AUTO_CTX *ctx, const char* str, char **esc,
                          int *do_free)
+{
+  NEOERR *err;
+  STRING out;
+
+  if (!esc)
+    return nerr_raise(NERR_ASSERT, "esc is NULL");
+
+  if (!do_free)
+    return nerr_raise(NERR_ASSERT, "do_free is NULL");
+
+  string_init(&out);
+  err = neos_auto_escape_append(ctx, str, &out, do_free);
+  if (err != STATUS_OK || !*do_free)
+  {
+    /* Unchanged, so str will do */
+    string_clear(&out);
+    *do_free = 0;
+    *esc = (char *)str;
+    return nerr_pass(err);
+  }
+  *esc = out.buf;
+  return STATUS_OK;
+}
+
+NEOERR *neos_auto_escape_append(NEOS_AUTO_CTX *ctx, const char* str,
+                                STRING *out, int *changed)
 {
   htmlparser_ctx *hctx;
   int st;
@@ -551,11 +491,11 @@ NEOERR *neos_auto_escape(NEOS_AUTO_CTX *ctx, const char* str, char **esc,
   if (!str)
     return nerr_raise(NERR_ASSERT, "str is NULL");
 
-  if (!esc)
-    return nerr_raise(NERR_ASSERT, "esc is NULL");
+  if (!out)
+    return nerr_raise(NERR_ASSERT, "out is NULL");
 
-  if (!do_free)
-    return nerr_raise(NERR_ASSERT, "do_free is NULL");
+  if (!changed)
+    return nerr_raise(NERR_ASSERT, "changed is NULL");
 
   hctx = ctx->hctx;
   st = htmlparser_state(hctx);
@@ -563,7 +503,7 @@ NEOERR *neos_auto_escape(NEOS_AUTO_CTX *ctx, const char* str, char **esc,
 
   /* Inside an HTML tag or attribute name */
   if (st == HTMLPARSER_STATE_ATTR || st == HTMLPARSER_STATE_TAG) {
-    return nerr_pass(neos_auto_tag_validate(str, esc, do_free));
+    return nerr_pass(neos_auto_tag_validate(str, out, changed));
   }
 
   /* Inside an HTML attribute value */
@@ -575,20 +515,20 @@ NEOERR *neos_auto_escape(NEOS_AUTO_CTX *ctx, const char* str, char **esc,
     switch (type) {
       case HTMLPARSER_ATTR_REGULAR:
         /* <input value="<?cs var: Blah ?>"> : */
-        return nerr_pass(neos_auto_html_escape(str, esc,
-                                               attr_quoted, do_free));
+        return nerr_pass(neos_auto_html_escape(str, out,
+                                               attr_quoted, changed));
         
       case HTMLPARSER_ATTR_URI:
         if (htmlparser_value_index(hctx) == 0)
           /* <a href="<?cs var:MyUrl ?>"> : Validate URI scheme of MyUrl */
-          return nerr_pass(neos_auto_url_validate(str, esc,
-                                                  attr_quoted, do_free));
+          return nerr_pass(neos_auto_url_validate(str, out,
+                                                  attr_quoted, changed));
         else
           /* <a href="http://www.blah.com?x=<?cs var: MyQuery ?>">:
             MyQuery is not at start of URL, so it only needs html escaping.
           */
-          return nerr_pass(neos_auto_html_escape(str, esc,
-                                                 attr_quoted, do_free));
+          return nerr_pass(neos_auto_html_escape(str, out,
+                                                 attr_quoted, changed));
 
       case HTMLPARSER_ATTR_JS:
         if (htmlparser_is_js_quoted(hctx))
@@ -599,8 +539,8 @@ NEOERR *neos_auto_escape(NEOS_AUTO_CTX *ctx, const char* str, char **esc,
             Note: neos_auto_js_escape() hex encodes all html metacharacters.
             Therefore it is safe to not do an HTML escape around this.
           */
-          return nerr_pass(neos_auto_js_escape(str, esc, attr_quoted,
-                                               do_free));
+          return nerr_pass(neos_auto_js_escape(str, out, attr_quoted,
+                                               changed));
         else
           /* <input onclick="alert(<?cs var:Blah ?>);"> OR
              <input onclick=alert(<?cs var:Blah ?>);> :
@@ -609,13 +549,13 @@ NEOERR *neos_auto_escape(NEOS_AUTO_CTX *ctx, const char* str, char **esc,
             inject arbitrary javascript. Only reason to omit the quotes is if
             the variable is intended to be a number.
           */
-          return nerr_pass(neos_auto_check_number(str, esc, do_free));
+          return nerr_pass(neos_auto_check_number(str, out, changed));
         break;
 
       case HTMLPARSER_ATTR_STYLE:
         /* <input style="border:<?cs var: FancyBorder ?>"> : */
-        return nerr_pass(neos_auto_css_validate((unsigned char*)str, esc,
-                                                attr_quoted, do_free));
+        return nerr_pass(neos_auto_css_validate((unsigned char*)str, out,
+                                                attr_quoted, changed));
 
       default:
         return nerr_raise(NERR_ASSERT, 
@@ -626,8 +566,8 @@ NEOERR *neos_auto_escape(NEOS_AUTO_CTX *ctx, const char* str, char **esc,
 
   if (st == HTMLPARSER_STATE_CSS_FILE || 
       (st == HTMLPARSER_STATE_TEXT && tag && strcmp(tag, "style") == 0)) {
-    return nerr_pass(neos_auto_css_validate(str, esc,
-                                            1, do_free));
+    return nerr_pass(neos_auto_css_validate(str, out,
+                                            1, changed));
   }
 
   /* Inside javascript. Do JS escaping */
@@ -637,15 +577,15 @@ NEOERR *neos_auto_escape(NEOS_AUTO_CTX *ctx, const char* str, char **esc,
       /* TODO(mugdha): This also includes variables inside javascript comments.
          They will also get stripped out if they are not numbers.
       */
-      return nerr_pass(neos_auto_js_escape(str, esc, 1, do_free));
+      return nerr_pass(neos_auto_js_escape(str, out, 1, changed));
     else
       /* <script> var a = "<?cs var: Blah ?>"; </script> */
-      return nerr_pass(neos_auto_check_number(str, esc, do_free));
+      return nerr_pass(neos_auto_check_number(str, out, changed));
   }
 
   /* Default is assumed to be HTML body */
   /* <b>Hello <?cs var: UserName ?></b> : */
-  return nerr_pass(neos_auto_html_escape(str, esc, 1, do_free));
+  return nerr_pass(neos_auto_html_escape(str, out, 1, changed));
 
 }
 
@@ -674,6 +614,7 @@ NEOERR *neos_auto_parse_var(NEOS_AUTO_CTX *ctx, const char *str, int len)
        This will be a problem if variables are used for tags we care about:
        i.e. script, style, title, textarea.
     */
+    ctx->state = NULL;
     retval = htmlparser_parse(ctx->hctx, str, len);
     if (retval == HTMLPARSER_STATE_ERROR)
       return nerr_raise(NERR_ASSERT,
@@ -694,6 +635,7 @@ NEOERR *neos_auto_parse(NEOS_AUTO_CTX *ctx, const char *str, int len)
   if (!str)
     return nerr_raise(NERR_ASSERT, "str is NULL");
 
+  ctx->state = NULL;
   retval = htmlparser_parse(ctx->hctx, str, len);
   if (retval == HTMLPARSER_STATE_ERROR)
   {
@@ -728,6 +670,7 @@ NEOERR *neos_auto_set_content_type(NEOS_AUTO_CTX *ctx, const char *type)
   for (esc = &ContentTypeList[0]; esc->content_type != NULL; esc++) {
     if (strcmp(type, esc->content_type) == 0) {
         htmlparser_reset_mode(ctx->hctx, esc->parser_mode);
+        ctx->state = NULL;
         return STATUS_OK;
     }
   }
@@ -749,6 +692,7 @@ NEOERR* neos_auto_init(NEOS_AUTO_CTX **pctx)
     return nerr_raise(NERR_NOMEM, "Could not create autoescape context");
 
   (*pctx)->hctx = htmlparser_new();
+  (*pctx)->state = &ResetState;
 
   if ((*pctx)->hctx == NULL)
     err = nerr_raise(NERR_NOMEM, "Could not create autoescape context");
@@ -772,6 +716,7 @@ NEOERR* neos_auto_reset(NEOS_AUTO_CTX *ctx)
     if (ctx->hctx == NULL)
       err = nerr_raise(NERR_NOMEM, "Could not create htmlparser context");
   }
+  ctx->state = &ResetState;
 
   return err;
 }
@@ -788,3 +733,96 @@ void neos_auto_destroy(NEOS_AUTO_CTX **pctx)
   }
   *pctx = NULL;
 }
+
+NEOERR *neos_auto_copy(NEOS_AUTO_CTX **pdst, NEOS_AUTO_CTX *src)
+{
+  NEOERR *err;
+
+  if (!src)
+    return nerr_raise(NERR_ASSERT, "src is NULL");
+
+  err = neos_auto_init(pdst);
+  if (err != STATUS_OK)
+  {
+    neos_auto_destroy(pdst);
+    return nerr_pass(err);
+  }
+  htmlparser_copy((*pdst)->hctx, src->hctx);
+  (*pdst)->state = src->state;
+  return STATUS_OK;
+}
+
+int neos_auto_in_tag(NEOS_AUTO_CTX *ctx)
+{
+  int st = htmlparser_state(ctx->hctx);
+
+  /* The same test as neos_auto_parse_var */
+  return ((st == HTMLPARSER_STATE_VALUE) ||
+          (st == HTMLPARSER_STATE_ATTR) ||
+          (st == HTMLPARSER_STATE_TAG));
+}
+
+NEOS_AUTO_STATE *neos_auto_state(NEOS_AUTO_CTX *ctx)
+{
+  return ctx->state;
+}
+
+NEOERR *neos_auto_save(NEOS_AUTO_CTX *ctx, int keep, NEOS_AUTO_STATE **pstate)
+{
+  NEOS_AUTO_STATE *state;
+
+  if (!ctx)
+    return nerr_raise(NERR_ASSERT, "ctx is NULL");
+
+  state = (NEOS_AUTO_STATE *) calloc (1, sizeof(NEOS_AUTO_STATE));
+  if (state == NULL)
+    return nerr_raise(NERR_NOMEM, "Could not save autoescape state");
+
+  if (keep)
+  {
+    state->hctx = htmlparser_new();
+    if (state->hctx == NULL)
+    {
+      free(state);
+      return nerr_raise(NERR_NOMEM, "Could not save autoescape state");
+    }
+    htmlparser_copy(state->hctx, ctx->hctx);
+  }
+  ctx->state = state;
+  *pstate = state;
+  return STATUS_OK;
+}
+
+NEOERR *neos_auto_restore(NEOS_AUTO_CTX *ctx, NEOS_AUTO_STATE *state)
+{
+  if (!ctx)
+    return nerr_raise(NERR_ASSERT, "ctx is NULL");
+
+  if (!state || !state->hctx)
+    return nerr_raise(NERR_ASSERT, "state wasn't saved with its parser");
+
+  htmlparser_copy(ctx->hctx, state->hctx);
+  ctx->state = state;
+  return STATUS_OK;
+}
+
+void neos_auto_set_state(NEOS_AUTO_CTX *ctx, NEOS_AUTO_STATE *state)
+{
+  ctx->state = state;
+}
+
+int neos_auto_state_kept(NEOS_AUTO_STATE *state)
+{
+  return state->hctx != NULL;
+}
+
+void neos_auto_state_destroy(NEOS_AUTO_STATE **pstate)
+{
+  if (!pstate || !*pstate)
+    return;
+
+  if ((*pstate)->hctx)
+    htmlparser_delete((*pstate)->hctx);
+  free(*pstate);
+  *pstate = NULL;
+}
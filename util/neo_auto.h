@@ -16,6 +16,9 @@ __BEGIN_DECLS
 struct _neos_auto_ctx;
 typedef struct _neos_auto_ctx NEOS_AUTO_CTX;
 
+struct _neos_auto_state;
+typedef struct _neos_auto_state NEOS_AUTO_STATE;
+
 /*
  * Function: neos_auto_escape - Escape input according to auto-escape context.
  * Description: neos_auto_escape takes an auto-escape context, determines the
@@ -35,6 +38,23 @@ typedef struct _neos_auto_ctx NEOS_AUTO_CTX;
 NEOERR *neos_auto_escape(NEOS_AUTO_CTX *ctx, const char* str,
                          char **esc, int *do_free);
 
+/*
+ * Function: neos_auto_escape_append - Escape input onto the end of a STRING.
+ * Description: neos_auto_escape_append escapes input the same way as
+ *              neos_auto_escape, but appends the result to out instead of
+ *              returning it, so nothing needs to be allocated for it (beyond
+ *              growing out).
+ * Input: ctx -> an object specifying the currrent auto-escape context.
+ *        str -> input string which will be escaped.
+ *
+ * Output: out -> the escaped string is appended to it.
+ *         changed -> set to true if what was appended differs from str.
+ * Returns: NERR_NOMEM if unable to grow out.
+ *          NERR_ASSERT if any of the supplied pointers are NULL.
+ */
+NEOERR *neos_auto_escape_append(NEOS_AUTO_CTX *ctx, const char* str,
+                                STRING *out, int *changed);
+
 /*
  * Function: neos_auto_parse_var - Parse input if parser is in interesting state.
  * Description: neos_auto_parse_var takes an auto-escape context, which contains
@@ -121,6 +141,98 @@ void neos_auto_destroy(NEOS_AUTO_CTX **pctx);
  */
 NEOERR *neos_auto_set_content_type(NEOS_AUTO_CTX *ctx, const char *type);
 
+/*
+ * Function: neos_auto_copy - Create a copy of a NEOS_AUTO_CTX object.
+ * Description: Returns a new NEOS_AUTO_CTX object whose parser is in the
+ *              same state as src, so the two can be fed different input.
+ * Input: pdst -> pointer to pointer to NEOS_AUTO_CTX structure.
+ *        src -> the NEOS_AUTO_CTX to copy.
+ * Output: pdst -> will contain the new NEOS_AUTO_CTX object.
+ * Returns: NERR_NOMEM if unable to allocate memory for *pdst.
+ */
+NEOERR *neos_auto_copy(NEOS_AUTO_CTX **pdst, NEOS_AUTO_CTX *src);
+
+/*
+ * Function: neos_auto_in_tag - Check whether variables will be parsed.
+ * Description: Returns whether the parser is inside a tag declaration, which
+ *              is when neos_auto_parse_var passes its input to the parser.
+ * Input: ctx -> an object specifying the currrent auto-escape context.
+ * Output: None.
+ * Returns: 1 if inside a tag declaration, 0 otherwise.
+ */
+int neos_auto_in_tag(NEOS_AUTO_CTX *ctx);
+
+/*
+ * Function: neos_auto_state - Return the saved state the parser is in.
+ * Description: A NEOS_AUTO_CTX tracks which NEOS_AUTO_STATE its parser is
+ *              known to be in: the one last saved or restored, or a shared
+ *              state for a freshly initialized or reset parser.  Parsing
+ *              input (other than a variable outside a tag) or setting the
+ *              content type forgets it.  As parsing is deterministic,
+ *              parsing the same input from the same saved state always
+ *              gives the same result, so that result can be saved once
+ *              and restored instead of parsed again.
+ * Input: ctx -> an object specifying the currrent auto-escape context.
+ * Output: None.
+ * Returns: The known state, or NULL if the state isn't known.
+ */
+NEOS_AUTO_STATE *neos_auto_state(NEOS_AUTO_CTX *ctx);
+
+/*
+ * Function: neos_auto_save - Save the current parser state.
+ * Description: Creates a new NEOS_AUTO_STATE for the current parser state,
+ *              which becomes the state ctx is known to be in.  If keep is
+ *              not set, the parser itself isn't copied, and the state can
+ *              only be used with neos_auto_set_state.
+ * Input: ctx -> an object specifying the currrent auto-escape context.
+ *        keep -> whether to keep a copy of the parser for neos_auto_restore.
+ * Output: pstate -> will contain the new NEOS_AUTO_STATE.
+ * Returns: NERR_NOMEM if unable to allocate memory for *pstate.
+ */
+NEOERR *neos_auto_save(NEOS_AUTO_CTX *ctx, int keep, NEOS_AUTO_STATE **pstate);
+
+/*
+ * Function: neos_auto_restore - Put the parser into a saved state.
+ * Description: Copies the parser saved in state (with keep set) into ctx.
+ * Input: ctx -> an object specifying the currrent auto-escape context.
+ *        state -> the NEOS_AUTO_STATE to restore.
+ * Output: None.
+ * Returns: NERR_ASSERT if state doesn't have a copy of the parser.
+ */
+NEOERR *neos_auto_restore(NEOS_AUTO_CTX *ctx, NEOS_AUTO_STATE *state);
+
+/*
+ * Function: neos_auto_set_state - Record that the parser is in a saved state.
+ * Description: For when the caller knows the parser has reached state
+ *              itself, because it parsed the same input from the same state
+ *              as when state was saved.
+ * Input: ctx -> an object specifying the currrent auto-escape context.
+ *        state -> the NEOS_AUTO_STATE the parser is now in.
+ * Output: None.
+ * Returns: None.
+ */
+void neos_auto_set_state(NEOS_AUTO_CTX *ctx, NEOS_AUTO_STATE *state);
+
+/*
+ * Function: neos_auto_state_kept - Check whether a state can be restored.
+ * Description: Returns whether state was saved with keep set.
+ * Input: state -> a NEOS_AUTO_STATE.
+ * Output: None.
+ * Returns: 1 if state has a copy of the parser, 0 otherwise.
+ */
+int neos_auto_state_kept(NEOS_AUTO_STATE *state);
+
+/*
+ * Function: neos_auto_state_destroy - Free a NEOS_AUTO_STATE.
+ * Description: Frees the saved state.  Any NEOS_AUTO_CTX in this state
+ *              must be reset (or have its state forgotten) before the
+ *              memory could be reused for another state.
+ * Input: pstate -> pointer to pointer that should be freed.
+ * Output: None.
+ * Returns: None.
+ */
+void neos_auto_state_destroy(NEOS_AUTO_STATE **pstate);
+
 __END_DECLS
 
 #endif /* __NEO_AUTO_H_ */
@@ -36,7 +36,6 @@ int NERR_DB = 0;
 int NERR_EXISTS = 0;
 int NERR_MAX_RECURSION = 0;
 
-static NEOERR *FreeList = NULL;
 static ULIST *Errors = NULL;
 static int Inited = 0;
 #ifdef HAVE_PTHREADS
@@ -44,54 +43,34 @@ static int Inited = 0;
 static pthread_mutex_t InitLock = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
-/* Set this to 1 to enable non-thread safe re-use of NEOERR data
- * structures.  This was a premature performance optimization that isn't
- * thread safe, if we want it thread safe we need to add mutex code...
- * which has its own performance penalties...
- */
-static int UseFreeList = 0;
+/* The errors returned by nerr_raise_static, one for each of the first
+ * NERR_STATIC_MAX error types.  They are filled in when the type is
+ * registered and never change after that, so they can be shared between
+ * threads. */
+#define NERR_STATIC_MAX 64
+#define NERR_STATIC_DESC "(raised without a description)"
+static NEOERR StaticErrors[NERR_STATIC_MAX];
 
 static NEOERR *_err_alloc(void)
 {
   NEOERR *err;
 
-  if (!UseFreeList || FreeList == NULL)
+  err = (NEOERR *)calloc (1, sizeof (NEOERR));
+  if (err == NULL)
   {
-    err = (NEOERR *)calloc (1, sizeof (NEOERR));
-    if (err == NULL)
-    {
-      ne_warn("INTERNAL ERROR: Unable to allocate memory for NEOERR");
-      return INTERNAL_ERR;
-    }
-    return err;
+    ne_warn("INTERNAL ERROR: Unable to allocate memory for NEOERR");
+    return INTERNAL_ERR;
   }
-  else
-  {
-    err = FreeList;
-    FreeList = FreeList->next;
-  }
-  err->flags |= NE_IN_USE;
-  err->next = NULL;
   return err;
 }
 
 static int _err_free (NEOERR *err)
 {
-  if (err == NULL || err == INTERNAL_ERR)
+  if (err == NULL || err == INTERNAL_ERR || (err->flags & NE_STATIC))
     return 0;
   if (err->next != NULL)
     _err_free(err->next);
-  if (UseFreeList)
-  {
-    err->next = FreeList;
-    FreeList = err;
-    err->flags = 0;
-    err->desc[0] = '\0';
-  }
-  else
-  {
-    free(err);
-  }
+  free(err);
   return 0;
 }
 
@@ -117,6 +96,15 @@ NEOERR *nerr_raisef (const char *func, const char *file, int lineno, int error,
   return err;
 }
 
+NEOERR *nerr_raise_staticf (const char *func, const char *file, int lineno,
+                            NERR_TYPE error)
+{
+  if (error > 0 && error <= NERR_STATIC_MAX &&
+      StaticErrors[error - 1].error == error)
+    return &(StaticErrors[error - 1]);
+  return nerr_raisef (func, file, lineno, error, NERR_STATIC_DESC);
+}
+
 NEOERR *nerr_raise_errnof (const char *func, const char *file, int lineno,
                                int error, const char *fmt, ...)
 {
@@ -148,7 +136,9 @@ NEOERR *nerr_passf (const char *func, const char *file, int lineno, NEOERR *err)
 {
   NEOERR *nerr;
 
-  if (err == STATUS_OK)
+  /* Static errors are for errors which are expected to be handled, so
+   * they don't carry a traceback */
+  if (err == STATUS_OK || err == INTERNAL_ERR || (err->flags & NE_STATIC))
     return err;
 
   nerr = _err_alloc();
@@ -466,6 +456,16 @@ NEOERR *nerr_register (int *val, const char *name)
   if (err != STATUS_OK) return nerr_pass(err);
 
   *val = uListLength(Errors);
+  if (*val <= NERR_STATIC_MAX)
+  {
+    err = &(StaticErrors[*val - 1]);
+    err->flags = NE_STATIC;
+    strcpy (err->desc, NERR_STATIC_DESC);
+    err->func = "nerr_raise_static";
+    err->file = __FILE__;
+    err->lineno = 0;
+    err->error = *val;
+  }
   return STATUS_OK;
 }
 
@@ -25,6 +25,7 @@ __BEGIN_DECLS
 
 /* NEOERR flags */
 #define NE_IN_USE (1<<0)
+#define NE_STATIC (1<<1)
 
 typedef int NERR_TYPE;
 
@@ -95,6 +96,27 @@ NEOERR *nerr_raise_errnof (const char *func, const char *file, int lineno,
                            int error, const char *fmt, ...)
                            ATTRIBUTE_PRINTF(5,6);
 
+/*
+ * function: nerr_raise_static
+ * description: Use this method instead of nerr_raise for errors which
+ *              are expected to be handled by the caller, like a
+ *              NERR_NOT_FOUND while searching for a file.  It returns a
+ *              shared, read-only error for the type, so it doesn't
+ *              allocate or format anything, and nerr_pass passes it
+ *              along unchanged.  The error has no description or
+ *              traceback of its own; use nerr_pass_ctx to add context
+ *              if it is going to be reported.  Freeing it with
+ *              nerr_handle or nerr_ignore is still fine.
+ * arguments: the error type
+ * returns: a pointer to a NEOERR, allocated with nerr_raise if the type
+ *          has no shared error (only the first 64 registered types do)
+ */
+#define nerr_raise_static(e) \
+   nerr_raise_staticf(__PRETTY_FUNCTION__,__FILE__,__LINE__,e)
+
+NEOERR *nerr_raise_staticf (const char *func, const char *file, int lineno,
+                            NERR_TYPE error);
+
 /* function: nerr_pass - pass a clearsilver error up a level in the call chain
  * description: this function is used to pass an error up a level in the
  *              call chain (ie, if the error isn't handled at the
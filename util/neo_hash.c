@@ -18,8 +18,26 @@
 #include "neo_err.h"
 #include "neo_hash.h"
 
+/* Tables start small, since most of them (HDF levels just past
+ * FORCE_HASH_AT, per-parse include lists) never hold many entries, and
+ * double whenever they are more than 3/4 full. */
+#define HASH_INIT_SIZE 16
+#define HASH_FULL(size, num) ((num) * 4 > (size) * 3)
+
 static NEOERR *_hash_resize(NE_HASH *hash);
-static NE_HASHNODE **_hash_lookup_node (NE_HASH *hash, void *key, UINT32 *hashv);
+static UINT32 _hash_lookup_node (NE_HASH *hash, void *key, UINT32 *hashv);
+static UINT32 _hash_find_node (NE_HASH *hash, void *key, UINT32 hashv);
+
+/* The hash functions we're given aren't always good in their low bits
+ * (ne_hash_int_hash of an aligned pointer, for one), so mix them before
+ * picking a slot. */
+static UINT32 _hash_slot (UINT32 hashv, UINT32 size)
+{
+  hashv ^= hashv >> 16;
+  hashv *= 0x85ebca6b;
+  hashv ^= hashv >> 13;
+  return hashv & (size - 1);
+}
 
 NEOERR *ne_hash_init (NE_HASH **hash, NE_HASH_FUNC hash_func, NE_COMP_FUNC comp_func)
 {
@@ -29,12 +47,12 @@ NEOERR *ne_hash_init (NE_HASH **hash, NE_HASH_FUNC hash_func, NE_COMP_FUNC comp_
   if (my_hash == NULL)
     return nerr_raise(NERR_NOMEM, "Unable to allocate memory for NE_HASH");
 
-  my_hash->size = 256;
+  my_hash->size = HASH_INIT_SIZE;
   my_hash->num = 0;
   my_hash->hash_func = hash_func;
   my_hash->comp_func = comp_func;
 
-  my_hash->nodes = (NE_HASHNODE **) calloc (my_hash->size, sizeof(NE_HASHNODE *));
+  my_hash->nodes = (NE_HASHNODE *) calloc (my_hash->size, sizeof(NE_HASHNODE));
   if (my_hash->nodes == NULL)
   {
     free(my_hash);
@@ -49,24 +67,12 @@ NEOERR *ne_hash_init (NE_HASH **hash, NE_HASH_FUNC hash_func, NE_COMP_FUNC comp_
 void ne_hash_destroy (NE_HASH **hash)
 {
   NE_HASH *my_hash;
-  NE_HASHNODE *node, *next;
-  int x;
 
   if (hash == NULL || *hash == NULL)
     return;
 
   my_hash = *hash;
 
-  for (x = 0; x < my_hash->size; x++)
-  {
-    node = my_hash->nodes[x];
-    while (node)
-    {
-      next = node->next;
-      free(node);
-      node = next;
-    }
-  }
   free(my_hash->nodes);
   my_hash->nodes = NULL;
   free(my_hash);
@@ -75,54 +81,91 @@ void ne_hash_destroy (NE_HASH **hash)
 
 NEOERR *ne_hash_insert(NE_HASH *hash, void *key, void *value)
 {
-  UINT32 hashv;
-  NE_HASHNODE **node;
+  return nerr_pass(ne_hash_insert_hashv(hash, key, value,
+	hash->hash_func(key)));
+}
 
-  node = _hash_lookup_node(hash, key, &hashv);
+NEOERR *ne_hash_insert_hashv(NE_HASH *hash, void *key, void *value,
+                             UINT32 hashv)
+{
+  NEOERR *err;
+  NE_HASHNODE *node;
 
-  if (*node)
+  node = &(hash->nodes[_hash_find_node(hash, key, hashv)]);
+
+  if (node->key)
   {
-    (*node)->value = value;
+    node->value = value;
+    return STATUS_OK;
   }
-  else
+
+  if (HASH_FULL(hash->size, hash->num + 1))
   {
-    *node = (NE_HASHNODE *) malloc(sizeof(NE_HASHNODE));
-    if (node == NULL)
-      return nerr_raise(NERR_NOMEM, "Unable to allocate NE_HASHNODE");
-
-    (*node)->hashv = hashv;
-    (*node)->key = key;
-    (*node)->value = value;
-    (*node)->next = NULL;
+    err = _hash_resize(hash);
+    if (err) return nerr_pass(err);
+    node = &(hash->nodes[_hash_find_node(hash, key, hashv)]);
   }
+
+  node->hashv = hashv;
+  node->key = key;
+  node->value = value;
   hash->num++;
 
-  return _hash_resize(hash);
+  return STATUS_OK;
 }
 
 void *ne_hash_lookup(NE_HASH *hash, void *key)
 {
   NE_HASHNODE *node;
 
-  node = *_hash_lookup_node(hash, key, NULL);
+  node = &(hash->nodes[_hash_lookup_node(hash, key, NULL)]);
 
-  return (node) ? node->value : NULL;
+  return (node->key) ? node->value : NULL;
 }
 
+void *ne_hash_lookup_hashv(NE_HASH *hash, void *key, UINT32 hashv)
+{
+  NE_HASHNODE *node;
+
+  node = &(hash->nodes[_hash_find_node(hash, key, hashv)]);
+
+  return (node->key) ? node->value : NULL;
+}
+
+/* Removing leaves no tombstone: the entries after the hole in the same
+ * run are shifted back over it unless that would move them in front of
+ * their home slot, so every probe still stops at the first empty slot. */
 void *ne_hash_remove(NE_HASH *hash, void *key)
 {
-  NE_HASHNODE **node, *rem;
-  void *value = NULL;
+  NE_HASHNODE *nodes = hash->nodes;
+  UINT32 mask = hash->size - 1;
+  UINT32 x, y, home;
+  void *value;
+
+  x = _hash_lookup_node(hash, key, NULL);
+  if (nodes[x].key == NULL)
+    return NULL;
 
-  node = _hash_lookup_node(hash, key, NULL);
-  if (*node)
+  value = nodes[x].value;
+  hash->num--;
+
+  y = x;
+  while (1)
   {
-    rem = *node;
-    *node = rem->next;
-    value = rem->value;
-    free(rem);
-    hash->num--;
+    y = (y + 1) & mask;
+    if (nodes[y].key == NULL)
+      break;
+    home = _hash_slot(nodes[y].hashv, hash->size);
+    /* leave it alone if home is cyclically in (x, y] */
+    if (((y - home) & mask) < ((y - x) & mask))
+      continue;
+    nodes[x] = nodes[y];
+    x = y;
   }
+  nodes[x].key = NULL;
+  nodes[x].value = NULL;
+  nodes[x].hashv = 0;
+
   return value;
 }
 
@@ -130,144 +173,105 @@ int ne_hash_has_key(NE_HASH *hash, void *key)
 {
   NE_HASHNODE *node;
 
-  node = *_hash_lookup_node(hash, key, NULL);
+  node = &(hash->nodes[_hash_lookup_node(hash, key, NULL)]);
 
-  if (node) return 1;
+  if (node->key) return 1;
   return 0;
 }
 
+/* Slots are walked in array order, so this visits every entry once as
+ * long as nothing is inserted or removed in between. */
 void *ne_hash_next(NE_HASH *hash, void **key)
 {
-  NE_HASHNODE **node = 0;
-  UINT32 hashv, bucket;
+  UINT32 x, hashv;
 
   if (*key)
   {
-    node = _hash_lookup_node(hash, *key, NULL);
-
-    if (*node)
-    {
-      bucket = (*node)->hashv & (hash->size - 1);
-    }
+    x = _hash_lookup_node(hash, *key, &hashv);
+    if (hash->nodes[x].key)
+      x++;
     else
-    {
-      hashv = hash->hash_func(*key);
-      bucket = hashv & (hash->size - 1);
-    }
+      x = _hash_slot(hashv, hash->size);
   }
   else
   {
-    bucket = 0;
-  }
-
-  if (node && *node)
-  {
-    if ((*node)->next)
-    {
-      *key = (*node)->next->key;
-      return (*node)->next->value;
-    }
-    bucket++;
+    x = 0;
   }
 
-  while (bucket < hash->size)
+  while (x < hash->size)
   {
-    if (hash->nodes[bucket])
+    if (hash->nodes[x].key)
     {
-      *key = hash->nodes[bucket]->key;
-      return hash->nodes[bucket]->value;
+      *key = hash->nodes[x].key;
+      return hash->nodes[x].value;
     }
-    bucket++;
+    x++;
   }
 
   return NULL;
 }
 
-static NE_HASHNODE **_hash_lookup_node (NE_HASH *hash, void *key, UINT32 *o_hashv)
+static UINT32 _hash_lookup_node (NE_HASH *hash, void *key, UINT32 *o_hashv)
 {
-  UINT32 hashv, bucket;
-  NE_HASHNODE **node;
+  UINT32 hashv;
 
   hashv = hash->hash_func(key);
   if (o_hashv) *o_hashv = hashv;
-  bucket = hashv & (hash->size - 1);
-  /* ne_warn("Lookup %s %d %d", key, hashv, bucket); */
+  return _hash_find_node(hash, key, hashv);
+}
+
+/* Returns the slot holding key, or the empty slot where it would go */
+static UINT32 _hash_find_node (NE_HASH *hash, void *key, UINT32 hashv)
+{
+  NE_HASHNODE *nodes = hash->nodes;
+  UINT32 mask = hash->size - 1;
+  UINT32 x;
 
-  node = &(hash->nodes[bucket]);
+  x = _hash_slot(hashv, hash->size);
 
   if (hash->comp_func)
   {
-    while (*node && !(hash->comp_func((*node)->key, key)))
-      node = &(*node)->next;
+    while (nodes[x].key && !(nodes[x].hashv == hashv &&
+	  hash->comp_func(nodes[x].key, key)))
+      x = (x + 1) & mask;
   }
   else
   {
     /* No comp_func means we're doing pointer comparisons */
-    while (*node && (*node)->key != key)
-      node = &(*node)->next;
+    while (nodes[x].key && nodes[x].key != key)
+      x = (x + 1) & mask;
   }
 
-  /* ne_warn("Node %x", node); */
-  return node;
+  return x;
 }
 
-/* Ok, we're doing some weirdness here... */
+/* We always double in size, and since the hash values are stored we just
+ * reinsert every entry without calling hash_func. */
 static NEOERR *_hash_resize(NE_HASH *hash)
 {
-  NE_HASHNODE **new_nodes;
-  NE_HASHNODE *entry, *prev;
-  int x, next_bucket;
-  int orig_size = hash->size;
-  UINT32 hash_mask;
+  NE_HASHNODE *old_nodes = hash->nodes;
+  NE_HASHNODE *new_nodes;
+  UINT32 old_size = hash->size;
+  UINT32 new_size = old_size * 2;
+  UINT32 x, y;
 
-  if (hash->size > hash->num)
-    return STATUS_OK;
-
-  /* We always double in size */
-  new_nodes = (NE_HASHNODE **) realloc (hash->nodes, (hash->size*2) * sizeof(NE_HASHNODE));
+  new_nodes = (NE_HASHNODE *) calloc (new_size, sizeof(NE_HASHNODE));
   if (new_nodes == NULL)
     return nerr_raise(NERR_NOMEM, "Unable to allocate memory to resize NE_HASH");
 
-  hash->nodes = new_nodes;
-  orig_size = hash->size;
-  hash->size = hash->size*2;
-
-  /* Initialize new parts */
-  for (x = orig_size; x < hash->size; x++)
+  for (x = 0; x < old_size; x++)
   {
-    hash->nodes[x] = NULL;
+    if (old_nodes[x].key == NULL) continue;
+    y = _hash_slot(old_nodes[x].hashv, new_size);
+    while (new_nodes[y].key)
+      y = (y + 1) & (new_size - 1);
+    new_nodes[y] = old_nodes[x];
   }
 
-  hash_mask = hash->size - 1;
+  free(old_nodes);
+  hash->nodes = new_nodes;
+  hash->size = new_size;
 
-  for (x = 0; x < orig_size; x++)
-  {
-    prev = NULL;
-    next_bucket = x + orig_size;
-    for (entry = hash->nodes[x]; 
-	 entry; 
-	 entry = prev ? prev->next : hash->nodes[x]) 
-    {
-      if ((entry->hashv & hash_mask) != x)
-      {
-	if (prev)
-	{
-	  prev->next = entry->next;
-	}
-	else
-	{
-	  hash->nodes[x] = entry->next;
-	}
-	entry->next = hash->nodes[next_bucket];
-	hash->nodes[next_bucket] = entry;
-      }
-      else
-      {
-	prev = entry;
-      }
-    }
-  }
-  
   return STATUS_OK;
 }
 
@@ -276,9 +280,32 @@ int ne_hash_str_comp(const void *a, const void *b)
   return !strcmp((const char *)a, (const char *)b);
 }
 
+/* FNV-1a: much cheaper than ne_crc, and _hash_slot makes up for its
+ * weaker mixing */
+UINT32 ne_hash_mem(const void *data, UINT32 len)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  UINT32 hashv = 2166136261U;
+
+  while (len--)
+  {
+    hashv ^= *p++;
+    hashv *= 16777619U;
+  }
+  return hashv;
+}
+
 UINT32 ne_hash_str_hash(const void *a)
 {
-  return ne_crc((unsigned char *)a, strlen((const char *)a));
+  const unsigned char *p = (const unsigned char *)a;
+  UINT32 hashv = 2166136261U;
+
+  while (*p)
+  {
+    hashv ^= *p++;
+    hashv *= 16777619U;
+  }
+  return hashv;
 }
 
 int ne_hash_int_comp(const void *a, const void *b)
@@ -20,20 +20,23 @@ __BEGIN_DECLS
 typedef UINT32 (*NE_HASH_FUNC)(const void *);
 typedef int (*NE_COMP_FUNC)(const void *, const void *);
 
+/* The table is open addressed: the nodes are the slots themselves, kept
+ * inline in one array with linear probing, and a NULL key marks an empty
+ * slot.  The hash value is stored so probes can skip most comp_func calls
+ * and so growing never needs to call hash_func again. */
 typedef struct _NE_HASHNODE
 {
   void *key;
   void *value;
   UINT32 hashv;
-  struct _NE_HASHNODE *next;
 } NE_HASHNODE;
 
 typedef struct _HASH
 {
-  UINT32 size;
+  UINT32 size;      /* always a power of two */
   UINT32 num;
 
-  NE_HASHNODE **nodes;
+  NE_HASHNODE *nodes;
   NE_HASH_FUNC hash_func;
   NE_COMP_FUNC comp_func;
 } NE_HASH;
@@ -41,13 +44,23 @@ typedef struct _HASH
 NEOERR *ne_hash_init (NE_HASH **hash, NE_HASH_FUNC hash_func, NE_COMP_FUNC comp_func);
 void ne_hash_destroy (NE_HASH **hash);
 NEOERR *ne_hash_insert(NE_HASH *hash, void *key, void *value);
+/* Like ne_hash_insert, with a hash value computed ahead of time, see
+ * ne_hash_lookup_hashv */
+NEOERR *ne_hash_insert_hashv(NE_HASH *hash, void *key, void *value,
+                             UINT32 hashv);
 void *ne_hash_lookup(NE_HASH *hash, void *key);
+/* Like ne_hash_lookup, but with a hash value the caller already computed
+ * with the same function as the hash_func of this hash */
+void *ne_hash_lookup_hashv(NE_HASH *hash, void *key, UINT32 hashv);
 int ne_hash_has_key(NE_HASH *hash, void *key);
 void *ne_hash_remove(NE_HASH *hash, void *key);
 void *ne_hash_next(NE_HASH *hash, void **key);
 
 int ne_hash_str_comp(const void *a, const void *b);
 UINT32 ne_hash_str_hash(const void *a);
+/* The hash ne_hash_str_hash uses, for keys which aren't NUL terminated.
+ * ne_hash_str_hash(s) == ne_hash_mem(s, strlen(s)) */
+UINT32 ne_hash_mem(const void *data, UINT32 len);
 
 int ne_hash_int_comp(const void *a, const void *b);
 UINT32 ne_hash_int_hash(const void *a);
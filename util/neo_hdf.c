@@ -19,7 +19,9 @@
 #include <errno.h>
 #include <limits.h>
 #include <stdarg.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include "neo_misc.h"
 #include "neo_err.h"
 #include "neo_rand.h"
@@ -27,6 +29,7 @@
 #include "neo_str.h"
 #include "neo_files.h"
 #include "ulist.h"
+#include "ulocks.h"
 
 static NEOERR* hdf_read_file_internal (HDF *hdf, const char *path,
                                        int include_handle);
@@ -53,13 +56,209 @@ static int hash_hdf_comp(const void *a, const void *b)
 static UINT32 hash_hdf_hash(const void *a)
 {
   HDF *ha = (HDF *)a;
-  return ne_crc((UINT8 *)(ha->name), ha->name_len);
+  return ne_hash_mem(ha->name, ha->name_len);
+}
+
+/* The arena used by hdf_init_arena.  Everything in the data set is bump
+ * allocated out of a list of blocks, and nothing is freed until the whole
+ * arena is.  Since nodes in an arena data set never own their values,
+ * alloc_value is always 0 for them; the things which do still need to be
+ * released individually (buffers given to us with hdf_set_buf, and the
+ * hash tables of large levels) are remembered on the owned list.  Data
+ * sets loaded with hdf_init_image also keep the mapping of the image,
+ * which their names and values point into. */
+#define ARENA_DEFAULT_SIZE (16 * 1024)
+#define ARENA_MAX_BLOCK (1024 * 1024)
+#define ARENA_ALIGN(x) (((x) + 7) & ~((size_t)7))
+
+typedef struct _hdf_arena_block
+{
+  struct _hdf_arena_block *next;
+  size_t size;
+  size_t used;
+} HDF_ARENA_BLOCK;
+
+typedef struct _hdf_arena_owned
+{
+  void *buf;
+  NE_HASH *hash;
+  struct _hdf_arena_owned *next;
+} HDF_ARENA_OWNED;
+
+struct _hdf_arena
+{
+  HDF_ARENA_BLOCK *blocks;
+  size_t block_size;
+  HDF_ARENA_OWNED *owned;
+  void *image;
+  size_t image_len;
+};
+
+#define ARENA_BLOCK_HDR ARENA_ALIGN(sizeof(HDF_ARENA_BLOCK))
+
+static HDF_ARENA_BLOCK *_arena_block_new (size_t size)
+{
+  HDF_ARENA_BLOCK *block;
+
+  block = (HDF_ARENA_BLOCK *) malloc (ARENA_BLOCK_HDR + size);
+  if (block == NULL) return NULL;
+  block->next = NULL;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+static void *_arena_alloc (HDF_ARENA *arena, size_t size)
+{
+  HDF_ARENA_BLOCK *block = arena->blocks;
+  void *p;
+
+  size = ARENA_ALIGN(size);
+  if (block->size - block->used < size)
+  {
+    if (size > arena->block_size / 4)
+    {
+      /* Big allocations get a block to themselves, behind the current
+       * one, so we don't waste what is left of it */
+      block = _arena_block_new (size);
+      if (block == NULL) return NULL;
+      block->next = arena->blocks->next;
+      arena->blocks->next = block;
+    }
+    else
+    {
+      if (arena->block_size < ARENA_MAX_BLOCK)
+        arena->block_size *= 2;
+      block = _arena_block_new (arena->block_size);
+      if (block == NULL) return NULL;
+      block->next = arena->blocks;
+      arena->blocks = block;
+    }
+  }
+  p = (char *)block + ARENA_BLOCK_HDR + block->used;
+  block->used += size;
+  return p;
+}
+
+static char *_arena_strndup (HDF_ARENA *arena, const char *s, size_t len)
+{
+  char *p;
+
+  p = (char *) _arena_alloc (arena, len + 1);
+  if (p == NULL) return NULL;
+  memcpy(p, s, len);
+  p[len] = '\0';
+  return p;
+}
+
+static NEOERR *_arena_own (HDF_ARENA *arena, void *buf, NE_HASH *hash)
+{
+  HDF_ARENA_OWNED *owned;
+
+  owned = (HDF_ARENA_OWNED *) _arena_alloc (arena, sizeof(HDF_ARENA_OWNED));
+  if (owned == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for hdf arena");
+  owned->buf = buf;
+  owned->hash = hash;
+  owned->next = arena->owned;
+  arena->owned = owned;
+  return STATUS_OK;
+}
+
+static void _arena_destroy (HDF_ARENA *arena)
+{
+  HDF_ARENA_OWNED *owned;
+  HDF_ARENA_BLOCK *block, *next;
+
+  for (owned = arena->owned; owned != NULL; owned = owned->next)
+  {
+    if (owned->buf) free(owned->buf);
+    if (owned->hash) ne_hash_destroy(&(owned->hash));
+  }
+  if (arena->image) munmap(arena->image, arena->image_len);
+  /* The arena itself lives in the first block, so this has to be last */
+  block = arena->blocks;
+  while (block != NULL)
+  {
+    next = block->next;
+    free(block);
+    block = next;
+  }
+}
+
+/* Sets the value of a node, releasing the old one if the node owns it */
+static NEOERR *_set_node_value (HDF *hdf, const char *value, int dupl, int wf)
+{
+  HDF_ARENA *arena = hdf->top ? hdf->top->arena : NULL;
+  NEOERR *err;
+
+  if (hdf->alloc_value)
+  {
+    free(hdf->value);
+    hdf->value = NULL;
+  }
+  if (value == NULL)
+  {
+    hdf->alloc_value = 0;
+    hdf->value = NULL;
+  }
+  else if (arena != NULL)
+  {
+    hdf->alloc_value = 0;
+    if (dupl)
+    {
+      hdf->value = _arena_strndup (arena, value, strlen(value));
+      if (hdf->value == NULL)
+	return nerr_raise (NERR_NOMEM, "Unable to duplicate value %s for %s",
+	    value, hdf->name);
+    }
+    else
+    {
+      if (wf)
+      {
+	err = _arena_own (arena, (void *)value, NULL);
+	if (err) return nerr_pass(err);
+      }
+      hdf->value = (char *)value;
+    }
+  }
+  else if (dupl)
+  {
+    hdf->alloc_value = 1;
+    hdf->value = strdup(value);
+    if (hdf->value == NULL)
+      return nerr_raise (NERR_NOMEM, "Unable to duplicate value %s for %s",
+	  value, hdf->name);
+  }
+  else
+  {
+    hdf->alloc_value = wf;
+    /* We're overriding the const of value here for the set_buf case
+     * where we overrode the char * to const char * earlier, since
+     * alloc_value actually keeps track of the const-ness for us */
+    hdf->value = (char *)value;
+  }
+  return STATUS_OK;
 }
 
 static NEOERR *_alloc_hdf (HDF **hdf, const char *name, size_t nlen,
                            const char *value, int dupl, int wf, HDF *top)
 {
-  *hdf = calloc (1, sizeof (HDF));
+  NEOERR *err;
+  HDF_ARENA *arena = top ? top->arena : NULL;
+  size_t len;
+
+  /* The node and the copy of its name live in the same allocation */
+  len = sizeof (HDF) + (name != NULL ? nlen + 1 : 0);
+  if (arena != NULL)
+  {
+    *hdf = (HDF *) _arena_alloc (arena, len);
+    if (*hdf != NULL) memset(*hdf, 0, sizeof (HDF));
+  }
+  else
+  {
+    *hdf = calloc (1, len);
+  }
   if (*hdf == NULL)
   {
     return nerr_raise (NERR_NOMEM, "Unable to allocate memory for hdf element");
@@ -70,44 +269,34 @@ static NEOERR *_alloc_hdf (HDF **hdf, const char *name, size_t nlen,
   if (name != NULL)
   {
     (*hdf)->name_len = nlen;
-    (*hdf)->name = (char *) malloc (nlen + 1);
-    if ((*hdf)->name == NULL)
-    {
-      free((*hdf));
-      (*hdf) = NULL;
-      return nerr_raise (NERR_NOMEM,
-	  "Unable to allocate memory for hdf element: %s", name);
-    }
-    strncpy((*hdf)->name, name, nlen);
+    (*hdf)->name = (char *)((*hdf) + 1);
+    memcpy((*hdf)->name, name, nlen);
     (*hdf)->name[nlen] = '\0';
   }
   if (value != NULL)
   {
-    if (dupl)
-    {
-      (*hdf)->alloc_value = 1;
-      (*hdf)->value = strdup(value);
-      if ((*hdf)->value == NULL)
-      {
-	free((*hdf)->name);
-	free((*hdf));
-	(*hdf) = NULL;
-	return nerr_raise (NERR_NOMEM,
-	    "Unable to allocate memory for hdf element %s", name);
-      }
-    }
-    else
+    err = _set_node_value (*hdf, value, dupl, wf);
+    if (err != STATUS_OK)
     {
-      (*hdf)->alloc_value = wf;
-      /* We're overriding the const of value here for the set_buf case
-       * where we overrode the char * to const char * earlier, since
-       * alloc_value actually keeps track of the const-ness for us */
-      (*hdf)->value = (char *)value;
+      if (arena == NULL) free((*hdf));
+      (*hdf) = NULL;
+      return nerr_pass (err);
     }
   }
   return STATUS_OK;
 }
 
+static HDF_ATTR *_alloc_attr (HDF_ARENA *arena)
+{
+  HDF_ATTR *attr;
+
+  if (arena == NULL)
+    return (HDF_ATTR *) calloc(1, sizeof(HDF_ATTR));
+  attr = (HDF_ATTR *) _arena_alloc(arena, sizeof(HDF_ATTR));
+  if (attr != NULL) memset(attr, 0, sizeof(HDF_ATTR));
+  return attr;
+}
+
 static void _dealloc_hdf_attr(HDF_ATTR **attr)
 {
   HDF_ATTR *next;
@@ -129,6 +318,12 @@ static void _dealloc_hdf (HDF **hdf)
   HDF *next = NULL;
 
   if (myhdf == NULL) return;
+  /* Nodes in an arena are only released with the whole arena */
+  if (myhdf->top != NULL && myhdf->top->arena != NULL)
+  {
+    *hdf = NULL;
+    return;
+  }
   if (myhdf->child != NULL)
     _dealloc_hdf(&(myhdf->child));
 
@@ -142,11 +337,8 @@ static void _dealloc_hdf (HDF **hdf)
     _dealloc_hdf(&next);
     next = myhdf->next;
   }
-  if (myhdf->name != NULL)
-  {
-    free (myhdf->name);
-    myhdf->name = NULL;
-  }
+  /* The name is part of the node's allocation */
+  myhdf->name = NULL;
   if (myhdf->value != NULL)
   {
     if (myhdf->alloc_value)
@@ -187,16 +379,83 @@ NEOERR* hdf_init (HDF **hdf)
   return STATUS_OK;
 }
 
+NEOERR* hdf_init_arena (HDF **hdf, size_t size_hint)
+{
+  NEOERR *err;
+  HDF_ARENA_BLOCK *block;
+  HDF_ARENA *arena;
+  HDF *my_hdf;
+
+  *hdf = NULL;
+
+  err = nerr_init();
+  if (err != STATUS_OK)
+    return nerr_pass (err);
+
+  if (size_hint == 0) size_hint = ARENA_DEFAULT_SIZE;
+  size_hint = ARENA_ALIGN(size_hint + sizeof(HDF_ARENA) + sizeof(HDF));
+  block = _arena_block_new (size_hint);
+  if (block == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for hdf arena");
+
+  /* The arena and the top node are the first things in the first block */
+  arena = (HDF_ARENA *)((char *)block + ARENA_BLOCK_HDR);
+  block->used = ARENA_ALIGN(sizeof(HDF_ARENA));
+  arena->blocks = block;
+  arena->block_size = size_hint;
+  arena->owned = NULL;
+  arena->image = NULL;
+  arena->image_len = 0;
+
+  my_hdf = (HDF *) _arena_alloc (arena, sizeof (HDF));
+  memset(my_hdf, 0, sizeof (HDF));
+  my_hdf->top = my_hdf;
+  my_hdf->arena = arena;
+
+  *hdf = my_hdf;
+
+  return STATUS_OK;
+}
+
+NEOERR* hdf_set_base (HDF *hdf, HDF *base)
+{
+  HDF *hp;
+
+  if (hdf == NULL || hdf->top != hdf || (base != NULL && base->top != base))
+    return nerr_raise (NERR_ASSERT,
+	"Only the top node of a data set can be an overlay or a base");
+  if (hdf->frozen)
+    return nerr_raise (NERR_ASSERT, "A frozen data set can't be an overlay");
+  for (hp = base; hp != NULL; hp = hp->base)
+  {
+    if (hp == hdf)
+      return nerr_raise (NERR_ASSERT, "An overlay can't be its own base");
+  }
+  hdf->base = base;
+  hdf->changes++;
+  return STATUS_OK;
+}
+
 void hdf_destroy (HDF **hdf)
 {
   if (*hdf == NULL) return;
   if ((*hdf)->top == (*hdf))
   {
+    if ((*hdf)->arena != NULL)
+    {
+      _arena_destroy((*hdf)->arena);
+      *hdf = NULL;
+      return;
+    }
     _dealloc_hdf(hdf);
   }
 }
 
-static int _walk_hdf (HDF *hdf, const char *name, HDF **node)
+static int _walk_hdf (HDF *hdf, const char *name, HDF **node);
+
+/* Looks name up in this data set only, never in the base of an overlay,
+ * which is what has to be used to find a node to change */
+static int _walk_hdf_local (HDF *hdf, const char *name, HDF **node)
 {
   HDF *parent = NULL;
   HDF *hp = hdf;
@@ -293,6 +552,120 @@ static int _walk_hdf (HDF *hdf, const char *name, HDF **node)
   return 0;
 }
 
+/* Names which an overlay doesn't have come from its base, see
+ * hdf_set_base.  Since the base is only set on a top node, this only
+ * happens for names looked up from the top. */
+static int _walk_hdf (HDF *hdf, const char *name, HDF **node)
+{
+  int r;
+
+  r = _walk_hdf_local (hdf, name, node);
+  while (r && hdf != NULL && hdf->base != NULL)
+  {
+    hdf = hdf->base;
+    r = _walk_hdf_local (hdf, name, node);
+  }
+  return r;
+}
+
+/* Same as _walk_hdf_local, but the name has already been split by
+ * hdf_path_compile */
+static int _walk_hdf_path_local (HDF *hdf, HDF_PATH *path, HDF **node)
+{
+  HDF *parent = NULL;
+  HDF *hp = hdf;
+  HDF hash_key;
+  HDF_PATH_ELEM *elem;
+  int x;
+  int r;
+
+  *node = NULL;
+
+  if (hdf == NULL) return -1;
+  if (path->num == 0)
+  {
+    *node = hdf;
+    return 0;
+  }
+
+  if (hdf->link)
+  {
+    r = _walk_hdf (hdf->top, hdf->value, &hp);
+    if (r) return r;
+    if (hp)
+    {
+      parent = hp;
+      hp = hp->child;
+    }
+  }
+  else
+  {
+    parent = hdf;
+    hp = hdf->child;
+  }
+  if (hp == NULL)
+  {
+    return -1;
+  }
+
+  for (x = 0; x < path->num; x++)
+  {
+    elem = &(path->elems[x]);
+    if (x)
+    {
+      if (hp->link)
+      {
+	r = _walk_hdf (hp->top, hp->value, &hp);
+	if (r) return r;
+      }
+      parent = hp;
+      hp = hp->child;
+    }
+    if (parent && parent->hash)
+    {
+      hash_key.name = (char *)elem->name;
+      hash_key.name_len = elem->len;
+      hp = ne_hash_lookup_hashv(parent->hash, &hash_key, elem->hashv);
+    }
+    else
+    {
+      while (hp != NULL)
+      {
+	if (hp->name && (elem->len == hp->name_len) &&
+	    !strncmp(hp->name, elem->name, elem->len))
+	{
+	  break;
+	}
+	hp = hp->next;
+      }
+    }
+    if (hp == NULL)
+    {
+      return -1;
+    }
+  }
+  if (hp->link)
+  {
+    return _walk_hdf (hp->top, hp->value, node);
+  }
+
+  *node = hp;
+  return 0;
+}
+
+static int _walk_hdf_path (HDF *hdf, HDF_PATH *path, HDF **node)
+{
+  int r;
+
+  r = _walk_hdf_path_local (hdf, path, node);
+  while (r && hdf != NULL && hdf->base != NULL)
+  {
+    hdf = hdf->base;
+    r = _walk_hdf_path_local (hdf, path, node);
+  }
+  return r;
+}
+
 int hdf_get_int_value (HDF *hdf, const char *name, int defval)
 {
   HDF *node;
@@ -385,6 +758,66 @@ HDF* hdf_get_obj (HDF *hdf, const char *name)
   return obj;
 }
 
+NEOERR* hdf_path_compile (const char *name, HDF_PATH **path)
+{
+  HDF_PATH *my_path;
+  HDF_PATH_ELEM *elem;
+  const char *s;
+  char *n;
+  int num = 0;
+  size_t len;
+
+  *path = NULL;
+  if (name == NULL) name = "";
+  len = strlen(name);
+  if (len)
+  {
+    num = 1;
+    for (s = name; *s; s++)
+      if (*s == '.') num++;
+  }
+
+  /* The elements and the copy of the name live in the same allocation */
+  my_path = (HDF_PATH *) malloc (sizeof(HDF_PATH) +
+                                 num * sizeof(HDF_PATH_ELEM) + len + 1);
+  if (my_path == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for path %s",
+                       name);
+  my_path->num = num;
+  my_path->elems = (HDF_PATH_ELEM *)(my_path + 1);
+  n = (char *)(my_path->elems + num);
+  memcpy(n, name, len + 1);
+
+  elem = my_path->elems;
+  while (num--)
+  {
+    s = strchr(n, '.');
+    elem->name = n;
+    elem->len = (s == NULL) ? strlen(n) : s - n;
+    elem->hashv = ne_hash_mem(n, elem->len);
+    elem++;
+    if (s) n = (char *)s + 1;
+  }
+
+  *path = my_path;
+  return STATUS_OK;
+}
+
+void hdf_path_destroy (HDF_PATH **path)
+{
+  if (*path == NULL) return;
+  free(*path);
+  *path = NULL;
+}
+
+HDF* hdf_get_obj_path (HDF *hdf, HDF_PATH *path)
+{
+  HDF *obj;
+
+  _walk_hdf_path(hdf, path, &obj);
+  return obj;
+}
+
 HDF* hdf_get_child (HDF *hdf, const char *name)
 {
   HDF *obj;
@@ -406,10 +839,14 @@ NEOERR* hdf_set_attr (HDF *hdf, const char *name, const char *key,
 {
   HDF *obj;
   HDF_ATTR *attr, *last;
+  HDF_ARENA *arena;
 
   _walk_hdf(hdf, name, &obj);
   if (obj == NULL)
     return nerr_raise(NERR_ASSERT, "Unable to set attribute on none existant node");
+  if (obj->top != NULL && obj->top->frozen)
+    return nerr_raise(NERR_ASSERT, "Unable to set attribute on frozen hdf");
+  arena = obj->top ? obj->top->arena : NULL;
 
   if (obj->attr != NULL)
   {
@@ -419,7 +856,7 @@ NEOERR* hdf_set_attr (HDF *hdf, const char *name, const char *key,
     {
       if (!strcmp(attr->key, key))
       {
-	if (attr->value) free(attr->value);
+	if (attr->value && arena == NULL) free(attr->value);
 	/* a set of NULL deletes the attr */
 	if (value == NULL)
 	{
@@ -427,11 +864,17 @@ NEOERR* hdf_set_attr (HDF *hdf, const char *name, const char *key,
 	    obj->attr = attr->next;
 	  else
 	    last->next = attr->next;
-	  free(attr->key);
-	  free(attr);
+	  if (arena == NULL)
+	  {
+	    free(attr->key);
+	    free(attr);
+	  }
 	  return STATUS_OK;
 	}
-	attr->value = strdup(value);
+	if (arena != NULL)
+	  attr->value = _arena_strndup(arena, value, strlen(value));
+	else
+	  attr->value = strdup(value);
 	if (attr->value == NULL)
 	  return nerr_raise(NERR_NOMEM, "Unable to set attr %s to %s", key, value);
 	return STATUS_OK;
@@ -439,21 +882,30 @@ NEOERR* hdf_set_attr (HDF *hdf, const char *name, const char *key,
       last = attr;
       attr = attr->next;
     }
-    last->next = (HDF_ATTR *) calloc(1, sizeof(HDF_ATTR));
-    if (last->next == NULL)
+    if (value == NULL) return STATUS_OK;
+    attr = _alloc_attr(arena);
+    if (attr == NULL)
       return nerr_raise(NERR_NOMEM, "Unable to set attr %s to %s", key, value);
-    attr = last->next;
+    last->next = attr;
   }
   else
   {
     if (value == NULL) return STATUS_OK;
-    obj->attr = (HDF_ATTR *) calloc(1, sizeof(HDF_ATTR));
+    obj->attr = _alloc_attr(arena);
     if (obj->attr == NULL)
       return nerr_raise(NERR_NOMEM, "Unable to set attr %s to %s", key, value);
     attr = obj->attr;
   }
-  attr->key = strdup(key);
-  attr->value = strdup(value);
+  if (arena != NULL)
+  {
+    attr->key = _arena_strndup(arena, key, strlen(key));
+    attr->value = _arena_strndup(arena, value, strlen(value));
+  }
+  else
+  {
+    attr->key = strdup(key);
+    attr->value = strdup(value);
+  }
   if (attr->key == NULL || attr->value == NULL)
     return nerr_raise(NERR_NOMEM, "Unable to set attr %s to %s", key, value);
 
@@ -473,6 +925,19 @@ HDF* hdf_obj_child (HDF *hdf)
   return hdf->child;
 }
 
+int hdf_obj_child_count (HDF *hdf)
+{
+  HDF *obj;
+  if (hdf == NULL) return 0;
+  if (hdf->link)
+  {
+    if (_walk_hdf(hdf->top, hdf->value, &obj))
+      return 0;
+    return obj->num_children;
+  }
+  return hdf->num_children;
+}
+
 HDF* hdf_obj_next (HDF *hdf)
 {
   if (hdf == NULL) return NULL;
@@ -514,64 +979,168 @@ char* hdf_obj_value (HDF *hdf)
 void _merge_attr (HDF_ATTR *dest, HDF_ATTR *src)
 {
   HDF_ATTR *da, *ld;
-  HDF_ATTR *sa, *ls;
-  BOOL found;
+  HDF_ATTR *sa;
 
-  sa = src;
-  ls = src;
-  while (sa != NULL)
+  while (src != NULL)
   {
+    sa = src;
+    src = sa->next;
+    sa->next = NULL;
+
     da = dest;
     ld = da;
-    found = 0;
     while (da != NULL)
     {
       if (!strcmp(da->key, sa->key))
-      {
-	if (da->value) free(da->value);
-	da->value = sa->value;
-	sa->value = NULL;
-	found = 1;
 	break;
-      }
       ld = da;
       da = da->next;
     }
-    if (!found)
+    if (da != NULL)
     {
-      ld->next = sa;
-      ls->next = sa->next;
-      if (src == sa) src = sa->next;
-      ld->next->next = NULL;
-      sa = ls->next;
+      if (da->value) free(da->value);
+      da->value = sa->value;
+      sa->value = NULL;
+      _dealloc_hdf_attr(&sa);
     }
     else
     {
-      ls = sa;
-      sa = sa->next;
+      ld->next = sa;
     }
   }
-  _dealloc_hdf_attr(&src);
 }
 
-NEOERR* _hdf_hash_level(HDF *hdf)
+/* Takes ownership of the attr list and sets it on hdf, merging it with
+ * any attributes the node already has.  In an arena data set, the list is
+ * copied into the arena and released. */
+static NEOERR *_set_node_attr (HDF *hdf, HDF_ATTR *attr)
 {
-  NEOERR *err;
-  HDF *child;
-
-  err = ne_hash_init(&(hdf->hash), hash_hdf_hash, hash_hdf_comp);
-  if (err) return nerr_pass(err);
+  HDF_ARENA *arena = hdf->top ? hdf->top->arena : NULL;
+  HDF_ATTR *sa, *da, *last;
 
-  child = hdf->child;
-  while (child)
+  if (attr == NULL) return STATUS_OK;
+  if (arena == NULL)
   {
-    err = ne_hash_insert(hdf->hash, child, child);
-    if (err) return nerr_pass(err);
-    child = child->next;
+    if (hdf->attr == NULL)
+      hdf->attr = attr;
+    else
+      _merge_attr(hdf->attr, attr);
+    return STATUS_OK;
   }
+
+  for (sa = attr; sa != NULL; sa = sa->next)
+  {
+    last = NULL;
+    for (da = hdf->attr; da != NULL; da = da->next)
+    {
+      if (!strcmp(da->key, sa->key)) break;
+      last = da;
+    }
+    if (da == NULL)
+    {
+      da = (HDF_ATTR *) _arena_alloc (arena, sizeof(HDF_ATTR));
+      if (da == NULL)
+	return nerr_raise(NERR_NOMEM, "Unable to set attr %s", sa->key);
+      da->key = _arena_strndup (arena, sa->key, strlen(sa->key));
+      da->value = NULL;
+      da->next = NULL;
+      if (da->key == NULL)
+	return nerr_raise(NERR_NOMEM, "Unable to set attr %s", sa->key);
+      if (last == NULL)
+	hdf->attr = da;
+      else
+	last->next = da;
+    }
+    da->value = NULL;
+    if (sa->value != NULL)
+    {
+      da->value = _arena_strndup (arena, sa->value, strlen(sa->value));
+      if (da->value == NULL)
+	return nerr_raise(NERR_NOMEM, "Unable to set attr %s to %s", sa->key,
+	    sa->value);
+    }
+  }
+  _dealloc_hdf_attr(&attr);
+  return STATUS_OK;
+}
+
+NEOERR* _hdf_hash_level(HDF *hdf)
+{
+  NEOERR *err;
+  HDF *child;
+
+  err = ne_hash_init(&(hdf->hash), hash_hdf_hash, hash_hdf_comp);
+  if (err) return nerr_pass(err);
+  if (hdf->top != NULL && hdf->top->arena != NULL)
+  {
+    err = _arena_own(hdf->top->arena, NULL, hdf->hash);
+    if (err)
+    {
+      ne_hash_destroy(&(hdf->hash));
+      return nerr_pass(err);
+    }
+  }
+
+  child = hdf->child;
+  while (child)
+  {
+    err = ne_hash_insert(hdf->hash, child, child);
+    if (err) return nerr_pass(err);
+    child = child->next;
+  }
+  return STATUS_OK;
+}
+
+static NEOERR* _freeze_level (HDF *hdf)
+{
+  NEOERR *err;
+  HDF *child;
+
+  if (hdf->hash == NULL && hdf->num_children > FORCE_HASH_AT)
+  {
+    err = _hdf_hash_level(hdf);
+    if (err) return nerr_pass(err);
+  }
+  for (child = hdf->child; child != NULL; child = child->next)
+  {
+    err = _freeze_level(child);
+    if (err) return nerr_pass(err);
+  }
+  return STATUS_OK;
+}
+
+NEOERR* hdf_freeze (HDF *hdf)
+{
+  NEOERR *err;
+
+  if (hdf == NULL || hdf->top != hdf)
+    return nerr_raise (NERR_ASSERT, "Only the top node of a data set can be frozen");
+  if (hdf->frozen) return STATUS_OK;
+
+  /* Every level which is big enough gets its hash now, so that nothing
+   * is left to be built the first time it's looked at */
+  err = _freeze_level(hdf);
+  if (err) return nerr_pass(err);
+  hdf->frozen = 1;
   return STATUS_OK;
 }
 
+/* Note that a name may lead somewhere else now, see hdf_change_count */
+static void _hdf_changed (HDF *hdf)
+{
+  if (hdf->top != NULL) hdf->top->changes++;
+}
+
+unsigned int hdf_change_count (HDF *hdf)
+{
+  unsigned int changes = 0;
+
+  if (hdf == NULL) return 0;
+  for (hdf = hdf->top; hdf != NULL; hdf = hdf->base)
+    changes += hdf->changes;
+  return changes;
+}
+
 static NEOERR* _set_value (HDF *hdf, const char *name, const char *value,
                            int dupl, int wf, int lnk, HDF_ATTR *attr,
                            HDF **set_node)
@@ -589,20 +1158,17 @@ static NEOERR* _set_value (HDF *hdf, const char *name, const char *value,
   {
     return nerr_raise(NERR_ASSERT, "Unable to set %s on NULL hdf", name);
   }
+  if (hdf->top != NULL && hdf->top->frozen)
+    return nerr_raise(NERR_ASSERT, "Unable to set %s on frozen hdf", name);
 
   /* HACK: allow setting of this node by passing an empty name */
   if (name == NULL || name[0] == '\0')
   {
     /* handle setting attr first */
-    if (hdf->attr == NULL)
-    {
-      hdf->attr = attr;
-    }
-    else
-    {
-      _merge_attr(hdf->attr, attr);
-    }
+    err = _set_node_attr(hdf, attr);
+    if (err) return nerr_pass(err);
     /* set link flag */
+    if (lnk || hdf->link) _hdf_changed(hdf);
     if (lnk) hdf->link = 1;
     else hdf->link = 0;
     /* if we're setting ourselves to ourselves... */
@@ -611,29 +1177,8 @@ static NEOERR* _set_value (HDF *hdf, const char *name, const char *value,
       if (set_node != NULL) *set_node = hdf;
       return STATUS_OK;
     }
-    if (hdf->alloc_value)
-    {
-      free(hdf->value);
-      hdf->value = NULL;
-    }
-    if (value == NULL)
-    {
-      hdf->alloc_value = 0;
-      hdf->value = NULL;
-    }
-    else if (dupl)
-    {
-      hdf->alloc_value = 1;
-      hdf->value = strdup(value);
-      if (hdf->value == NULL)
-	return nerr_raise (NERR_NOMEM, "Unable to duplicate value %s for %s",
-	    value, name);
-    }
-    else
-    {
-      hdf->alloc_value = wf;
-      hdf->value = (char *)value;
-    }
+    err = _set_node_value(hdf, value, dupl, wf);
+    if (err) return nerr_pass(err);
     if (set_node != NULL) *set_node = hdf;
     return STATUS_OK;
   }
@@ -726,17 +1271,22 @@ skip_search:
       else
       {
 	err = _alloc_hdf (&hp, n, x, value, dupl, wf, hdf->top);
-	if (lnk) hp->link = 1;
-	else hp->link = 0;
-	hp->attr = attr;
+	if (err == STATUS_OK)
+	{
+	  if (lnk) hp->link = 1;
+	  else hp->link = 0;
+	  err = _set_node_attr(hp, attr);
+	}
       }
       if (err != STATUS_OK)
 	return nerr_pass (err);
+      _hdf_changed(hdf);
       if (hn->child == NULL)
 	hn->child = hp;
       else
 	hs->next = hp;
       hn->last_child = hp;
+      hn->num_children++;
 
       /* This is the point at which we convert to a hash table
        * at this level, if we're over the count */
@@ -756,40 +1306,14 @@ skip_search:
       /* If there is a matching node and we're at the end of the HDF
        * name, then we update the value of the node */
       /* handle setting attr first */
-      if (hp->attr == NULL)
-      {
-	hp->attr = attr;
-      }
-      else
-      {
-	_merge_attr(hp->attr, attr);
-      }
+      err = _set_node_attr(hp, attr);
+      if (err) return nerr_pass(err);
       if (hp->value != value)
       {
-	if (hp->alloc_value)
-	{
-	  free(hp->value);
-	  hp->value = NULL;
-	}
-	if (value == NULL)
-	{
-	  hp->alloc_value = 0;
-	  hp->value = NULL;
-	}
-	else if (dupl)
-	{
-	  hp->alloc_value = 1;
-	  hp->value = strdup(value);
-	  if (hp->value == NULL)
-	    return nerr_raise (NERR_NOMEM, "Unable to duplicate value %s for %s",
-		value, name);
-	}
-	else
-	{
-	  hp->alloc_value = wf;
-	  hp->value = (char *)value;
-	}
+	err = _set_node_value(hp, value, dupl, wf);
+	if (err) return nerr_pass(err);
       }
+      if (lnk || hp->link) _hdf_changed(hdf);
       if (lnk) hp->link = 1;
       else hp->link = 0;
     }
@@ -853,6 +1377,20 @@ NEOERR* hdf_set_buf (HDF *hdf, const char *name, char *value)
   return nerr_pass(_set_value (hdf, name, value, 0, 1, 0, NULL, NULL));
 }
 
+NEOERR* hdf_set_borrowed (HDF *hdf, const char *name, const char *value)
+{
+  return nerr_pass(_set_value (hdf, name, value, 0, 0, 0, NULL, NULL));
+}
+
+NEOERR* hdf_own_buf (HDF *hdf, char *buf)
+{
+  if (hdf == NULL || hdf->top == NULL || hdf->top->arena == NULL)
+    return nerr_raise (NERR_ASSERT, "Only an arena data set can own a buffer");
+  if (hdf->top->frozen)
+    return nerr_raise (NERR_ASSERT, "A frozen data set can't own a buffer");
+  return nerr_pass(_arena_own (hdf->top->arena, buf, NULL));
+}
+
 NEOERR* hdf_set_copy (HDF *hdf, const char *dest, const char *src)
 {
   HDF *node;
@@ -900,7 +1438,7 @@ NEOERR* hdf_set_valuef (HDF *hdf, const char *fmt, ...)
 
 NEOERR* hdf_get_node (HDF *hdf, const char *name, HDF **ret)
 {
-  _walk_hdf(hdf, name, ret);
+  _walk_hdf_local(hdf, name, ret);
   if (*ret == NULL)
   {
     return nerr_pass(_set_value (hdf, name, NULL, 0, 1, 0, NULL, ret));
@@ -921,6 +1459,8 @@ NEOERR *hdf_sort_obj (HDF *h, int (*compareFunc)(const void *, const void *))
   if (h == NULL) return STATUS_OK;
   c = h->child;
   if (c == NULL) return STATUS_OK;
+  if (h->top != NULL && h->top->frozen)
+    return nerr_raise(NERR_ASSERT, "Unable to sort frozen hdf");
 
   do {
     err = uListInit(&level, 40, 0);
@@ -955,6 +1495,8 @@ NEOERR* hdf_remove_tree (HDF *hdf, const char *name)
   const char *n = name;
 
   if (hdf == NULL) return STATUS_OK;
+  if (hdf->top != NULL && hdf->top->frozen)
+    return nerr_raise(NERR_ASSERT, "Unable to remove %s from frozen hdf", name);
 
   hp = hdf->child;
   if (hp == NULL)
@@ -997,6 +1539,7 @@ NEOERR* hdf_remove_tree (HDF *hdf, const char *name)
     x = (s == NULL) ? strlen(n) : s - n;
   }
 
+  _hdf_changed(lp);
   if (lp->hash != NULL)
   {
     ne_hash_remove(lp->hash, hp);
@@ -1013,8 +1556,14 @@ NEOERR* hdf_remove_tree (HDF *hdf, const char *name)
   else
   {
     lp->child = hp->next;
+    if (lp->child == NULL)
+      lp->last_child = NULL;
     hp->next = NULL;
   }
+  lp->num_children--;
+  /* the set cache may point at the node we're removing */
+  lp->last_hp = NULL;
+  lp->last_hs = NULL;
   _dealloc_hdf (&hp);
 
   return STATUS_OK;
@@ -1085,7 +1634,7 @@ NEOERR* hdf_copy (HDF *dest, const char *name, HDF *src)
   NEOERR *err;
   HDF *node;
 
-  if (_walk_hdf(dest, name, &node) == -1)
+  if (_walk_hdf_local(dest, name, &node) == -1)
   {
     err = _set_value (dest, name, NULL, 0, 0, 0, NULL, &node);
     if (err) return nerr_pass (err);
@@ -1356,52 +1905,394 @@ NEOERR *hdf_write_string (HDF *hdf, char **s)
 }
 
 
-#define SKIPWS(s) while (*s && isspace(*s)) s++;
+/* Compiled images, see hdf_write_image.  An image is the header, then
+ * the nodes, then the attributes, then the string table, all in host
+ * byte order.  The nodes are in breadth first order, so the children of
+ * a node are always consecutive and after it, and node 0 is the top.
+ * Strings are referred to by their offset in the string table; offset 0
+ * is a single NUL byte which stands for NULL. */
+#define HDF_IMAGE_MAGIC 0x46444843
+#define HDF_IMAGE_VERSION 1
 
-static int _copy_line (const char **s, char *buf, size_t buf_len)
+typedef struct _hdf_image_header
 {
-  int x = 0;
-  const char *st = *s;
+  UINT32 magic;
+  UINT32 version;
+  /* ne_hash_mem of "HDF", to tell if the stored hashes are still good */
+  UINT32 hash_check;
+  UINT32 num_nodes;
+  UINT32 num_attrs;
+  UINT32 nodes;
+  UINT32 attrs;
+  UINT32 strings;
+  UINT32 strings_len;
+} HDF_IMAGE_HEADER;
+
+typedef struct _hdf_image_node
+{
+  UINT32 name;
+  UINT32 name_len;
+  UINT32 value;
+  UINT32 hashv;
+  UINT32 link;
+  UINT32 child;
+  UINT32 num_children;
+  UINT32 attr;
+  UINT32 num_attrs;
+} HDF_IMAGE_NODE;
+
+typedef struct _hdf_image_attr
+{
+  UINT32 key;
+  UINT32 value;
+} HDF_IMAGE_ATTR;
+
+static NEOERR *_image_string (STRING *strings, NE_HASH *offsets,
+                              const char *s, UINT32 *offset)
+{
+  NEOERR *err;
+
+  if (s == NULL)
+  {
+    *offset = 0;
+    return STATUS_OK;
+  }
+  /* Names like "0" and "Name" repeat a lot, only store them once */
+  *offset = (UINT32)(long) ne_hash_lookup(offsets, (void *)s);
+  if (*offset) return STATUS_OK;
+
+  *offset = strings->len;
+  err = string_appendn(strings, s, strlen(s) + 1);
+  if (err) return nerr_pass(err);
+  return nerr_pass(ne_hash_insert(offsets, (void *)s,
+	(void *)(long)(*offset)));
+}
+
+static NEOERR *_image_write (const char *path, HDF_IMAGE_HEADER *header,
+                             HDF_IMAGE_NODE *nodes, HDF_IMAGE_ATTR *attrs,
+                             STRING *strings)
+{
+  char tpath[PATH_BUF_SIZE];
+  static int count = 0;
+  FILE *fp;
+  int ok;
+
+  snprintf(tpath, sizeof(tpath), "%s.%5.5f.%d", path, ne_timef(), count++);
+
+  fp = fopen(tpath, "w");
+  if (fp == NULL)
+    return nerr_raise_errno (NERR_IO, "Unable to open %s for writing", tpath);
+
+  ok = fwrite(header, sizeof(HDF_IMAGE_HEADER), 1, fp) == 1 &&
+    fwrite(nodes, sizeof(HDF_IMAGE_NODE), header->num_nodes, fp) ==
+      header->num_nodes &&
+    fwrite(attrs, sizeof(HDF_IMAGE_ATTR), header->num_attrs, fp) ==
+      header->num_attrs &&
+    fwrite(strings->buf, 1, strings->len, fp) == strings->len;
+  if (fclose(fp) != 0) ok = 0;
 
-  while (*st && x < buf_len-1)
+  if (!ok)
+  {
+    unlink(tpath);
+    return nerr_raise_errno (NERR_IO, "Unable to write %s", tpath);
+  }
+  /* Replace the old image atomically, processes which already have it
+   * mapped keep the old one */
+  if (rename(tpath, path) == -1)
   {
-    buf[x++] = *st;
-    if (*st++ == '\n') break;
+    unlink (tpath);
+    return nerr_raise_errno (NERR_IO, "Unable to rename file %s to %s",
+	tpath, path);
+  }
+  return STATUS_OK;
+}
+
+NEOERR* hdf_write_image (HDF *hdf, const char *path)
+{
+  NEOERR *err;
+  HDF_IMAGE_HEADER header;
+  HDF_IMAGE_NODE *nodes = NULL, *in;
+  HDF_IMAGE_ATTR *attrs = NULL;
+  STRING strings;
+  NE_HASH *offsets = NULL;
+  ULIST *order = NULL;
+  HDF *hn, *child;
+  HDF_ATTR *attr;
+  int x, num_attrs = 0, next_child = 1;
+
+  string_init(&strings);
+
+  /* Lay the nodes out breadth first */
+  err = uListInit(&order, 256, 0);
+  if (err) return nerr_pass(err);
+  err = uListAppend(order, hdf);
+  for (x = 0; err == STATUS_OK && x < uListLength(order); x++)
+  {
+    hn = (HDF *) order->items[x];
+    for (attr = hn->attr; attr != NULL; attr = attr->next)
+      num_attrs++;
+    for (child = hn->child; err == STATUS_OK && child; child = child->next)
+      err = uListAppend(order, child);
+  }
+  if (err) goto image_error;
+
+  memset(&header, 0, sizeof(header));
+  header.magic = HDF_IMAGE_MAGIC;
+  header.version = HDF_IMAGE_VERSION;
+  header.hash_check = ne_hash_mem("HDF", 3);
+  header.num_nodes = uListLength(order);
+  header.num_attrs = num_attrs;
+
+  nodes = (HDF_IMAGE_NODE *) calloc(header.num_nodes, sizeof(HDF_IMAGE_NODE));
+  attrs = (HDF_IMAGE_ATTR *) calloc(num_attrs + 1, sizeof(HDF_IMAGE_ATTR));
+  if (nodes == NULL || attrs == NULL)
+  {
+    err = nerr_raise(NERR_NOMEM, "Unable to allocate memory for hdf image");
+    goto image_error;
+  }
+  err = ne_hash_init(&offsets, ne_hash_str_hash, ne_hash_str_comp);
+  if (err) goto image_error;
+  err = string_appendn(&strings, "", 1);
+  if (err) goto image_error;
+
+  num_attrs = 0;
+  for (x = 0; x < header.num_nodes; x++)
+  {
+    hn = (HDF *) order->items[x];
+    in = &(nodes[x]);
+    if (x)
+    {
+      err = _image_string(&strings, offsets, hn->name, &(in->name));
+      if (err) goto image_error;
+      in->name_len = hn->name_len;
+      in->hashv = hash_hdf_hash(hn);
+    }
+    err = _image_string(&strings, offsets, hn->value, &(in->value));
+    if (err) goto image_error;
+    in->link = hn->link;
+    in->attr = num_attrs;
+    for (attr = hn->attr; attr != NULL; attr = attr->next)
+    {
+      err = _image_string(&strings, offsets, attr->key,
+	  &(attrs[num_attrs].key));
+      if (err) goto image_error;
+      err = _image_string(&strings, offsets, attr->value,
+	  &(attrs[num_attrs].value));
+      if (err) goto image_error;
+      num_attrs++;
+      in->num_attrs++;
+    }
+    in->child = next_child;
+    for (child = hn->child; child; child = child->next)
+      in->num_children++;
+    next_child += in->num_children;
   }
-  buf[x] = '\0';
-  *s = st;
 
-  return x;
+  header.nodes = sizeof(header);
+  header.attrs = header.nodes + header.num_nodes * sizeof(HDF_IMAGE_NODE);
+  header.strings = header.attrs + header.num_attrs * sizeof(HDF_IMAGE_ATTR);
+  header.strings_len = strings.len;
+
+  err = _image_write(path, &header, nodes, attrs, &strings);
+
+image_error:
+  string_clear(&strings);
+  ne_hash_destroy(&offsets);
+  uListDestroy(&order, 0);
+  free(nodes);
+  free(attrs);
+  return nerr_pass(err);
+}
+
+static NEOERR *_image_check (const char *image, size_t len, const char *path)
+{
+  HDF_IMAGE_HEADER *header = (HDF_IMAGE_HEADER *)image;
+
+  if (len < sizeof(HDF_IMAGE_HEADER) || header->magic != HDF_IMAGE_MAGIC)
+    return nerr_raise (NERR_PARSE, "%s is not an hdf image", path);
+  if (header->version != HDF_IMAGE_VERSION)
+    return nerr_raise (NERR_PARSE, "%s is version %d, expected %d", path,
+	header->version, HDF_IMAGE_VERSION);
+  if (header->num_nodes == 0 ||
+      header->nodes != sizeof(HDF_IMAGE_HEADER) ||
+      header->attrs != header->nodes +
+        (size_t)header->num_nodes * sizeof(HDF_IMAGE_NODE) ||
+      header->strings != header->attrs +
+        (size_t)header->num_attrs * sizeof(HDF_IMAGE_ATTR) ||
+      header->strings_len == 0 ||
+      len != (size_t)header->strings + header->strings_len ||
+      image[len - 1] != '\0')
+    return nerr_raise (NERR_PARSE, "%s is a corrupt hdf image", path);
+  return STATUS_OK;
 }
 
-/* Copy the characters in the file (up to the next newline) into line
- * and advance s to the next line */
-static NEOERR *_copy_line_advance(const char **s, STRING *line)
+/* Builds the HDF nodes for an image which passed _image_check.  Nothing
+ * is copied: names, values and attributes point into the image. */
+static NEOERR *_image_load (HDF *top, const char *image, const char *path)
 {
   NEOERR *err;
-  int x = 0;
-  const char *st = *s;
-  const char *nl;
+  HDF_ARENA *arena = top->arena;
+  HDF_IMAGE_HEADER *header = (HDF_IMAGE_HEADER *)image;
+  HDF_IMAGE_NODE *nodes = (HDF_IMAGE_NODE *)(image + header->nodes);
+  HDF_IMAGE_ATTR *iattrs = (HDF_IMAGE_ATTR *)(image + header->attrs);
+  const char *strings = image + header->strings;
+  UINT32 strings_len = header->strings_len;
+  HDF *hdfs, *hn, *child;
+  HDF_ATTR *attrs;
+  HDF_IMAGE_NODE *in;
+  UINT32 x, c, a, next_child = 1;
+  int use_hashv = (header->hash_check == ne_hash_mem("HDF", 3));
+
+#define IMAGE_NODE(i) ((i) ? &(hdfs[(i) - 1]) : top)
+#define IMAGE_STR(o) ((o) ? (char *)(strings + (o)) : NULL)
+
+  /* The top node is already there */
+  hdfs = (HDF *) _arena_alloc (arena, sizeof(HDF) * (header->num_nodes - 1));
+  attrs = (HDF_ATTR *) _arena_alloc (arena,
+      sizeof(HDF_ATTR) * (header->num_attrs + 1));
+  if (hdfs == NULL || attrs == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for hdf image");
+  memset(hdfs, 0, sizeof(HDF) * (header->num_nodes - 1));
+
+  for (x = 0; x < header->num_nodes; x++)
+  {
+    in = &(nodes[x]);
+    hn = IMAGE_NODE(x);
+    if (in->name >= strings_len || in->value >= strings_len ||
+	in->name_len >= strings_len - in->name ||
+	(x && (in->name == 0 || x >= next_child)) ||
+	(in->num_children && in->child != next_child) ||
+	in->num_children > header->num_nodes - next_child ||
+	in->attr > header->num_attrs ||
+	in->num_attrs > header->num_attrs - in->attr)
+      return nerr_raise (NERR_PARSE, "%s is a corrupt hdf image", path);
+
+    hn->top = top;
+    if (x)
+    {
+      hn->name = IMAGE_STR(in->name);
+      hn->name_len = in->name_len;
+    }
+    hn->value = IMAGE_STR(in->value);
+    hn->link = in->link;
+
+    for (a = 0; a < in->num_attrs; a++)
+    {
+      if (iattrs[in->attr + a].key >= strings_len ||
+	  iattrs[in->attr + a].value >= strings_len)
+	return nerr_raise (NERR_PARSE, "%s is a corrupt hdf image", path);
+      attrs[in->attr + a].key = IMAGE_STR(iattrs[in->attr + a].key);
+      attrs[in->attr + a].value = IMAGE_STR(iattrs[in->attr + a].value);
+      attrs[in->attr + a].next =
+	(a + 1 < in->num_attrs) ? &(attrs[in->attr + a + 1]) : NULL;
+    }
+    if (in->num_attrs) hn->attr = &(attrs[in->attr]);
+
+    if (in->num_children == 0) continue;
+
+    hn->child = IMAGE_NODE(in->child);
+    hn->last_child = IMAGE_NODE(in->child + in->num_children - 1);
+    hn->num_children = in->num_children;
+    for (c = in->child; c + 1 < in->child + in->num_children; c++)
+      IMAGE_NODE(c)->next = IMAGE_NODE(c + 1);
+    next_child += in->num_children;
+  }
 
-  nl = strchr(st, '\n');
-  if (nl == NULL)
+  /* The children have to have their names before they can be hashed */
+  for (x = 0; x < header->num_nodes; x++)
   {
-    x = strlen(st);
-    err = string_appendn(line, st, x);
+    in = &(nodes[x]);
+    hn = IMAGE_NODE(x);
+    if (in->num_children <= FORCE_HASH_AT) continue;
+    if (!use_hashv)
+    {
+      err = _hdf_hash_level(hn);
+      if (err) return nerr_pass(err);
+      continue;
+    }
+    err = ne_hash_init(&(hn->hash), hash_hdf_hash, hash_hdf_comp);
     if (err) return nerr_pass(err);
-    *s = st + x;
+    err = _arena_own(arena, NULL, hn->hash);
+    if (err)
+    {
+      ne_hash_destroy(&(hn->hash));
+      return nerr_pass(err);
+    }
+    for (c = in->child; c < in->child + in->num_children; c++)
+    {
+      child = IMAGE_NODE(c);
+      err = ne_hash_insert_hashv(hn->hash, child, child, nodes[c].hashv);
+      if (err) return nerr_pass(err);
+    }
   }
-  else
+
+#undef IMAGE_NODE
+#undef IMAGE_STR
+
+  return STATUS_OK;
+}
+
+NEOERR* hdf_init_image (HDF **hdf, const char *path)
+{
+  NEOERR *err;
+  struct stat s;
+  HDF_IMAGE_HEADER *header;
+  HDF *my_hdf;
+  void *image;
+  int fd;
+
+  *hdf = NULL;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return nerr_raise_errno (NERR_IO, "Unable to open %s", path);
+  if (fstat(fd, &s) == -1)
   {
-    x = nl - st;
-    err = string_appendn(line, st, x);
-    if (err) return nerr_pass(err);
-    *s = nl + 1;
+    close(fd);
+    return nerr_raise_errno (NERR_IO, "Unable to stat %s", path);
+  }
+  if (s.st_size < sizeof(HDF_IMAGE_HEADER))
+  {
+    close(fd);
+    return nerr_raise (NERR_PARSE, "%s is not an hdf image", path);
+  }
+  image = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED)
+    return nerr_raise_errno (NERR_IO, "Unable to mmap %s", path);
+
+  err = _image_check((char *)image, s.st_size, path);
+  if (err)
+  {
+    munmap(image, s.st_size);
+    return nerr_pass(err);
+  }
+
+  header = (HDF_IMAGE_HEADER *)image;
+  err = hdf_init_arena (&my_hdf, sizeof(HDF) * header->num_nodes +
+      sizeof(HDF_ATTR) * (header->num_attrs + 1));
+  if (err)
+  {
+    munmap(image, s.st_size);
+    return nerr_pass(err);
+  }
+  /* From here on hdf_destroy takes care of the mapping */
+  my_hdf->arena->image = image;
+  my_hdf->arena->image_len = s.st_size;
+
+  err = _image_load(my_hdf, (char *)image, path);
+  if (err)
+  {
+    hdf_destroy(&my_hdf);
+    return nerr_pass(err);
   }
 
+  *hdf = my_hdf;
   return STATUS_OK;
 }
 
+#define SKIPWS(s) while (*s && isspace(*s)) s++;
+
 /* attributes are of the form [key1, key2, key3=value, key4="repr"] */
 static NEOERR* parse_attr(char **str, HDF_ATTR **attr)
 {
@@ -1547,25 +2438,107 @@ static NEOERR* parse_attr(char **str, HDF_ATTR **attr)
 #define INCLUDE_FILE 0
 #define INCLUDE_MAX_DEPTH 50
 
-static NEOERR* _hdf_read_string (HDF *hdf, const char **str, STRING *line,
+/* Find the node a dotted prefix names, without creating anything or going
+ * through links.  Used by the parser to remember where the last line put
+ * its value, so the next line with the same prefix can start there instead
+ * of at the root. */
+static HDF *_read_prefix_node (HDF *hdf, const char *name, int len)
+{
+  HDF *hp = hdf;
+  HDF hash_key;
+  const char *n = name;
+  const char *end = name + len;
+  const char *s;
+  int x;
+
+  if (hp->link) return NULL;
+  while (1)
+  {
+    s = memchr (n, '.', end - n);
+    x = (s != NULL) ? s - n : end - n;
+    /* Leave empty components to _set_value to complain about */
+    if (x == 0) return NULL;
+    if (hp->hash != NULL)
+    {
+      hash_key.name = (char *)n;
+      hash_key.name_len = x;
+      hp = ne_hash_lookup (hp->hash, &hash_key);
+    }
+    else
+    {
+      hp = hp->child;
+      while (hp != NULL &&
+             !(hp->name && x == hp->name_len && !strncmp(hp->name, n, x)))
+        hp = hp->next;
+    }
+    if (hp == NULL || hp->link) return NULL;
+    if (s == NULL) break;
+    n = s + 1;
+  }
+  return hp;
+}
+
+/* Set name on hdf, starting from the node the last line's prefix named if
+ * this line has the same one.  cur, cur_name and cur_len are that
+ * cursor, cur_name points back into the buffer being parsed. */
+static NEOERR* _read_set_value (HDF *hdf, char *name, const char *value,
+                                int dupl, HDF_ATTR *attr, HDF **cur,
+                                char **cur_name, int *cur_len)
+{
+  char *dot;
+  int x;
+
+  dot = strrchr (name, '.');
+  if (dot != NULL && dot != name && dot[1] != '\0')
+  {
+    x = dot - name;
+    if (*cur == NULL || x != *cur_len || memcmp(name, *cur_name, x))
+    {
+      *cur = _read_prefix_node (hdf, name, x);
+      *cur_name = name;
+      *cur_len = x;
+    }
+    if (*cur != NULL)
+      return nerr_pass(_set_value (*cur, dot + 1, value, dupl, 1, 0, attr,
+                                   NULL));
+  }
+  return nerr_pass(_set_value (hdf, name, value, dupl, 1, 0, attr, NULL));
+}
+
+/* Parse the HDF in the buffer from *str to end, in place: lines are split
+ * and trimmed by writing NULs into the buffer, so nothing is copied until
+ * the values are set.  Returns at the end of the buffer, or at the } which
+ * closes the current level. */
+static NEOERR* _hdf_read_string (HDF *hdf, char **str, char *end,
                                  const char *path, int *lineno,
                                  int include_handle)
 {
   NEOERR *err;
   HDF *lower;
+  HDF *cur = NULL;
+  char *cur_name = NULL;
+  int cur_len = 0;
+  char *line, *nl;
   char *s;
   char *name, *value;
   HDF_ATTR *attr = NULL;
 
-  while (**str != '\0')
+  while (*str < end)
   {
-    /* Reset string length, but don't free the reserved buffer */
-    line->len = 0;
-    err = _copy_line_advance(str, line);
-    if (err) return nerr_pass(err);
+    line = *str;
+    nl = memchr (line, '\n', end - line);
+    if (nl != NULL)
+    {
+      *nl = '\0';
+      *str = nl + 1;
+    }
+    else
+    {
+      *str = end;
+    }
     attr = NULL;
     (*lineno)++;
-    s = line->buf;
+    s = line;
     SKIPWS(s);
     if (!strncmp(s, "#include ", 9) && include_handle != INCLUDE_IGNORE)
     {
@@ -1591,6 +2564,7 @@ static NEOERR* _hdf_read_string (HDF *hdf, const char **str, STRING *line,
         {
           return nerr_pass_ctx(err, "In file %s:%d", path, *lineno);
         }
+        cur = NULL;
       }
       else
       {
@@ -1611,7 +2585,7 @@ static NEOERR* _hdf_read_string (HDF *hdf, const char **str, STRING *line,
       {
         err = nerr_raise(NERR_PARSE,
 	    "[%s:%d] Trailing garbage on line following }: %s", path, *lineno,
-	    line->buf);
+	    line);
         return err;
       }
       return STATUS_OK;
@@ -1641,7 +2615,8 @@ static NEOERR* _hdf_read_string (HDF *hdf, const char **str, STRING *line,
 	name = neos_strip(name);
 	s++;
 	value = neos_strip(s);
-	err = _set_value (hdf, name, value, 1, 1, 0, attr, NULL);
+	err = _read_set_value (hdf, name, value, 1, attr, &cur, &cur_name,
+	                       &cur_len);
 	if (err != STATUS_OK)
         {
           return nerr_pass_ctx(err, "In file %s:%d", path, *lineno);
@@ -1654,7 +2629,8 @@ static NEOERR* _hdf_read_string (HDF *hdf, const char **str, STRING *line,
 	s+=2;
 	value = neos_strip(s);
 	value = hdf_get_value(hdf->top, value, "");
-	err = _set_value (hdf, name, value, 1, 1, 0, attr, NULL);
+	err = _read_set_value (hdf, name, value, 1, attr, &cur, &cur_name,
+	                       &cur_len);
 	if (err != STATUS_OK)
         {
           return nerr_pass_ctx(err, "In file %s:%d", path, *lineno);
@@ -1671,6 +2647,8 @@ static NEOERR* _hdf_read_string (HDF *hdf, const char **str, STRING *line,
         {
           return nerr_pass_ctx(err, "In file %s:%d", path, *lineno);
         }
+	/* The cursor may now be on the far side of a link */
+	cur = NULL;
       }
       else if (s[0] == '{') /* deeper */
       {
@@ -1689,17 +2667,16 @@ static NEOERR* _hdf_read_string (HDF *hdf, const char **str, STRING *line,
         {
           return nerr_pass_ctx(err, "In file %s:%d", path, *lineno);
         }
-	err = _hdf_read_string (lower, str, line, path, lineno, include_handle);
+	err = _hdf_read_string (lower, str, end, path, lineno, include_handle);
 	if (err != STATUS_OK)
         {
           return nerr_pass_ctx(err, "In file %s:%d", path, *lineno);
         }
+	cur = NULL;
       }
       else if (s[0] == '<' && s[1] == '<') /* multi-line assignment */
       {
 	char *m;
-	int msize = 0;
-	int mmax = 128;
 	int l;
 
 	*s = '\0';
@@ -1711,52 +2688,35 @@ static NEOERR* _hdf_read_string (HDF *hdf, const char **str, STRING *line,
         {
 	  err = nerr_raise(NERR_PARSE,
 	      "[%s:%d] No multi-assignment terminator given: %s", path, *lineno,
-	      line->buf);
+	      line);
           return err;
         }
-	m = (char *) malloc (mmax * sizeof(char));
-	if (m == NULL)
-        {
-	  return nerr_raise(NERR_NOMEM,
-	    "[%s:%d] Unable to allocate memory for multi-line assignment to %s",
-	    path, *lineno, name);
-        }
-	while (_copy_line (str, m+msize, mmax-msize) != 0)
+	/* The value is every line up to the terminator, which is already
+	 * contiguous in the buffer */
+	m = *str;
+	while (*str < end)
 	{
+	  nl = memchr (*str, '\n', end - *str);
           (*lineno)++;
-	  if (!strncmp(value, m+msize, l) && isspace(m[msize+l]))
+	  if (!strncmp(value, *str, l) && isspace((*str)[l]))
 	  {
-	    m[msize] = '\0';
+	    **str = '\0';
+	    *str = (nl != NULL) ? nl + 1 : end;
 	    break;
 	  }
-	  msize += strlen(m+msize);
-	  if (msize + l + 10 > mmax)
-	  {
-            void *new_ptr;
-	    mmax += 128;
-	    new_ptr = realloc (m, mmax * sizeof(char));
-	    if (new_ptr == NULL)
-            {
-              free(m);
-	      return nerr_raise(NERR_NOMEM,
-		  "[%s:%d] Unable to allocate memory for multi-line assignment to %s: size=%d",
-		  path, *lineno, name, mmax);
-            }
-            m = (char *) new_ptr;
-	  }
+	  *str = (nl != NULL) ? nl + 1 : end;
 	}
-	err = _set_value (hdf, name, m, 0, 1, 0, attr, NULL);
+	err = _read_set_value (hdf, name, m, 1, attr, &cur, &cur_name,
+	                       &cur_len);
 	if (err != STATUS_OK)
 	{
-	  free (m);
           return nerr_pass_ctx(err, "In file %s:%d", path, *lineno);
 	}
-
       }
       else
       {
 	err = nerr_raise(NERR_PARSE, "[%s:%d] Unable to parse line %s", path,
-	    *lineno, line->buf);
+	    *lineno, line);
         return err;
       }
     }
@@ -1764,31 +2724,479 @@ static NEOERR* _hdf_read_string (HDF *hdf, const char **str, STRING *line,
   return STATUS_OK;
 }
 
-NEOERR * hdf_read_string (HDF *hdf, const char *str)
+static NEOERR* _hdf_read_string_copy (HDF *hdf, const char *str,
+                                      int include_handle)
 {
   NEOERR *err;
   int lineno = 0;
-  STRING line;
-  string_init(&line);
-  err = _hdf_read_string(hdf, &str, &line, "<string>", &lineno, INCLUDE_ERROR);
-  string_clear(&line);
+  char *buf, *ptr;
+  int len = strlen(str);
+
+  buf = (char *) malloc (len + 1);
+  if (buf == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to allocate copy of HDF string");
+  memcpy (buf, str, len + 1);
+  ptr = buf;
+  err = _hdf_read_string(hdf, &ptr, buf + len, "<string>", &lineno,
+                         include_handle);
+  free(buf);
   return nerr_pass(err);
 }
 
-NEOERR * hdf_read_string_ignore (HDF *hdf, const char *str, int ignore)
+NEOERR * hdf_read_string (HDF *hdf, const char *str)
 {
-  NEOERR *err;
-  int lineno = 0;
-  STRING line;
-  string_init(&line);
-  err = _hdf_read_string(hdf, &str, &line, "<string>", &lineno,
-                         (ignore ? INCLUDE_IGNORE : INCLUDE_ERROR));
-  string_clear(&line);
-  return nerr_pass(err);
+  return nerr_pass(_hdf_read_string_copy(hdf, str, INCLUDE_ERROR));
+}
+
+NEOERR * hdf_read_string_ignore (HDF *hdf, const char *str, int ignore)
+{
+  return nerr_pass(_hdf_read_string_copy(hdf, str,
+                   (ignore ? INCLUDE_IGNORE : INCLUDE_ERROR)));
+}
+
+/* The binary format, see hdf_write_binary.  After the magic number and
+ * version comes the number of children of the top node, then each child
+ * depth first:
+ *   name, flags, value (if HDF_BINARY_VALUE), number of attributes,
+ *   key and value of each attribute, number of children, children
+ * Numbers are 4 bytes, little endian (ne_stream4).  Strings are their
+ * length as a number, then the bytes and a NUL, so values can be used
+ * straight from the buffer.  ne_stream_str only does strings up to 255
+ * bytes, which is too short for values. */
+#define HDF_BINARY_MAGIC 0x42464448
+#define HDF_BINARY_VERSION 1
+#define HDF_BINARY_VALUE (1<<0)
+#define HDF_BINARY_LINK (1<<1)
+#define HDF_BINARY_MAX_DEPTH 1024
+
+static size_t _binary_len (HDF *hdf)
+{
+  HDF *child;
+  HDF_ATTR *attr;
+  size_t len = 4;
+
+  for (child = hdf->child; child != NULL; child = child->next)
+  {
+    len += 4 + child->name_len + 1 + 1 + 4;
+    if (child->value != NULL) len += 4 + strlen(child->value) + 1;
+    for (attr = child->attr; attr != NULL; attr = attr->next)
+    {
+      len += 4 + strlen(attr->key) + 1;
+      len += 4 + (attr->value ? strlen(attr->value) : 0) + 1;
+    }
+    len += _binary_len (child);
+  }
+  return len;
+}
+
+static UINT8 *_binary_str (UINT8 *dest, const char *s)
+{
+  size_t l = (s != NULL) ? strlen(s) : 0;
+
+  dest = ne_stream4 (dest, l);
+  memcpy (dest, s, l);
+  dest[l] = '\0';
+  return dest + l + 1;
+}
+
+static UINT8 *_binary_write (UINT8 *dest, HDF *hdf)
+{
+  HDF *child;
+  HDF_ATTR *attr;
+  UINT8 *count;
+  UINT32 num, num_attrs;
+
+  /* The counts are filled in once we know them */
+  count = dest;
+  dest += 4;
+  for (num = 0, child = hdf->child; child != NULL; child = child->next, num++)
+  {
+    dest = _binary_str (dest, child->name);
+    *dest = 0;
+    if (child->value != NULL) *dest |= HDF_BINARY_VALUE;
+    if (child->link) *dest |= HDF_BINARY_LINK;
+    dest++;
+    if (child->value != NULL)
+      dest = _binary_str (dest, child->value);
+    num_attrs = 0;
+    for (attr = child->attr; attr != NULL; attr = attr->next)
+      num_attrs++;
+    dest = ne_stream4 (dest, num_attrs);
+    for (attr = child->attr; attr != NULL; attr = attr->next)
+    {
+      dest = _binary_str (dest, attr->key);
+      dest = _binary_str (dest, attr->value);
+    }
+    dest = _binary_write (dest, child);
+  }
+  ne_stream4 (count, num);
+  return dest;
+}
+
+NEOERR* hdf_write_binary (HDF *hdf, char **buf, int *len)
+{
+  UINT8 *b, *p;
+  size_t l;
+
+  *buf = NULL;
+  *len = 0;
+  if (hdf == NULL)
+    return nerr_raise(NERR_ASSERT, "Can't write NULL hdf");
+
+  l = 8 + _binary_len (hdf);
+  if (l > INT_MAX)
+    return nerr_raise(NERR_OUTOFRANGE, "HDF too large to write: %lu bytes",
+	(unsigned long) l);
+  b = (UINT8 *) malloc (l);
+  if (b == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to allocate %lu bytes for HDF",
+	(unsigned long) l);
+
+  p = ne_stream4 (b, HDF_BINARY_MAGIC);
+  p = ne_stream4 (p, HDF_BINARY_VERSION);
+  p = _binary_write (p, hdf);
+
+  *buf = (char *) b;
+  *len = p - b;
+  return STATUS_OK;
+}
+
+typedef struct _binary_reader
+{
+  UINT8 *p;
+  UINT8 *end;
+} BINARY_READER;
+
+static int _binary_read_num (BINARY_READER *r, UINT32 *num)
+{
+  if (r->end - r->p < 4) return -1;
+  r->p = ne_unstream4 (num, r->p);
+  return 0;
+}
+
+static int _binary_read_str (BINARY_READER *r, char **s)
+{
+  UINT32 l;
+
+  if (_binary_read_num (r, &l) || l >= (UINT32)(r->end - r->p) ||
+      r->p[l] != '\0')
+    return -1;
+  *s = (char *) r->p;
+  r->p += l + 1;
+  return 0;
+}
+
+/* Allocate a node for a level which started out empty, so it can just be
+ * appended.  The name and value are in the same allocation as the node;
+ * the value isn't marked as allocated, so setting a new one leaves it
+ * alone. */
+static NEOERR* _binary_node (HDF *hdf, const char *name, const char *value,
+                             HDF **node)
+{
+  HDF_ARENA *arena = hdf->top ? hdf->top->arena : NULL;
+  size_t nlen = strlen(name);
+  size_t vlen = (value != NULL) ? strlen(value) + 1 : 0;
+  size_t len = sizeof(HDF) + nlen + 1 + vlen;
+  HDF *hn;
+
+  if (arena != NULL)
+  {
+    hn = (HDF *) _arena_alloc (arena, len);
+    if (hn != NULL) memset(hn, 0, sizeof(HDF));
+  }
+  else
+  {
+    hn = (HDF *) calloc (1, len);
+  }
+  if (hn == NULL)
+    return nerr_raise(NERR_NOMEM, "Unable to allocate memory for %s", name);
+
+  hn->top = hdf->top;
+  hn->name = (char *)(hn + 1);
+  hn->name_len = nlen;
+  memcpy(hn->name, name, nlen + 1);
+  if (value != NULL)
+  {
+    hn->value = hn->name + nlen + 1;
+    memcpy(hn->value, value, vlen);
+  }
+
+  if (hdf->child == NULL)
+    hdf->child = hn;
+  else
+    hdf->last_child->next = hn;
+  hdf->last_child = hn;
+  hdf->num_children++;
+  *node = hn;
+  return STATUS_OK;
+}
+
+static NEOERR* _binary_read (HDF *hdf, BINARY_READER *r, int depth)
+{
+  NEOERR *err;
+  HDF *node;
+  HDF_ATTR *attr, *last;
+  UINT32 num, num_attrs;
+  char *name, *value, *key, *avalue;
+  int flags;
+  int fresh;
+
+  if (depth > HDF_BINARY_MAX_DEPTH)
+    return nerr_raise(NERR_PARSE, "Binary HDF nested too deeply");
+  if (_binary_read_num (r, &num))
+    return nerr_raise(NERR_PARSE, "Binary HDF is truncated");
+
+  /* Reading into an empty level is the common case, and there's nothing
+   * to merge with */
+  fresh = (hdf->child == NULL && hdf->hash == NULL && !hdf->link);
+
+  while (num--)
+  {
+    value = NULL;
+    if (_binary_read_str (r, &name) || name[0] == '\0' ||
+	strchr(name, '.') != NULL || r->p == r->end)
+      return nerr_raise(NERR_PARSE, "Binary HDF is corrupt");
+    flags = *(r->p++);
+    if ((flags & HDF_BINARY_VALUE) && _binary_read_str (r, &value))
+      return nerr_raise(NERR_PARSE, "Binary HDF is corrupt at %s", name);
+    if (_binary_read_num (r, &num_attrs))
+      return nerr_raise(NERR_PARSE, "Binary HDF is corrupt at %s", name);
+
+    attr = last = NULL;
+    while (num_attrs--)
+    {
+      if (_binary_read_str (r, &key) || _binary_read_str (r, &avalue))
+      {
+	_dealloc_hdf_attr(&attr);
+	return nerr_raise(NERR_PARSE, "Binary HDF is corrupt at %s", name);
+      }
+      if (last == NULL)
+	last = attr = (HDF_ATTR *) calloc (1, sizeof(HDF_ATTR));
+      else
+	last = last->next = (HDF_ATTR *) calloc (1, sizeof(HDF_ATTR));
+      if (last == NULL || (last->key = strdup(key)) == NULL ||
+	  (last->value = strdup(avalue)) == NULL)
+      {
+	_dealloc_hdf_attr(&attr);
+	return nerr_raise(NERR_NOMEM, "Unable to load attributes of %s", name);
+      }
+    }
+
+    /* Links are set after their children, so the children don't go
+     * through the link */
+    node = NULL;
+    if (fresh)
+    {
+      err = _binary_node (hdf, name, value, &node);
+      if (err == STATUS_OK)
+	err = _set_node_attr (node, attr);
+      else
+	_dealloc_hdf_attr(&attr);
+    }
+    else
+    {
+      if (value == NULL)
+	node = _read_prefix_node (hdf, name, strlen(name));
+      if (node != NULL)
+	err = _set_value (node, NULL, node->value, 1, 1, 0, attr, NULL);
+      else
+	err = _set_value (hdf, name, value, 1, 1, 0, attr, &node);
+    }
+    if (err) return nerr_pass(err);
+    err = _binary_read (node, r, depth + 1);
+    if (err) return nerr_pass(err);
+    if (flags & HDF_BINARY_LINK) node->link = 1;
+  }
+  if (fresh && hdf->num_children > FORCE_HASH_AT)
+    return nerr_pass(_hdf_hash_level(hdf));
+  return STATUS_OK;
+}
+
+NEOERR* hdf_read_binary (HDF *hdf, const char *buf, int len)
+{
+  NEOERR *err;
+  BINARY_READER r;
+  UINT32 magic, version;
+
+  if (hdf == NULL)
+    return nerr_raise(NERR_ASSERT, "Can't read into NULL hdf");
+  if (hdf->top != NULL && hdf->top->frozen)
+    return nerr_raise(NERR_ASSERT, "Can't read into frozen hdf");
+  _hdf_changed(hdf);
+  if (len < 8)
+    return nerr_raise(NERR_PARSE, "Binary HDF is truncated");
+
+  r.p = (UINT8 *) buf;
+  r.end = r.p + len;
+  r.p = ne_unstream4 (&magic, r.p);
+  r.p = ne_unstream4 (&version, r.p);
+  if (magic != HDF_BINARY_MAGIC)
+    return nerr_raise(NERR_PARSE, "Not a binary HDF");
+  if (version != HDF_BINARY_VERSION)
+    return nerr_raise(NERR_PARSE, "Binary HDF has version %d, expected %d",
+	version, HDF_BINARY_VERSION);
+
+  err = _binary_read (hdf, &r, 0);
+  if (err) return nerr_pass(err);
+  if (r.p != r.end)
+    return nerr_raise(NERR_PARSE, "Trailing garbage after binary HDF");
+  return STATUS_OK;
 }
 
 /* The search path is part of the HDF by convention */
-NEOERR* hdf_search_path (HDF *hdf, const char *path, char *full, int full_len)
+/* The hdf_search_path cache, see hdf_search_path_cache.  Entries are
+ * keyed by the load paths and the relative path together, so changing
+ * hdf.loadpaths just means using different entries.  An entry without a
+ * full path remembers that the file wasn't found. */
+#define SEARCH_CACHE_MAX 4096
+
+typedef struct _search_cache_entry
+{
+  char *key;
+  char *full;
+  time_t expires;
+  struct _search_cache_entry *next;
+} SEARCH_CACHE_ENTRY;
+
+static NE_HASH *SearchCache = NULL;
+static int SearchCacheTTL = 0;
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t SearchCacheLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static NEOERR* _search_cache_lock (void)
+{
+#ifdef HAVE_PTHREADS
+  return nerr_pass(mLock(&SearchCacheLock));
+#else
+  return STATUS_OK;
+#endif
+}
+
+static void _search_cache_unlock (void)
+{
+#ifdef HAVE_PTHREADS
+  NEOERR *err;
+
+  err = mUnlock(&SearchCacheLock);
+  nerr_ignore(&err);
+#endif
+}
+
+/* Must be called with the lock held */
+static void _search_cache_empty (void)
+{
+  SEARCH_CACHE_ENTRY *entry, *entries = NULL;
+  void *key = NULL;
+
+  if (SearchCache == NULL)
+    return;
+
+  /* The keys belong to the entries, so empty the hash before freeing them */
+  while ((entry = (SEARCH_CACHE_ENTRY *) ne_hash_next (SearchCache, &key)))
+  {
+    entry->next = entries;
+    entries = entry;
+  }
+  ne_hash_destroy (&SearchCache);
+
+  while (entries != NULL)
+  {
+    entry = entries;
+    entries = entry->next;
+    free(entry);
+  }
+}
+
+void hdf_search_path_cache (int ttl)
+{
+  NEOERR *err;
+
+  /* cgi_display calls this on every request, so setting the TTL which is
+   * already set mustn't empty the cache or take the lock */
+  if (ttl == SearchCacheTTL)
+    return;
+  err = _search_cache_lock();
+  if (err)
+  {
+    nerr_ignore(&err);
+    return;
+  }
+  if (ttl != SearchCacheTTL)
+  {
+    _search_cache_empty();
+    SearchCacheTTL = ttl;
+  }
+  _search_cache_unlock();
+}
+
+static int _search_cache_key (HDF *hdf, const char *path, char *key,
+                              int key_len)
+{
+  HDF *paths;
+  int l = 0, r;
+
+  for (paths = hdf_get_child (hdf, "hdf.loadpaths");
+      paths;
+      paths = hdf_obj_next (paths))
+  {
+    r = snprintf (key + l, key_len - l, "%s\n", hdf_obj_value(paths));
+    if (r < 0 || r >= key_len - l) return -1;
+    l += r;
+  }
+  r = snprintf (key + l, key_len - l, "\n%s", path);
+  if (r < 0 || r >= key_len - l) return -1;
+  return 0;
+}
+
+/* The cache is only an optimization, so failing to add to it isn't an
+ * error.  Must be called with the lock held. */
+static void _search_cache_add (const char *key, const char *full)
+{
+  NEOERR *err;
+  SEARCH_CACHE_ENTRY *entry;
+  size_t key_len = strlen(key) + 1;
+  size_t full_len = full ? strlen(full) + 1 : 0;
+
+  if (SearchCache != NULL && SearchCache->num >= SEARCH_CACHE_MAX)
+    _search_cache_empty();
+  if (SearchCache == NULL)
+  {
+    err = ne_hash_init (&SearchCache, ne_hash_str_hash, ne_hash_str_comp);
+    if (err)
+    {
+      nerr_ignore (&err);
+      return;
+    }
+  }
+
+  entry = (SEARCH_CACHE_ENTRY *) ne_hash_remove (SearchCache, (void *)key);
+  if (entry != NULL) free(entry);
+
+  entry = (SEARCH_CACHE_ENTRY *) malloc (sizeof(SEARCH_CACHE_ENTRY) +
+      key_len + full_len);
+  if (entry == NULL) return;
+  entry->key = (char *)(entry + 1);
+  memcpy(entry->key, key, key_len);
+  entry->full = NULL;
+  if (full != NULL)
+  {
+    entry->full = entry->key + key_len;
+    memcpy(entry->full, full, full_len);
+  }
+  entry->expires = (SearchCacheTTL > 0) ? time(NULL) + SearchCacheTTL : 0;
+  entry->next = NULL;
+
+  err = ne_hash_insert (SearchCache, entry->key, entry);
+  if (err)
+  {
+    nerr_ignore (&err);
+    free(entry);
+  }
+}
+
+static NEOERR* _search_path (HDF *hdf, const char *path, char *full,
+                             int full_len)
 {
   HDF *paths;
   struct stat s;
@@ -1818,7 +3226,70 @@ NEOERR* hdf_search_path (HDF *hdf, const char *path, char *full, int full_len)
   }
   else return STATUS_OK;
 
-  return nerr_raise (NERR_NOT_FOUND, "Path %s not found", path);
+  /* Callers often probe for optional files, so this is expected */
+  return nerr_raise_static (NERR_NOT_FOUND);
+}
+
+NEOERR* hdf_search_path_probe (HDF *hdf, const char *path, char *full,
+                               int full_len)
+{
+  NEOERR *err, *lock_err;
+  SEARCH_CACHE_ENTRY *entry;
+  char key[PATH_BUF_SIZE * 2];
+  int cached = 0, found = -1;
+
+  /* The cache is off unless someone turned it on, and finding that out
+   * shouldn't take a lock; SearchCacheTTL is checked again under it */
+  if (SearchCacheTTL == 0)
+    return nerr_pass(_search_path (hdf, path, full, full_len));
+
+  err = _search_cache_lock();
+  if (err) return nerr_pass(err);
+  if (SearchCacheTTL != 0 &&
+      _search_cache_key (hdf, path, key, sizeof(key)) != -1)
+  {
+    cached = 1;
+    entry = NULL;
+    if (SearchCache != NULL)
+      entry = (SEARCH_CACHE_ENTRY *) ne_hash_lookup (SearchCache, key);
+    if (entry != NULL &&
+        (entry->expires == 0 || entry->expires > time(NULL)))
+    {
+      found = (entry->full != NULL);
+      if (found)
+        snprintf (full, full_len, "%s", entry->full);
+    }
+  }
+  _search_cache_unlock();
+
+  if (found == 0)
+    return nerr_raise_static (NERR_NOT_FOUND);
+  if (found == 1)
+    return STATUS_OK;
+
+  /* Don't hold the lock while stat'ing the load paths */
+  err = _search_path (hdf, path, full, full_len);
+  if (cached && (err == STATUS_OK || nerr_match (err, NERR_NOT_FOUND)))
+  {
+    lock_err = _search_cache_lock();
+    if (lock_err == STATUS_OK)
+    {
+      _search_cache_add (key, err == STATUS_OK ? full : NULL);
+      _search_cache_unlock();
+    }
+    nerr_ignore(&lock_err);
+  }
+  return nerr_pass(err);
+}
+
+NEOERR* hdf_search_path (HDF *hdf, const char *path, char *full, int full_len)
+{
+  NEOERR *err;
+
+  err = hdf_search_path_probe (hdf, path, full, full_len);
+  if (nerr_handle(&err, NERR_NOT_FOUND))
+    return nerr_raise (NERR_NOT_FOUND, "Path %s not found", path);
+  return nerr_pass(err);
 }
 
 static NEOERR* hdf_read_file_internal (HDF *hdf, const char *path,
@@ -1828,11 +3299,8 @@ static NEOERR* hdf_read_file_internal (HDF *hdf, const char *path,
   int lineno = 0;
   char fpath[PATH_BUF_SIZE];
   char *ibuf = NULL;
-  const char *ptr = NULL;
+  char *ptr = NULL;
   HDF *top = hdf->top;
-  STRING line;
-
-  string_init(&line);
 
   if (path == NULL)
     return nerr_raise(NERR_ASSERT, "Can't read NULL file");
@@ -1845,8 +3313,9 @@ static NEOERR* hdf_read_file_internal (HDF *hdf, const char *path,
   {
     if (path[0] != '/')
     {
-      err = hdf_search_path (hdf, path, fpath, PATH_BUF_SIZE);
-      if (err != STATUS_OK) return nerr_pass(err);
+      err = hdf_search_path_probe (hdf, path, fpath, PATH_BUF_SIZE);
+      if (err != STATUS_OK)
+        return nerr_pass_ctx(err, "Path %s not found", path);
       path = fpath;
     }
 
@@ -1855,9 +3324,9 @@ static NEOERR* hdf_read_file_internal (HDF *hdf, const char *path,
   if (err) return nerr_pass(err);
 
   ptr = ibuf;
-  err = _hdf_read_string(hdf, &ptr, &line, path, &lineno, include_handle);
+  err = _hdf_read_string(hdf, &ptr, ibuf + strlen(ibuf), path, &lineno,
+                         include_handle);
   free(ibuf);
-  string_clear(&line);
   return nerr_pass(err);
 }
 
@@ -1875,3 +3344,196 @@ void hdf_register_fileload(HDF *hdf, void *ctx, HDFFILELOAD fileload)
   hdf->fileload_ctx = ctx;
   hdf->fileload = fileload;
 }
+
+/* A version of the data set published to an HDF_SNAPSHOT.  The snapshot
+ * holds one reference to its current version and each reader holds one
+ * more, and the version is destroyed by whoever drops the last one. */
+typedef struct _hdf_snapshot_version
+{
+  HDF *hdf;
+  int refs;
+  struct _hdf_snapshot_version *next;
+} HDF_SNAPSHOT_VERSION;
+
+struct _hdf_snapshot
+{
+#ifdef HAVE_PTHREADS
+  pthread_mutex_t lock;
+#endif
+  /* The current version first, followed by the old ones still in use */
+  HDF_SNAPSHOT_VERSION *versions;
+};
+
+static NEOERR* _snapshot_lock (HDF_SNAPSHOT *snap)
+{
+#ifdef HAVE_PTHREADS
+  return nerr_pass(mLock(&(snap->lock)));
+#else
+  return STATUS_OK;
+#endif
+}
+
+static void _snapshot_unlock (HDF_SNAPSHOT *snap)
+{
+#ifdef HAVE_PTHREADS
+  NEOERR *err;
+
+  err = mUnlock(&(snap->lock));
+  nerr_ignore(&err);
+#endif
+}
+
+/* Drops a reference to version, and returns it if it was the last one so
+ * that it can be destroyed once the lock is released.  Must be called
+ * with the lock held. */
+static HDF_SNAPSHOT_VERSION* _snapshot_unref (HDF_SNAPSHOT *snap,
+                                              HDF_SNAPSHOT_VERSION *version)
+{
+  HDF_SNAPSHOT_VERSION **vp;
+
+  if (--version->refs > 0) return NULL;
+  for (vp = &(snap->versions); *vp != NULL; vp = &((*vp)->next))
+  {
+    if (*vp == version)
+    {
+      *vp = version->next;
+      break;
+    }
+  }
+  return version;
+}
+
+static void _snapshot_version_destroy (HDF_SNAPSHOT_VERSION *version)
+{
+  if (version == NULL) return;
+  hdf_destroy(&(version->hdf));
+  free(version);
+}
+
+NEOERR* hdf_snapshot_init (HDF_SNAPSHOT **snap)
+{
+  NEOERR *err;
+  HDF_SNAPSHOT *my_snap;
+
+  *snap = NULL;
+  my_snap = (HDF_SNAPSHOT *) calloc (1, sizeof (HDF_SNAPSHOT));
+  if (my_snap == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for hdf snapshot");
+#ifdef HAVE_PTHREADS
+  err = mCreate(&(my_snap->lock));
+  if (err)
+  {
+    free(my_snap);
+    return nerr_pass(err);
+  }
+#endif
+  *snap = my_snap;
+  return STATUS_OK;
+}
+
+void hdf_snapshot_destroy (HDF_SNAPSHOT **snap)
+{
+  HDF_SNAPSHOT_VERSION *version, *next;
+
+  if (*snap == NULL) return;
+  for (version = (*snap)->versions; version != NULL; version = next)
+  {
+    next = version->next;
+    _snapshot_version_destroy(version);
+  }
+#ifdef HAVE_PTHREADS
+  mDestroy(&((*snap)->lock));
+#endif
+  free(*snap);
+  *snap = NULL;
+}
+
+NEOERR* hdf_snapshot_publish (HDF_SNAPSHOT *snap, HDF *hdf)
+{
+  NEOERR *err;
+  HDF_SNAPSHOT_VERSION *version, *retired;
+
+  if (snap == NULL)
+    return nerr_raise (NERR_ASSERT, "Can't publish to NULL snapshot");
+  /* Everything expensive happens before the lock is taken */
+  err = hdf_freeze(hdf);
+  if (err) return nerr_pass(err);
+  version = (HDF_SNAPSHOT_VERSION *) calloc (1, sizeof (HDF_SNAPSHOT_VERSION));
+  if (version == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for hdf snapshot");
+  version->hdf = hdf;
+  version->refs = 1;
+
+  err = _snapshot_lock(snap);
+  if (err)
+  {
+    free(version);
+    return nerr_pass(err);
+  }
+  for (retired = snap->versions; retired != NULL; retired = retired->next)
+  {
+    if (retired->hdf == hdf) break;
+  }
+  if (retired != NULL)
+  {
+    _snapshot_unlock(snap);
+    free(version);
+    return nerr_raise (NERR_DUPLICATE, "This hdf has already been published");
+  }
+  version->next = snap->versions;
+  snap->versions = version;
+  if (version->next != NULL)
+    retired = _snapshot_unref(snap, version->next);
+  _snapshot_unlock(snap);
+
+  _snapshot_version_destroy(retired);
+  return STATUS_OK;
+}
+
+NEOERR* hdf_snapshot_acquire (HDF_SNAPSHOT *snap, HDF **hdf)
+{
+  NEOERR *err;
+
+  *hdf = NULL;
+  if (snap == NULL)
+    return nerr_raise (NERR_ASSERT, "Can't acquire from NULL snapshot");
+  err = _snapshot_lock(snap);
+  if (err) return nerr_pass(err);
+  if (snap->versions != NULL)
+  {
+    snap->versions->refs++;
+    *hdf = snap->versions->hdf;
+  }
+  _snapshot_unlock(snap);
+  if (*hdf == NULL)
+    return nerr_raise (NERR_NOT_FOUND, "Nothing has been published");
+  return STATUS_OK;
+}
+
+void hdf_snapshot_release (HDF_SNAPSHOT *snap, HDF **hdf)
+{
+  NEOERR *err;
+  HDF_SNAPSHOT_VERSION *version, *retired = NULL;
+
+  if (snap == NULL || *hdf == NULL) return;
+  err = _snapshot_lock(snap);
+  if (err)
+  {
+    /* Rather leak the version than destroy it under another reader */
+    nerr_ignore(&err);
+    *hdf = NULL;
+    return;
+  }
+  for (version = snap->versions; version != NULL; version = version->next)
+  {
+    if (version->hdf == *hdf)
+    {
+      retired = _snapshot_unref(snap, version);
+      break;
+    }
+  }
+  _snapshot_unlock(snap);
+  *hdf = NULL;
+
+  _snapshot_version_destroy(retired);
+}
@@ -81,6 +81,13 @@ typedef struct _hdf HDF;
 typedef NEOERR* (*HDFFILELOAD)(void *ctx, HDF *hdf, const char *filename,
                               char **contents);
 
+/* The bump allocator behind hdf_init_arena, opaque outside neo_hdf.c */
+typedef struct _hdf_arena HDF_ARENA;
+
+/* A shared data set which can be replaced while it's in use, opaque
+ * outside neo_hdf.c, see hdf_snapshot_init */
+typedef struct _hdf_snapshot HDF_SNAPSHOT;
+
 typedef struct _attr
 {
   char *key;
@@ -109,13 +116,48 @@ struct _hdf
   NE_HASH *hash;
   /* When using the HASH, we need to know where to append new children */
   struct _hdf *last_child;
+  /* The number of children, see hdf_obj_child_count */
+  int num_children;
 
   /* Should only be set on the head node, used to override the default file
    * load method */
   void *fileload_ctx;
   HDFFILELOAD fileload;
+
+  /* Should only be set on the head node, the arena all the nodes of this
+   * data set come from, see hdf_init_arena */
+  HDF_ARENA *arena;
+
+  /* Should only be set on the head node, the data set names missing from
+   * this one are looked up in, see hdf_set_base */
+  struct _hdf *base;
+
+  /* Should only be set on the head node, nothing in this data set can be
+   * changed any more, see hdf_freeze */
+  int frozen;
+
+  /* Should only be set on the head node, bumped whenever a name could
+   * start leading somewhere else, see hdf_change_count */
+  unsigned int changes;
 };
 
+/* HDF_PATH is an HDF name which has been split into its dot separated
+ * elements ahead of time, along with the length and hash of each element,
+ * so that the same name can be looked up over and over again without
+ * re-scanning it.  See hdf_path_compile and hdf_get_obj_path. */
+typedef struct _hdf_path_elem
+{
+  const char *name;
+  int len;
+  UINT32 hashv;
+} HDF_PATH_ELEM;
+
+typedef struct _hdf_path
+{
+  int num;
+  HDF_PATH_ELEM *elems;
+} HDF_PATH;
+
 /*
  * Function: hdf_init - Initialize an HDF data set
  * Description: hdf_init initializes an HDF data set and returns the
@@ -126,6 +168,114 @@ struct _hdf
  */
 NEOERR* hdf_init (HDF **hdf);
 
+/*
+ * Function: hdf_init_arena - Initialize an HDF data set using an arena
+ * Description: hdf_init_arena is the same as hdf_init, except that the
+ *              nodes, names, values and attributes of the data set are
+ *              allocated from a bump arena which is released in one go
+ *              by hdf_destroy, instead of with a malloc/free pair each.
+ *              This is meant for short lived data sets, like the one
+ *              built for each CGI request: memory for values which are
+ *              overwritten and trees removed with hdf_remove_tree isn't
+ *              reused until the data set is destroyed.
+ *              Buffers passed to hdf_set_buf are still owned by the data
+ *              set, and freed by hdf_destroy.
+ * Input: hdf - pointer to an HDF pointer
+ *        size_hint - the number of bytes the data set is expected to
+ *                    use, or 0 for the default.  The arena grows as
+ *                    needed regardless.
+ * Output: hdf - allocated hdf node
+ * Returns: NERR_NOMEM - unable to allocate memory for dataset
+ */
+NEOERR* hdf_init_arena (HDF **hdf, size_t size_hint);
+
+/*
+ * Function: hdf_init_image - Load a data set from a compiled image
+ * Description: hdf_init_image maps an image written by hdf_write_image
+ *              and returns a data set for it, without parsing anything.
+ *              The names, values and attributes of the data set point
+ *              straight into the mapping, which is shared read-only
+ *              between every process that loads the same image; only
+ *              the nodes themselves are built, in one arena allocation,
+ *              along with the hash tables of large levels from the
+ *              hash values stored in the image.
+ *              The data set is an arena data set (see hdf_init_arena),
+ *              so it can still be changed, but it's meant for large
+ *              static data like configuration and localization files.
+ *              Values from the image must never be modified in place.
+ *              hdf_destroy releases the mapping.
+ * Input: hdf - pointer to an HDF pointer
+ *        path - the image file
+ * Output: hdf - the top node of the loaded data set
+ * Returns: NERR_IO - unable to open or map the file
+ *          NERR_PARSE - the file isn't a valid image
+ *          NERR_NOMEM
+ */
+NEOERR* hdf_init_image (HDF **hdf, const char *path);
+
+/*
+ * Function: hdf_set_base - Layer a data set over a shared base
+ * Description: hdf_set_base makes hdf an overlay of base: any name which
+ *              is looked up from the top of hdf and isn't found there is
+ *              looked up in base instead, the same way the global_hdf
+ *              of a CSPARSE works.  Changes always go to hdf, so only
+ *              the nodes which are set are created in it, and base is
+ *              never modified; many overlays, in many threads, can share
+ *              one base as long as nothing changes the base itself.
+ *              This replaces making a copy of a large shared data set
+ *              for each request.
+ *              The fall through is by name: once hdf has a node, the
+ *              node of the same name in base is hidden, including its
+ *              children for hdf_obj_child and the like.  Lookups from
+ *              a node below the top, hdf_dump and hdf_write_file only
+ *              see hdf.  The base may be an overlay itself, and must
+ *              outlive hdf.  Nodes found in the base belong to it and
+ *              must not be changed.
+ * Input: hdf - the top node of the overlay data set
+ *        base - the top node of the base data set, or NULL to make hdf
+ *               a regular data set again
+ * Output: None
+ * Returns: NERR_ASSERT - either isn't a top node, or base is an
+ *                        overlay of hdf
+ */
+NEOERR* hdf_set_base (HDF *hdf, HDF *base);
+
+/*
+ * Function: hdf_freeze - Make a data set read only
+ * Description: hdf_freeze finishes building the indexes of the data set
+ *              and marks it read only.  Afterwards, anything which would
+ *              change it, such as hdf_set_value, hdf_set_attr,
+ *              hdf_remove_tree, hdf_sort_obj, hdf_copy into it or
+ *              reading into it, fails with NERR_ASSERT, and looking
+ *              names up in it changes nothing either, so any number of
+ *              threads can read it at once without locking.  Per
+ *              request changes belong in an overlay, see hdf_set_base.
+ *              There is no way to thaw a data set; copy it instead.
+ * Input: hdf - the top node of the data set
+ * Output: None
+ * Returns: NERR_ASSERT - not a top node
+ *          NERR_NOMEM - unable to build an index
+ * MT-Level: Unsafe until it returns, Safe for reading afterwards.
+ */
+NEOERR* hdf_freeze (HDF *hdf);
+
+/*
+ * Function: hdf_change_count - Tell whether names still lead to the same nodes
+ * Description: hdf_change_count returns a number which changes every time
+ *              a node is added to or removed from the data set hdf is
+ *              in, a link in it is set or changed, or its base changes,
+ *              including any of those in its base (see hdf_set_base).
+ *              Setting the value or attributes of an ordinary node
+ *              doesn't change it.  So if the count is the same as when
+ *              a name was looked up, the same lookup still finds the same
+ *              node, and code which looks the same names up over and over
+ *              (like the CS renderer) can remember the nodes instead.
+ * Input: hdf -> any node of the data set
+ * Output: None
+ * Returns: The change count, 0 for a NULL hdf
+ */
+unsigned int hdf_change_count (HDF *hdf);
+
 /*
  * Function: hdf_destroy - deallocate an HDF data set
  * Description: hdf_destroy is used to deallocate all memory associated
@@ -236,6 +386,40 @@ NEOERR* hdf_get_copy (HDF *hdf, const char *name, char **value,
  */
 HDF* hdf_get_obj (HDF *hdf, const char *name);
 
+/*
+ * Function: hdf_path_compile - split an HDF name for hdf_get_obj_path
+ * Description: hdf_path_compile splits name into its elements and
+ *              precomputes the information hdf_get_obj_path needs to walk
+ *              to it.  The HDF_PATH keeps its own copy of the name, and
+ *              is a single allocation which can be released with
+ *              hdf_path_destroy.
+ * Input: name -> the name to compile
+ * Output: path -> the allocated HDF_PATH
+ * Returns: NERR_NOMEM if unable to allocate the path
+ */
+NEOERR* hdf_path_compile (const char *name, HDF_PATH **path);
+
+/*
+ * Function: hdf_path_destroy - deallocate an HDF_PATH
+ * Description: hdf_path_destroy frees a path created by
+ *              hdf_path_compile.  It is safe to call with a NULL path.
+ * Input: path -> pointer to the HDF_PATH pointer
+ * Output: path -> NULL
+ * Returns: None
+ */
+void hdf_path_destroy (HDF_PATH **path);
+
+/*
+ * Function: hdf_get_obj_path - return the HDF node at a compiled location
+ * Description: hdf_get_obj_path is the same as hdf_get_obj, except the
+ *              name is given as an HDF_PATH from hdf_path_compile.
+ * Input: hdf -> the dataset node to start from
+ *        path -> the compiled name to walk to
+ * Output: None
+ * Returns: the pointer to the named node, or NULL if it doesn't exist
+ */
+HDF* hdf_get_obj_path (HDF *hdf, HDF_PATH *path);
+
 /*
  * Function: hdf_get_node - Similar to hdf_get_obj except all the nodes
  *           are created if the don't exist.
@@ -243,6 +427,8 @@ HDF* hdf_get_obj (HDF *hdf, const char *name);
  *              of stopping if it can't find a node in the tree, it will
  *              create all of the nodes necessary to hand you back the
  *              node you ask for.  Nodes are created with no value.
+ *              In an overlay, the node is always one of the overlay's
+ *              own, never one from its base (see hdf_set_base).
  * Input: hdf -> the dataset node to start from
  *        name -> the name to walk to
  * Output: ret -> the dataset node you asked for
@@ -294,6 +480,18 @@ NEOERR* hdf_set_attr (HDF *hdf, const char *name, const char *key,
  */
 HDF* hdf_obj_child (HDF *hdf);
 
+/*
+ * Function: hdf_obj_child_count - Return the number of children of a node
+ * Description: hdf_obj_child_count returns how many children the node
+ *              has, without walking them.  This makes appending to a
+ *              numbered list of children (ie, Query.id.0, Query.id.1...)
+ *              constant time.  Like hdf_obj_child, it follows links.
+ * Input: hdf -> the hdf dataset node
+ * Output: None
+ * Returns: The number of children
+ */
+int hdf_obj_child_count (HDF *hdf);
+
 /*
  * Function: hdf_obj_next - Return the next node of a dataset level
  * Description: hdf_obj_next is an accessor function for the HDF struct
@@ -441,6 +639,38 @@ NEOERR* hdf_set_copy (HDF *hdf, const char *dest, const char *src);
 
 NEOERR* hdf_set_buf (HDF *hdf, const char *name, char *value);
 
+/*
+ * Function: hdf_set_borrowed - Set the value of a node to a string owned
+ *           elsewhere
+ * Description: hdf_set_borrowed is similar to hdf_set_value, except the
+ *              dataset points at value instead of making a copy of it,
+ *              and never frees it.  value must not change or be freed
+ *              while the node still has it as its value.  Use with
+ *              hdf_own_buf to set many values out of one buffer, which
+ *              is released with the dataset.
+ * Input: hdf -> the hdf dataset node
+ *        name -> the name to walk to
+ *        value -> the value
+ * Output: None
+ * Returns: NERR_NOMEM - unable to allocate a node
+ */
+NEOERR* hdf_set_borrowed (HDF *hdf, const char *name, const char *value);
+
+/*
+ * Function: hdf_own_buf - Give a buffer to a dataset to free with it
+ * Description: hdf_own_buf makes the dataset responsible for freeing buf
+ *              when it is destroyed, so values set with hdf_set_borrowed
+ *              can point into it.  Only datasets created with
+ *              hdf_init_arena can own buffers.
+ * Input: hdf -> any node of the hdf dataset
+ *        buf -> a malloc'd buffer
+ * Output: None
+ * Returns: NERR_ASSERT - the dataset isn't an arena dataset, the caller
+ *                        still owns buf
+ *          NERR_NOMEM - the caller still owns buf
+ */
+NEOERR* hdf_own_buf (HDF *hdf, char *buf);
+
 /*
  * Function: hdf_set_symlink - Set part of the tree to link to another
  * Description: hdf_set_symlink creates a link between two sections of
@@ -521,6 +751,23 @@ NEOERR* hdf_write_file (HDF *hdf, const char *path);
  */
 NEOERR* hdf_write_file_atomic (HDF *hdf, const char *path);
 
+/*
+ * Function: hdf_write_image - compile an HDF data set to an image file
+ * Description: hdf_write_image writes hdf and everything below it as a
+ *              flat image for hdf_init_image: a string table, the nodes
+ *              with their children as offsets, and the hash of each
+ *              name.  Links are written as links.  The image is in host
+ *              byte order, and like hdf_write_file_atomic the old file
+ *              is replaced with rename(2), so processes which have it
+ *              mapped aren't affected.
+ * Input: hdf - the data set to write, which becomes the top node of
+ *              the image
+ *        path - the image file
+ * Output: None
+ * Returns: NERR_IO, NERR_NOMEM
+ */
+NEOERR* hdf_write_image (HDF *hdf, const char *path);
+
 /*
  * Function: hdf_read_string - read an HDF string
  * Description:
@@ -548,6 +795,36 @@ NEOERR* hdf_read_string_ignore (HDF *hdf, const char *s, int ignore);
  */
 NEOERR* hdf_write_string (HDF *hdf, char **s);
 
+/*
+ * Function: hdf_write_binary - serialize an HDF dataset to a binary buffer
+ * Description: hdf_write_binary is the binary version of
+ *              hdf_write_string, for handing a data set to another
+ *              process.  Names, values and attributes are stored with
+ *              their lengths, and the children of each node are counted,
+ *              so hdf_read_binary doesn't have to parse anything.  Links
+ *              and attributes are kept.  The format is the same on all
+ *              platforms.
+ * Input: hdf - the data set to write; its children and everything
+ *              below them are written, like hdf_write_string
+ * Output: buf - an allocated buffer, which the caller must free
+ *         len - the length of buf
+ * Returns: NERR_NOMEM
+ */
+NEOERR* hdf_write_binary (HDF *hdf, char **buf, int *len);
+
+/*
+ * Function: hdf_read_binary - read a buffer written by hdf_write_binary
+ * Description: hdf_read_binary adds the data set in buf below hdf, the
+ *              same way hdf_read_string would add its text version.
+ *              buf isn't changed or kept.
+ * Input: hdf - the data set to read into
+ *        buf - a buffer from hdf_write_binary
+ *        len - the length of buf
+ * Output: None
+ * Returns: NERR_PARSE if buf isn't a complete binary HDF, NERR_NOMEM
+ */
+NEOERR* hdf_read_binary (HDF *hdf, const char *buf, int len);
+
 /*
  * Function: hdf_dump - dump an HDF dataset to stdout
  * Description:
@@ -602,7 +879,8 @@ NEOERR* hdf_copy (HDF *dest_hdf, const char *name, HDF *src);
  * Description: hdf_search_path is a convenience/utility function that
  *              searches for relative filenames in a search path.  The
  *              search path is the list given by the children of
- *              hdf.loadpaths.
+ *              hdf.loadpaths.  Results can be cached with
+ *              hdf_search_path_cache.
  * Input: hdf -> the hdf dataset to use
  *        path -> the relative path
  *        full -> a pointer to a buffer
@@ -612,6 +890,49 @@ NEOERR* hdf_copy (HDF *dest_hdf, const char *name, HDF *src);
  */
 NEOERR* hdf_search_path (HDF *hdf, const char *path, char *full, int full_len);
 
+/*
+ * Function: hdf_search_path_probe - hdf_search_path for optional files
+ * Description: hdf_search_path_probe is hdf_search_path for callers which
+ *              expect some files to be missing, such as the template
+ *              parser for optional includes.  The NERR_NOT_FOUND it
+ *              returns is raised with nerr_raise_static, so it is cheap
+ *              to handle but says nothing about the path; use
+ *              nerr_pass_ctx to add it if the error is passed on.
+ * Input: hdf -> the hdf dataset to use
+ *        path -> the relative path
+ *        full -> a pointer to a buffer
+ *        full_len -> size of full buffer
+ * Output: full -> the full path of the file
+ * Returns: NERR_NOT_FOUND if the file wasn't found in the search path
+ */
+NEOERR* hdf_search_path_probe (HDF *hdf, const char *path, char *full,
+                               int full_len);
+
+/*
+ * Function: hdf_search_path_cache - cache the results of hdf_search_path
+ * Description: hdf_search_path stats each entry of hdf.loadpaths in turn
+ *              until it finds the file, which adds up when every
+ *              template include goes through it on every request.
+ *              hdf_search_path_cache turns on a process wide cache of
+ *              where relative paths were found, and of the ones which
+ *              weren't found, so repeated lookups don't stat anything.
+ *              Results are kept per list of load paths, so changing
+ *              hdf.loadpaths never returns a stale result, but files
+ *              which are added or removed in the load paths are only
+ *              noticed once the cached result expires.  Changing the
+ *              ttl empties the cache; calling it again with the ttl
+ *              which is already set does nothing, so it can be called
+ *              on every request.  cgi_display sets it from
+ *              Config.SearchPathCacheTTL when that is set.
+ * Input: ttl - the number of seconds results are kept for, -1 to keep
+ *              them until the cache is emptied, or 0 to turn the cache
+ *              off, which is the default
+ * Output: None
+ * Return: None
+ * MT-Level: Safe.
+ */
+void hdf_search_path_cache (int ttl);
+
 /*
  * Function: hdf_register_fileload - register a fileload function
  * Description: hdf_register_fileload registers a fileload function that
@@ -631,6 +952,85 @@ NEOERR* hdf_search_path (HDF *hdf, const char *path, char *full, int full_len);
 
 void hdf_register_fileload(HDF *hdf, void *ctx, HDFFILELOAD fileload);
 
+/*
+ * Function: hdf_snapshot_init - Create a snapshot holder
+ * Description: An HDF_SNAPSHOT holds the current version of a shared
+ *              data set, such as the config of a threaded server, so a
+ *              new version can be loaded in the background and swapped
+ *              in while requests keep using the one they started with.
+ *              Readers call hdf_snapshot_acquire at the start of a
+ *              request and hdf_snapshot_release at the end, the loader
+ *              calls hdf_snapshot_publish with each new version, and
+ *              an old version is destroyed when the last request using
+ *              it releases it.  The lock is only held to count
+ *              references, never while loading or destroying a version.
+ * Input: snap - pointer to an HDF_SNAPSHOT pointer
+ * Output: snap - the new snapshot holder, with nothing published
+ * Returns: NERR_NOMEM - unable to allocate memory
+ *          NERR_LOCK - unable to create the lock
+ */
+NEOERR* hdf_snapshot_init (HDF_SNAPSHOT **snap);
+
+/*
+ * Function: hdf_snapshot_destroy - Destroy a snapshot holder
+ * Description: hdf_snapshot_destroy destroys the snapshot holder and
+ *              every version of the data set it still has, so every
+ *              version acquired from it has to have been released.
+ * Input: snap - pointer to an HDF_SNAPSHOT pointer
+ * Output: snap - set to NULL
+ * Returns: None
+ * MT-Level: Unsafe.
+ */
+void hdf_snapshot_destroy (HDF_SNAPSHOT **snap);
+
+/*
+ * Function: hdf_snapshot_publish - Make a data set the current version
+ * Description: hdf_snapshot_publish freezes hdf (see hdf_freeze) and
+ *              makes it the version returned by hdf_snapshot_acquire
+ *              from now on.  The snapshot owns hdf afterwards.  The
+ *              previous version is destroyed right away if no request
+ *              is using it, and otherwise by the last
+ *              hdf_snapshot_release of it.
+ * Input: snap - the snapshot holder
+ *        hdf - the top node of the new version, which must not be an
+ *              overlay of a version that can be retired
+ * Output: None
+ * Returns: NERR_ASSERT - hdf isn't a top node
+ *          NERR_DUPLICATE - hdf has already been published
+ *          NERR_NOMEM - unable to allocate memory
+ * MT-Level: Safe.
+ */
+NEOERR* hdf_snapshot_publish (HDF_SNAPSHOT *snap, HDF *hdf);
+
+/*
+ * Function: hdf_snapshot_acquire - Get the current version
+ * Description: hdf_snapshot_acquire returns the current version of the
+ *              data set, which stays valid until it's passed to
+ *              hdf_snapshot_release, however many times a new version
+ *              is published meanwhile.  It is frozen, so give each
+ *              request an overlay of it (see hdf_set_base) for
+ *              anything the request sets.
+ * Input: snap - the snapshot holder
+ * Output: hdf - the current version, or NULL on error
+ * Returns: NERR_NOT_FOUND - nothing has been published yet
+ *          NERR_LOCK - unable to lock the snapshot holder
+ * MT-Level: Safe.
+ */
+NEOERR* hdf_snapshot_acquire (HDF_SNAPSHOT *snap, HDF **hdf);
+
+/*
+ * Function: hdf_snapshot_release - Stop using a version
+ * Description: hdf_snapshot_release gives back a version returned by
+ *              hdf_snapshot_acquire, and destroys it if it has been
+ *              replaced and this was the last request using it.
+ * Input: snap - the snapshot holder
+ *        hdf - pointer to the version to give back
+ * Output: hdf - set to NULL
+ * Returns: None
+ * MT-Level: Safe.
+ */
+void hdf_snapshot_release (HDF_SNAPSHOT *snap, HDF **hdf);
+
 __END_DECLS
 
 #endif /* __NEO_HDF_H_ */
@@ -624,8 +624,9 @@ char *repr_string_alloc (const char *s)
   return rs;
 }
 
-NEOERR *neos_js_escape (const char *in, char **esc)
+NEOERR *neos_js_escape_append (const char *in, STRING *out)
 {
+  NEOERR *err;
   int nl = 0;
   int l = 0;
   unsigned char *buf = (unsigned char *)in;
@@ -643,10 +644,9 @@ NEOERR *neos_js_escape (const char *in, char **esc)
     l++;
   }
 
-  s = (unsigned char *) malloc (sizeof(unsigned char) * (nl + 1));
-  if (s == NULL)
-    return nerr_raise (NERR_NOMEM, "Unable to allocate memory to escape %s",
-        buf);
+  err = string_check_length (out, nl);
+  if (err != STATUS_OK) return nerr_pass (err);
+  s = (unsigned char *)out->buf + out->len;
 
   nl = 0; l = 0;
   while (buf[l])
@@ -667,8 +667,24 @@ NEOERR *neos_js_escape (const char *in, char **esc)
     }
   }
   s[nl] = '\0';
+  out->len += nl;
+
+  return STATUS_OK;
+}
+
+NEOERR *neos_js_escape (const char *in, char **esc)
+{
+  NEOERR *err;
+  STRING out_s;
 
-  *esc = (char *)s;
+  string_init(&out_s);
+  err = neos_js_escape_append (in, &out_s);
+  if (err)
+  {
+    string_clear (&out_s);
+    return nerr_pass (err);
+  }
+  *esc = out_s.buf;
   return STATUS_OK;
 }
 
@@ -681,14 +697,15 @@ static char CssReservedChars[] = "\n\r\"'()*<>\\";
 #define IN_LIST(l, c) (strchr(l, c) != NULL)
 
 /*
- * Apply URL escaping to 'in' and return result in 'esc'.
+ * Apply URL escaping to 'in' and append the result to 'out'.
  * The parameters 'reserved' and 'other' indicate which characters to escape.
  * If 'escape_non_printable' is non zero, all characters < 0x20 and > 0x7E
  * will also be escaped.
  */
-static NEOERR *url_escape_helper (const char *in, char **esc, char *reserved,
+static NEOERR *url_escape_helper (const char *in, STRING *out, char *reserved,
                                   const char *other, int escape_non_printable)
 {
+  NEOERR *err;
   int nl = 0;
   int l = 0;
   int x = 0;
@@ -721,10 +738,9 @@ static NEOERR *url_escape_helper (const char *in, char **esc, char *reserved,
     l++;
   }
 
-  s = (unsigned char *) malloc (sizeof(unsigned char) * (nl + 1));
-  if (s == NULL)
-    return nerr_raise (NERR_NOMEM, "Unable to allocate memory to escape %s",
-      buf);
+  err = string_check_length (out, nl);
+  if (err != STATUS_OK) return nerr_pass (err);
+  s = (unsigned char *)out->buf + out->len;
 
   nl = 0; l = 0;
   while (buf[l])
@@ -769,60 +785,85 @@ static NEOERR *url_escape_helper (const char *in, char **esc, char *reserved,
     }
   }
   s[nl] = '\0';
+  out->len += nl;
 
-  *esc = (char *)s;
   return STATUS_OK;
 }
 
+NEOERR *neos_url_escape_append (const char *in, STRING *out,
+                                const char *other)
+{
+  return nerr_pass(url_escape_helper(in, out, QueryReservedChars, other, 1));
+}
+
 NEOERR *neos_url_escape (const char *in, char **esc,
                          const char *other)
 {
-  return url_escape_helper(in, esc, QueryReservedChars, other, 1);
+  NEOERR *err;
+  STRING out_s;
+
+  string_init(&out_s);
+  err = neos_url_escape_append (in, &out_s, other);
+  if (err)
+  {
+    string_clear (&out_s);
+    return nerr_pass (err);
+  }
+  *esc = out_s.buf;
+  return STATUS_OK;
 }
 
-NEOERR *neos_html_escape (const char *src, int slen,
-                          char **out)
+NEOERR *neos_html_escape_append (const char *src, int slen, STRING *out)
 {
   NEOERR *err = STATUS_OK;
-  STRING out_s;
   int x;
   char *ptr;
 
-  string_init(&out_s);
-  err = string_append (&out_s, "");
-  if (err) return nerr_pass (err);
-  *out = NULL;
-
   x = 0;
   while (x < slen)
   {
     ptr = strpbrk(src + x, "&<>\"'\r");
     if (ptr == NULL || (ptr-src >= slen))
     {
-      err = string_appendn (&out_s, src + x, slen-x);
+      err = string_appendn (out, src + x, slen-x);
       x = slen;
     }
     else
     {
-      err = string_appendn (&out_s, src + x, (ptr - src) - x);
+      err = string_appendn (out, src + x, (ptr - src) - x);
       if (err != STATUS_OK) break;
       x = ptr - src;
       if (src[x] == '&')
-        err = string_append (&out_s, "&amp;");
+        err = string_appendn (out, "&amp;", 5);
       else if (src[x] == '<')
-        err = string_append (&out_s, "&lt;");
+        err = string_appendn (out, "&lt;", 4);
       else if (src[x] == '>')
-        err = string_append (&out_s, "&gt;");
+        err = string_appendn (out, "&gt;", 4);
       else if (src[x] == '"')
-        err = string_append (&out_s, "&quot;");
+        err = string_appendn (out, "&quot;", 6);
       else if (src[x] == '\'')
-        err = string_append (&out_s, "&#39;");
+        err = string_appendn (out, "&#39;", 5);
       else if (src[x] != '\r')
         err = nerr_raise (NERR_ASSERT, "src[x] == '%c'", src[x]);
       x++;
     }
     if (err != STATUS_OK) break;
   }
+  return nerr_pass (err);
+}
+
+NEOERR *neos_html_escape (const char *src, int slen,
+                          char **out)
+{
+  NEOERR *err = STATUS_OK;
+  STRING out_s;
+
+  string_init(&out_s);
+  err = string_append (&out_s, "");
+  if (err) return nerr_pass (err);
+  *out = NULL;
+
+  err = neos_html_escape_append (src, slen, &out_s);
   if (err)
   {
     string_clear (&out_s);
@@ -832,9 +873,9 @@ NEOERR *neos_html_escape (const char *src, int slen,
   return STATUS_OK;
 }
 
-static NEOERR *css_url_escape(const char *in, char **esc)
+static NEOERR *css_url_escape(const char *in, STRING *out)
 {
-  return url_escape_helper(in, esc, CssReservedChars, NULL, 0);
+  return nerr_pass(url_escape_helper(in, out, CssReservedChars, NULL, 0));
 }
 
 char *URL_PROTOCOLS[] = {"http://", "https://", "ftp://", "mailto:"};
@@ -844,12 +885,11 @@ char *URL_PROTOCOLS[] = {"http://", "https://", "ftp://", "mailto:"};
  * Ensures that the URL is a relative URL or an absolute url with a safe scheme
  * (currently http, https, ftp or mailto). This is to avoid
  * dangerous schemes like javascript. It then escapes the URL in the requested
- * escape_mode.
+ * escape_mode, appending it to out.
  */
-static NEOERR *url_validate(const char *in, char **esc, NEOS_ESCAPE escape_mode)
+static NEOERR *url_validate(const char *in, STRING *out,
+                            NEOS_ESCAPE escape_mode)
 {
-  NEOERR *err = STATUS_OK;
-  STRING out_s;
   int valid = 0;
   size_t i;
   size_t inlen;
@@ -898,11 +938,11 @@ static NEOERR *url_validate(const char *in, char **esc, NEOS_ESCAPE escape_mode)
   {
     if (escape_mode == NEOS_ESCAPE_HTML)
     {
-      return neos_html_escape(in, inlen, esc);
+      return nerr_pass(neos_html_escape_append(in, inlen, out));
     }
     else if(escape_mode == NEOS_ESCAPE_CSS_URL)
     {
-      return css_url_escape(in, esc);
+      return nerr_pass(css_url_escape(in, out));
     }
     else
     {
@@ -911,22 +951,47 @@ static NEOERR *url_validate(const char *in, char **esc, NEOS_ESCAPE escape_mode)
   }
 
   /* 'in' contains an unsupported scheme, replace with '#' */
+  return nerr_pass(string_appendn (out, "#", 1));
+}
+
+/* Run url_validate into a newly allocated string */
+static NEOERR *url_validate_alloc(const char *in, char **esc,
+                                  NEOS_ESCAPE escape_mode)
+{
+  NEOERR *err;
+  STRING out_s;
+
   string_init(&out_s);
-  err = string_append (&out_s, "#");
+  err = string_append (&out_s, "");
   if (err) return nerr_pass (err);
-
+  err = url_validate (in, &out_s, escape_mode);
+  if (err)
+  {
+    string_clear (&out_s);
+    return nerr_pass (err);
+  }
   *esc = out_s.buf;
   return STATUS_OK;
 }
 
 NEOERR *neos_url_validate (const char *in, char **esc)
 {
-  return url_validate(in, esc, NEOS_ESCAPE_HTML);
+  return url_validate_alloc(in, esc, NEOS_ESCAPE_HTML);
+}
+
+NEOERR *neos_url_validate_append (const char *in, STRING *out)
+{
+  return nerr_pass(url_validate(in, out, NEOS_ESCAPE_HTML));
 }
 
 NEOERR *neos_css_url_validate (const char *in, char **esc)
 {
-  return url_validate(in, esc, NEOS_ESCAPE_CSS_URL);
+  return url_validate_alloc(in, esc, NEOS_ESCAPE_CSS_URL);
+}
+
+NEOERR *neos_css_url_validate_append (const char *in, STRING *out)
+{
+  return nerr_pass(url_validate(in, out, NEOS_ESCAPE_CSS_URL));
 }
 
 NEOERR *neos_var_escape (NEOS_ESCAPE context,
@@ -955,3 +1020,26 @@ NEOERR *neos_var_escape (NEOS_ESCAPE context,
   return nerr_raise(NERR_ASSERT, "unknown escape context supplied: %d",
     context);
 }
+
+NEOERR *neos_var_escape_append (NEOS_ESCAPE context,
+                                const char *in,
+                                STRING *out)
+{
+  /* Just append it if we do nothing. */
+  if (context == NEOS_ESCAPE_NONE ||
+      context == NEOS_ESCAPE_FUNCTION)
+  {
+    return nerr_pass(string_append(out, in));
+  }
+
+  /* Same order of precedence as neos_var_escape */
+  if (context & NEOS_ESCAPE_URL)
+    return nerr_pass(neos_url_escape_append(in, out, NULL));
+  else if (context & NEOS_ESCAPE_SCRIPT)
+    return nerr_pass(neos_js_escape_append(in, out));
+  else if (context & NEOS_ESCAPE_HTML)
+    return nerr_pass(neos_html_escape_append(in, strlen(in), out));
+
+  return nerr_raise(NERR_ASSERT, "unknown escape context supplied: %d",
+    context);
+}
@@ -134,6 +134,19 @@ NEOERR *neos_url_validate (const char *in, char **esc);
  */
 NEOERR *neos_css_url_validate (const char *in, char **esc);
 
+/* The same escapes, appending the result to out instead of returning a
+ * newly allocated string.  Used when rendering, where the output is
+ * already being built up in a STRING. */
+NEOERR *neos_var_escape_append (NEOS_ESCAPE context,
+                                const char *in,
+                                STRING *out);
+NEOERR *neos_url_escape_append (const char *in, STRING *out,
+                                const char *other);
+NEOERR *neos_js_escape_append (const char *in, STRING *out);
+NEOERR *neos_html_escape_append (const char *src, int slen, STRING *out);
+NEOERR *neos_url_validate_append (const char *in, STRING *out);
+NEOERR *neos_css_url_validate_append (const char *in, STRING *out);
+
 __END_DECLS
 
 #endif /* __NEO_STR_H_ */
@@ -13,11 +13,9 @@ void dump_string_hash(NE_HASH *hash)
 
   for (x = 0; x < hash->size; x++)
   {
-    ne_warn("Node %d", x);
-    for (node = hash->nodes[x]; node; node = node->next)
-    {
-      ne_warn("  %s = %s [%8x | %d]", (char *)node->key, (char *)node->value, node->hashv, node->hashv & (hash->size - 1));
-    }
+    node = &(hash->nodes[x]);
+    if (node->key == NULL) continue;
+    ne_warn("Node %d: %s = %s [%8x]", x, (char *)node->key, (char *)node->value, node->hashv);
   }
 }
 
@@ -135,6 +133,47 @@ NEOERR *hash_next_test()
   return STATUS_OK;
 }
 
+/* Removing shifts later entries back, make sure none of them get lost */
+NEOERR *hash_remove_test()
+{
+  NEOERR *err;
+  NE_HASH *hs;
+  long x;
+
+  ne_warn("Running hash_remove_test");
+
+  err = ne_hash_init(&hs, ne_hash_int_hash, NULL);
+  if (err) return nerr_pass(err);
+
+  for (x = 1; x <= 1000; x++)
+  {
+    err = ne_hash_insert(hs, (void *)x, (void *)(x * 2));
+    if (err) return nerr_pass(err);
+  }
+  /* Replacing a value isn't a new entry */
+  err = ne_hash_insert(hs, (void *)1, (void *)2);
+  if (err) return nerr_pass(err);
+  if (hs->num != 1000)
+    return nerr_raise(NERR_ASSERT, "Hash has %d entries, expected 1000", hs->num);
+
+  for (x = 1; x <= 1000; x += 2)
+  {
+    if (ne_hash_remove(hs, (void *)x) != (void *)(x * 2))
+      return nerr_raise(NERR_ASSERT, "Removing %ld returned the wrong value", x);
+  }
+  if (hs->num != 500)
+    return nerr_raise(NERR_ASSERT, "Hash has %d entries, expected 500", hs->num);
+
+  for (x = 1; x <= 1000; x++)
+  {
+    if (ne_hash_lookup(hs, (void *)x) != ((x & 1) ? NULL : (void *)(x * 2)))
+      return nerr_raise(NERR_ASSERT, "Lookup of %ld returned the wrong value", x);
+  }
+
+  ne_hash_destroy(&hs);
+  return STATUS_OK;
+}
+
 int main(int argc, char **argv)
 {
   NEOERR *err;
@@ -154,6 +193,13 @@ int main(int argc, char **argv)
     printf("FAIL\n");
     return -1;
   }
+  err = hash_remove_test();
+  if (err)
+  {
+    nerr_log_error(err);
+    printf("FAIL\n");
+    return -1;
+  }
   printf("PASS\n");
   return 0;
 }
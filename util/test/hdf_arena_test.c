@@ -0,0 +1,108 @@
+#include "cs_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+#include "hdf_test_data.h"
+
+/* Build the same data set in a regular and an arena HDF, and make sure
+ * they serialize the same */
+static NEOERR *fill(HDF *hdf) {
+  NEOERR *err;
+  char *buf;
+
+  err = hdf_test_fill(hdf);
+  if (err) return nerr_pass(err);
+
+  /* Overwrite values, including ones we own */
+  err = hdf_set_value(hdf, "Over.Write", "first");
+  if (err) return nerr_pass(err);
+  err = hdf_set_buf(hdf, "Over.Write", strdup("second"));
+  if (err) return nerr_pass(err);
+  buf = strdup("third");
+  err = hdf_set_buf(hdf, "Over.Write", buf);
+  if (err) return nerr_pass(err);
+  err = hdf_set_buf(hdf, "Over.Write", buf);
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(hdf, "Over.Buf", "first");
+  if (err) return nerr_pass(err);
+  err = hdf_set_buf(hdf, "Over.Buf", strdup("last"));
+  if (err) return nerr_pass(err);
+
+  /* Attributes, including changing and removing them */
+  err = hdf_set_attr(hdf, "Chart", "color", "red");
+  if (err) return nerr_pass(err);
+  err = hdf_set_attr(hdf, "Chart", "size", "10");
+  if (err) return nerr_pass(err);
+  err = hdf_set_attr(hdf, "Chart", "color", "blue");
+  if (err) return nerr_pass(err);
+  err = hdf_set_attr(hdf, "Chart", "size", NULL);
+  if (err) return nerr_pass(err);
+
+  err = hdf_remove_tree(hdf, "Big.50");
+  if (err) return nerr_pass(err);
+  err = hdf_remove_tree(hdf, "Filters");
+  if (err) return nerr_pass(err);
+
+  err = hdf_copy(hdf, "Copy", hdf_get_obj(hdf, "Chart"));
+  if (err) return nerr_pass(err);
+
+  return STATUS_OK;
+}
+
+NEOERR *test_arena_matches() {
+  NEOERR *err;
+  HDF *hdf_1, *hdf_2, *hdf_3;
+
+  ne_warn("Running test_arena_matches");
+
+  err = hdf_init(&hdf_1);
+  if (err) return nerr_pass(err);
+  /* Start small so the arena has to grow */
+  err = hdf_init_arena(&hdf_2, 64);
+  if (err) return nerr_pass(err);
+  err = hdf_init(&hdf_3);
+  if (err) return nerr_pass(err);
+
+  err = fill(hdf_1);
+  if (err) return nerr_pass(err);
+  err = fill(hdf_2);
+  if (err) return nerr_pass(err);
+  /* And back out of an arena */
+  err = hdf_copy(hdf_3, "", hdf_2);
+  if (err) return nerr_pass(err);
+
+  err = hdf_test_check_same(hdf_1, hdf_2, "Arena");
+  if (err) return nerr_pass(err);
+  err = hdf_test_check_same(hdf_1, hdf_3, "Copy");
+  if (err) return nerr_pass(err);
+  if (strcmp(hdf_get_value(hdf_2, "Over.Write", ""), "third") ||
+      strcmp(hdf_get_value(hdf_2, "Over.Buf", ""), "last") ||
+      strcmp(hdf_get_value(hdf_2, "Link.next_stage.Type", ""), "Mux")) {
+    return nerr_raise(NERR_ASSERT, "Arena HDF has the wrong values");
+  }
+
+  hdf_destroy(&hdf_1);
+  hdf_destroy(&hdf_2);
+  hdf_destroy(&hdf_3);
+  if (hdf_2 != NULL) {
+    return nerr_raise(NERR_ASSERT, "hdf_destroy didn't clear the arena HDF");
+  }
+
+  return STATUS_OK;
+}
+
+int main(void) {
+  NEOERR *err;
+
+  err = test_arena_matches();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,153 @@
+#include "cs_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+#include "hdf_test_data.h"
+
+/* The shared data set, plus the values which need escaping or a flag in
+ * the binary format: empty and multi-line values, quoted attributes and
+ * an attribute on a node with no value */
+static NEOERR *fill(HDF *hdf) {
+  NEOERR *err;
+  HDF *node;
+
+  err = hdf_test_fill(hdf);
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(hdf, "Empty", "");
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(hdf, "Lines", "one\ntwo\n\n");
+  if (err) return nerr_pass(err);
+  err = hdf_read_string(hdf, "Chart [shape=round, color=\"a, b\"] = chart");
+  if (err) return nerr_pass(err);
+  err = hdf_get_node(hdf, "NoValue", &node);
+  if (err) return nerr_pass(err);
+  err = hdf_set_attr(hdf, "NoValue", "flag", "1");
+  if (err) return nerr_pass(err);
+
+  return STATUS_OK;
+}
+
+NEOERR *test_binary_round_trip() {
+  NEOERR *err;
+  HDF *hdf, *copy, *arena;
+  char *buf;
+  int len;
+
+  ne_warn("Running test_binary_round_trip");
+
+  err = hdf_init(&hdf);
+  if (err) return nerr_pass(err);
+  err = fill(hdf);
+  if (err) return nerr_pass(err);
+  err = hdf_write_binary(hdf, &buf, &len);
+  if (err) return nerr_pass(err);
+
+  err = hdf_init(&copy);
+  if (err) return nerr_pass(err);
+  err = hdf_read_binary(copy, buf, len);
+  if (err) return nerr_pass(err);
+  err = hdf_test_check_same(hdf, copy, "Binary");
+  if (err) return nerr_pass(err);
+  err = hdf_init_arena(&arena, 0);
+  if (err) return nerr_pass(err);
+  err = hdf_read_binary(arena, buf, len);
+  if (err) return nerr_pass(err);
+  err = hdf_test_check_same(hdf, arena, "Binary arena");
+  if (err) return nerr_pass(err);
+
+  if (strcmp(hdf_get_value(copy, "Link.next_stage.Type", ""), "Mux") ||
+      strcmp(hdf_get_attr(copy, "Chart")->value, "round") ||
+      strcmp(hdf_get_attr(copy, "Chart")->next->value, "a, b") ||
+      strcmp(hdf_get_attr(copy, "NoValue")->value, "1") ||
+      hdf_get_value(copy, "NoValue", NULL) != NULL ||
+      strcmp(hdf_get_value(copy, "Lines", ""), "one\ntwo\n\n") ||
+      hdf_obj_child_count(hdf_get_obj(copy, "Big")) != 100) {
+    return nerr_raise(NERR_ASSERT, "Binary HDF has the wrong values");
+  }
+  /* Still a link, not a copy */
+  err = hdf_set_value(copy, "Chart.next_stage.Type", "Changed");
+  if (err) return nerr_pass(err);
+  if (strcmp(hdf_get_value(copy, "Link.next_stage.Type", ""), "Changed"))
+    return nerr_raise(NERR_ASSERT, "Binary HDF didn't keep the link");
+
+  /* Reading again merges, like hdf_read_string */
+  err = hdf_set_value(copy, "Big.1.Name", "changed");
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(copy, "Extra", "extra");
+  if (err) return nerr_pass(err);
+  err = hdf_read_binary(copy, buf, len);
+  if (err) return nerr_pass(err);
+  if (strcmp(hdf_get_value(copy, "Big.1.Name", ""), "1") ||
+      strcmp(hdf_get_value(copy, "Extra", ""), "extra") ||
+      hdf_obj_child_count(hdf_get_obj(copy, "Big")) != 100) {
+    return nerr_raise(NERR_ASSERT, "Reading binary HDF again didn't merge");
+  }
+
+  free(buf);
+  hdf_destroy(&hdf);
+  hdf_destroy(&copy);
+  hdf_destroy(&arena);
+  return STATUS_OK;
+}
+
+NEOERR *test_binary_corrupt() {
+  NEOERR *err;
+  HDF *hdf, *copy;
+  char *buf;
+  int len, x;
+
+  ne_warn("Running test_binary_corrupt");
+
+  err = hdf_init(&hdf);
+  if (err) return nerr_pass(err);
+  err = fill(hdf);
+  if (err) return nerr_pass(err);
+  err = hdf_write_binary(hdf, &buf, &len);
+  if (err) return nerr_pass(err);
+
+  /* Every truncation fails cleanly */
+  for (x = 0; x < len; x++) {
+    err = hdf_init(&copy);
+    if (err) return nerr_pass(err);
+    err = hdf_read_binary(copy, buf, x);
+    if (!nerr_handle(&err, NERR_PARSE)) {
+      if (err) return nerr_pass(err);
+      return nerr_raise(NERR_ASSERT, "Read binary HDF truncated to %d", x);
+    }
+    hdf_destroy(&copy);
+  }
+
+  err = hdf_init(&copy);
+  if (err) return nerr_pass(err);
+  err = hdf_read_binary(copy, "Foo = bar\n", 10);
+  if (!nerr_handle(&err, NERR_PARSE)) {
+    if (err) return nerr_pass(err);
+    return nerr_raise(NERR_ASSERT, "Read text HDF as binary");
+  }
+
+  free(buf);
+  hdf_destroy(&hdf);
+  hdf_destroy(&copy);
+  return STATUS_OK;
+}
+
+int main(void) {
+  NEOERR *err;
+
+  err = test_binary_round_trip();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+  err = test_binary_corrupt();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+
+  return 0;
+}
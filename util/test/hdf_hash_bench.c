@@ -0,0 +1,258 @@
+#include "cs_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+#include "util/neo_hash.h"
+
+/* Compares NE_HASH against the chained table it replaced, on the lookups
+ * HDF makes into the child index of a large level: the keys are the HDF
+ * nodes themselves, hashed and compared by name.  Not run as part of the
+ * tests; build it with "make bench" and run it by hand. */
+
+/* The old chained NE_HASH, trimmed to what HDF uses */
+typedef struct _chain_node
+{
+  void *key;
+  void *value;
+  UINT32 hashv;
+  struct _chain_node *next;
+} CHAIN_NODE;
+
+typedef struct _chain
+{
+  UINT32 size;
+  UINT32 num;
+  CHAIN_NODE **nodes;
+} CHAIN;
+
+static int hdf_comp(const void *a, const void *b)
+{
+  HDF *ha = (HDF *)a;
+  HDF *hb = (HDF *)b;
+
+  return (ha->name_len == hb->name_len) && !strncmp(ha->name, hb->name, ha->name_len);
+}
+
+static UINT32 hdf_hash_crc(const void *a)
+{
+  HDF *ha = (HDF *)a;
+  return ne_crc((UINT8 *)(ha->name), ha->name_len);
+}
+
+static UINT32 hdf_hash_new(const void *a)
+{
+  HDF *ha = (HDF *)a;
+  return ne_hash_mem(ha->name, ha->name_len);
+}
+
+static CHAIN_NODE **chain_find(CHAIN *c, void *key, UINT32 hashv)
+{
+  CHAIN_NODE **node = &(c->nodes[hashv & (c->size - 1)]);
+
+  while (*node && !hdf_comp((*node)->key, key))
+    node = &(*node)->next;
+  return node;
+}
+
+static void chain_resize(CHAIN *c)
+{
+  CHAIN_NODE **nodes, *node, *next;
+  UINT32 x, size = c->size * 2;
+
+  nodes = (CHAIN_NODE **) calloc(size, sizeof(CHAIN_NODE *));
+  for (x = 0; x < c->size; x++)
+  {
+    for (node = c->nodes[x]; node; node = next)
+    {
+      next = node->next;
+      node->next = nodes[node->hashv & (size - 1)];
+      nodes[node->hashv & (size - 1)] = node;
+    }
+  }
+  free(c->nodes);
+  c->nodes = nodes;
+  c->size = size;
+}
+
+static CHAIN *chain_init(void)
+{
+  CHAIN *c = (CHAIN *) calloc(1, sizeof(CHAIN));
+
+  c->size = 256;
+  c->nodes = (CHAIN_NODE **) calloc(c->size, sizeof(CHAIN_NODE *));
+  return c;
+}
+
+static void chain_insert(CHAIN *c, void *key, void *value)
+{
+  UINT32 hashv = hdf_hash_crc(key);
+  CHAIN_NODE **node = chain_find(c, key, hashv);
+
+  if (*node == NULL)
+  {
+    *node = (CHAIN_NODE *) calloc(1, sizeof(CHAIN_NODE));
+    (*node)->key = key;
+    (*node)->hashv = hashv;
+  }
+  (*node)->value = value;
+  if (++c->num >= c->size) chain_resize(c);
+}
+
+static void *chain_lookup(CHAIN *c, void *key)
+{
+  CHAIN_NODE *node = *chain_find(c, key, hdf_hash_crc(key));
+  return node ? node->value : NULL;
+}
+
+static void chain_destroy(CHAIN *c)
+{
+  CHAIN_NODE *node, *next;
+  UINT32 x;
+
+  for (x = 0; x < c->size; x++)
+  {
+    for (node = c->nodes[x]; node; node = next)
+    {
+      next = node->next;
+      free(node);
+    }
+  }
+  free(c->nodes);
+  free(c);
+}
+
+/* Children named like the ones HDF levels get big with: numbered list
+ * entries, and a mix of longer attribute style names */
+static NEOERR *fill_level(HDF *hdf, int num, HDF ***keys, HDF ***misses)
+{
+  NEOERR *err;
+  HDF *level, *child;
+  char name[64];
+  int x;
+
+  for (x = 0; x < num; x++)
+  {
+    if (x & 1)
+      snprintf(name, sizeof(name), "Bench.%d", x);
+    else
+      snprintf(name, sizeof(name), "Bench.Item_%d_Description", x);
+    err = hdf_set_value(hdf, name, "1");
+    if (err) return nerr_pass(err);
+    snprintf(name, sizeof(name), "Miss.Missing_%d", x);
+    err = hdf_set_value(hdf, name, "1");
+    if (err) return nerr_pass(err);
+  }
+
+  *keys = (HDF **) calloc(num, sizeof(HDF *));
+  *misses = (HDF **) calloc(num, sizeof(HDF *));
+  level = hdf_get_obj(hdf, "Bench");
+  for (x = 0, child = hdf_obj_child(level); child; child = hdf_obj_next(child))
+    (*keys)[x++] = child;
+  level = hdf_get_obj(hdf, "Miss");
+  for (x = 0, child = hdf_obj_child(level); child; child = hdf_obj_next(child))
+    (*misses)[x++] = child;
+
+  return STATUS_OK;
+}
+
+static NEOERR *bench_level(int num, int rounds)
+{
+  NEOERR *err;
+  HDF *hdf, **keys = NULL, **misses = NULL;
+  NE_HASH *hash;
+  CHAIN *chain;
+  double start, t_build[2], t_hit[2], t_miss[2];
+  int x, r, found = 0;
+
+  err = hdf_init(&hdf);
+  if (err) return nerr_pass(err);
+  err = fill_level(hdf, num, &keys, &misses);
+  if (err) return nerr_pass(err);
+
+  start = ne_timef();
+  for (r = 0; r < 10; r++)
+  {
+    chain = chain_init();
+    for (x = 0; x < num; x++)
+      chain_insert(chain, keys[x], keys[x]);
+    if (r < 9) chain_destroy(chain);
+  }
+  t_build[0] = (ne_timef() - start) / 10;
+  start = ne_timef();
+  for (r = 0; r < rounds; r++)
+    for (x = 0; x < num; x++)
+      found += (chain_lookup(chain, keys[x]) != NULL);
+  t_hit[0] = ne_timef() - start;
+  start = ne_timef();
+  for (r = 0; r < rounds; r++)
+    for (x = 0; x < num; x++)
+      found += (chain_lookup(chain, misses[x]) != NULL);
+  t_miss[0] = ne_timef() - start;
+  chain_destroy(chain);
+
+  start = ne_timef();
+  for (r = 0; r < 10; r++)
+  {
+    err = ne_hash_init(&hash, hdf_hash_new, hdf_comp);
+    if (err) return nerr_pass(err);
+    for (x = 0; x < num; x++)
+    {
+      err = ne_hash_insert(hash, keys[x], keys[x]);
+      if (err) return nerr_pass(err);
+    }
+    if (r < 9) ne_hash_destroy(&hash);
+  }
+  t_build[1] = (ne_timef() - start) / 10;
+  start = ne_timef();
+  for (r = 0; r < rounds; r++)
+    for (x = 0; x < num; x++)
+      found += (ne_hash_lookup(hash, keys[x]) != NULL);
+  t_hit[1] = ne_timef() - start;
+  start = ne_timef();
+  for (r = 0; r < rounds; r++)
+    for (x = 0; x < num; x++)
+      found += (ne_hash_lookup(hash, misses[x]) != NULL);
+  t_miss[1] = ne_timef() - start;
+  ne_hash_destroy(&hash);
+
+  if (found != 2 * num * rounds)
+    return nerr_raise(NERR_ASSERT, "Found %d entries, expected %d", found,
+	2 * num * rounds);
+
+  printf("%6d children  build %8.2fus %8.2fus  hit %6.1fns %6.1fns  "
+      "miss %6.1fns %6.1fns\n", num,
+      t_build[0] * 1e6, t_build[1] * 1e6,
+      t_hit[0] * 1e9 / ((double)num * rounds),
+      t_hit[1] * 1e9 / ((double)num * rounds),
+      t_miss[0] * 1e9 / ((double)num * rounds),
+      t_miss[1] * 1e9 / ((double)num * rounds));
+
+  free(keys);
+  free(misses);
+  hdf_destroy(&hdf);
+  return STATUS_OK;
+}
+
+int main(int argc, char *argv[])
+{
+  NEOERR *err;
+  int sizes[] = {16, 64, 256, 1024, 8192, 65536};
+  int x;
+
+  printf("Times are chained (old) then open addressing (NE_HASH)\n");
+  for (x = 0; x < sizeof(sizes) / sizeof(sizes[0]); x++)
+  {
+    err = bench_level(sizes[x], 2000000 / sizes[x] + 1);
+    if (err)
+    {
+      nerr_log_error(err);
+      return -1;
+    }
+  }
+
+  return 0;
+}
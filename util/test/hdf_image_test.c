@@ -0,0 +1,122 @@
+#include "cs_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+#include "util/neo_files.h"
+#include "hdf_test_data.h"
+
+#define IMAGE_FILE "hdf_image_test.img"
+
+static NEOERR *fill(HDF *hdf) {
+  NEOERR *err;
+
+  err = hdf_test_fill(hdf);
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(hdf, "Empty", "");
+  if (err) return nerr_pass(err);
+
+  return STATUS_OK;
+}
+
+NEOERR *test_image_matches() {
+  NEOERR *err;
+  HDF *hdf, *image;
+
+  ne_warn("Running test_image_matches");
+
+  err = hdf_init(&hdf);
+  if (err) return nerr_pass(err);
+  err = fill(hdf);
+  if (err) return nerr_pass(err);
+  err = hdf_write_image(hdf, IMAGE_FILE);
+  if (err) return nerr_pass(err);
+  err = hdf_init_image(&image, IMAGE_FILE);
+  if (err) return nerr_pass(err);
+
+  err = hdf_test_check_same(hdf, image, "Image");
+  if (err) return nerr_pass(err);
+
+  if (strcmp(hdf_get_value(image, "Big.57.Name", ""), "57") ||
+      strcmp(hdf_get_value(image, "Link.next_stage.Type", ""), "Mux") ||
+      strcmp(hdf_get_attr(image, "Chart")->value, "round") ||
+      hdf_obj_child_count(hdf_get_obj(image, "Big")) != 100 ||
+      hdf_get_obj(image, "Big.100") != NULL) {
+    return nerr_raise(NERR_ASSERT, "Image HDF has the wrong values");
+  }
+
+  /* It is still an arena data set which can be changed */
+  err = hdf_set_value(image, "Big.3.Name", "changed");
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(image, "Big.1000.Name", "new");
+  if (err) return nerr_pass(err);
+  err = hdf_remove_tree(image, "Big.4");
+  if (err) return nerr_pass(err);
+  if (strcmp(hdf_get_value(image, "Big.3.Name", ""), "changed") ||
+      strcmp(hdf_get_value(image, "Big.1000.Name", ""), "new") ||
+      hdf_get_obj(image, "Big.4") != NULL ||
+      hdf_obj_child_count(hdf_get_obj(image, "Big")) != 100) {
+    return nerr_raise(NERR_ASSERT, "Changing the image HDF failed");
+  }
+
+  hdf_destroy(&hdf);
+  hdf_destroy(&image);
+  return STATUS_OK;
+}
+
+NEOERR *test_image_corrupt() {
+  NEOERR *err;
+  HDF *image;
+  FILE *fp;
+  char *data;
+  int len;
+
+  ne_warn("Running test_image_corrupt");
+
+  err = ne_load_file_len(IMAGE_FILE, &data, &len);
+  if (err) return nerr_pass(err);
+
+  err = ne_save_file(IMAGE_FILE, "not an image");
+  if (err) return nerr_pass(err);
+  err = hdf_init_image(&image, IMAGE_FILE);
+  if (!nerr_handle(&err, NERR_PARSE)) {
+    if (err) return nerr_pass(err);
+    return nerr_raise(NERR_ASSERT, "Loaded a file which isn't an image");
+  }
+
+  fp = fopen(IMAGE_FILE, "w");
+  if (fp == NULL)
+    return nerr_raise_errno(NERR_IO, "Unable to open %s", IMAGE_FILE);
+  fwrite(data, 1, len / 2, fp);
+  fclose(fp);
+  err = hdf_init_image(&image, IMAGE_FILE);
+  if (!nerr_handle(&err, NERR_PARSE)) {
+    if (err) return nerr_pass(err);
+    return nerr_raise(NERR_ASSERT, "Loaded a truncated image");
+  }
+
+  free(data);
+  unlink(IMAGE_FILE);
+  return STATUS_OK;
+}
+
+int main(void) {
+  NEOERR *err;
+
+  err = test_image_matches();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+  err = test_image_corrupt();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,237 @@
+#include "cs_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+
+static NEOERR *fill_base(HDF *hdf) {
+  NEOERR *err;
+  char name[64];
+  int i;
+
+  err = hdf_read_string(hdf,
+      "Config.Site.Url = http://example.com/\n"
+      "Config.Site.Name = Example\n"
+      "Config.List.0 = zero\n"
+      "Config.List.1 = one\n"
+      "Config.Color [shade=dark] = blue\n");
+  if (err) return nerr_pass(err);
+  err = hdf_set_symlink(hdf, "Site", "Config.Site");
+  if (err) return nerr_pass(err);
+
+  /* Enough children to make the level use a hash */
+  for (i = 0; i < 100; i++) {
+    snprintf(name, sizeof(name), "Big.%d", i);
+    err = hdf_set_int_value(hdf, name, i);
+    if (err) return nerr_pass(err);
+  }
+
+  return STATUS_OK;
+}
+
+NEOERR *test_overlay() {
+  NEOERR *err;
+  HDF *base, *overlay, *under;
+  HDF_PATH *path;
+  char *before = NULL, *after = NULL;
+
+  ne_warn("Running test_overlay");
+
+  err = hdf_init(&base);
+  if (err) return nerr_pass(err);
+  err = fill_base(base);
+  if (err) return nerr_pass(err);
+  err = hdf_write_string(base, &before);
+  if (err) return nerr_pass(err);
+
+  err = hdf_init_arena(&overlay, 0);
+  if (err) return nerr_pass(err);
+  err = hdf_set_base(overlay, base);
+  if (err) return nerr_pass(err);
+
+  /* Everything in the base shows through */
+  err = hdf_path_compile("Big.42", &path);
+  if (err) return nerr_pass(err);
+  if (strcmp(hdf_get_value(overlay, "Config.Site.Url", ""),
+	     "http://example.com/") ||
+      strcmp(hdf_get_value(overlay, "Site.Name", ""), "Example") ||
+      hdf_get_int_value(overlay, "Big.42", -1) != 42 ||
+      strcmp(hdf_obj_value(hdf_get_obj_path(overlay, path)), "42") ||
+      strcmp(hdf_get_attr(overlay, "Config.Color")->value, "dark") ||
+      hdf_get_obj(overlay, "Config.Missing") != NULL) {
+    return nerr_raise(NERR_ASSERT, "Overlay doesn't show its base");
+  }
+  hdf_path_destroy(&path);
+
+  /* Changes only go to the overlay */
+  err = hdf_set_value(overlay, "Config.Site.Url", "http://example.org/");
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(overlay, "Query.q", "search");
+  if (err) return nerr_pass(err);
+  err = hdf_set_symlink(overlay, "List", "Config.List");
+  if (err) return nerr_pass(err);
+  err = hdf_copy(overlay, "Copy", hdf_get_obj(overlay, "Config.List"));
+  if (err) return nerr_pass(err);
+  err = hdf_remove_tree(overlay, "Big.7");
+  if (err) return nerr_pass(err);
+  if (strcmp(hdf_get_value(overlay, "Config.Site.Url", ""),
+	     "http://example.org/") ||
+      strcmp(hdf_get_value(overlay, "Config.Site.Name", ""), "Example") ||
+      strcmp(hdf_get_value(overlay, "Query.q", ""), "search") ||
+      strcmp(hdf_get_value(overlay, "List.1", ""), "one") ||
+      strcmp(hdf_get_value(overlay, "Copy.0", ""), "zero") ||
+      hdf_get_int_value(overlay, "Big.7", -1) != 7) {
+    return nerr_raise(NERR_ASSERT, "Overlay has the wrong values");
+  }
+  if (hdf_get_obj(base, "Query") != NULL ||
+      hdf_get_obj(base, "Copy") != NULL ||
+      hdf_get_obj(hdf_get_obj(overlay, "Config.Site"), "Name") != NULL) {
+    return nerr_raise(NERR_ASSERT, "Overlay should only have what was set");
+  }
+
+  /* And overlays stack */
+  err = hdf_init(&under);
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(under, "Under", "below");
+  if (err) return nerr_pass(err);
+  err = hdf_set_base(base, under);
+  if (err) return nerr_pass(err);
+  if (strcmp(hdf_get_value(overlay, "Under", ""), "below"))
+    return nerr_raise(NERR_ASSERT, "Overlay doesn't see its base's base");
+  err = hdf_set_base(under, overlay);
+  if (!nerr_handle(&err, NERR_ASSERT)) {
+    if (err) return nerr_pass(err);
+    return nerr_raise(NERR_ASSERT, "Made an overlay its own base");
+  }
+  err = hdf_set_base(base, NULL);
+  if (err) return nerr_pass(err);
+
+  err = hdf_write_string(base, &after);
+  if (err) return nerr_pass(err);
+  if (strcmp(before, after)) {
+    ne_warn("Before:\n%s", before);
+    ne_warn("After:\n%s", after);
+    return nerr_raise(NERR_ASSERT, "Overlay changed its base");
+  }
+
+  free(before);
+  free(after);
+  hdf_destroy(&overlay);
+  hdf_destroy(&base);
+  hdf_destroy(&under);
+  return STATUS_OK;
+}
+
+static NEOERR *expect_change(HDF *hdf, unsigned int *last, int changed,
+                             const char *what) {
+  unsigned int now = hdf_change_count(hdf);
+
+  if ((now != *last) != changed) {
+    return nerr_raise(NERR_ASSERT, "%s %s the change count", what,
+                      changed ? "didn't change" : "changed");
+  }
+  *last = now;
+  return STATUS_OK;
+}
+
+NEOERR *test_change_count() {
+  NEOERR *err;
+  HDF *base, *overlay, *node;
+  unsigned int last;
+  char *buf;
+  int len;
+
+  ne_warn("Running test_change_count");
+
+  err = hdf_init(&base);
+  if (err) return nerr_pass(err);
+  err = fill_base(base);
+  if (err) return nerr_pass(err);
+  err = hdf_init(&overlay);
+  if (err) return nerr_pass(err);
+  last = hdf_change_count(overlay);
+
+  err = hdf_set_base(overlay, base);
+  if (err) return nerr_pass(err);
+  err = expect_change(overlay, &last, 1, "hdf_set_base");
+  if (err) return nerr_pass(err);
+
+  /* Values and attributes don't change where names lead */
+  err = hdf_set_value(overlay, "Query.q", "search");
+  if (err) return nerr_pass(err);
+  err = expect_change(overlay, &last, 1, "Adding a node");
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(overlay, "Query.q", "other");
+  if (err) return nerr_pass(err);
+  err = hdf_set_attr(overlay, "Query.q", "key", "value");
+  if (err) return nerr_pass(err);
+  err = hdf_get_node(overlay, "Query.q", &node);
+  if (err) return nerr_pass(err);
+  err = expect_change(overlay, &last, 0, "Setting a value");
+  if (err) return nerr_pass(err);
+
+  err = hdf_set_symlink(overlay, "Query.link", "Query.q");
+  if (err) return nerr_pass(err);
+  err = expect_change(overlay, &last, 1, "Adding a link");
+  if (err) return nerr_pass(err);
+  err = hdf_set_symlink(overlay, "Query.link", "Config.Site");
+  if (err) return nerr_pass(err);
+  err = expect_change(overlay, &last, 1, "Pointing a link elsewhere");
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(overlay, "Query.link", "plain");
+  if (err) return nerr_pass(err);
+  err = expect_change(overlay, &last, 1, "Replacing a link with a value");
+  if (err) return nerr_pass(err);
+  if (strcmp(hdf_get_value(overlay, "Query.link", ""), "plain"))
+    return nerr_raise(NERR_ASSERT, "Link wasn't replaced");
+
+  err = hdf_remove_tree(overlay, "Query.q");
+  if (err) return nerr_pass(err);
+  err = expect_change(overlay, &last, 1, "hdf_remove_tree");
+  if (err) return nerr_pass(err);
+  err = hdf_remove_tree(overlay, "Query.missing");
+  if (err) return nerr_pass(err);
+  err = expect_change(overlay, &last, 0, "Removing nothing");
+  if (err) return nerr_pass(err);
+
+  /* Changes to the base show through the overlay */
+  err = hdf_set_value(base, "Config.New", "new");
+  if (err) return nerr_pass(err);
+  err = expect_change(overlay, &last, 1, "Adding a node to the base");
+  if (err) return nerr_pass(err);
+
+  err = hdf_write_binary(base, &buf, &len);
+  if (err) return nerr_pass(err);
+  err = hdf_read_binary(overlay, buf, len);
+  if (err) return nerr_pass(err);
+  err = expect_change(overlay, &last, 1, "hdf_read_binary");
+  if (err) return nerr_pass(err);
+  free(buf);
+
+  if (hdf_change_count(NULL) != 0)
+    return nerr_raise(NERR_ASSERT, "NULL hdf has a change count");
+
+  hdf_destroy(&overlay);
+  hdf_destroy(&base);
+  return STATUS_OK;
+}
+
+int main(void) {
+  NEOERR *err;
+
+  err = test_overlay();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+  err = test_change_count();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,136 @@
+#include "cs_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+#include "util/neo_str.h"
+
+/* Times hdf_read_string on a data set the size of a large backend dump,
+ * written out both as nested blocks (hdf_write_string) and as one dotted
+ * name per line (hdf_dump_str), and compares writing and reading it with
+ * hdf_write_binary/hdf_read_binary.  Not run as part of the tests; build
+ * it with "make bench" and run it by hand. */
+
+static NEOERR *fill(HDF *hdf, int num)
+{
+  NEOERR *err;
+  char name[128];
+  int x, y;
+
+  for (x = 0; x < num; x++)
+  {
+    for (y = 0; y < 8; y++)
+    {
+      snprintf(name, sizeof(name), "Results.%d.Field%d", x, y);
+      err = hdf_set_valuef(hdf, "%s=value %d of result %d", name, y, x);
+      if (err) return nerr_pass(err);
+    }
+    snprintf(name, sizeof(name), "Results.%d.Author.Name", x);
+    err = hdf_set_valuef(hdf, "%s=author %d", name, x % 100);
+    if (err) return nerr_pass(err);
+    snprintf(name, sizeof(name), "Results.%d.Author.Id", x);
+    err = hdf_set_int_value(hdf, name, x % 100);
+    if (err) return nerr_pass(err);
+    snprintf(name, sizeof(name), "Lang.Msg.Str%d", x);
+    err = hdf_set_valuef(hdf, "%s=localized text %d", name, x);
+    if (err) return nerr_pass(err);
+  }
+  return STATUS_OK;
+}
+
+static NEOERR *bench_read(const char *what, const char *data, int len,
+                          int rounds)
+{
+  NEOERR *err;
+  HDF *hdf;
+  double start, t, best = 0;
+  int r;
+
+  for (r = 0; r < rounds; r++)
+  {
+    err = hdf_init(&hdf);
+    if (err) return nerr_pass(err);
+    start = ne_timef();
+    if (len < 0)
+      err = hdf_read_string(hdf, data);
+    else
+      err = hdf_read_binary(hdf, data, len);
+    t = ne_timef() - start;
+    if (r == 0 || t < best) best = t;
+    if (err) return nerr_pass(err);
+    hdf_destroy(&hdf);
+  }
+
+  printf("read  %-8s %8.1fKB  best of %d %8.2fms\n", what,
+      (len < 0 ? strlen(data) : len) / 1024.0, rounds, best * 1000);
+  return STATUS_OK;
+}
+
+static NEOERR *bench_write(HDF *hdf, int binary, int rounds)
+{
+  NEOERR *err;
+  double start, t, best = 0;
+  char *data;
+  int r, len;
+
+  for (r = 0; r < rounds; r++)
+  {
+    start = ne_timef();
+    if (binary)
+      err = hdf_write_binary(hdf, &data, &len);
+    else
+      err = hdf_write_string(hdf, &data);
+    t = ne_timef() - start;
+    if (r == 0 || t < best) best = t;
+    if (err) return nerr_pass(err);
+    free(data);
+  }
+
+  printf("write %-8s %22s best of %d %8.2fms\n", binary ? "binary" : "nested",
+      "", rounds, best * 1000);
+  return STATUS_OK;
+}
+
+int main(int argc, char *argv[])
+{
+  NEOERR *err;
+  HDF *hdf;
+  char *nested = NULL, *binary = NULL;
+  int len = 0;
+  STRING flat;
+
+  string_init(&flat);
+  err = hdf_init(&hdf);
+  if (err == STATUS_OK)
+    err = fill(hdf, 20000);
+  if (err == STATUS_OK)
+    err = hdf_write_string(hdf, &nested);
+  if (err == STATUS_OK)
+    err = hdf_dump_str(hdf, NULL, 0, &flat);
+  if (err == STATUS_OK)
+    err = hdf_write_binary(hdf, &binary, &len);
+  if (err == STATUS_OK)
+    err = bench_read("nested", nested, -1, 10);
+  if (err == STATUS_OK)
+    err = bench_read("flat", flat.buf, -1, 10);
+  if (err == STATUS_OK)
+    err = bench_read("binary", binary, len, 10);
+  if (err == STATUS_OK)
+    err = bench_write(hdf, 0, 10);
+  if (err == STATUS_OK)
+    err = bench_write(hdf, 1, 10);
+  if (err)
+  {
+    nerr_log_error(err);
+    return -1;
+  }
+
+  free(nested);
+  free(binary);
+  string_clear(&flat);
+  hdf_destroy(&hdf);
+  return 0;
+}
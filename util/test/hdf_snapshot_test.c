@@ -0,0 +1,282 @@
+#include "cs_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+
+static NEOERR *load_config(int version, HDF **hdf) {
+  NEOERR *err;
+  char name[64];
+  int i;
+
+  err = hdf_init(hdf);
+  if (err) return nerr_pass(err);
+  err = hdf_set_int_value(*hdf, "Config.Version", version);
+  if (err) return nerr_pass(err);
+  err = hdf_set_symlink(*hdf, "Version", "Config.Version");
+  if (err) return nerr_pass(err);
+
+  /* Enough children to make the level use a hash */
+  for (i = 0; i < 100; i++) {
+    snprintf(name, sizeof(name), "Config.Hosts.%d", i);
+    err = hdf_set_int_value(*hdf, name, version);
+    if (err) return nerr_pass(err);
+  }
+  return STATUS_OK;
+}
+
+static NEOERR *expect_frozen(NEOERR *err, const char *what) {
+  if (!nerr_handle(&err, NERR_ASSERT)) {
+    if (err) return nerr_pass(err);
+    return nerr_raise(NERR_ASSERT, "%s changed a frozen hdf", what);
+  }
+  return STATUS_OK;
+}
+
+NEOERR *test_freeze() {
+  NEOERR *err;
+  HDF *hdf, *overlay;
+  char *before = NULL, *after = NULL;
+
+  ne_warn("Running test_freeze");
+
+  err = load_config(1, &hdf);
+  if (err) return nerr_pass(err);
+  err = hdf_freeze(hdf_get_obj(hdf, "Config"));
+  err = expect_frozen(err, "Freezing a child");
+  if (err) return nerr_pass(err);
+  err = hdf_freeze(hdf);
+  if (err) return nerr_pass(err);
+  err = hdf_write_string(hdf, &before);
+  if (err) return nerr_pass(err);
+
+  err = expect_frozen(hdf_set_value(hdf, "Config.Version", "2"),
+      "hdf_set_value");
+  if (err) return nerr_pass(err);
+  err = expect_frozen(hdf_set_value(hdf_get_obj(hdf, "Config"), "New", "2"),
+      "hdf_set_value below the top");
+  if (err) return nerr_pass(err);
+  err = expect_frozen(hdf_set_attr(hdf, "Config.Version", "key", "value"),
+      "hdf_set_attr");
+  if (err) return nerr_pass(err);
+  err = expect_frozen(hdf_remove_tree(hdf, "Config.Hosts.7"),
+      "hdf_remove_tree");
+  if (err) return nerr_pass(err);
+  err = expect_frozen(hdf_sort_obj(hdf_get_obj(hdf, "Config.Hosts"), NULL),
+      "hdf_sort_obj");
+  if (err) return nerr_pass(err);
+  err = expect_frozen(hdf_copy(hdf, "Copy", hdf_get_obj(hdf, "Config")),
+      "hdf_copy");
+  if (err) return nerr_pass(err);
+  err = expect_frozen(hdf_read_string(hdf, "Config.Version = 3"),
+      "hdf_read_string");
+  if (err) return nerr_pass(err);
+  err = expect_frozen(hdf_set_base(hdf, NULL), "hdf_set_base");
+  if (err) return nerr_pass(err);
+
+  err = hdf_write_string(hdf, &after);
+  if (err) return nerr_pass(err);
+  if (strcmp(before, after)) {
+    ne_warn("Before:\n%s", before);
+    ne_warn("After:\n%s", after);
+    return nerr_raise(NERR_ASSERT, "Frozen hdf changed");
+  }
+
+  /* Changes go in an overlay instead, which can be copied from it */
+  err = hdf_init(&overlay);
+  if (err) return nerr_pass(err);
+  err = hdf_set_base(overlay, hdf);
+  if (err) return nerr_pass(err);
+  err = hdf_set_value(overlay, "Config.Version", "2");
+  if (err) return nerr_pass(err);
+  err = hdf_copy(overlay, "Copy", hdf_get_obj(hdf, "Config"));
+  if (err) return nerr_pass(err);
+  if (hdf_get_int_value(overlay, "Config.Version", 0) != 2 ||
+      hdf_get_int_value(overlay, "Copy.Hosts.42", 0) != 1 ||
+      hdf_get_int_value(hdf, "Version", 0) != 1) {
+    return nerr_raise(NERR_ASSERT, "Overlay of frozen hdf has wrong values");
+  }
+
+  free(before);
+  free(after);
+  hdf_destroy(&overlay);
+  hdf_destroy(&hdf);
+  return STATUS_OK;
+}
+
+NEOERR *test_snapshot() {
+  NEOERR *err;
+  HDF_SNAPSHOT *snap;
+  HDF *v1, *v2, *old, *cur;
+
+  ne_warn("Running test_snapshot");
+
+  err = hdf_snapshot_init(&snap);
+  if (err) return nerr_pass(err);
+  err = hdf_snapshot_acquire(snap, &cur);
+  if (!nerr_handle(&err, NERR_NOT_FOUND)) {
+    if (err) return nerr_pass(err);
+    return nerr_raise(NERR_ASSERT, "Acquired before anything was published");
+  }
+
+  err = load_config(1, &v1);
+  if (err) return nerr_pass(err);
+  err = hdf_snapshot_publish(snap, v1);
+  if (err) return nerr_pass(err);
+  err = hdf_snapshot_publish(snap, v1);
+  if (!nerr_handle(&err, NERR_DUPLICATE)) {
+    if (err) return nerr_pass(err);
+    return nerr_raise(NERR_ASSERT, "Published the same hdf twice");
+  }
+  err = expect_frozen(hdf_set_value(v1, "Config.Version", "0"),
+      "hdf_set_value after hdf_snapshot_publish");
+  if (err) return nerr_pass(err);
+
+  /* A request in flight keeps the version it started with */
+  err = hdf_snapshot_acquire(snap, &old);
+  if (err) return nerr_pass(err);
+  err = load_config(2, &v2);
+  if (err) return nerr_pass(err);
+  err = hdf_snapshot_publish(snap, v2);
+  if (err) return nerr_pass(err);
+  err = hdf_snapshot_acquire(snap, &cur);
+  if (err) return nerr_pass(err);
+  if (old != v1 || cur != v2 ||
+      hdf_get_int_value(old, "Version", 0) != 1 ||
+      hdf_get_int_value(cur, "Version", 0) != 2) {
+    return nerr_raise(NERR_ASSERT, "Acquired the wrong version");
+  }
+  hdf_snapshot_release(snap, &old);
+  hdf_snapshot_release(snap, &cur);
+  if (old != NULL || cur != NULL)
+    return nerr_raise(NERR_ASSERT, "Release didn't clear the pointer");
+
+  /* v1 is gone now, which ASAN or valgrind would notice if it weren't;
+   * v2 is still current */
+  err = hdf_snapshot_acquire(snap, &cur);
+  if (err) return nerr_pass(err);
+  if (hdf_get_int_value(cur, "Config.Hosts.99", 0) != 2)
+    return nerr_raise(NERR_ASSERT, "Current version was destroyed");
+  hdf_snapshot_release(snap, &cur);
+
+  hdf_snapshot_destroy(&snap);
+  if (snap != NULL)
+    return nerr_raise(NERR_ASSERT, "Destroy didn't clear the pointer");
+  return STATUS_OK;
+}
+
+#ifdef HAVE_PTHREADS
+#define NUM_READERS 4
+#define NUM_VERSIONS 50
+#define NUM_READS 2000
+
+typedef struct _reader {
+  HDF_SNAPSHOT *snap;
+  NEOERR *err;
+} READER;
+
+static NEOERR *read_versions(READER *reader) {
+  NEOERR *err;
+  HDF *hdf, *overlay;
+  int x, version, last = 0;
+
+  for (x = 0; x < NUM_READS; x++) {
+    err = hdf_snapshot_acquire(reader->snap, &hdf);
+    if (err) return nerr_pass(err);
+    err = hdf_init(&overlay);
+    if (err) return nerr_pass(err);
+    err = hdf_set_base(overlay, hdf);
+    if (err) return nerr_pass(err);
+    err = hdf_set_value(overlay, "Query.q", "search");
+    if (err) return nerr_pass(err);
+
+    version = hdf_get_int_value(overlay, "Version", 0);
+    if (version < last ||
+        hdf_get_int_value(overlay, "Config.Hosts.99", 0) != version) {
+      return nerr_raise(NERR_ASSERT, "Read version %d after %d", version,
+          last);
+    }
+    last = version;
+
+    hdf_destroy(&overlay);
+    hdf_snapshot_release(reader->snap, &hdf);
+  }
+  return STATUS_OK;
+}
+
+static void *reader_thread(void *arg) {
+  READER *reader = (READER *) arg;
+
+  reader->err = read_versions(reader);
+  return NULL;
+}
+
+NEOERR *test_snapshot_threads() {
+  NEOERR *err;
+  HDF_SNAPSHOT *snap;
+  HDF *hdf;
+  READER readers[NUM_READERS];
+  pthread_t threads[NUM_READERS];
+  int x;
+
+  ne_warn("Running test_snapshot_threads");
+
+  err = hdf_snapshot_init(&snap);
+  if (err) return nerr_pass(err);
+  err = load_config(1, &hdf);
+  if (err) return nerr_pass(err);
+  err = hdf_snapshot_publish(snap, hdf);
+  if (err) return nerr_pass(err);
+
+  for (x = 0; x < NUM_READERS; x++) {
+    readers[x].snap = snap;
+    readers[x].err = STATUS_OK;
+    if (pthread_create(&threads[x], NULL, reader_thread, &readers[x]))
+      return nerr_raise_errno(NERR_SYSTEM, "Unable to start reader");
+  }
+  for (x = 2; x <= NUM_VERSIONS && err == STATUS_OK; x++) {
+    err = load_config(x, &hdf);
+    if (err == STATUS_OK)
+      err = hdf_snapshot_publish(snap, hdf);
+  }
+  for (x = 0; x < NUM_READERS; x++)
+    pthread_join(threads[x], NULL);
+  if (err) return nerr_pass(err);
+  for (x = 0; x < NUM_READERS; x++) {
+    if (readers[x].err) return nerr_pass(readers[x].err);
+  }
+
+  hdf_snapshot_destroy(&snap);
+  return STATUS_OK;
+}
+#endif
+
+int main(void) {
+  NEOERR *err;
+
+  err = test_freeze();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+  err = test_snapshot();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+#ifdef HAVE_PTHREADS
+  err = test_snapshot_threads();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+#endif
+
+  return 0;
+}
@@ -5,6 +5,7 @@
 #include "util/neo_misc.h"
 #include "util/neo_hdf.h"
 #include "util/neo_rand.h"
+#include "util/neo_files.h"
 
 #define DIE_NOT_OK(err) \
   if (err != STATUS_OK) { \
@@ -126,6 +127,115 @@ int main(int argc, char *argv[])
     }
   }
 
+  /* test the search path cache */
+  {
+    char full[PATH_BUF_SIZE];
+
+    err = hdf_set_value(hdf, "hdf.loadpaths.0", "/nonexistent");
+    DIE_NOT_OK(err);
+    err = hdf_set_value(hdf, "hdf.loadpaths.1", ".");
+    DIE_NOT_OK(err);
+    err = ne_save_file("hdf_test_cached.hdf", "Cached = 1\n");
+    DIE_NOT_OK(err);
+    hdf_search_path_cache(-1);
+
+    err = hdf_search_path(hdf, "hdf_test_cached.hdf", full, sizeof(full));
+    DIE_NOT_OK(err);
+    if (strcmp(full, "./hdf_test_cached.hdf")) {
+      ne_warn("hdf_search_path returned %s, expected ./hdf_test_cached.hdf",
+              full);
+      return -1;
+    }
+    err = hdf_search_path(hdf, "hdf_test_missing.hdf", full, sizeof(full));
+    if (!nerr_match(err, NERR_NOT_FOUND)) {
+      ne_warn("hdf_search_path found a missing file");
+      return -1;
+    }
+    if (strstr(err->desc, "hdf_test_missing.hdf") == NULL) {
+      ne_warn("hdf_search_path error doesn't name the path: %s", err->desc);
+      return -1;
+    }
+    nerr_ignore(&err);
+
+    /* Cached both ways until the cache is emptied, which setting the
+     * same TTL again doesn't do */
+    unlink("hdf_test_cached.hdf");
+    err = ne_save_file("hdf_test_missing.hdf", "Missing = 1\n");
+    DIE_NOT_OK(err);
+    hdf_search_path_cache(-1);
+    err = hdf_search_path(hdf, "hdf_test_cached.hdf", full, sizeof(full));
+    DIE_NOT_OK(err);
+    if (strcmp(full, "./hdf_test_cached.hdf")) {
+      ne_warn("hdf_search_path returned %s, expected ./hdf_test_cached.hdf",
+              full);
+      return -1;
+    }
+    err = hdf_search_path(hdf, "hdf_test_missing.hdf", full, sizeof(full));
+    if (!nerr_handle(&err, NERR_NOT_FOUND)) {
+      ne_warn("hdf_search_path didn't cache a missing file");
+      return -1;
+    }
+
+    /* But not across different load paths */
+    err = hdf_set_value(hdf, "hdf.loadpaths.0", "..");
+    DIE_NOT_OK(err);
+    err = hdf_search_path(hdf, "hdf_test_missing.hdf", full, sizeof(full));
+    DIE_NOT_OK(err);
+    if (strcmp(full, "./hdf_test_missing.hdf")) {
+      ne_warn("hdf_search_path returned %s, expected ./hdf_test_missing.hdf",
+              full);
+      return -1;
+    }
+
+    hdf_search_path_cache(0);
+    err = hdf_search_path(hdf, "hdf_test_cached.hdf", full, sizeof(full));
+    if (!nerr_handle(&err, NERR_NOT_FOUND)) {
+      ne_warn("hdf_search_path found a removed file with the cache off");
+      return -1;
+    }
+    unlink("hdf_test_missing.hdf");
+    err = hdf_remove_tree(hdf, "hdf");
+    DIE_NOT_OK(err);
+  }
+
+  /* the parser starts where the last line left off, make sure links
+   * it reads don't leave it in the wrong place */
+  {
+    const char *v;
+
+    err = hdf_read_string(hdf,
+        "Parse.Target.x = target\n"
+        "Parse.A.B.c = 1\n"
+        "Parse.A.B.d = 2\n"
+        "Parse.A.B : Parse.Target\n"
+        "Parse.A.B.e = 3\n"
+        "Parse.A {\n"
+        "  B.f = 4\n"
+        "  C : Parse.Target\n"
+        "}\n"
+        "Parse.A.C.g = 5\n"
+        "Parse.A.B.Text << EOM\n"
+        "one\n"
+        "EOM\n"
+        "Parse.A.B.h = 6\n");
+    DIE_NOT_OK(err);
+    v = hdf_get_value(hdf, "Parse.Target.e", "");
+    if (strcmp(v, "3") || strcmp(hdf_get_value(hdf, "Parse.Target.f", ""), "4")
+        || strcmp(hdf_get_value(hdf, "Parse.Target.g", ""), "5")
+        || strcmp(hdf_get_value(hdf, "Parse.Target.Text", ""), "one\n")
+        || strcmp(hdf_get_value(hdf, "Parse.Target.h", ""), "6")) {
+      ne_warn("hdf_read_string didn't follow links it read, e = %s", v);
+      return -1;
+    }
+    err = hdf_read_string(hdf, "Parse.A..B = 1\n");
+    if (!nerr_handle(&err, NERR_ASSERT)) {
+      ne_warn("hdf_read_string accepted an empty name component");
+      return -1;
+    }
+    err = hdf_remove_tree(hdf, "Parse");
+    DIE_NOT_OK(err);
+  }
+
   for (x = 0; x < 10000; x++)
   {
     rand_name(name, sizeof(name));
@@ -0,0 +1,54 @@
+#include "cs_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/neo_misc.h"
+#include "util/neo_hdf.h"
+#include "hdf_test_data.h"
+
+NEOERR *hdf_test_fill(HDF *hdf) {
+  NEOERR *err;
+  char name[64];
+  int i;
+
+  err = hdf_read_file(hdf, "hdf_copy_test.hdf");
+  if (err) return nerr_pass(err);
+
+  /* Enough children to make the level use a hash */
+  for (i = 0; i < 100; i++) {
+    snprintf(name, sizeof(name), "Big.%d.Name", i);
+    err = hdf_set_int_value(hdf, name, i);
+    if (err) return nerr_pass(err);
+  }
+  err = hdf_read_string(hdf, "Chart [shape=round, color=green] = chart");
+  if (err) return nerr_pass(err);
+  err = hdf_set_symlink(hdf, "Link", "Chart");
+  if (err) return nerr_pass(err);
+
+  return STATUS_OK;
+}
+
+NEOERR *hdf_test_check_same(HDF *hdf, HDF *other, const char *what) {
+  NEOERR *err;
+  char *s1 = NULL, *s2 = NULL;
+
+  err = hdf_write_string(hdf, &s1);
+  if (err) return nerr_pass(err);
+  err = hdf_write_string(other, &s2);
+  if (err) {
+    free(s1);
+    return nerr_pass(err);
+  }
+  if (strcmp(s1, s2)) {
+    ne_warn("Regular:\n%s", s1);
+    ne_warn("%s:\n%s", what, s2);
+    free(s1);
+    free(s2);
+    return nerr_raise(NERR_ASSERT, "%s HDF doesn't match regular HDF", what);
+  }
+  free(s1);
+  free(s2);
+  return STATUS_OK;
+}
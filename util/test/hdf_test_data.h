@@ -0,0 +1,28 @@
+/*
+ * Copyright 2009 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+#ifndef __UTIL_TEST_HDF_TEST_DATA_H_
+#define __UTIL_TEST_HDF_TEST_DATA_H_ 1
+
+#include "util/neo_err.h"
+#include "util/neo_hdf.h"
+
+/* Builds the data set shared by the tests which store an HDF some other
+ * way (arena, image, binary) and compare it against a regular one:
+ * hdf_copy_test.hdf, a Big level with enough children to use a hash,
+ * a Chart node with attributes and a Link symlink to it */
+NEOERR *hdf_test_fill(HDF *hdf);
+
+/* Serializes hdf and other and raises NERR_ASSERT, after dumping both,
+ * if they differ.  what names other in the error */
+NEOERR *hdf_test_check_same(HDF *hdf, HDF *other, const char *what);
+
+#endif /* __UTIL_TEST_HDF_TEST_DATA_H_ */
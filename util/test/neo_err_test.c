@@ -30,9 +30,46 @@ void test_no_nerr_init() {
   CHECK_STREQ(buf.buf, "Unknown Error: This is an error!");
 }
 
+void test_static_error() {
+  NEOERR *err, *err2, *shared;
+  STRING buf;
+
+  CHECK((nerr_init() == STATUS_OK));
+
+  // The same shared error each time, and passing it doesn't allocate
+  err = nerr_raise_static(NERR_NOT_FOUND);
+  err2 = nerr_raise_static(NERR_NOT_FOUND);
+  CHECK((err == err2));
+  shared = err;
+  CHECK((nerr_pass(err) == err));
+  CHECK(nerr_match(err, NERR_NOT_FOUND));
+  CHECK(!nerr_match(err, NERR_IO));
+  CHECK(nerr_handle(&err, NERR_NOT_FOUND));
+  CHECK((err == STATUS_OK));
+  nerr_ignore(&err2);
+
+  // Context can still be added, and freeing it leaves the shared error
+  string_init(&buf);
+  err = nerr_pass_ctx(nerr_raise_static(NERR_NOT_FOUND), "Looking for %s",
+                      "file.cs");
+  CHECK(nerr_match(err, NERR_NOT_FOUND));
+  nerr_error_string(err, &buf);
+  CHECK_STREQ(buf.buf, "NotFoundError: (raised without a description)");
+  string_clear(&buf);
+  nerr_error_traceback(err, &buf);
+  CHECK((strstr(buf.buf, "Looking for file.cs") != NULL));
+  string_clear(&buf);
+  nerr_ignore(&err);
+  err = nerr_raise_static(NERR_NOT_FOUND);
+  CHECK((err == shared));
+  CHECK((err->flags & NE_STATIC));
+  CHECK(nerr_handle(&err, NERR_NOT_FOUND));
+}
+
 int main(int argc, char *argv[]) {
   // Run this test first, before any calls to nerr_init
   test_no_nerr_init();
+  test_static_error();
 
   ne_warn("PASS");
   return 0;
@@ -0,0 +1,156 @@
+#include "cs_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/neo_misc.h"
+#include "util/neo_err.h"
+#include "util/neo_str.h"
+
+static const char *Inputs[] = {
+  "",
+  "plain",
+  "a b",
+  "<script>alert('x' + \"y\");</script>",
+  "&amp; \r\n\t\x01\x7f",
+  "http://example.com/a?b=c&d=e f#g",
+  "javascript:alert(1)",
+  "//host:80/path",
+  "host.com:80",
+  "a/b:c;d\\e(f)*",
+  "caf\xc3\xa9 \xe9",
+  NULL
+};
+
+/* What each escape gives, allocated and appended */
+typedef struct _escape
+{
+  const char *name;
+  NEOERR *(*alloc)(const char *in, char **esc);
+  NEOERR *(*append)(const char *in, STRING *out);
+} ESCAPE;
+
+static NEOERR *html_alloc(const char *in, char **esc) {
+  return nerr_pass(neos_html_escape(in, strlen(in), esc));
+}
+
+static NEOERR *html_append(const char *in, STRING *out) {
+  return nerr_pass(neos_html_escape_append(in, strlen(in), out));
+}
+
+static NEOERR *url_alloc(const char *in, char **esc) {
+  return nerr_pass(neos_url_escape(in, esc, "e"));
+}
+
+static NEOERR *url_append(const char *in, STRING *out) {
+  return nerr_pass(neos_url_escape_append(in, out, "e"));
+}
+
+static NEOERR *var_alloc(const char *in, char **esc) {
+  return nerr_pass(neos_var_escape(NEOS_ESCAPE_SCRIPT | NEOS_ESCAPE_HTML,
+                                   in, esc));
+}
+
+static NEOERR *var_append(const char *in, STRING *out) {
+  return nerr_pass(neos_var_escape_append(
+        NEOS_ESCAPE_SCRIPT | NEOS_ESCAPE_HTML, in, out));
+}
+
+static NEOERR *none_alloc(const char *in, char **esc) {
+  return nerr_pass(neos_var_escape(NEOS_ESCAPE_NONE, in, esc));
+}
+
+static NEOERR *none_append(const char *in, STRING *out) {
+  return nerr_pass(neos_var_escape_append(NEOS_ESCAPE_NONE, in, out));
+}
+
+static ESCAPE Escapes[] = {
+  {"html", html_alloc, html_append},
+  {"url", url_alloc, url_append},
+  {"js", neos_js_escape, neos_js_escape_append},
+  {"url_validate", neos_url_validate, neos_url_validate_append},
+  {"css_url_validate", neos_css_url_validate, neos_css_url_validate_append},
+  {"var", var_alloc, var_append},
+  {"none", none_alloc, none_append},
+  {NULL, NULL, NULL}
+};
+
+/* Appending has to give the same as the allocating version, after
+ * whatever is already there, and keep the buffer terminated */
+static NEOERR *test_append(void) {
+  NEOERR *err;
+  STRING out;
+  char *esc;
+  int x, y, start;
+
+  ne_warn("Running test_append");
+
+  string_init(&out);
+  for (x = 0; Escapes[x].name != NULL; x++)
+  {
+    for (y = 0; Inputs[y] != NULL; y++)
+    {
+      err = Escapes[x].alloc(Inputs[y], &esc);
+      if (err) return nerr_pass(err);
+      err = string_append(&out, "prefix");
+      if (err) return nerr_pass(err);
+      start = out.len;
+      err = Escapes[x].append(Inputs[y], &out);
+      if (err) return nerr_pass(err);
+      if (out.len - start != (int)strlen(esc) || strcmp(out.buf + start, esc))
+      {
+        err = nerr_raise(NERR_ASSERT, "%s of input %d: appended '%s', not '%s'",
+                         Escapes[x].name, y, out.buf + start, esc);
+        free(esc);
+        return err;
+      }
+      free(esc);
+    }
+  }
+  string_clear(&out);
+  return STATUS_OK;
+}
+
+/* Growing past the first buffer, one escape at a time */
+static NEOERR *test_append_grow(void) {
+  NEOERR *err;
+  STRING out;
+  int x;
+
+  ne_warn("Running test_append_grow");
+
+  string_init(&out);
+  for (x = 0; x < 1000; x++)
+  {
+    err = neos_html_escape_append("<>", 2, &out);
+    if (err) return nerr_pass(err);
+    err = neos_js_escape_append("'", &out);
+    if (err) return nerr_pass(err);
+  }
+  if (out.len != 1000 * 12 || strlen(out.buf) != out.len ||
+      strncmp(out.buf + out.len - 12, "&lt;&gt;\\x27", 12))
+  {
+    return nerr_raise(NERR_ASSERT, "Wrong output after growing: %d bytes",
+                      out.len);
+  }
+  string_clear(&out);
+  return STATUS_OK;
+}
+
+int main(void) {
+  NEOERR *err;
+
+  err = test_append();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+  err = test_append_grow();
+  if (err) {
+    nerr_log_error(err);
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,131 @@
+#include "cs_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/neo_misc.h"
+#include "util/neo_err.h"
+#include "util/neo_hdf.h"
+
+/* Times what a missing optional include costs: the NERR_NOT_FOUND from
+ * hdf_search_path_probe, passed up a couple of levels and then handled.  Not
+ * run as part of the tests; build it with "make bench" and run it by
+ * hand. */
+
+#define NUM_LOADPATHS 8
+
+static NEOERR *find_formatted(const char *path)
+{
+  return nerr_raise(NERR_NOT_FOUND, "Path %s not found", path);
+}
+
+static NEOERR *find_static(const char *path)
+{
+  return nerr_raise_static(NERR_NOT_FOUND);
+}
+
+static NEOERR *include_formatted(const char *path)
+{
+  return nerr_pass(nerr_pass(find_formatted(path)));
+}
+
+static NEOERR *include_static(const char *path)
+{
+  return nerr_pass(nerr_pass(find_static(path)));
+}
+
+static NEOERR *include_search(HDF *hdf, const char *path)
+{
+  char full[PATH_BUF_SIZE];
+
+  return nerr_pass(nerr_pass(hdf_search_path_probe(hdf, path, full,
+                                                   sizeof(full))));
+}
+
+static NEOERR *bench_errors(int rounds)
+{
+  NEOERR *err;
+  double start, t_formatted, t_static;
+  int x;
+
+  start = ne_timef();
+  for (x = 0; x < rounds; x++)
+  {
+    err = include_formatted("missing.cs");
+    if (!nerr_handle(&err, NERR_NOT_FOUND))
+      return nerr_raise(NERR_ASSERT, "Expected NERR_NOT_FOUND");
+  }
+  t_formatted = ne_timef() - start;
+
+  start = ne_timef();
+  for (x = 0; x < rounds; x++)
+  {
+    err = include_static("missing.cs");
+    if (!nerr_handle(&err, NERR_NOT_FOUND))
+      return nerr_raise(NERR_ASSERT, "Expected NERR_NOT_FOUND");
+  }
+  t_static = ne_timef() - start;
+
+  printf("raise, pass twice, handle   nerr_raise %6.1fns  "
+      "nerr_raise_static %6.1fns\n",
+      t_formatted * 1e9 / rounds, t_static * 1e9 / rounds);
+  return STATUS_OK;
+}
+
+static NEOERR *bench_search(int rounds, int ttl)
+{
+  NEOERR *err;
+  HDF *hdf;
+  char name[64];
+  double start, t_miss;
+  int x;
+
+  err = hdf_init(&hdf);
+  if (err) return nerr_pass(err);
+  for (x = 0; x < NUM_LOADPATHS; x++)
+  {
+    snprintf(name, sizeof(name), "hdf.loadpaths.%d", x);
+    err = hdf_set_valuef(hdf, "%s=search_path_bench_%d", name, x);
+    if (err) return nerr_pass(err);
+  }
+
+  hdf_search_path_cache(ttl);
+  start = ne_timef();
+  for (x = 0; x < rounds; x++)
+  {
+    err = include_search(hdf, "missing.cs");
+    if (!nerr_handle(&err, NERR_NOT_FOUND))
+    {
+      if (err) return nerr_pass(err);
+      return nerr_raise(NERR_ASSERT, "Found missing.cs");
+    }
+  }
+  t_miss = ne_timef() - start;
+  hdf_search_path_cache(0);
+
+  printf("hdf_search_path_probe miss, %d loadpaths, cache %-3s %8.1fns\n",
+      NUM_LOADPATHS, ttl ? "on" : "off", t_miss * 1e9 / rounds);
+  hdf_destroy(&hdf);
+  return STATUS_OK;
+}
+
+int main(int argc, char *argv[])
+{
+  NEOERR *err;
+
+  err = nerr_init();
+  if (err == STATUS_OK)
+    err = bench_errors(2000000);
+  if (err == STATUS_OK)
+    err = bench_search(200000, 0);
+  if (err == STATUS_OK)
+    err = bench_search(2000000, -1);
+  if (err)
+  {
+    nerr_log_error(err);
+    return -1;
+  }
+
+  return 0;
+}